@@ -0,0 +1,647 @@
+// NU-Information Exchange load generator and latency benchmark
+//
+// Simulates N campuses with M TCP connections each against a running
+// server, speaking the real auth frame and UDP heartbeat protocol. Every
+// message carries its send time, so receivers measure end-to-end latency
+// over loopback. Results are printed as JSON for regression tracking.
+// With --metrics-port the server's own counters are read at both ends of
+// the measured window: its I/O model and system calls per routed message,
+// and for a server built with -DNU_COUNT_ALLOCATIONS its heap allocations
+// per routed message. Running it once per --io model compares them.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <unordered_set>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #pragma comment(lib, "ws2_32.lib")
+    typedef int socklen_t;
+    #define SHUT_RDWR SD_BOTH
+#else
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <arpa/inet.h>
+    #include <unistd.h>
+    #include <csignal>
+    #define SOCKET int
+    #define INVALID_SOCKET -1
+    #define SOCKET_ERROR -1
+    #define closesocket close
+#endif
+
+#include "Protocol.h"
+
+using namespace std;
+
+const int TCP_PORT = 8080;
+const int UDP_PORT = 8081;
+
+// Same defaults as the server's campus registry
+const char* const CAMPUS_PASSWORDS[] = {"", "23L-0999", "23K-0664", "23P-0871", "23F-0763", "23M-0740"};
+
+// Payload prefix: send time (ns, u32 high + u32 low), sender index, sequence
+const size_t STAMP_SIZE = 16;
+
+enum FanOut { FANOUT_RING, FANOUT_ALL, FANOUT_HOTSPOT, FANOUT_RANDOM };
+
+struct BenchConfig {
+    string serverIp;
+    int campuses;           // simulated campuses, IDs 1..campuses
+    int connections;        // connections per campus
+    size_t messageSize;     // payload bytes, including the stamp
+    FanOut fanOut;
+    double rate;            // messages per second per connection, 0 = unlimited
+    int durationSec;        // measured time
+    int warmupSec;          // sent but not measured
+    int heartbeatSec;
+    string outputPath;      // JSON destination, empty = stdout
+    int metricsPort;        // server metrics endpoint to sample, 0 = off
+};
+
+BenchConfig benchConfig = {"127.0.0.1", 5, 1, 64, FANOUT_RING, 1000, 10, 1, 10, "", 0};
+
+const char* fanOutName(FanOut f) {
+    switch (f) {
+        case FANOUT_ALL: return "all";
+        case FANOUT_HOTSPOT: return "hotspot";
+        case FANOUT_RANDOM: return "random";
+        default: return "ring";
+    }
+}
+
+typedef chrono::steady_clock BenchClock;
+
+uint64_t nowNs() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+        BenchClock::now().time_since_epoch()).count();
+}
+
+// Log-linear latency histogram: 16 sub-buckets per power of two, so every
+// bucket is within ~6% of the values it holds. Owned by one thread and
+// merged at the end, so recording never takes a lock.
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+
+    LatencyHistogram() : counts(64 * SUB_COUNT, 0), total(0), sum(0), minValue(UINT64_MAX), maxValue(0) {}
+
+    void record(uint64_t ns) {
+        counts[bucketOf(ns)]++;
+        total++;
+        sum += ns;
+        if (ns < minValue) minValue = ns;
+        if (ns > maxValue) maxValue = ns;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        if (other.minValue < minValue) minValue = other.minValue;
+        if (other.maxValue > maxValue) maxValue = other.maxValue;
+    }
+
+    // Upper bound of the bucket holding the p-th percentile (0 < p <= 100)
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)ceil(p / 100.0 * total);
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) return min(bucketLimit(i), maxValue);
+        }
+        return maxValue;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t minimum() const { return total ? minValue : 0; }
+    uint64_t maximum() const { return maxValue; }
+    double mean() const { return total ? (double)sum / total : 0; }
+    size_t buckets() const { return counts.size(); }
+    uint64_t bucketCount(size_t i) const { return counts[i]; }
+
+    static size_t bucketOf(uint64_t v) {
+        if (v < (uint64_t)SUB_COUNT) return (size_t)v;
+        int msb = 63;
+        while (!(v >> msb)) msb--;
+        int shift = msb - SUB_BITS;
+        return (size_t)((shift + 1) * SUB_COUNT + ((v >> shift) & (SUB_COUNT - 1)));
+    }
+
+    // Largest value that falls into bucket i
+    static uint64_t bucketLimit(size_t i) {
+        if (i < (size_t)SUB_COUNT) return i;
+        int shift = (int)(i / SUB_COUNT) - 1;
+        uint64_t base = ((uint64_t)SUB_COUNT + i % SUB_COUNT) << shift;
+        return base + ((uint64_t)1 << shift) - 1;
+    }
+
+private:
+    vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t sum;
+    uint64_t minValue;
+    uint64_t maxValue;
+};
+
+// One simulated campus connection
+struct BenchConnection {
+    int index;
+    uint16_t campusId;
+    SOCKET socket;
+    RecvBuffer buffer;
+    LatencyHistogram latency;   // written by the receiver thread only
+    uint64_t sent;              // frames sent inside the measured window
+    uint64_t sentBytes;
+    uint64_t received;          // frames received that were sent inside the window
+    uint64_t receivedBytes;
+    uint64_t errors;            // FRAME_ERROR replies
+    uint64_t queued;            // FRAME_QUEUED replies
+    uint64_t lateFrames;        // frames sent after the window, ignored
+    uint64_t duplicates;        // copies another connection of the campus counted first
+};
+
+// Messages a campus has counted, by sender index and sequence number. With
+// --connections=M the server's default delivery policy hands each message
+// to all M sessions of the campus; only the first copy counts as received.
+struct CampusReceipts {
+    mutex lock;
+    unordered_set<uint64_t> seen;
+};
+
+vector<CampusReceipts*> campusReceipts;    // by campus ID, only with M > 1
+
+vector<BenchConnection*> benchConnections;
+atomic<bool> heartbeatRunning(true);
+uint64_t measureStartNs = 0;
+uint64_t measureEndNs = 0;
+
+bool sendAll(SOCKET socket, const char* data, size_t length) {
+    while (length > 0) {
+        int sent = send(socket, data, length, 0);
+        if (sent == SOCKET_ERROR) return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+FrameStatus readFrame(BenchConnection* conn, FrameView& frame) {
+    FrameStatus status;
+    while ((status = conn->buffer.nextFrame(frame)) == FRAME_INCOMPLETE) {
+        char* space = conn->buffer.writePtr();
+        int bytesReceived = recv(conn->socket, space, conn->buffer.writeSpace(), 0);
+        if (bytesReceived <= 0) return FRAME_INVALID;
+        conn->buffer.commit(bytesReceived);
+    }
+    return status;
+}
+
+// Server counters at one end of the measured window
+struct ServerSample {
+    bool valid;
+    bool countsAllocations;     // the server was built with NU_COUNT_ALLOCATIONS
+    uint64_t routed;            // sum of nu_messages_routed_total
+    uint64_t allocations;       // nu_heap_allocations_total
+    uint64_t syscalls;          // nu_io_syscalls_total
+    string ioModel;             // label of nu_io_model
+};
+
+ServerSample serverBefore = {false, false, 0, 0, 0, ""}, serverAfter = {false, false, 0, 0, 0, ""};
+
+// Read the server's metrics endpoint (plain text, one "name{labels} value" per line)
+ServerSample sampleServer() {
+    ServerSample sample = {false, false, 0, 0, 0, ""};
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) return sample;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(benchConfig.metricsPort);
+    inet_pton(AF_INET, benchConfig.serverIp.c_str(), &addr.sin_addr);
+    string text;
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (connect(s, (sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR && sendAll(s, request, sizeof(request) - 1)) {
+        char chunk[4096];
+        int n;
+        while ((n = recv(s, chunk, sizeof(chunk), 0)) > 0) text.append(chunk, n);
+    }
+    closesocket(s);
+
+    istringstream lines(text);
+    string line;
+    while (getline(lines, line)) {
+        size_t space = line.rfind(' ');
+        if (space == string::npos) continue;
+        uint64_t value = strtoull(line.c_str() + space + 1, NULL, 10);
+        if (line.compare(0, 24, "nu_messages_routed_total") == 0) {
+            sample.routed += value;
+            sample.valid = true;
+        } else if (line.compare(0, 25, "nu_heap_allocations_total") == 0) {
+            sample.allocations = value;
+            sample.countsAllocations = true;
+        } else if (line.compare(0, 20, "nu_io_syscalls_total") == 0) {
+            sample.syscalls = value;
+        } else if (line.compare(0, 18, "nu_io_model{model=") == 0) {
+            size_t end = line.find('"', 19);
+            if (end != string::npos) sample.ioModel = line.substr(19, end - 19);
+        }
+    }
+    return sample;
+}
+
+void sleepUntilNs(uint64_t when) {
+    uint64_t now = nowNs();
+    if (when > now) this_thread::sleep_for(chrono::nanoseconds(when - now));
+}
+
+// Sample the server as the measured window opens and closes
+void serverSampler() {
+    sleepUntilNs(measureStartNs);
+    serverBefore = sampleServer();
+    sleepUntilNs(measureEndNs);
+    serverAfter = sampleServer();
+}
+
+// Connect and authenticate exactly like a campus client
+bool connectCampus(BenchConnection* conn) {
+    conn->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->socket == INVALID_SOCKET) return false;
+
+    int noDelay = 1;
+    setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+    sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(TCP_PORT);
+    inet_pton(AF_INET, benchConfig.serverIp.c_str(), &serverAddr.sin_addr);
+    if (connect(conn->socket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) return false;
+
+    string authMsg = string("Campus:") + campusNameOf(conn->campusId) + ",Pass:" + CAMPUS_PASSWORDS[conn->campusId];
+    vector<char> frame = makeFrame(FRAME_AUTH, 0, 0, 0, 0, authMsg);
+    if (!sendAll(conn->socket, frame.data(), frame.size())) return false;
+
+    FrameView reply;
+    if (readFrame(conn, reply) != FRAME_READY || reply.header.type != FRAME_AUTH_REPLY) return false;
+    return string(reply.payload, reply.header.length) == "AUTH_SUCCESS";
+}
+
+// Destinations of one message from `campusId` under the configured fan-out
+void pickTargets(uint16_t campusId, uint32_t& randomState, vector<uint16_t>& targets) {
+    targets.clear();
+    int n = benchConfig.campuses;
+    switch (benchConfig.fanOut) {
+        case FANOUT_RING:
+            targets.push_back((uint16_t)(campusId % n + 1));
+            break;
+        case FANOUT_ALL:
+            for (int id = 1; id <= n; id++) {
+                if (id != campusId) targets.push_back((uint16_t)id);
+            }
+            break;
+        case FANOUT_HOTSPOT:
+            targets.push_back(campusId == 1 ? 2 : 1);
+            break;
+        case FANOUT_RANDOM: {
+            randomState ^= randomState << 13;
+            randomState ^= randomState >> 17;
+            randomState ^= randomState << 5;
+            uint16_t target = (uint16_t)(randomState % (n - 1) + 1);
+            if (target >= campusId) target++;
+            targets.push_back(target);
+            break;
+        }
+    }
+}
+
+void senderLoop(BenchConnection* conn) {
+    vector<char> payload(benchConfig.messageSize, 'x');
+    vector<char> batch;
+    vector<uint16_t> targets;
+    uint32_t randomState = 2463534242u + conn->index * 7919u;
+    uint64_t intervalNs = benchConfig.rate > 0 ? (uint64_t)(1e9 / benchConfig.rate) : 0;
+    uint64_t start = nowNs();
+    uint64_t nextSend = start + (intervalNs ? (uint64_t)conn->index * intervalNs / benchConnections.size() : 0);
+
+    for (uint32_t seq = 1;; seq++) {
+        uint64_t stamp;
+        if (intervalNs) {
+            // Stamp the intended send time, so a stalled server shows up as
+            // latency instead of silently lowering the offered load
+            uint64_t now = nowNs();
+            if (nextSend > now) this_thread::sleep_for(chrono::nanoseconds(nextSend - now));
+            stamp = nextSend;
+            nextSend += intervalNs;
+        } else {
+            stamp = nowNs();
+        }
+        if (stamp >= measureEndNs) break;
+
+        putU32(&payload[0], (uint32_t)(stamp >> 32));
+        putU32(&payload[4], (uint32_t)stamp);
+        putU32(&payload[8], (uint32_t)conn->index);
+        putU32(&payload[12], seq);
+
+        pickTargets(conn->campusId, randomState, targets);
+        batch.clear();
+        for (size_t i = 0; i < targets.size(); i++) {
+            appendFrame(batch, FRAME_MESSAGE, seq, conn->campusId, targets[i],
+                        (uint16_t)(seq % (DEPARTMENT_COUNT - 1) + 1), payload.data(), payload.size());
+        }
+        if (!sendAll(conn->socket, batch.data(), batch.size())) break;
+        if (stamp >= measureStartNs) {
+            conn->sent += targets.size();
+            conn->sentBytes += batch.size();
+        }
+    }
+}
+
+// Whether this is the first copy of a message to reach conn's campus
+bool firstCopy(const BenchConnection* conn, const char* payload) {
+    if (campusReceipts.empty()) return true;
+    uint64_t key = ((uint64_t)getU32(payload + 8) << 32) | getU32(payload + 12);
+    CampusReceipts& receipts = *campusReceipts[conn->campusId];
+    lock_guard<mutex> lock(receipts.lock);
+    return receipts.seen.insert(key).second;
+}
+
+void receiverLoop(BenchConnection* conn) {
+    FrameView frame;
+    while (readFrame(conn, frame) == FRAME_READY) {
+        if (frame.header.type == FRAME_ERROR) {
+            conn->errors++;
+        } else if (frame.header.type == FRAME_QUEUED) {
+            conn->queued++;
+        } else if (frame.header.type == FRAME_MESSAGE && frame.header.length >= STAMP_SIZE) {
+            uint64_t arrived = nowNs();
+            uint64_t stamp = ((uint64_t)getU32(frame.payload) << 32) | getU32(frame.payload + 4);
+            if (stamp < measureStartNs) continue;
+            if (stamp >= measureEndNs) {
+                conn->lateFrames++;
+                continue;
+            }
+            if (!firstCopy(conn, frame.payload)) {
+                conn->duplicates++;
+                continue;
+            }
+            conn->latency.record(arrived > stamp ? arrived - stamp : 0);
+            conn->received++;
+            conn->receivedBytes += FRAME_HEADER_SIZE + frame.header.length;
+        }
+    }
+}
+
+// One UDP heartbeat per campus, same text format as Client.cpp
+void heartbeatLoop() {
+    SOCKET udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(UDP_PORT);
+    inet_pton(AF_INET, benchConfig.serverIp.c_str(), &serverAddr.sin_addr);
+
+    while (heartbeatRunning) {
+        for (int id = 1; id <= benchConfig.campuses; id++) {
+            string heartbeat = string("HEARTBEAT|") + campusNameOf((uint16_t)id);
+            sendto(udpSocket, heartbeat.c_str(), heartbeat.length(), 0, (sockaddr*)&serverAddr, sizeof(serverAddr));
+        }
+        for (int i = 0; i < benchConfig.heartbeatSec * 10 && heartbeatRunning; i++) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+    }
+    closesocket(udpSocket);
+}
+
+string jsonNumber(double v) {
+    char text[64];
+    snprintf(text, sizeof(text), "%.3f", v);
+    return text;
+}
+
+string formatResults(const LatencyHistogram& latency, uint64_t sent, uint64_t sentBytes, uint64_t received,
+                     uint64_t receivedBytes, uint64_t duplicates, uint64_t errors, uint64_t queued,
+                     uint64_t connected) {
+    double seconds = benchConfig.durationSec;
+    ostringstream out;
+    out << "{\n"
+        << "  \"config\": {\"campuses\": " << benchConfig.campuses
+        << ", \"connections_per_campus\": " << benchConfig.connections
+        << ", \"message_bytes\": " << benchConfig.messageSize
+        << ", \"fanout\": \"" << fanOutName(benchConfig.fanOut) << "\""
+        << ", \"rate_per_connection\": " << jsonNumber(benchConfig.rate)
+        << ", \"duration_sec\": " << benchConfig.durationSec
+        << ", \"warmup_sec\": " << benchConfig.warmupSec << "},\n"
+        << "  \"connected\": " << connected << ",\n"
+        << "  \"sent\": " << sent << ",\n"
+        << "  \"received\": " << received << ",\n"
+        << "  \"lost\": " << (sent > received ? sent - received : 0) << ",\n"
+        << "  \"duplicates\": " << duplicates << ",\n"
+        << "  \"errors\": " << errors << ",\n"
+        << "  \"queued\": " << queued << ",\n"
+        << "  \"throughput_msgs_per_sec\": " << jsonNumber(received / seconds) << ",\n"
+        << "  \"throughput_bytes_per_sec\": " << jsonNumber(receivedBytes / seconds) << ",\n"
+        << "  \"offered_bytes_per_sec\": " << jsonNumber(sentBytes / seconds) << ",\n"
+        << "  \"latency_us\": {"
+        << "\"min\": " << jsonNumber(latency.minimum() / 1000.0)
+        << ", \"mean\": " << jsonNumber(latency.mean() / 1000.0)
+        << ", \"p50\": " << jsonNumber(latency.percentile(50) / 1000.0)
+        << ", \"p90\": " << jsonNumber(latency.percentile(90) / 1000.0)
+        << ", \"p99\": " << jsonNumber(latency.percentile(99) / 1000.0)
+        << ", \"p999\": " << jsonNumber(latency.percentile(99.9) / 1000.0)
+        << ", \"max\": " << jsonNumber(latency.maximum() / 1000.0) << "},\n";
+    if (serverBefore.valid && serverAfter.valid) {
+        uint64_t routed = serverAfter.routed - serverBefore.routed;
+        uint64_t syscalls = serverAfter.syscalls - serverBefore.syscalls;
+        out << "  \"server\": {\"io_model\": \"" << serverAfter.ioModel << "\", \"routed\": " << routed
+            << ", \"syscalls\": " << syscalls
+            << ", \"syscalls_per_message\": " << jsonNumber(routed ? (double)syscalls / routed : 0.0);
+        if (serverBefore.countsAllocations && serverAfter.countsAllocations) {
+            uint64_t allocations = serverAfter.allocations - serverBefore.allocations;
+            out << ", \"heap_allocations\": " << allocations
+                << ", \"allocations_per_message\": " << jsonNumber(routed ? (double)allocations / routed : 0.0);
+        }
+        out << "},\n";
+    }
+    out << "  \"histogram_us\": [";
+    // Non-empty buckets as [upper bound, count]
+    bool first = true;
+    for (size_t i = 0; i < latency.buckets(); i++) {
+        if (latency.bucketCount(i) == 0) continue;
+        out << (first ? "" : ", ") << "[" << jsonNumber(LatencyHistogram::bucketLimit(i) / 1000.0)
+            << ", " << latency.bucketCount(i) << "]";
+        first = false;
+    }
+    out << "]\n}\n";
+    return out.str();
+}
+
+// Parse command-line options
+//   --server=IP          server address
+//   --campuses=N         simulated campuses (1-5)
+//   --connections=M      connections per campus
+//   --size=BYTES         message payload size (at least 16)
+//   --fanout=ring|all|hotspot|random
+//   --rate=N             messages per second per connection (0 = unlimited)
+//   --duration=SEC       measured time
+//   --warmup=SEC         time before measuring starts
+//   --heartbeat=SEC      UDP heartbeat interval
+//   --output=PATH        write JSON results to PATH instead of stdout
+//   --metrics-port=N     sample the server's metrics endpoint on port N
+bool parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (arg.find("--server=") == 0) {
+            benchConfig.serverIp = arg.substr(9);
+        } else if (arg.find("--campuses=") == 0) {
+            benchConfig.campuses = atoi(arg.c_str() + 11);
+        } else if (arg.find("--connections=") == 0) {
+            benchConfig.connections = max(1, atoi(arg.c_str() + 14));
+        } else if (arg.find("--size=") == 0) {
+            benchConfig.messageSize = max((size_t)STAMP_SIZE, (size_t)strtoul(arg.c_str() + 7, NULL, 10));
+        } else if (arg == "--fanout=ring") {
+            benchConfig.fanOut = FANOUT_RING;
+        } else if (arg == "--fanout=all") {
+            benchConfig.fanOut = FANOUT_ALL;
+        } else if (arg == "--fanout=hotspot") {
+            benchConfig.fanOut = FANOUT_HOTSPOT;
+        } else if (arg == "--fanout=random") {
+            benchConfig.fanOut = FANOUT_RANDOM;
+        } else if (arg.find("--rate=") == 0) {
+            benchConfig.rate = max(0.0, atof(arg.c_str() + 7));
+        } else if (arg.find("--duration=") == 0) {
+            benchConfig.durationSec = max(1, atoi(arg.c_str() + 11));
+        } else if (arg.find("--warmup=") == 0) {
+            benchConfig.warmupSec = max(0, atoi(arg.c_str() + 9));
+        } else if (arg.find("--heartbeat=") == 0) {
+            benchConfig.heartbeatSec = max(1, atoi(arg.c_str() + 12));
+        } else if (arg.find("--output=") == 0) {
+            benchConfig.outputPath = arg.substr(9);
+        } else if (arg.find("--metrics-port=") == 0) {
+            benchConfig.metricsPort = atoi(arg.c_str() + 15);
+        } else {
+            cerr << "Unknown option: " << arg << "\n"
+                 << "Usage: " << argv[0] << " [--server=IP] [--campuses=N] [--connections=M] [--size=BYTES]\n"
+                 << "              [--fanout=ring|all|hotspot|random] [--rate=N] [--duration=SEC]\n"
+                 << "              [--warmup=SEC] [--heartbeat=SEC] [--output=PATH] [--metrics-port=N]\n";
+            return false;
+        }
+    }
+    if (benchConfig.campuses < 2 || benchConfig.campuses >= CAMPUS_COUNT) {
+        cerr << "--campuses must be between 2 and " << CAMPUS_COUNT - 1 << "\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parseArguments(argc, argv)) return 1;
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    for (int c = 0; c < benchConfig.campuses * benchConfig.connections; c++) {
+        BenchConnection* conn = new BenchConnection();
+        conn->index = c;
+        conn->campusId = (uint16_t)(c % benchConfig.campuses + 1);
+        if (!connectCampus(conn)) {
+            cerr << "Cannot connect " << campusNameOf(conn->campusId) << " (connection " << c << ")\n";
+            return 1;
+        }
+        benchConnections.push_back(conn);
+    }
+    if (benchConfig.connections > 1) {
+        campusReceipts.assign(CAMPUS_COUNT, NULL);
+        for (int id = 1; id <= benchConfig.campuses; id++) campusReceipts[id] = new CampusReceipts;
+    }
+
+    thread heartbeat(heartbeatLoop);
+
+    uint64_t start = nowNs();
+    measureStartNs = start + (uint64_t)benchConfig.warmupSec * 1000000000ULL;
+    measureEndNs = measureStartNs + (uint64_t)benchConfig.durationSec * 1000000000ULL;
+
+    vector<thread> threads;
+    for (size_t i = 0; i < benchConnections.size(); i++) {
+        threads.push_back(thread(receiverLoop, benchConnections[i]));
+    }
+    vector<thread> senders;
+    for (size_t i = 0; i < benchConnections.size(); i++) {
+        senders.push_back(thread(senderLoop, benchConnections[i]));
+    }
+    thread sampler;
+    if (benchConfig.metricsPort > 0) sampler = thread(serverSampler);
+    for (size_t i = 0; i < senders.size(); i++) senders[i].join();
+    if (sampler.joinable()) sampler.join();
+
+    // Give in-flight frames time to arrive, then close everything
+    this_thread::sleep_for(chrono::seconds(1));
+    heartbeatRunning = false;
+    for (size_t i = 0; i < benchConnections.size(); i++) shutdown(benchConnections[i]->socket, SHUT_RDWR);
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    heartbeat.join();
+
+    LatencyHistogram latency;
+    uint64_t sent = 0, sentBytes = 0, received = 0, receivedBytes = 0, duplicates = 0, errors = 0, queued = 0;
+    for (size_t i = 0; i < benchConnections.size(); i++) {
+        BenchConnection* conn = benchConnections[i];
+        latency.merge(conn->latency);
+        sent += conn->sent;
+        sentBytes += conn->sentBytes;
+        received += conn->received;
+        receivedBytes += conn->receivedBytes;
+        duplicates += conn->duplicates;
+        errors += conn->errors;
+        queued += conn->queued;
+        closesocket(conn->socket);
+    }
+
+    string results = formatResults(latency, sent, sentBytes, received, receivedBytes, duplicates, errors, queued,
+                                   benchConnections.size());
+    if (benchConfig.outputPath.empty()) {
+        cout << results;
+    } else {
+        ofstream file(benchConfig.outputPath.c_str());
+        file << results;
+    }
+    cerr << "sent " << sent << ", received " << received << ", "
+         << (uint64_t)(received / (double)benchConfig.durationSec) << " msg/s, p50 "
+         << latency.percentile(50) / 1000.0 << " us, p99 " << latency.percentile(99) / 1000.0
+         << " us, p999 " << latency.percentile(99.9) / 1000.0 << " us\n";
+    if (duplicates > 0) cerr << duplicates << " copies delivered to more than one connection of a campus\n";
+    if (serverBefore.valid && serverAfter.valid) {
+        uint64_t routed = serverAfter.routed - serverBefore.routed;
+        cerr << "server (" << serverAfter.ioModel << "): " << routed << " routed, "
+             << serverAfter.syscalls - serverBefore.syscalls << " system calls";
+        if (serverBefore.countsAllocations && serverAfter.countsAllocations) {
+            cerr << ", " << serverAfter.allocations - serverBefore.allocations << " heap allocations on I/O threads";
+        }
+        cerr << "\n";
+    }
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
@@ -3,30 +3,54 @@
 #include <mutex>
 #include <cstring>
 #include <chrono>
-#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <random>
+#include <deque>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
     #pragma comment(lib, "ws2_32.lib")
+    #include <io.h>
+    #include <direct.h>
     typedef int socklen_t;
+    #define SHUT_RDWR SD_BOTH
 #else
     #include <sys/socket.h>
+    #include <sys/un.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
+    #include <poll.h>
+    #include <csignal>
+    #include <sys/uio.h>
     #define SOCKET int
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR -1
     #define closesocket close
 #endif
 
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
+
+#include "Protocol.h"
+
 using namespace std;
 
 // Configuration
-const string SERVER_IP = "127.0.0.1";
+string serverIp = "127.0.0.1";
 const int TCP_PORT = 8080;
 const int UDP_PORT = 8081;
+int serverPort = TCP_PORT;              // heartbeats go to serverPort + 1
 const int CLIENT_UDP_PORT = 8082;
 const int HEARTBEAT_INTERVAL = 10; // seconds
 
@@ -35,109 +59,556 @@ SOCKET tcpSocket = INVALID_SOCKET;
 SOCKET udpSocket = INVALID_SOCKET;
 string campusName;
 string campusPassword;
+string endpointName;    // login name in the server's credentials file
 bool isConnected = false;
 mutex coutMutex;
+RecvBuffer recvBuffer;
+uint32_t nextSeq = 1;
 
-// Department list
+// Payload compression, offered at login and used once the server agrees.
+// Messages are only compressed on the sending thread, so one table and
+// output buffer are reused for all of them.
+struct CompressionConfig {
+    bool offered;           // ask the server for compression (--no-compress turns it off)
+    size_t threshold;       // smallest payload worth compressing
+};
+
+CompressionConfig compression = {true, 512};
+bool compressionActive = false;
+LzTable compressTable;
+vector<char> compressBuffer;
+
+// Department list (IDs 1-4 in Protocol.h)
 const string departments[] = {"CS", "SE", "AI", "EE"};
 
+// Headless mode: messages come from a file, stdin or a Unix socket instead
+// of the menu, and every outcome is printed as one JSON line on stdout
+struct HeadlessConfig {
+    bool enabled;
+    string inputPath;       // file to read, "-" for stdin
+    string socketPath;      // Unix socket to accept message writers on
+    uint16_t defaultTarget; // used for lines without a "Campus|Dept|" prefix
+    uint16_t defaultDept;
+    size_t window;          // max messages waiting for an outcome
+    int waitSec;            // how long to wait for outcomes after the input ends
+    bool publish;           // lines are topic publishes ("*" allowed as campus or dept)
+};
+
+HeadlessConfig headless = {false, "-", "", 0, 1, 256, 10, false};
+
+// Department topics this connection follows (--subscribe or the menu)
+struct Topic {
+    uint16_t campus;
+    uint16_t dept;
+};
+
+vector<Topic> subscribedTopics;
+
+// Extra campuses this process sends heartbeats for (--heartbeat-for), e.g.
+// a gateway aggregating several sites or a test emulating many endpoints
+vector<string> heartbeatCampuses;
+bool heartbeatOnly = false;     // just send heartbeats, no login
+
+// Multicast group to receive broadcasts on (--broadcast-group); when empty,
+// the server sends broadcasts back to our heartbeat socket
+string broadcastGroup;
+int broadcastGroupPort = CLIENT_UDP_PORT;
+string multicastInterface;
+
+// A headless send waiting for its DELIVERED / QUEUED / ERROR reply
+struct PendingSend {
+    uint64_t line;
+    uint16_t target;
+    uint16_t dept;
+};
+
+map<uint32_t, PendingSend> pendingSends;
+mutex pendingMutex;
+condition_variable pendingChanged;
+uint64_t delivered = 0, queuedCount = 0, failed = 0, sentCount = 0;
+
+// The menu, the receiver thread and file transfer threads all write to the
+// server connection, so every frame (or batch of frames) goes out whole
+// under this lock
+mutex sendMutex;
+
+// Session resumption (see FRAME_FLAG_RESUME in Protocol.h). When the link
+// drops, the receiver thread reconnects with exponential backoff and
+// resumes the session: the server replays what we missed and we resend
+// what it had not processed. Sends made meanwhile wait in unackedSent.
+struct ReconnectConfig {
+    bool enabled;           // --no-reconnect turns it off
+    int initialDelayMs;
+    int maxDelayMs;
+    int giveUpSec;          // stop trying after this long (--reconnect-for)
+};
+
+ReconnectConfig reconnect = {true, 250, 30000, 300};
+string sessionToken;                // empty if the server keeps no session
+atomic<bool> linkUp(false);         // changed under sendMutex
+deque<vector<char> > unackedSent;   // session frames not yet acknowledged, under sendMutex
+uint64_t unackedBase = 0;           // number of unackedSent.front()
+uint64_t sessionReceived = 0;       // session frames received (receiver thread)
+uint64_t receivedAcked = 0;         // last count acknowledged to the server
+
+// Flow control (see FRAME_CREDIT): messages and publishes wait in
+// sendToServer() while the server's grant for this connection is used up;
+// the server stops reading a client that sends past it
+uint64_t creditUsed = 0;            // sent on this connection, under sendMutex
+uint64_t creditGranted = 0;         // 0 = the server does no flow control
+condition_variable creditChanged;
+
+// A file this client is sending. The transfer thread streams it from disk
+// while the receiver thread records the other side's replies.
+enum FileState { FILE_OFFERED, FILE_SENDING, FILE_DONE, FILE_FAILED };
+
+struct OutgoingFile {
+    uint32_t id;
+    string path;
+    string name;
+    uint16_t target;
+    int fd;
+    uint64_t size;
+    uint64_t startOffset;   // where the receiver asked us to resume
+    uint64_t acked;         // bytes the receiver has written
+    FileState state;
+    string detail;
+};
+
+// A file this client is receiving into <download dir>/<Campus>-<name>.part;
+// only the receiver thread touches these
+struct IncomingFile {
+    int fd;
+    string path;
+    uint64_t size;
+    uint64_t received;
+    uint64_t acked;         // last offset reported back to the sender
+};
+
+map<uint32_t, OutgoingFile*> outgoingFiles;    // by transfer ID
+map<uint64_t, IncomingFile> incomingFiles;      // by sender campus << 32 | transfer ID
+mutex filesMutex;
+condition_variable filesChanged;
+string downloadDir = "downloads";
+vector<string> sendFilePaths;                  // --send-file, sent in headless mode
+
+// Human-readable progress; goes to stderr in headless mode so stdout stays
+// machine-readable
 void safeLog(const string& message) {
     lock_guard<mutex> lock(coutMutex);
-    cout << message << endl;
+    (headless.enabled ? cerr : cout) << message << endl;
+}
+
+string jsonString(const string& text) {
+    string out = "\"";
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += (char)c;
+        }
+    }
+    return out + "\"";
+}
+
+// One structured event line on stdout
+void reportEvent(const string& json) {
+    lock_guard<mutex> lock(coutMutex);
+    cout << json << endl;
+}
+
+// Send a whole buffer
+bool sendAll(SOCKET socket, const char* data, size_t length) {
+    while (length > 0) {
+        int sent = send(socket, data, length, 0);
+        if (sent == SOCKET_ERROR) return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Keep copies of the session frames in a buffer of whole frames until the
+// server acknowledges them. Call with sendMutex held.
+void keepUnacked(const char* data, size_t length) {
+    while (length >= FRAME_HEADER_SIZE) {
+        size_t size = FRAME_HEADER_SIZE + getU32(data + 4);
+        if (isSessionFrame((uint8_t)data[2])) unackedSent.push_back(vector<char>(data, data + size));
+        data += size;
+        length -= size;
+    }
+}
+
+// Messages and publishes in a buffer of whole frames
+uint64_t creditedFrames(const char* data, size_t length) {
+    uint64_t count = 0;
+    while (length >= FRAME_HEADER_SIZE) {
+        size_t size = FRAME_HEADER_SIZE + getU32(data + 4);
+        if (usesCredit((uint8_t)data[2])) count++;
+        data += size;
+        length -= size;
+    }
+    return count;
+}
+
+// Length of the leading frames of a buffer that need at most credit
+size_t creditedPrefix(const char* data, size_t length, uint64_t credit) {
+    size_t offset = 0;
+    while (length - offset >= FRAME_HEADER_SIZE) {
+        if (usesCredit((uint8_t)data[offset + 2])) {
+            if (credit == 0) break;
+            credit--;
+        }
+        offset += FRAME_HEADER_SIZE + getU32(data + offset + 4);
+    }
+    return offset;
+}
+
+// Send frames to the server. With a resumable session they are kept until
+// acknowledged, and a send while the link is down succeeds: the frames go
+// out once the session is resumed. Messages wait for flow-control credit;
+// a batch larger than the credit left goes out in pieces as it comes back.
+bool sendToServer(const char* data, size_t length) {
+    unique_lock<mutex> lock(sendMutex);
+    while (length > 0) {
+        size_t piece = length;
+        if (creditedFrames(data, length) > 0) {
+            while (linkUp && isConnected && creditGranted > 0 && creditUsed >= creditGranted) {
+                creditChanged.wait_for(lock, chrono::milliseconds(200));
+            }
+            if (creditUsed < creditGranted) piece = creditedPrefix(data, length, creditGranted - creditUsed);
+        }
+        bool resumable = !sessionToken.empty();
+        if (!linkUp) {
+            if (resumable) keepUnacked(data, length);
+            return resumable;
+        }
+        if (resumable) keepUnacked(data, piece);
+        creditUsed += creditedFrames(data, piece);
+        if (!sendAll(tcpSocket, data, piece)) {
+            // Let the receiver thread notice and reconnect
+            linkUp = false;
+            shutdown(tcpSocket, SHUT_RDWR);
+            if (resumable) keepUnacked(data + piece, length - piece);
+            return resumable;
+        }
+        data += piece;
+        length -= piece;
+    }
+    return true;
+}
+
+// Tell the server how many session frames we have processed
+void acknowledgeReceived() {
+    char payload[8];
+    putU64(payload, sessionReceived);
+    vector<char> frame;
+    appendFrame(frame, FRAME_ACK, 0, 0, 0, 0, payload, sizeof(payload));
+    receivedAcked = sessionReceived;
+    sendToServer(&frame[0], frame.size());
+}
+
+// Block until the next complete frame arrives in recvBuffer. Before
+// waiting for more data, everything received so far is acknowledged, so
+// the server gets one ack per burst.
+FrameStatus readFrame(FrameView& frame) {
+    FrameStatus status;
+    while ((status = recvBuffer.nextFrame(frame)) == FRAME_INCOMPLETE) {
+        if (linkUp && !sessionToken.empty() && sessionReceived != receivedAcked) acknowledgeReceived();
+        char* space = recvBuffer.writePtr();
+        int bytesReceived = recv(tcpSocket, space, recvBuffer.writeSpace(), 0);
+        if (bytesReceived <= 0) return FRAME_INVALID;
+        recvBuffer.commit(bytesReceived);
+    }
+    return status;
+}
+
+// Append a message or publish frame to out, compressing the text when the
+// server agreed to compression, the text is long enough and it shrinks
+void appendTextFrame(vector<char>& out, uint8_t type, uint32_t seq, uint16_t to, uint16_t dept,
+                     const string& text, uint8_t flags) {
+    if (compressionActive && text.size() >= compression.threshold &&
+        compressPayload(text.data(), text.size(), compressBuffer, compressTable)) {
+        appendFrame(out, type, seq, campusIdOf(campusName), to, dept, &compressBuffer[0], compressBuffer.size(),
+                    flags | FRAME_FLAG_COMPRESSED);
+    } else {
+        appendFrame(out, type, seq, campusIdOf(campusName), to, dept, text.data(), text.size(), flags);
+    }
 }
 
-// Connect to central server via TCP
-bool connectToServer() {
-    tcpSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (tcpSocket == INVALID_SOCKET) {
+// Follow or stop following a topic on the server
+bool sendSubscription(const Topic& topic, bool subscribe) {
+    vector<char> frame = makeFrame(subscribe ? FRAME_SUBSCRIBE : FRAME_UNSUBSCRIBE, nextSeq++,
+                                   campusIdOf(campusName), topic.campus, topic.dept, "");
+    return sendToServer(&frame[0], frame.size());
+}
+
+// Value of ",Key:value" in a login reply
+string replyField(const string& reply, const string& key) {
+    size_t start = reply.find("," + key + ":");
+    if (start == string::npos) return "";
+    start += key.size() + 2;
+    return reply.substr(start, reply.find(',', start) - start);
+}
+
+// Connect to the central server and log in, or resume the session when
+// resume is set and we hold a token. On success the link is up and frames
+// the server has not processed are sent again. A refused resume falls back
+// to a full login.
+bool connectToServer(bool resume = false) {
+    SOCKET newSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (newSocket == INVALID_SOCKET) {
         safeLog("Failed to create TCP socket");
         return false;
     }
     
     sockaddr_in serverAddr;
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(TCP_PORT);
-    inet_pton(AF_INET, SERVER_IP.c_str(), &serverAddr.sin_addr);
+    serverAddr.sin_port = htons(serverPort);
+    inet_pton(AF_INET, serverIp.c_str(), &serverAddr.sin_addr);
     
-    if (connect(tcpSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-        safeLog("Failed to connect to server");
-        closesocket(tcpSocket);
+    if (connect(newSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+        if (!resume) safeLog("Failed to connect to server");
+        closesocket(newSocket);
         return false;
     }
     
-    // Send authentication
-    string authMsg = "Campus:" + campusName + ",Pass:" + campusPassword;
-    send(tcpSocket, authMsg.c_str(), authMsg.length(), 0);
+    // Send authentication; the flags offer compressed frames and a
+    // resumable session, and ask for flow-control credit
+    bool resuming = resume && !sessionToken.empty();
+    string authMsg = resuming ? "Resume:" + sessionToken + ",Received:" + to_string(sessionReceived)
+                              : "Campus:" + endpointName + ",Pass:" + campusPassword;
+    vector<char> authFrame;
+    appendFrame(authFrame, FRAME_AUTH, 0, 0, 0, 0, authMsg.data(), authMsg.size(),
+                (compression.offered ? FRAME_FLAG_COMPRESSED : 0) | (reconnect.enabled ? FRAME_FLAG_RESUME : 0) |
+                FRAME_FLAG_CREDIT);
+    tcpSocket = newSocket;
+    recvBuffer.clear();
+    sendAll(tcpSocket, &authFrame[0], authFrame.size());
     
     // Wait for response
-    char buffer[1024] = {0};
-    int bytesReceived = recv(tcpSocket, buffer, sizeof(buffer), 0);
-    
-    if (bytesReceived > 0) {
-        string response(buffer, bytesReceived);
-        if (response == "AUTH_SUCCESS") {
-            safeLog("Authentication successful!");
-            isConnected = true;
-            return true;
-        } else {
+    FrameView frame;
+    string response;
+    if (readFrame(frame) == FRAME_READY && frame.header.type == FRAME_AUTH_REPLY) {
+        response.assign(frame.payload, frame.header.length);
+    }
+    string status = response.substr(0, response.find(','));
+    if (status != "AUTH_SUCCESS" && status != "AUTH_RESUMED") {
+        closesocket(tcpSocket);
+        tcpSocket = INVALID_SOCKET;
+        if (status == "RESUME_FAILED") {
+            safeLog("Session expired on the server, logging in again");
+            sessionToken.clear();
+            return connectToServer(true);
+        }
+        if (status == "RESUME_BUSY" || (resume && status.empty())) return false;
+        if (status == "AUTH_FAILED" || status.empty()) {
             safeLog("Authentication failed!");
+        } else {
+            safeLog("Authentication failed! (" + response + ")");
         }
+        return false;
     }
     
-    closesocket(tcpSocket);
+    bool resumed = status == "AUTH_RESUMED";
+    compressionActive = (frame.header.flags & FRAME_FLAG_COMPRESSED) != 0;
+    uint64_t serverReceived = strtoull(replyField(response, "Received").c_str(), NULL, 10);
+    if (!resumed) sessionReceived = receivedAcked = 0;
+    size_t resent = 0;
+    {
+        lock_guard<mutex> lock(sendMutex);
+        sessionToken = (frame.header.flags & FRAME_FLAG_RESUME) ? replyField(response, "Token") : "";
+        if (resumed) {
+            while (unackedBase < serverReceived && !unackedSent.empty()) {
+                unackedSent.pop_front();
+                unackedBase++;
+            }
+        } else {
+            // A new session: whatever the old one had not confirmed is sent
+            // again as its first frames, and may arrive twice
+            unackedBase = 0;
+            if (sessionToken.empty()) unackedSent.clear();
+        }
+        creditGranted = (frame.header.flags & FRAME_FLAG_CREDIT)
+                        ? strtoull(replyField(response, "Credit").c_str(), NULL, 10) : 0;
+        creditUsed = 0;
+        for (size_t i = 0; i < unackedSent.size(); i++, resent++) {
+            if (!sendAll(tcpSocket, &unackedSent[i][0], unackedSent[i].size())) break;
+            creditUsed += creditedFrames(&unackedSent[i][0], unackedSent[i].size());
+        }
+        linkUp = true;
+    }
+    isConnected = true;
+    
+    if (resumed) {
+        safeLog("Session resumed" + (resent > 0 ? " (" + to_string(resent) + " frames sent again)" : string()));
+    } else {
+        safeLog("Authentication successful!");
+        for (size_t i = 0; i < subscribedTopics.size(); i++) {
+            sendSubscription(subscribedTopics[i], true);
+        }
+    }
+    return true;
+}
+
+// The link dropped: reconnect with exponential backoff and jitter until
+// the session is back, the user quits or --reconnect-for runs out
+bool reconnectToServer() {
+    if (!reconnect.enabled || !isConnected) return false;
+    {
+        lock_guard<mutex> lock(sendMutex);
+        linkUp = false;
+        closesocket(tcpSocket);
+        tcpSocket = INVALID_SOCKET;
+        creditChanged.notify_all();
+    }
+    safeLog("Connection to server lost, reconnecting...");
+    
+    mt19937 random((unsigned)chrono::steady_clock::now().time_since_epoch().count());
+    chrono::steady_clock::time_point giveUp = chrono::steady_clock::now() + chrono::seconds(reconnect.giveUpSec);
+    int delayMs = reconnect.initialDelayMs;
+    while (isConnected && chrono::steady_clock::now() < giveUp) {
+        // Sleep between half and all of the current delay, in short steps
+        // so a quit is noticed
+        int sleepMs = delayMs / 2 + (int)(random() % (unsigned)(delayMs / 2 + 1));
+        for (int slept = 0; slept < sleepMs && isConnected; slept += 100) {
+            this_thread::sleep_for(chrono::milliseconds(min(100, sleepMs - slept)));
+        }
+        if (isConnected && connectToServer(true)) return true;
+        delayMs = min(delayMs * 2, reconnect.maxDelayMs);
+    }
+    if (isConnected) safeLog("Could not reconnect to the server");
     return false;
 }
 
-// UDP heartbeat sender
-void sendHeartbeat() {
-    udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+// Send one heartbeat per campus; a single sendmmsg call per 1024 datagrams
+// on Linux, one sendto each elsewhere
+void sendHeartbeatBatch(SOCKET socket, const sockaddr_in& serverAddr, const vector<string>& heartbeats) {
+#ifdef __linux__
+    const size_t MAX_BATCH = 1024;
+    vector<mmsghdr> messages(min(heartbeats.size(), MAX_BATCH));
+    vector<iovec> buffers(messages.size());
+    for (size_t start = 0; start < heartbeats.size(); start += MAX_BATCH) {
+        size_t count = min(heartbeats.size() - start, MAX_BATCH);
+        for (size_t i = 0; i < count; i++) {
+            buffers[i].iov_base = (void*)heartbeats[start + i].data();
+            buffers[i].iov_len = heartbeats[start + i].size();
+            memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_iov = &buffers[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = (void*)&serverAddr;
+            messages[i].msg_hdr.msg_namelen = sizeof(serverAddr);
+        }
+        // sendmmsg may stop early; carry on from the first unsent datagram
+        size_t sent = 0;
+        while (sent < count) {
+            int result = sendmmsg(socket, &messages[sent], count - sent, 0);
+            if (result <= 0) break;
+            sent += result;
+        }
+    }
+#else
+    for (size_t i = 0; i < heartbeats.size(); i++) {
+        sendto(socket, heartbeats[i].c_str(), heartbeats[i].length(), 0,
+               (sockaddr*)&serverAddr, sizeof(serverAddr));
+    }
+#endif
+}
+
+// The heartbeat socket doubles as the UDP broadcast endpoint, so it is
+// created before the heartbeat and broadcast threads start
+bool openHeartbeatSocket() {
+    if (udpSocket == INVALID_SOCKET) udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
     if (udpSocket == INVALID_SOCKET) {
         safeLog("Failed to create UDP socket for heartbeat");
-        return;
+        return false;
     }
+    return true;
+}
+
+// UDP heartbeat sender
+void sendHeartbeat() {
+    if (!openHeartbeatSocket()) return;
     
     sockaddr_in serverAddr;
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(UDP_PORT);
-    inet_pton(AF_INET, SERVER_IP.c_str(), &serverAddr.sin_addr);
+    serverAddr.sin_port = htons(serverPort + (UDP_PORT - TCP_PORT));
+    inet_pton(AF_INET, serverIp.c_str(), &serverAddr.sin_addr);
+    
+    vector<string> heartbeats;
+    if (!campusName.empty()) heartbeats.push_back("HEARTBEAT|" + campusName);
+    for (size_t i = 0; i < heartbeatCampuses.size(); i++) {
+        heartbeats.push_back("HEARTBEAT|" + heartbeatCampuses[i]);
+    }
     
     while (isConnected) {
-        string heartbeat = "HEARTBEAT|" + campusName;
-        sendto(udpSocket, heartbeat.c_str(), heartbeat.length(), 0,
-               (sockaddr*)&serverAddr, sizeof(serverAddr));
+        sendHeartbeatBatch(udpSocket, serverAddr, heartbeats);
         
-        safeLog("[Heartbeat] Status sent to server");
+        if (!headless.enabled && !heartbeatOnly) safeLog("[Heartbeat] Status sent to server");
         this_thread::sleep_for(chrono::seconds(HEARTBEAT_INTERVAL));
     }
-    
-    closesocket(udpSocket);
 }
 
-// UDP broadcast receiver
-void receiveBroadcasts() {
-    SOCKET broadcastSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (broadcastSocket == INVALID_SOCKET) {
-        safeLog("Failed to create UDP socket for broadcasts");
-        return;
-    }
+// Socket joined to the broadcast multicast group
+SOCKET joinBroadcastGroup() {
+    SOCKET groupSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (groupSocket == INVALID_SOCKET) return INVALID_SOCKET;
+    
+    // Several clients on one host may listen to the same group
+    int reuse = 1;
+    setsockopt(groupSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
     
     sockaddr_in clientAddr;
+    memset(&clientAddr, 0, sizeof(clientAddr));
     clientAddr.sin_family = AF_INET;
     clientAddr.sin_addr.s_addr = INADDR_ANY;
-    clientAddr.sin_port = htons(CLIENT_UDP_PORT);
+    clientAddr.sin_port = htons(broadcastGroupPort);
     
-    if (bind(broadcastSocket, (sockaddr*)&clientAddr, sizeof(clientAddr)) == SOCKET_ERROR) {
-        safeLog("Failed to bind UDP socket for broadcasts");
-        closesocket(broadcastSocket);
-        return;
+    ip_mreq membership;
+    inet_pton(AF_INET, broadcastGroup.c_str(), &membership.imr_multiaddr);
+    membership.imr_interface.s_addr = INADDR_ANY;
+    if (!multicastInterface.empty()) inet_pton(AF_INET, multicastInterface.c_str(), &membership.imr_interface);
+    
+    if (bind(groupSocket, (sockaddr*)&clientAddr, sizeof(clientAddr)) == SOCKET_ERROR ||
+        setsockopt(groupSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == SOCKET_ERROR) {
+        closesocket(groupSocket);
+        return INVALID_SOCKET;
     }
+    return groupSocket;
+}
+
+// UDP broadcast receiver
+void receiveBroadcasts() {
+    SOCKET broadcastSocket = udpSocket;
+    if (!broadcastGroup.empty()) {
+        broadcastSocket = joinBroadcastGroup();
+        if (broadcastSocket == INVALID_SOCKET) {
+            safeLog("Failed to join broadcast group " + broadcastGroup);
+            return;
+        }
+    }
+    if (broadcastSocket == INVALID_SOCKET) return;
+    
+    // Wake up regularly to notice a disconnect
+#ifdef _WIN32
+    DWORD timeout = 1000;
+#else
+    timeval timeout = {1, 0};
+#endif
+    setsockopt(broadcastSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
     
     char buffer[4096];
     while (isConnected) {
         sockaddr_in serverAddr;
         socklen_t serverLen = sizeof(serverAddr);
         
-        int bytesReceived = recvfrom(broadcastSocket, buffer, sizeof(buffer), 0,
+        int bytesReceived = recvfrom(broadcastSocket, buffer, sizeof(buffer) - 1, 0,
                                      (sockaddr*)&serverAddr, &serverLen);
         
         if (bytesReceived > 0) {
@@ -153,44 +624,463 @@ void receiveBroadcasts() {
         }
     }
     
-    closesocket(broadcastSocket);
+    if (broadcastSocket != udpSocket) closesocket(broadcastSocket);
+}
+
+// ---- File transfers ----
+
+#ifdef _WIN32
+bool writeAt(int fd, const char* data, size_t length, uint64_t offset) {
+    return _lseeki64(fd, offset, SEEK_SET) >= 0 && _write(fd, data, (unsigned)length) == (int)length;
+}
+#else
+bool writeAt(int fd, const char* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written <= 0) return false;
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+#endif
+
+// Send one chunk of a file: the frame header, then the file bytes straight
+// from the page cache with sendfile() where available
+bool sendFileChunk(const OutgoingFile* file, uint64_t offset, size_t length) {
+    char header[FRAME_HEADER_SIZE + 8];
+    FrameHeader h = {FRAME_FILE_CHUNK, 0, (uint32_t)(8 + length), file->id, campusIdOf(campusName), file->target, 0};
+    encodeFrameHeader(header, h);
+    putU64(header + FRAME_HEADER_SIZE, offset);
+    
+    lock_guard<mutex> lock(sendMutex);
+    if (!linkUp) return false;
+#ifdef __linux__
+    // MSG_MORE lets the header share a segment with the start of the data
+    const char* data = header;
+    size_t left = sizeof(header);
+    while (left > 0) {
+        ssize_t sent = send(tcpSocket, data, left, MSG_MORE);
+        if (sent <= 0) return false;
+        data += sent;
+        left -= sent;
+    }
+    off_t position = (off_t)offset;
+    while (length > 0) {
+        ssize_t sent = sendfile(tcpSocket, file->fd, &position, length);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        length -= sent;
+    }
+    return true;
+#else
+    vector<char> chunk(sizeof(header) + length);
+    memcpy(&chunk[0], header, sizeof(header));
+    if (lseek(file->fd, (long)offset, SEEK_SET) < 0 ||
+        read(file->fd, &chunk[sizeof(header)], (unsigned)length) != (int)length) {
+        return false;
+    }
+    return sendAll(tcpSocket, &chunk[0], chunk.size());
+#endif
+}
+
+// Tell the user (or the headless caller) how a transfer ended
+void reportFile(const OutgoingFile* file) {
+    bool done = file->state == FILE_DONE;
+    if (headless.enabled) {
+        string json = "{\"event\":\"file\",\"name\":" + jsonString(file->name) +
+                      ",\"to\":" + jsonString(campusNameOf(file->target)) +
+                      ",\"status\":\"" + (done ? "done" : "failed") + "\",\"bytes\":" + to_string(file->size) +
+                      ",\"resumed_from\":" + to_string(file->startOffset);
+        if (!done) json += ",\"detail\":" + jsonString(file->detail);
+        reportEvent(json + "}");
+    } else if (done) {
+        safeLog("\n[File] " + file->name + " delivered to " + campusNameOf(file->target) + " (" +
+                to_string(file->size) + " bytes" +
+                (file->startOffset > 0 ? ", resumed at " + to_string(file->startOffset) : "") + ")");
+    } else {
+        safeLog("\n[File] " + file->name + " to " + campusNameOf(file->target) + " failed: " + file->detail);
+    }
+}
+
+// Offer a file to a campus and stream it once the receiver says from
+// where; runs on its own thread, so messages keep flowing meanwhile.
+// True if the receiver saved the whole file.
+bool runFileTransfer(string path, uint16_t target) {
+    OutgoingFile* file = new OutgoingFile();
+    file->path = path;
+    size_t slash = path.find_last_of("/\\");
+    file->name = slash == string::npos ? path : path.substr(slash + 1);
+    file->target = target;
+    file->startOffset = file->acked = 0;
+    file->state = FILE_OFFERED;
+    file->fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (file->fd < 0 || fstat(file->fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        file->state = FILE_FAILED;
+        file->detail = "cannot read " + path;
+        reportFile(file);
+        if (file->fd >= 0) close(file->fd);
+        delete file;
+        return false;
+    }
+    file->size = (uint64_t)info.st_size;
+    
+    {
+        lock_guard<mutex> lock(filesMutex);
+        random_device random;
+        do {
+            file->id = (uint32_t)random();
+        } while (file->id == 0 || outgoingFiles.count(file->id) != 0);
+        outgoingFiles[file->id] = file;
+    }
+    
+    vector<char> offer(8 + file->name.size());
+    putU64(&offer[0], file->size);
+    memcpy(&offer[8], file->name.data(), file->name.size());
+    vector<char> frame;
+    appendFrame(frame, FRAME_FILE_OFFER, file->id, campusIdOf(campusName), target, 0, &offer[0], offer.size());
+    bool ok = sendToServer(&frame[0], frame.size());
+    
+    unique_lock<mutex> lock(filesMutex);
+    if (ok) {
+        filesChanged.wait_for(lock, chrono::seconds(30), [file] { return file->state != FILE_OFFERED || !isConnected; });
+    }
+    if (file->state == FILE_OFFERED) {
+        file->state = FILE_FAILED;
+        file->detail = ok && isConnected ? "no answer to the offer" : "not connected";
+    }
+    
+    // Keep at most FILE_WINDOW bytes unacknowledged
+    uint64_t offset = file->startOffset;
+    while (file->state == FILE_SENDING && offset < file->size) {
+        filesChanged.wait(lock, [file, offset] {
+            return file->state != FILE_SENDING || !isConnected || offset - file->acked < FILE_WINDOW;
+        });
+        if (file->state != FILE_SENDING) break;
+        if (!isConnected) {
+            file->state = FILE_FAILED;
+            file->detail = "disconnected at " + to_string(file->acked) + " bytes";
+            break;
+        }
+        size_t length = (size_t)min((uint64_t)FILE_CHUNK_SIZE, file->size - offset);
+        lock.unlock();
+        ok = sendFileChunk(file, offset, length);
+        lock.lock();
+        if (!ok && file->state == FILE_SENDING) {
+            file->state = FILE_FAILED;
+            file->detail = "send failed at " + to_string(offset) + " bytes";
+        }
+        offset += length;
+    }
+    if (file->state == FILE_SENDING) {
+        filesChanged.wait_for(lock, chrono::seconds(60), [file] { return file->state != FILE_SENDING || !isConnected; });
+        if (file->state == FILE_SENDING) {
+            file->state = FILE_FAILED;
+            file->detail = "no confirmation from the receiver";
+        }
+    }
+    outgoingFiles.erase(file->id);
+    lock.unlock();
+    
+    close(file->fd);
+    reportFile(file);
+    bool done = file->state == FILE_DONE;
+    delete file;
+    return done;
+}
+
+// Reply to the sender of an incoming file
+void sendFileReply(uint8_t type, uint32_t id, uint16_t senderCampus, const char* payload, size_t length) {
+    vector<char> frame;
+    appendFrame(frame, type, id, campusIdOf(campusName), senderCampus, 0, payload, length);
+    sendToServer(&frame[0], frame.size());
+}
+
+void sendFileOffset(uint8_t type, uint32_t id, uint16_t senderCampus, uint64_t offset) {
+    char payload[8];
+    putU64(payload, offset);
+    sendFileReply(type, id, senderCampus, payload, sizeof(payload));
+}
+
+// Last path component of an offered name, or "" if it is not usable
+string safeFileName(const string& name) {
+    size_t slash = name.find_last_of("/\\");
+    string base = slash == string::npos ? name : name.substr(slash + 1);
+    if (base.empty() || base == "." || base == ".." || base.find('\0') != string::npos) return "";
+    return base;
+}
+
+// Close a finished incoming file and give it its final name
+void finishIncomingFile(uint64_t key, uint32_t id, uint16_t from) {
+    IncomingFile& incoming = incomingFiles[key];
+    close(incoming.fd);
+    string partPath = incoming.path + ".part";
+    remove(incoming.path.c_str());
+    bool ok = rename(partPath.c_str(), incoming.path.c_str()) == 0;
+    if (ok) {
+        sendFileReply(FRAME_FILE_DONE, id, from, NULL, 0);
+    } else {
+        string reason = "cannot save " + incoming.path;
+        sendFileReply(FRAME_FILE_CANCEL, id, from, reason.data(), reason.size());
+    }
+    if (headless.enabled) {
+        reportEvent(string("{\"event\":\"file-received\",\"from\":") + jsonString(campusNameOf(from)) +
+                    ",\"path\":" + jsonString(incoming.path) + ",\"bytes\":" + to_string(incoming.size) +
+                    ",\"status\":\"" + (ok ? "done" : "failed") + "\"}");
+    } else {
+        safeLog(string("\n[File] ") + (ok ? "Received " : "Could not save ") + incoming.path + " from " +
+                campusNameOf(from) + " (" + to_string(incoming.size) + " bytes)");
+    }
+    incomingFiles.erase(key);
+}
+
+// Start receiving an offered file, resuming from a .part file left by an
+// earlier attempt
+void acceptFile(const FrameView& frame) {
+    uint32_t id = frame.header.seq;
+    uint16_t from = frame.header.from;
+    string name = frame.header.length > 8 ? safeFileName(string(frame.payload + 8, frame.header.length - 8)) : "";
+    if (name.empty()) {
+        sendFileReply(FRAME_FILE_CANCEL, id, from, "bad file name", 13);
+        return;
+    }
+    
+    IncomingFile incoming;
+    incoming.size = getU64(frame.payload);
+    incoming.path = downloadDir + "/" + campusNameOf(from) + "-" + name;
+#ifdef _WIN32
+    _mkdir(downloadDir.c_str());
+    incoming.fd = open((incoming.path + ".part").c_str(), O_WRONLY | O_CREAT | O_BINARY, 0644);
+#else
+    mkdir(downloadDir.c_str(), 0755);
+    incoming.fd = open((incoming.path + ".part").c_str(), O_WRONLY | O_CREAT, 0644);
+#endif
+    struct stat info;
+    if (incoming.fd < 0 || fstat(incoming.fd, &info) != 0) {
+        string reason = "cannot write " + incoming.path;
+        sendFileReply(FRAME_FILE_CANCEL, id, from, reason.data(), reason.size());
+        if (incoming.fd >= 0) close(incoming.fd);
+        return;
+    }
+    incoming.received = (uint64_t)info.st_size;
+    if (incoming.received > incoming.size) incoming.received = 0;   // a different file; start over
+    incoming.acked = incoming.received;
+    
+    uint64_t key = ((uint64_t)from << 32) | id;
+    incomingFiles[key] = incoming;
+    if (!headless.enabled) {
+        safeLog("\n[File] Receiving " + name + " from " + campusNameOf(from) + " (" + to_string(incoming.size) +
+                " bytes" + (incoming.received > 0 ? ", resuming at " + to_string(incoming.received) : "") + ")");
+    }
+    sendFileOffset(FRAME_FILE_ACCEPT, id, from, incoming.received);
+    if (incoming.received == incoming.size) finishIncomingFile(key, id, from);
+}
+
+// Write a chunk of an incoming file; chunks arrive in order over TCP
+void writeFileChunk(const FrameView& frame) {
+    uint32_t id = frame.header.seq;
+    uint16_t from = frame.header.from;
+    uint64_t key = ((uint64_t)from << 32) | id;
+    map<uint64_t, IncomingFile>::iterator it = incomingFiles.find(key);
+    if (it == incomingFiles.end() || frame.header.length < 8) return;
+    
+    IncomingFile& incoming = it->second;
+    uint64_t offset = getU64(frame.payload);
+    size_t length = frame.header.length - 8;
+    const char* reason = NULL;
+    if (offset != incoming.received || length > incoming.size - incoming.received) reason = "chunk out of order";
+    else if (!writeAt(incoming.fd, frame.payload + 8, length, offset)) reason = "write failed";
+    if (reason != NULL) {
+        sendFileReply(FRAME_FILE_CANCEL, id, from, reason, strlen(reason));
+        close(incoming.fd);
+        incomingFiles.erase(it);
+        return;
+    }
+    
+    incoming.received += length;
+    if (incoming.received == incoming.size) {
+        finishIncomingFile(key, id, from);
+    } else if (incoming.received - incoming.acked >= FILE_WINDOW / 2) {
+        incoming.acked = incoming.received;
+        sendFileOffset(FRAME_FILE_ACK, id, from, incoming.received);
+    }
+}
+
+// Dispatch a file transfer frame from the receiver thread
+void handleFileFrame(const FrameView& frame) {
+    uint8_t type = frame.header.type;
+    if (type == FRAME_FILE_OFFER) {
+        acceptFile(frame);
+        return;
+    }
+    if (type == FRAME_FILE_CHUNK) {
+        writeFileChunk(frame);
+        return;
+    }
+    
+    {
+        lock_guard<mutex> lock(filesMutex);
+        map<uint32_t, OutgoingFile*>::iterator it = outgoingFiles.find(frame.header.seq);
+        if (it != outgoingFiles.end() && it->second->target == frame.header.from) {
+            OutgoingFile* file = it->second;
+            uint64_t offset = frame.header.length >= 8 ? getU64(frame.payload) : 0;
+            if (type == FRAME_FILE_ACCEPT && file->state == FILE_OFFERED) {
+                file->startOffset = file->acked = min(offset, file->size);
+                file->state = FILE_SENDING;
+            } else if (type == FRAME_FILE_ACK) {
+                file->acked = max(file->acked, min(offset, file->size));
+            } else if (type == FRAME_FILE_DONE) {
+                file->acked = file->size;
+                file->state = FILE_DONE;
+            } else if (type == FRAME_FILE_CANCEL) {
+                file->state = FILE_FAILED;
+                file->detail = string(frame.payload, frame.header.length);
+            }
+            filesChanged.notify_all();
+            return;
+        }
+    }
+    
+    // A cancel from the sending side; the .part file stays for a resume
+    uint64_t key = ((uint64_t)frame.header.from << 32) | frame.header.seq;
+    map<uint64_t, IncomingFile>::iterator incoming = incomingFiles.find(key);
+    if (type == FRAME_FILE_CANCEL && incoming != incomingFiles.end()) {
+        close(incoming->second.fd);
+        safeLog("\n[File] Transfer of " + incoming->second.path + " interrupted at " +
+                to_string(incoming->second.received) + " bytes: " + string(frame.payload, frame.header.length));
+        incomingFiles.erase(incoming);
+    }
+}
+
+// Report the outcome of a headless send and free its window slot
+void reportOutcome(const FrameView& frame, const char* status) {
+    PendingSend send = {0, frame.header.to, frame.header.dept};
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        map<uint32_t, PendingSend>::iterator it = pendingSends.find(frame.header.seq);
+        if (it != pendingSends.end()) send = it->second;
+    }
+    
+    string json = "{\"event\":\"outcome\",\"seq\":" + to_string(frame.header.seq) +
+                  ",\"line\":" + to_string(send.line) +
+                  ",\"to\":" + jsonString(headless.publish ? topicName(send.target, send.dept) : campusNameOf(send.target)) +
+                  ",\"status\":\"" + status + "\"";
+    if (headless.publish && frame.header.type == FRAME_DELIVERED) {
+        json += ",\"recipients\":" + to_string(atoi(string(frame.payload, frame.header.length).c_str()));
+    } else if (frame.header.type != FRAME_DELIVERED) {
+        json += ",\"detail\":" + jsonString(string(frame.payload, frame.header.length));
+    }
+    reportEvent(json + "}");
+    
+    // Only now free the slot, so the summary always comes after this line
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        pendingSends.erase(frame.header.seq);
+        if (frame.header.type == FRAME_DELIVERED) delivered++;
+        else if (frame.header.type == FRAME_QUEUED) queuedCount++;
+        else failed++;
+    }
+    pendingChanged.notify_all();
 }
 
 // TCP message receiver
 void receiveMessages() {
-    char buffer[4096];
-    
+    vector<char> inflated;     // reused for every compressed payload
     while (isConnected) {
-        memset(buffer, 0, sizeof(buffer));
-        int bytesReceived = recv(tcpSocket, buffer, sizeof(buffer), 0);
-        
-        if (bytesReceived <= 0) {
-            safeLog("Disconnected from server");
+        FrameView frame;
+        if (readFrame(frame) != FRAME_READY) {
+            if (reconnectToServer()) continue;
+            if (isConnected) safeLog("Disconnected from server");
             isConnected = false;
+            pendingChanged.notify_all();
+            {
+                lock_guard<mutex> lock(filesMutex);
+                filesChanged.notify_all();
+            }
             break;
         }
         
-        string message(buffer, bytesReceived);
+        if (frame.header.type == FRAME_ACK) {
+            uint64_t received = frame.header.length >= 8 ? getU64(frame.payload) : 0;
+            lock_guard<mutex> lock(sendMutex);
+            while (unackedBase < received && !unackedSent.empty()) {
+                unackedSent.pop_front();
+                unackedBase++;
+            }
+            continue;
+        }
+        if (frame.header.type == FRAME_CREDIT) {
+            lock_guard<mutex> lock(sendMutex);
+            if (frame.header.length >= 8) creditGranted = max(creditGranted, getU64(frame.payload));
+            creditChanged.notify_all();
+            continue;
+        }
+        if (isSessionFrame(frame.header.type)) sessionReceived++;
         
-        if (message.find("ERROR|") == 0) {
-            safeLog("\n[ERROR] " + message.substr(6));
-        } else {
-            // Format: FROM|DEPT|MESSAGE
-            size_t pos1 = message.find('|');
-            size_t pos2 = message.find('|', pos1 + 1);
-            
-            if (pos1 != string::npos && pos2 != string::npos) {
-                string from = message.substr(0, pos1);
-                string dept = message.substr(pos1 + 1, pos2 - pos1 - 1);
-                string content = message.substr(pos2 + 1);
-                
-                safeLog("\n╔════════════════════════════════════════╗");
-                safeLog("║         NEW MESSAGE RECEIVED           ║");
-                safeLog("╠════════════════════════════════════════╣");
-                safeLog("║ From: " + from + " (" + dept + ")");
-                safeLog("║ Message: " + content);
-                safeLog("╚════════════════════════════════════════╝\n");
+        if (frame.header.flags & FRAME_FLAG_COMPRESSED) {
+            if (!decompressPayload(frame.payload, frame.header.length, inflated)) {
+                safeLog("Dropped a message that could not be decompressed");
+                continue;
             }
+            frame.payload = &inflated[0];
+            frame.header.length = (uint32_t)inflated.size();
+        }
+        
+        if (frame.header.type >= FRAME_FILE_OFFER && frame.header.type <= FRAME_FILE_CANCEL) {
+            handleFileFrame(frame);
+            continue;
+        }
+        
+        if (headless.enabled) {
+            if (frame.header.type == FRAME_DELIVERED) {
+                reportOutcome(frame, "delivered");
+            } else if (frame.header.type == FRAME_QUEUED) {
+                reportOutcome(frame, "queued");
+            } else if (frame.header.type == FRAME_ERROR) {
+                reportOutcome(frame, "error");
+            } else if (frame.header.type == FRAME_BROADCAST) {
+                reportEvent("{\"event\":\"broadcast\",\"text\":" +
+                            jsonString(string(frame.payload, frame.header.length)) + "}");
+            } else if (frame.header.type == FRAME_MESSAGE) {
+                reportEvent(string("{\"event\":\"message\",\"from\":") + jsonString(campusNameOf(frame.header.from)) +
+                            ",\"dept\":" + jsonString(departmentNameOf(frame.header.dept)) +
+                            ",\"seq\":" + to_string(frame.header.seq) +
+                            ",\"text\":" + jsonString(string(frame.payload, frame.header.length)) + "}");
+            } else if (frame.header.type == FRAME_PUBLISH) {
+                reportEvent(string("{\"event\":\"publish\",\"from\":") + jsonString(campusNameOf(frame.header.from)) +
+                            ",\"topic\":" + jsonString(topicName(frame.header.to, frame.header.dept)) +
+                            ",\"seq\":" + to_string(frame.header.seq) +
+                            ",\"text\":" + jsonString(string(frame.payload, frame.header.length)) + "}");
+            }
+            continue;
+        }
+        
+        if (frame.header.type == FRAME_ERROR) {
+            safeLog("\n[ERROR] " + string(frame.payload, frame.header.length));
+        } else if (frame.header.type == FRAME_QUEUED) {
+            safeLog("\n[QUEUED] " + string(frame.payload, frame.header.length));
+        } else if (frame.header.type == FRAME_BROADCAST) {
+            safeLog("\n*** SYSTEM BROADCAST ***");
+            safeLog(string(frame.payload, frame.header.length));
+            safeLog("************************\n");
+        } else if (frame.header.type == FRAME_MESSAGE) {
+            safeLog("\n╔════════════════════════════════════════╗");
+            safeLog("║         NEW MESSAGE RECEIVED           ║");
+            safeLog("╠════════════════════════════════════════╣");
+            safeLog("║ From: " + string(campusNameOf(frame.header.from)) +
+                    " (" + departmentNameOf(frame.header.dept) + ")");
+            safeLog("║ Message: " + string(frame.payload, frame.header.length));
+            safeLog("╚════════════════════════════════════════╝\n");
+        } else if (frame.header.type == FRAME_PUBLISH) {
+            safeLog("\n╔════════════════════════════════════════╗");
+            safeLog("║         NEW TOPIC POST                 ║");
+            safeLog("╠════════════════════════════════════════╣");
+            safeLog("║ Topic: " + topicName(frame.header.to, frame.header.dept));
+            safeLog("║ From: " + string(campusNameOf(frame.header.from)));
+            safeLog("║ Message: " + string(frame.payload, frame.header.length));
+            safeLog("╚════════════════════════════════════════╝\n");
         }
     }
 }
@@ -201,28 +1091,20 @@ void sendMessage() {
     
     // Select target campus
     cout << "Available Campuses:\n";
-    cout << "1. Lahore\n";
-    cout << "2. Karachi\n";
-    cout << "3. Peshawar\n";
-    cout << "4. Chiniot\n";
-    cout << "5. Multan\n";
+    for (uint16_t id = 1; id < CAMPUS_COUNT; id++) {
+        cout << id << ". " << CAMPUS_NAMES[id] << "\n";
+    }
     cout << "Enter target campus number: ";
     
     int campusChoice;
     cin >> campusChoice;
     cin.ignore();
     
-    string targetCampus;
-    switch(campusChoice) {
-        case 1: targetCampus = "Lahore"; break;
-        case 2: targetCampus = "Karachi"; break;
-        case 3: targetCampus = "Peshawar"; break;
-        case 4: targetCampus = "Chiniot"; break;
-        case 5: targetCampus = "Multan"; break;
-        default:
-            cout << "Invalid choice!\n";
-            return;
+    if (campusChoice < 1 || campusChoice >= CAMPUS_COUNT) {
+        cout << "Invalid choice!\n";
+        return;
     }
+    string targetCampus = CAMPUS_NAMES[campusChoice];
     
     if (targetCampus == campusName) {
         cout << "Cannot send message to yourself!\n";
@@ -252,13 +1134,433 @@ void sendMessage() {
     string messageContent;
     getline(cin, messageContent);
     
-    // Format: FROM|TO|DEPT|MESSAGE
-    string fullMessage = campusName + "|" + targetCampus + "|" + targetDept + "|" + messageContent;
+    vector<char> frame;
+    appendTextFrame(frame, FRAME_MESSAGE, nextSeq++, campusIdOf(targetCampus), departmentIdOf(targetDept),
+                    messageContent, 0);
     
-    send(tcpSocket, fullMessage.c_str(), fullMessage.length(), 0);
+    sendToServer(&frame[0], frame.size());
     cout << "Message sent successfully!\n";
 }
 
+// Send a file in the background; the menu stays usable meanwhile
+void sendFile() {
+    cout << "\n=== Send File ===\n";
+    for (uint16_t id = 1; id < CAMPUS_COUNT; id++) {
+        cout << id << ". " << CAMPUS_NAMES[id] << "\n";
+    }
+    cout << "Enter target campus number: ";
+    int campusChoice;
+    cin >> campusChoice;
+    cin.ignore();
+    if (campusChoice < 1 || campusChoice >= CAMPUS_COUNT || CAMPUS_NAMES[campusChoice] == campusName) {
+        cout << "Invalid choice!\n";
+        return;
+    }
+    
+    cout << "Enter file path: ";
+    string path;
+    getline(cin, path);
+    thread(runFileTransfer, path, (uint16_t)campusChoice).detach();
+    cout << "Sending " << path << " in the background; a re-send resumes where it stopped\n";
+}
+
+// Ask for a "Campus/Dept" topic; false (after a message) if it is not valid
+bool readTopic(const string& prompt, Topic& topic) {
+    cout << prompt;
+    string text;
+    getline(cin, text);
+    if (!parseTopic(text, topic.campus, topic.dept)) {
+        cout << "Invalid topic! Use Campus/Dept, e.g. Karachi/CS or */CS\n";
+        return false;
+    }
+    return true;
+}
+
+// Publish a message to everyone following a department topic
+void publishToTopic() {
+    cout << "\n=== Publish to Topic ===\n";
+    Topic topic;
+    if (!readTopic("Enter topic (e.g. Karachi/CS, */CS, Lahore/*): ", topic)) return;
+    
+    cout << "Enter your message: ";
+    string messageContent;
+    getline(cin, messageContent);
+    
+    vector<char> frame;
+    appendTextFrame(frame, FRAME_PUBLISH, nextSeq++, topic.campus, topic.dept, messageContent, 0);
+    sendToServer(&frame[0], frame.size());
+    cout << "Published to " << topicName(topic.campus, topic.dept) << "\n";
+}
+
+// Follow a topic, or stop following one that is already followed
+void manageSubscriptions() {
+    cout << "\n=== Topic Subscriptions ===\n";
+    for (size_t i = 0; i < subscribedTopics.size(); i++) {
+        cout << "  " << topicName(subscribedTopics[i].campus, subscribedTopics[i].dept) << "\n";
+    }
+    if (subscribedTopics.empty()) cout << "  (none)\n";
+    
+    Topic topic;
+    if (!readTopic("Enter topic to follow, or a followed one to drop: ", topic)) return;
+    
+    for (size_t i = 0; i < subscribedTopics.size(); i++) {
+        if (subscribedTopics[i].campus == topic.campus && subscribedTopics[i].dept == topic.dept) {
+            subscribedTopics.erase(subscribedTopics.begin() + i);
+            sendSubscription(topic, false);
+            cout << "Stopped following " << topicName(topic.campus, topic.dept) << "\n";
+            return;
+        }
+    }
+    subscribedTopics.push_back(topic);
+    sendSubscription(topic, true);
+    cout << "Now following " << topicName(topic.campus, topic.dept) << "\n";
+}
+
+// Split an input line into target, department and text. Lines look like
+// "Karachi|CS|text" ("*" is allowed with --publish); anything else goes to
+// --to / --dept as a whole.
+bool parseInputLine(const string& line, uint16_t& target, uint16_t& dept, string& text) {
+    target = headless.defaultTarget;
+    dept = headless.defaultDept;
+    text = line;
+    
+    size_t firstBar = line.find('|');
+    if (firstBar != string::npos) {
+        size_t secondBar = line.find('|', firstBar + 1);
+        string campusPart = line.substr(0, firstBar);
+        string deptPart = secondBar == string::npos ? "" : line.substr(firstBar + 1, secondBar - firstBar - 1);
+        uint16_t campusId = headless.publish ? topicCampusOf(campusPart) : campusIdOf(campusPart);
+        uint16_t deptId = headless.publish ? topicDepartmentOf(deptPart) : departmentIdOf(deptPart);
+        if (campusId != 0 && deptId != 0) {
+            target = campusId;
+            dept = deptId;
+            text = line.substr(secondBar + 1);
+        }
+    }
+    return target != 0;
+}
+
+#ifdef _WIN32
+int readInput(int fd, char* buffer, size_t length) { return _read(fd, buffer, (unsigned)length); }
+#else
+int readInput(int fd, char* buffer, size_t length) { return (int)read(fd, buffer, length); }
+#endif
+
+void flushBatch(vector<char>& batch) {
+    if (!batch.empty() && !sendToServer(&batch[0], batch.size())) isConnected = false;
+    batch.clear();
+}
+
+// Turn one input line into a frame at the end of batch. Blocks while the
+// window of unanswered sends is full, after flushing what is already batched.
+void queueInputLine(const string& line, uint64_t lineNumber, vector<char>& batch) {
+    uint16_t target, dept;
+    string text;
+    const char* problem = NULL;
+    if (!parseInputLine(line, target, dept, text)) problem = "no target campus (use --to or Campus|Dept|text)";
+    else if (!headless.publish && target == campusIdOf(campusName)) problem = "cannot send a message to your own campus";
+    if (problem != NULL) {
+        {
+            lock_guard<mutex> lock(pendingMutex);
+            failed++;
+        }
+        reportEvent("{\"event\":\"outcome\",\"seq\":0,\"line\":" + to_string(lineNumber) +
+                    ",\"status\":\"rejected\",\"detail\":" + jsonString(problem) + "}");
+        return;
+    }
+    
+    uint32_t seq;
+    {
+        unique_lock<mutex> lock(pendingMutex);
+        if (pendingSends.size() >= headless.window) {
+            lock.unlock();
+            flushBatch(batch);
+            lock.lock();
+            pendingChanged.wait(lock, [] { return pendingSends.size() < headless.window || !isConnected; });
+        }
+        seq = nextSeq++;
+        PendingSend send = {lineNumber, target, dept};
+        pendingSends[seq] = send;
+        sentCount++;
+    }
+    appendTextFrame(batch, headless.publish ? FRAME_PUBLISH : FRAME_MESSAGE, seq, target, dept, text, FRAME_FLAG_ACK);
+}
+
+// Read lines from fd until EOF and pipeline them without waiting for replies;
+// everything read in one chunk goes out in one send
+void pumpInput(int fd, uint64_t& lineNumber) {
+    const size_t MAX_BATCH = 64 * 1024;
+    vector<char> chunk(64 * 1024);
+    vector<char> batch;
+    string partial;
+    
+    while (isConnected) {
+        int bytesRead = readInput(fd, &chunk[0], chunk.size());
+        if (bytesRead <= 0) break;
+        partial.append(&chunk[0], bytesRead);
+        
+        size_t start = 0, end;
+        while ((end = partial.find('\n', start)) != string::npos) {
+            string line = partial.substr(start, end - start);
+            if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+            lineNumber++;
+            if (!line.empty()) queueInputLine(line, lineNumber, batch);
+            if (batch.size() >= MAX_BATCH) flushBatch(batch);
+            start = end + 1;
+        }
+        partial.erase(0, start);
+        flushBatch(batch);
+    }
+    if (!partial.empty() && isConnected) {
+        queueInputLine(partial, ++lineNumber, batch);
+        flushBatch(batch);
+    }
+}
+
+#ifndef _WIN32
+// Accept local writers on a Unix socket, one at a time, until the server
+// connection goes away
+bool serveInputSocket(uint64_t& lineNumber) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, headless.socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+    
+    if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        safeLog("Failed to listen on " + headless.socketPath);
+        if (listener >= 0) close(listener);
+        return false;
+    }
+    safeLog("Reading messages from " + headless.socketPath);
+    
+    while (isConnected) {
+        pollfd waitFor = {listener, POLLIN, 0};
+        if (poll(&waitFor, 1, 1000) <= 0) continue;
+        int writer = accept(listener, NULL, NULL);
+        if (writer < 0) continue;
+        pumpInput(writer, lineNumber);
+        close(writer);
+    }
+    close(listener);
+    unlink(addr.sun_path);
+    return true;
+}
+#endif
+
+// Non-interactive mode: send everything from the input, wait for the
+// outcomes, print a summary. Exit code 0 only if every message got through.
+int runHeadless() {
+    thread heartbeatThread(sendHeartbeat);
+    heartbeatThread.detach();
+    thread receiveThread(receiveMessages);
+    
+    // Files go out on their own threads, alongside the input lines
+    vector<thread> transfers;
+    vector<char> transferOk(sendFilePaths.size(), 0);
+    for (size_t i = 0; i < sendFilePaths.size(); i++) {
+        transfers.push_back(thread([i, &transferOk] {
+            transferOk[i] = runFileTransfer(sendFilePaths[i], headless.defaultTarget);
+        }));
+    }
+    
+    uint64_t lineNumber = 0;
+    bool inputOk = true;
+    if (!headless.socketPath.empty()) {
+#ifndef _WIN32
+        inputOk = serveInputSocket(lineNumber);
+#else
+        safeLog("--socket is not supported on Windows");
+        inputOk = false;
+#endif
+    } else {
+        int fd = headless.inputPath == "-" ? 0 : open(headless.inputPath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            safeLog("Cannot open " + headless.inputPath);
+            inputOk = false;
+        } else {
+            pumpInput(fd, lineNumber);
+            if (fd != 0) close(fd);
+        }
+    }
+    
+    bool filesOk = true;
+    for (size_t i = 0; i < transfers.size(); i++) {
+        transfers[i].join();
+        filesOk = filesOk && transferOk[i];
+    }
+    
+    size_t unanswered;
+    string summary;
+    {
+        unique_lock<mutex> lock(pendingMutex);
+        pendingChanged.wait_for(lock, chrono::seconds(headless.waitSec),
+                                [] { return pendingSends.empty() || !isConnected; });
+        unanswered = pendingSends.size();
+        summary = "{\"event\":\"summary\",\"lines\":" + to_string(lineNumber) +
+                  ",\"sent\":" + to_string(sentCount) +
+                  ",\"delivered\":" + to_string(delivered) +
+                  ",\"queued\":" + to_string(queuedCount) +
+                  ",\"failed\":" + to_string(failed) +
+                  ",\"unanswered\":" + to_string(unanswered) + "}";
+    }
+    reportEvent(summary);
+    
+    isConnected = false;
+    shutdown(tcpSocket, SHUT_RDWR);
+    receiveThread.join();
+    closesocket(tcpSocket);
+    return inputOk && filesOk && failed == 0 && unanswered == 0 ? 0 : 2;
+}
+
+// Parse command-line options
+//   --server=IP          central server address
+//   --port=N             server TCP port (heartbeats go to N+1)
+//   --campus=NAME        log in as NAME (skips the campus menu)
+//   --password=PASS      password for --campus
+//   --endpoint=NAME      login name if it differs from the campus (sub-sites)
+//   --no-compress        never send or accept compressed frames
+//   --compress-threshold=N  compress messages of at least N bytes
+//   --send-file=PATH     headless: send this file to --to (repeatable)
+//   --download-dir=PATH  where received files are saved (default downloads)
+//   --headless           no menu; send lines from --input or --socket
+//   --input=PATH         read messages from PATH ("-" = stdin, the default)
+//   --socket=PATH        accept message writers on a Unix socket
+//   --to=CAMPUS          target for lines without a "Campus|Dept|" prefix
+//   --dept=DEPT          department for those lines (default CS)
+//   --window=N           max messages waiting for an outcome
+//   --wait=SEC           how long to wait for outcomes after the input ends
+//   --publish            send lines as topic publishes (--to / --dept may be "*")
+//   --subscribe=T1,T2    follow these Campus/Dept topics, e.g. */CS
+//   --heartbeat-for=A,B  also send heartbeats for these campuses
+//   --heartbeat-only     only send heartbeats (no login), e.g. for load tests
+//   --broadcast-group=IP[:PORT]  receive UDP broadcasts from a multicast group
+//   --multicast-if=IP    local interface address for the group
+//   --no-reconnect       exit when the server connection drops
+//   --reconnect-for=SEC  how long to keep trying to reconnect (default 300)
+bool parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        
+        if (arg.find("--server=") == 0) {
+            serverIp = arg.substr(9);
+        } else if (arg.find("--port=") == 0) {
+            serverPort = atoi(arg.c_str() + 7);
+        } else if (arg.find("--campus=") == 0) {
+            campusName = arg.substr(9);
+        } else if (arg.find("--password=") == 0) {
+            campusPassword = arg.substr(11);
+        } else if (arg.find("--endpoint=") == 0) {
+            endpointName = arg.substr(11);
+        } else if (arg == "--no-compress") {
+            compression.offered = false;
+        } else if (arg.find("--compress-threshold=") == 0) {
+            compression.threshold = strtoul(arg.c_str() + 21, NULL, 10);
+        } else if (arg.find("--send-file=") == 0) {
+            headless.enabled = true;
+            sendFilePaths.push_back(arg.substr(12));
+        } else if (arg.find("--download-dir=") == 0) {
+            downloadDir = arg.substr(15);
+        } else if (arg == "--headless") {
+            headless.enabled = true;
+        } else if (arg.find("--input=") == 0) {
+            headless.enabled = true;
+            headless.inputPath = arg.substr(8);
+        } else if (arg.find("--socket=") == 0) {
+            headless.enabled = true;
+            headless.socketPath = arg.substr(9);
+        } else if (arg.find("--to=") == 0) {
+            headless.defaultTarget = topicCampusOf(arg.substr(5));
+            if (headless.defaultTarget == 0) {
+                cerr << "Unknown campus: " << arg.substr(5) << "\n";
+                return false;
+            }
+        } else if (arg.find("--dept=") == 0) {
+            headless.defaultDept = topicDepartmentOf(arg.substr(7));
+            if (headless.defaultDept == 0) {
+                cerr << "Unknown department: " << arg.substr(7) << "\n";
+                return false;
+            }
+        } else if (arg.find("--window=") == 0) {
+            headless.window = max(1, atoi(arg.c_str() + 9));
+        } else if (arg.find("--wait=") == 0) {
+            headless.waitSec = max(0, atoi(arg.c_str() + 7));
+        } else if (arg == "--publish") {
+            headless.publish = true;
+        } else if (arg.find("--subscribe=") == 0) {
+            string topics = arg.substr(12);
+            size_t start = 0;
+            while (start <= topics.size()) {
+                size_t comma = topics.find(',', start);
+                if (comma == string::npos) comma = topics.size();
+                Topic topic;
+                if (comma > start) {
+                    if (!parseTopic(topics.substr(start, comma - start), topic.campus, topic.dept)) {
+                        cerr << "Unknown topic: " << topics.substr(start, comma - start) << "\n";
+                        return false;
+                    }
+                    subscribedTopics.push_back(topic);
+                }
+                start = comma + 1;
+            }
+        } else if (arg.find("--heartbeat-for=") == 0) {
+            string names = arg.substr(16);
+            size_t start = 0;
+            while (start <= names.size()) {
+                size_t comma = names.find(',', start);
+                if (comma == string::npos) comma = names.size();
+                if (comma > start) heartbeatCampuses.push_back(names.substr(start, comma - start));
+                start = comma + 1;
+            }
+        } else if (arg == "--heartbeat-only") {
+            heartbeatOnly = true;
+        } else if (arg.find("--broadcast-group=") == 0) {
+            broadcastGroup = arg.substr(18);
+            size_t colon = broadcastGroup.find(':');
+            if (colon != string::npos) {
+                broadcastGroupPort = atoi(broadcastGroup.c_str() + colon + 1);
+                broadcastGroup.erase(colon);
+            }
+        } else if (arg.find("--multicast-if=") == 0) {
+            multicastInterface = arg.substr(15);
+        } else if (arg == "--no-reconnect") {
+            reconnect.enabled = false;
+        } else if (arg.find("--reconnect-for=") == 0) {
+            reconnect.giveUpSec = max(0, atoi(arg.c_str() + 16));
+        } else {
+            cerr << "Unknown option: " << arg << "\n"
+                 << "Usage: " << argv[0] << " [--server=IP] [--port=N] [--campus=NAME --password=PASS]\n"
+                 << "              [--endpoint=NAME] [--no-compress] [--compress-threshold=N]\n"
+                 << "              [--send-file=PATH] [--download-dir=PATH]\n"
+                 << "              [--headless] [--input=PATH|-] [--socket=PATH] [--to=CAMPUS]\n"
+                 << "              [--dept=DEPT] [--window=N] [--wait=SEC]\n"
+                 << "              [--publish] [--subscribe=CAMPUS/DEPT,...]\n"
+                 << "              [--heartbeat-for=CAMPUS,...] [--heartbeat-only]\n"
+                 << "              [--broadcast-group=IP[:PORT]] [--multicast-if=IP]\n"
+                 << "              [--no-reconnect] [--reconnect-for=SEC]\n";
+            return false;
+        }
+    }
+    if (!campusName.empty() && campusIdOf(campusName) == 0) {
+        cerr << "Unknown campus: " << campusName << "\n";
+        return false;
+    }
+    if (!headless.publish && (headless.defaultTarget == TOPIC_ANY || headless.defaultDept == TOPIC_ANY)) {
+        cerr << "\"*\" in --to / --dept needs --publish\n";
+        return false;
+    }
+    if (!sendFilePaths.empty() && (headless.defaultTarget == 0 || headless.defaultTarget == TOPIC_ANY)) {
+        cerr << "--send-file needs --to=CAMPUS\n";
+        return false;
+    }
+    if (headless.enabled && (campusName.empty() || campusPassword.empty())) {
+        cerr << "Headless mode needs --campus and --password\n";
+        return false;
+    }
+    return true;
+}
+
 // Display menu and handle user input
 void userInterface() {
     while (isConnected) {
@@ -266,8 +1568,11 @@ void userInterface() {
         cout << "║  " << campusName << " Campus - NU Info Exchange  \n";
         cout << "╠════════════════════════════════════════╣\n";
         cout << "║  1. Send Message to Another Campus     ║\n";
-        cout << "║  2. View Connection Status             ║\n";
-        cout << "║  3. Exit                               ║\n";
+        cout << "║  2. Publish to a Department Topic      ║\n";
+        cout << "║  3. Follow / Drop a Topic              ║\n";
+        cout << "║  4. Send a File to Another Campus      ║\n";
+        cout << "║  5. View Connection Status             ║\n";
+        cout << "║  6. Exit                               ║\n";
         cout << "╚════════════════════════════════════════╝\n";
         cout << "Enter your choice: ";
         
@@ -280,11 +1585,23 @@ void userInterface() {
                 sendMessage();
                 break;
             case 2:
-                cout << "\nConnection Status: " << (isConnected ? "Connected" : "Disconnected") << "\n";
-                cout << "Campus: " << campusName << "\n";
-                cout << "Server: " << SERVER_IP << ":" << TCP_PORT << "\n";
+                publishToTopic();
                 break;
             case 3:
+                manageSubscriptions();
+                break;
+            case 4:
+                sendFile();
+                break;
+            case 5:
+                cout << "\nConnection Status: " << (!isConnected ? "Disconnected" : linkUp ? "Connected" : "Reconnecting")
+                     << "\n";
+                cout << "Campus: " << campusName << "\n";
+                cout << "Server: " << serverIp << ":" << serverPort << "\n";
+                cout << "Following: " << subscribedTopics.size() << " topics\n";
+                cout << "Compression: " << (compressionActive ? "on" : "off") << "\n";
+                break;
+            case 6:
                 cout << "Disconnecting...\n";
                 isConnected = false;
                 return;
@@ -294,48 +1611,72 @@ void userInterface() {
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (!parseArguments(argc, argv)) return 1;
+    
 #ifdef _WIN32
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
         cout << "WSAStartup failed" << endl;
         return 1;
     }
+#else
+    signal(SIGPIPE, SIG_IGN);
 #endif
     
+    if (heartbeatOnly) {
+        if (!campusName.empty()) heartbeatCampuses.push_back(campusName);
+        campusName.clear();
+        safeLog("Sending heartbeats for " + to_string(heartbeatCampuses.size()) + " campuses every " +
+                to_string(HEARTBEAT_INTERVAL) + "s");
+        isConnected = true;
+        sendHeartbeat();
+        return 0;
+    }
+    
+    if (headless.enabled) {
+        if (endpointName.empty()) endpointName = campusName;
+        if (!connectToServer()) return 1;
+        int status = runHeadless();
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return status;
+    }
+    
     cout << "======================================\n";
     cout << "  NU-Information Exchange System\n";
     cout << "  Campus Client\n";
     cout << "======================================\n\n";
     
-    // Campus selection
-    cout << "Select your campus:\n";
-    cout << "1. Lahore (Password: 23L-0999)\n";
-    cout << "2. Karachi (Password: 23K-0664)\n";
-    cout << "3. Peshawar (Password: 23P-0871)\n";
-    cout << "4. Chiniot/CFD (Password: 23F-0763)\n";
-    cout << "5. Multan (Password: 23M-0740)\n";
-    cout << "Enter campus number (1-5): ";
-    
-    int choice;
-    if (!(cin >> choice)) {
-        cout << "\nError: Please enter a NUMBER (1-5), not text!\n";
-        cout << "Example: Enter '1' for Lahore\n";
-        return 1;
-    }
-    cin.ignore();
+    // Campus selection, unless given with --campus
+    if (campusName.empty()) {
+        cout << "Select your campus:\n";
+        for (uint16_t id = 1; id < CAMPUS_COUNT; id++) {
+            cout << id << ". " << CAMPUS_NAMES[id] << "\n";
+        }
+        cout << "Enter campus number (1-" << CAMPUS_COUNT - 1 << "): ";
     
-    switch(choice) {
-        case 1: campusName = "Lahore"; campusPassword = "23L-0999"; break;
-        case 2: campusName = "Karachi"; campusPassword = "23K-0664"; break;
-        case 3: campusName = "Peshawar"; campusPassword = "23P-0871"; break;
-        case 4: campusName = "Chiniot"; campusPassword = "23F-0763"; break;
-        case 5: campusName = "Multan"; campusPassword = "23M-0740"; break;
-        default:
-            cout << "\nInvalid choice! Please enter a number between 1 and 5.\n";
+        int choice;
+        if (!(cin >> choice)) {
+            cout << "\nError: Please enter a NUMBER (1-" << CAMPUS_COUNT - 1 << "), not text!\n";
+            cout << "Example: Enter '1' for Lahore\n";
+            return 1;
+        }
+        cin.ignore();
+    
+        if (choice < 1 || choice >= CAMPUS_COUNT) {
+            cout << "\nInvalid choice! Please enter a number between 1 and " << CAMPUS_COUNT - 1 << ".\n";
             cout << "You entered: " << choice << "\n";
             cout << "Try again and enter just the number (e.g., '1' for Lahore)\n";
             return 1;
+        }
+        campusName = CAMPUS_NAMES[choice];
+    }
+    if (endpointName.empty()) endpointName = campusName;
+    if (campusPassword.empty()) {
+        cout << "Password for " << endpointName << ": ";
+        getline(cin, campusPassword);
     }
     
     cout << "\nConnecting to Central Server as " << campusName << " campus...\n";
@@ -346,6 +1687,7 @@ int main() {
     }
     
     // Start background threads
+    openHeartbeatSocket();
     thread heartbeatThread(sendHeartbeat);
     thread broadcastThread(receiveBroadcasts);
     thread receiveThread(receiveMessages);
@@ -359,6 +1701,7 @@ int main() {
     receiveThread.join();
     
     closesocket(tcpSocket);
+    closesocket(udpSocket);
     
 #ifdef _WIN32
     WSACleanup();
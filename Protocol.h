@@ -0,0 +1,491 @@
+// NU-Information Exchange wire protocol (shared by server and client)
+//
+// Every TCP message is a frame: a fixed 20-byte header followed by
+// `length` payload bytes. All integers are big-endian.
+//
+//   offset  size  field
+//   0       1     magic   (0x4E, 'N')
+//   1       1     version (PROTOCOL_VERSION)
+//   2       1     type    (FrameType)
+//   3       1     flags
+//   4       4     payload length
+//   8       4     sequence number (chosen by the sender, echoed in replies)
+//   12      2     source campus ID
+//   14      2     destination campus ID
+//   16      2     department ID
+//   18      2     reserved (zero)
+//
+// A frame with FRAME_FLAG_COMPRESSED carries a u32 original length followed
+// by an LZ4-format block; see compressPayload() below.
+
+#ifndef NU_PROTOCOL_H
+#define NU_PROTOCOL_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+const uint8_t FRAME_MAGIC = 0x4E;
+const uint8_t PROTOCOL_VERSION = 1;
+const size_t FRAME_HEADER_SIZE = 20;
+const uint32_t MAX_FRAME_PAYLOAD = 64 * 1024 * 1024;
+
+enum FrameType {
+    FRAME_AUTH = 1,         // payload: "Campus:<name>,Pass:<password>"
+                            // or "Resume:<token>,Received:<n>" (FRAME_FLAG_RESUME)
+                            // or "Node:<name>,Secret:<secret>" (FRAME_FLAG_PEER)
+    FRAME_AUTH_REPLY = 2,   // payload: "AUTH_SUCCESS" or "AUTH_FAILED"; see FRAME_FLAG_RESUME
+    FRAME_MESSAGE = 3,      // campus-to-campus message, payload: text
+    FRAME_ERROR = 4,        // payload: error description
+    FRAME_QUEUED = 5,       // target offline, message stored for later delivery
+    FRAME_DELIVERED = 6,    // message handed to the target campus (reply to FRAME_FLAG_ACK)
+    FRAME_BROADCAST = 7,    // admin broadcast over TCP, payload: text
+    FRAME_SUBSCRIBE = 8,    // follow the topic (to, dept); either may be TOPIC_ANY
+    FRAME_UNSUBSCRIBE = 9,  // stop following the topic (to, dept)
+    FRAME_PUBLISH = 10,     // text for every subscriber of topic (to, dept); the
+                            // server replies DELIVERED with the recipient count
+    // File transfers. seq is the transfer ID chosen by the sending client;
+    // frames from the receiver carry the sender's campus in `to`.
+    FRAME_FILE_OFFER = 11,  // sender -> campus: u64 size, then the file name
+    FRAME_FILE_ACCEPT = 12, // receiver -> sender: u64 offset to start (resume) from
+    FRAME_FILE_CHUNK = 13,  // sender -> receiver: u64 offset, then file bytes
+    FRAME_FILE_ACK = 14,    // receiver -> sender: u64 bytes written so far
+    FRAME_FILE_DONE = 15,   // receiver -> sender: the whole file is saved
+    FRAME_FILE_CANCEL = 16, // either way: transfer aborted, payload: reason
+    FRAME_ACK = 17,         // either way: u64 session frames received so far
+    // Between server nodes only: entries of the replicated campus-to-node
+    // map, each u16 campus, u64 epoch, u8 name length, node name
+    FRAME_PEER_MAP = 18,
+    // Flow control: server -> client, u64 number of messages and publishes
+    // the client may have sent on this connection in total (FRAME_FLAG_CREDIT)
+    FRAME_CREDIT = 19
+};
+
+// Header flags
+const uint8_t FRAME_FLAG_ACK = 0x01;    // sender wants a FRAME_DELIVERED reply on success
+// On FRAME_AUTH: the client can send and read compressed frames; on an
+// AUTH_SUCCESS reply: the server agreed. On any other frame: the payload
+// is compressed.
+const uint8_t FRAME_FLAG_COMPRESSED = 0x02;
+// On FRAME_AUTH: the client can resume sessions; a "Resume:" payload
+// resumes one instead of logging in. On an AUTH_REPLY: the status is
+// followed by ",Token:<token>,Received:<n>", where n is how many session
+// frames of the client the server has processed. A resumed session is
+// answered "AUTH_RESUMED", an unknown or expired one "RESUME_FAILED" and
+// one whose old connection is still being closed "RESUME_BUSY".
+const uint8_t FRAME_FLAG_RESUME = 0x04;
+// On FRAME_AUTH: another server node opening a peer link. Messages and
+// publishes on the link keep their `from` campus; their seq is chosen by
+// the forwarding node and echoed in the DELIVERED / QUEUED / ERROR reply.
+const uint8_t FRAME_FLAG_PEER = 0x08;
+// On FRAME_AUTH: the client waits for flow-control credit. The AUTH_SUCCESS /
+// AUTH_RESUMED reply then sets it too and carries the first grant as
+// ",Credit:<n>"; FRAME_CREDIT raises it.
+const uint8_t FRAME_FLAG_CREDIT = 0x10;
+
+// Session frames are numbered implicitly, in the order each side writes
+// them; FRAME_ACK and resumption count them. The login exchange, acks and
+// file transfer frames (which resume by offset) are not session frames,
+// nor are credit grants, which belong to one connection.
+inline bool isSessionFrame(uint8_t type) {
+    return type != FRAME_AUTH && type != FRAME_AUTH_REPLY && type != FRAME_ACK && type != FRAME_CREDIT &&
+           (type < FRAME_FILE_OFFER || type > FRAME_FILE_CANCEL);
+}
+
+// Frames that spend flow-control credit (see FRAME_CREDIT)
+inline bool usesCredit(uint8_t type) {
+    return type == FRAME_MESSAGE || type == FRAME_PUBLISH;
+}
+
+struct FrameHeader {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t length;
+    uint32_t seq;
+    uint16_t from;
+    uint16_t to;
+    uint16_t dept;
+};
+
+// A parsed frame; payload points into the receive buffer and stays valid
+// only until the next read into that buffer
+struct FrameView {
+    FrameHeader header;
+    const char* payload;
+};
+
+// Campus and department IDs (0 means "none" / the central server)
+const char* const CAMPUS_NAMES[] = {"Islamabad", "Lahore", "Karachi", "Peshawar", "Chiniot", "Multan"};
+const uint16_t CAMPUS_COUNT = 6;
+const char* const DEPARTMENT_NAMES[] = {"", "CS", "SE", "AI", "EE"};
+const uint16_t DEPARTMENT_COUNT = 5;
+
+inline uint16_t lookupId(const char* const names[], uint16_t count, const char* name, size_t len) {
+    for (uint16_t id = 1; id < count; id++) {
+        if (strlen(names[id]) == len && memcmp(names[id], name, len) == 0) return id;
+    }
+    return 0;
+}
+
+inline uint16_t campusIdOf(const std::string& name) {
+    return lookupId(CAMPUS_NAMES, CAMPUS_COUNT, name.data(), name.size());
+}
+
+inline uint16_t departmentIdOf(const std::string& name) {
+    return lookupId(DEPARTMENT_NAMES, DEPARTMENT_COUNT, name.data(), name.size());
+}
+
+inline const char* campusNameOf(uint16_t id) {
+    return id < CAMPUS_COUNT ? CAMPUS_NAMES[id] : "Unknown";
+}
+
+inline const char* departmentNameOf(uint16_t id) {
+    return id < DEPARTMENT_COUNT ? DEPARTMENT_NAMES[id] : "Unknown";
+}
+
+// Topics are (campus, department) pairs written "Karachi/CS". TOPIC_ANY in
+// either field is the wildcard "*", so "*/CS" is every CS department.
+const uint16_t TOPIC_ANY = 0xFFFF;
+
+inline uint16_t topicCampusOf(const std::string& name) {
+    return name == "*" ? TOPIC_ANY : campusIdOf(name);
+}
+
+inline uint16_t topicDepartmentOf(const std::string& name) {
+    return name == "*" ? TOPIC_ANY : departmentIdOf(name);
+}
+
+// False if the text is not "Campus/Dept" with known names or "*"
+inline bool parseTopic(const std::string& topic, uint16_t& campus, uint16_t& dept) {
+    size_t slash = topic.find('/');
+    if (slash == std::string::npos) return false;
+    campus = topicCampusOf(topic.substr(0, slash));
+    dept = topicDepartmentOf(topic.substr(slash + 1));
+    return campus != 0 && dept != 0;
+}
+
+inline std::string topicName(uint16_t campus, uint16_t dept) {
+    return std::string(campus == TOPIC_ANY ? "*" : campusNameOf(campus)) + "/" +
+           (dept == TOPIC_ANY ? "*" : departmentNameOf(dept));
+}
+
+// Big-endian integer helpers
+inline void putU16(char* p, uint16_t v) {
+    p[0] = (char)(v >> 8);
+    p[1] = (char)v;
+}
+
+inline void putU32(char* p, uint32_t v) {
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+inline void putU64(char* p, uint64_t v) {
+    putU32(p, (uint32_t)(v >> 32));
+    putU32(p + 4, (uint32_t)v);
+}
+
+inline uint16_t getU16(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return (uint16_t)((u[0] << 8) | u[1]);
+}
+
+inline uint32_t getU32(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+inline uint64_t getU64(const char* p) {
+    return ((uint64_t)getU32(p) << 32) | getU32(p + 4);
+}
+
+// File data per FRAME_FILE_CHUNK, and how much of it a sender keeps
+// unacknowledged. The server lets other frames overtake queued chunks, so
+// a transfer holds up messages by at most the chunk being written.
+const size_t FILE_CHUNK_SIZE = 64 * 1024;
+const size_t FILE_WINDOW = 8 * FILE_CHUNK_SIZE;
+
+// Write a frame header into out[0..FRAME_HEADER_SIZE)
+inline void encodeFrameHeader(char* out, const FrameHeader& h) {
+    out[0] = (char)FRAME_MAGIC;
+    out[1] = (char)PROTOCOL_VERSION;
+    out[2] = (char)h.type;
+    out[3] = (char)h.flags;
+    putU32(out + 4, h.length);
+    putU32(out + 8, h.seq);
+    putU16(out + 12, h.from);
+    putU16(out + 14, h.to);
+    putU16(out + 16, h.dept);
+    putU16(out + 18, 0);
+}
+
+// Append a complete frame to out
+inline void appendFrame(std::vector<char>& out, uint8_t type, uint32_t seq, uint16_t from,
+                        uint16_t to, uint16_t dept, const char* payload, size_t length,
+                        uint8_t flags = 0) {
+    FrameHeader h = {type, flags, (uint32_t)length, seq, from, to, dept};
+    char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header, h);
+    out.reserve(out.size() + FRAME_HEADER_SIZE + length);
+    out.insert(out.end(), header, header + FRAME_HEADER_SIZE);
+    out.insert(out.end(), payload, payload + length);
+}
+
+inline std::vector<char> makeFrame(uint8_t type, uint32_t seq, uint16_t from, uint16_t to,
+                                   uint16_t dept, const std::string& payload) {
+    std::vector<char> out;
+    appendFrame(out, type, seq, from, to, dept, payload.data(), payload.size());
+    return out;
+}
+
+// ---- Payload compression ----
+//
+// A small LZ4-compatible block codec. Neither side allocates: the
+// compressor works in a caller-owned hash table and output buffer, and the
+// decompressor writes into a buffer of the original size.
+
+const size_t COMPRESSED_PREFIX = 4;     // u32 original length
+const int LZ_HASH_BITS = 12;
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_LAST_LITERALS = 5;      // a block always ends with literals
+const size_t LZ_MATCH_LIMIT = 12;       // no match starts in the last 12 bytes
+const size_t LZ_MAX_OFFSET = 65535;
+
+struct LzTable {
+    uint32_t positions[1 << LZ_HASH_BITS];  // position + 1 of the last 4-byte run, 0 = none
+};
+
+inline uint32_t lzRead32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t lzHash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a length that did not fit in its token nibble as 255-byte steps
+inline unsigned char* lzPutLength(unsigned char* op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+// Append one sequence (literals, then an optional match); NULL if it does
+// not fit before oend
+inline unsigned char* lzPutSequence(unsigned char* op, unsigned char* oend, const unsigned char* literals,
+                                    size_t literalLength, size_t offset, size_t matchLength) {
+    size_t worst = 1 + literalLength / 255 + 1 + literalLength + (matchLength ? 2 + matchLength / 255 + 1 : 0);
+    if (worst > (size_t)(oend - op)) return NULL;
+    
+    unsigned char* token = op++;
+    *token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4);
+    if (literalLength >= 15) op = lzPutLength(op, literalLength - 15);
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+    if (matchLength == 0) return op;
+    
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    size_t extra = matchLength - LZ_MIN_MATCH;
+    *token |= (unsigned char)(extra < 15 ? extra : 15);
+    if (extra >= 15) op = lzPutLength(op, extra - 15);
+    return op;
+}
+
+// Compress src into dst; the block size, or 0 if it would not fit in
+// capacity (callers pass a capacity below the input size, so 0 also means
+// "not worth it")
+inline size_t lzCompress(const char* src, size_t length, char* dst, size_t capacity, LzTable& table) {
+    const unsigned char* base = (const unsigned char*)src;
+    const unsigned char* end = base + length;
+    const unsigned char* anchor = base;
+    unsigned char* op = (unsigned char*)dst;
+    unsigned char* oend = op + capacity;
+    
+    if (length > LZ_MATCH_LIMIT) {
+        memset(table.positions, 0, sizeof(table.positions));
+        const unsigned char* matchStartLimit = end - LZ_MATCH_LIMIT;
+        const unsigned char* matchEndLimit = end - LZ_LAST_LITERALS;
+        const unsigned char* ip = base;
+        while (ip < matchStartLimit) {
+            uint32_t sequence = lzRead32(ip);
+            uint32_t& slot = table.positions[lzHash(sequence)];
+            // Slots hold position + 1 (0 = empty); compare offsets, and only
+            // form a pointer to a position that exists
+            size_t position = (size_t)(ip - base);
+            size_t candidate = slot;
+            slot = (uint32_t)position + 1;
+            if (candidate == 0 || position - (candidate - 1) > LZ_MAX_OFFSET ||
+                lzRead32(base + (candidate - 1)) != sequence) {
+                ip++;
+                continue;
+            }
+            const unsigned char* matchEnd = ip + LZ_MIN_MATCH;
+            const unsigned char* ref = base + (candidate - 1) + LZ_MIN_MATCH;
+            while (matchEnd < matchEndLimit && *matchEnd == *ref) {
+                matchEnd++;
+                ref++;
+            }
+            op = lzPutSequence(op, oend, anchor, ip - anchor, matchEnd - ref, matchEnd - ip);
+            if (op == NULL) return 0;
+            ip = anchor = matchEnd;
+        }
+    }
+    op = lzPutSequence(op, oend, anchor, end - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - (unsigned char*)dst);
+}
+
+// Decompress a block into exactly length bytes; false if it is malformed
+inline bool lzDecompress(const char* src, size_t srcLength, char* dst, size_t length) {
+    const unsigned char* ip = (const unsigned char*)src;
+    const unsigned char* iend = ip + srcLength;
+    unsigned char* op = (unsigned char*)dst;
+    unsigned char* oend = op + length;
+    
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15) {
+            unsigned char step;
+            do {
+                if (ip == iend) return false;
+                step = *ip++;
+                literalLength += step;
+            } while (step == 255);
+        }
+        if (literalLength > (size_t)(iend - ip) || literalLength > (size_t)(oend - op)) return false;
+        memcpy(op, ip, literalLength);
+        op += literalLength;
+        ip += literalLength;
+        if (ip == iend) return op == oend;
+        
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char*)dst)) return false;
+        size_t matchLength = token & 15;
+        if (matchLength == 15) {
+            unsigned char step;
+            do {
+                if (ip == iend) return false;
+                step = *ip++;
+                matchLength += step;
+            } while (step == 255);
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (matchLength > (size_t)(oend - op)) return false;
+        // Byte by byte: the match may overlap the bytes it produces
+        const unsigned char* ref = op - offset;
+        for (size_t i = 0; i < matchLength; i++) op[i] = ref[i];
+        op += matchLength;
+    }
+    return false;
+}
+
+// Compressed payload (original length, then the block) in out, which is
+// reused between calls; false if compression would not make it smaller
+inline bool compressPayload(const char* payload, size_t length, std::vector<char>& out, LzTable& table) {
+    if (length <= COMPRESSED_PREFIX + 1) return false;
+    if (out.size() < length) out.resize(length);
+    size_t block = lzCompress(payload, length, &out[COMPRESSED_PREFIX], length - COMPRESSED_PREFIX - 1, table);
+    if (block == 0) return false;
+    putU32(&out[0], (uint32_t)length);
+    out.resize(COMPRESSED_PREFIX + block);
+    return true;
+}
+
+// Original length of a compressed payload, or 0 if it has no valid prefix
+inline uint32_t compressedOriginalLength(const char* payload, size_t length) {
+    if (length < COMPRESSED_PREFIX) return 0;
+    uint32_t original = getU32(payload);
+    return original <= MAX_FRAME_PAYLOAD ? original : 0;
+}
+
+// Decompress a payload into out, resized to the original length
+inline bool decompressPayload(const char* payload, size_t length, std::vector<char>& out) {
+    uint32_t original = compressedOriginalLength(payload, length);
+    if (original == 0) return false;
+    out.resize(original);
+    return lzDecompress(payload + COMPRESSED_PREFIX, length - COMPRESSED_PREFIX, &out[0], original);
+}
+
+enum FrameStatus { FRAME_READY, FRAME_INCOMPLETE, FRAME_INVALID };
+
+// Reusable per-connection receive buffer. Bytes are appended at the tail by
+// recv() and frames are parsed in place from the head; the buffer only grows
+// when a single frame is larger than its current capacity.
+class RecvBuffer {
+public:
+    explicit RecvBuffer(size_t capacity = 64 * 1024) : data(capacity), head(0), tail(0) {}
+
+    // Writable region of at least minSpace bytes for the next recv(). Call
+    // this before writeSpace(), which reports the size of that region.
+    char* writePtr(size_t minSpace = 4096) {
+        if (head == tail) head = tail = 0;
+        if (data.size() - tail < minSpace) {
+            if (head > 0) {
+                memmove(&data[0], &data[head], tail - head);
+                tail -= head;
+                head = 0;
+            }
+            if (data.size() - tail < minSpace) data.resize(tail + minSpace);
+        }
+        return &data[tail];
+    }
+
+    size_t writeSpace() const { return data.size() - tail; }
+    void commit(size_t n) { tail += n; }
+    size_t size() const { return tail - head; }
+    void clear() { head = tail = 0; }
+
+    // Parse the next complete frame without copying it. The view is valid
+    // until the next writePtr() call.
+    FrameStatus nextFrame(FrameView& view) {
+        size_t available = tail - head;
+        if (available < FRAME_HEADER_SIZE) return FRAME_INCOMPLETE;
+
+        const char* p = &data[head];
+        if ((uint8_t)p[0] != FRAME_MAGIC || (uint8_t)p[1] != PROTOCOL_VERSION) return FRAME_INVALID;
+
+        view.header.type = (uint8_t)p[2];
+        view.header.flags = (uint8_t)p[3];
+        view.header.length = getU32(p + 4);
+        view.header.seq = getU32(p + 8);
+        view.header.from = getU16(p + 12);
+        view.header.to = getU16(p + 14);
+        view.header.dept = getU16(p + 16);
+
+        if (view.header.length > MAX_FRAME_PAYLOAD) return FRAME_INVALID;
+
+        size_t total = FRAME_HEADER_SIZE + view.header.length;
+        if (available < total) {
+            // Make sure the whole frame will fit once it arrives
+            if (data.size() - head < total) {
+                writePtr(total - available);
+            }
+            return FRAME_INCOMPLETE;
+        }
+
+        view.payload = p + FRAME_HEADER_SIZE;
+        head += total;
+        return FRAME_READY;
+    }
+
+    // Put back the frame nextFrame() just returned, to be parsed again later
+    void unread(const FrameView& view) { head -= FRAME_HEADER_SIZE + view.header.length; }
+
+private:
+    std::vector<char> data;
+    size_t head;
+    size_t tail;
+};
+
+#endif
@@ -3,268 +3,6848 @@
 #include <mutex>
 #include <map>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <condition_variable>
 #include <cstring>
 #include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <csignal>
+#include <cstdio>
+#include <algorithm>
+#include <unordered_map>
+#include <fstream>
 #include <sstream>
+#include <random>
+
+#include "Protocol.h"
 
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
     #pragma comment(lib, "ws2_32.lib")
     typedef int socklen_t;
+    #define SHUT_RDWR SD_BOTH
 #else
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
+    #include <fcntl.h>
+    #include <dirent.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
     #define SOCKET int
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR -1
     #define closesocket close
 #endif
 
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/uio.h>
+    #include <poll.h>
+    #include <errno.h>
+    #include <sys/syscall.h>
+    // io_uring through raw system calls; needs kernel headers from Linux 6.0
+    // (multishot receive) or later
+    #if defined(__has_include)
+        #if __has_include(<linux/io_uring.h>)
+            #include <linux/io_uring.h>
+            #ifdef IORING_RECV_MULTISHOT
+                #define NU_IO_URING 1
+            #endif
+        #endif
+    #endif
+#endif
+
 using namespace std;
 
-// Port configurations
+// Default ports (--port moves both; heartbeats use the TCP port + 1)
 const int TCP_PORT = 8080;
 const int UDP_PORT = 8081;
 
-// Campus credentials (Campus:Password)
-map<string, string> campusCredentials = {
-    {"Lahore", "23L-0999"},
-    {"Karachi", "23K-0664"},
-    {"Peshawar", "23P-0871"},
-    {"Chiniot", "23F-0763"},
-    {"Multan", "23M-0740"}
-};
+// I/O model used for authenticated campus connections
+enum IoModel {
+    IO_THREAD_PER_CAMPUS,   // one blocking thread per campus (original model)
+    IO_EPOLL_REACTOR,       // fixed pool of epoll event loops (Linux only)
+    IO_URING_REACTOR        // the same shards driven by io_uring (Linux 6.0+)
+};
+
+// What happens when a destination's outbound queue is full
+enum OverflowPolicy {
+    OVERFLOW_DROP_OLDEST,   // discard the oldest unsent frames
+    OVERFLOW_REJECT,        // refuse the new frame and tell the sender
+    OVERFLOW_DISCONNECT     // drop the slow campus connection
+};
+
+// Which of a campus's sessions get a message addressed to the campus
+enum DeliveryPolicy {
+    DELIVER_ALL,            // every session (front-desk terminals)
+    DELIVER_ROUND_ROBIN,    // one session, rotating (gateway processes)
+    DELIVER_LEAST_QUEUED    // one session, the one with the fewest queued bytes
+};
+
+// Server configuration (overridable from the command line)
+struct ServerConfig {
+    IoModel ioModel;
+    int ioThreads;
+    int authThreads;            // password checks off the reactor shards
+    int listenBacklog;
+    int sendTimeoutMs;
+    size_t queueLimit;          // max frames waiting for one connection
+    size_t queueByteLimit;      // max bytes waiting for one connection
+    OverflowPolicy overflowPolicy;
+    int heartbeatIntervalSec;   // how often campuses send a UDP heartbeat
+    int suspectAfter;           // missed heartbeats before a campus is suspect
+    int offlineAfter;           // missed heartbeats before it is disconnected
+    int metricsPort;            // local plain-text metrics endpoint, 0 = off
+    DeliveryPolicy delivery;
+    int maxSessions;            // concurrent logins allowed per campus
+    int authTimeoutSec;         // time a new connection has to log in
+    bool compression;           // accept clients that ask for compressed frames
+    int resumeGraceSec;         // how long a dropped session can be resumed, 0 = off
+    int tcpPort;
+    int udpPort;                // campus heartbeats
+    uint64_t creditWindow;      // messages a client may have in flight, 0 = off
+};
+
+ServerConfig serverConfig = {
+#ifdef __linux__
+    IO_EPOLL_REACTOR,
+#else
+    IO_THREAD_PER_CAMPUS,
+#endif
+    4,
+    2,
+    SOMAXCONN,
+    5000,
+    1024,
+    16 * 1024 * 1024,
+    OVERFLOW_REJECT,
+    10,
+    2,
+    3,
+    8090,
+    DELIVER_ALL,
+    8,
+    5,
+    true,
+    60,
+    TCP_PORT,
+    UDP_PORT,
+    256
+};
+
+// Where a graceful shutdown is (see "Graceful shutdown and warm restart")
+enum ShutdownPhase {
+    SHUTDOWN_NONE,          // serving
+    SHUTDOWN_DRAINING,      // no new logins or messages; outbound queues are flushed
+    SHUTDOWN_CLOSING        // connections are being closed
+};
+
+atomic<int> shutdownPhase(SHUTDOWN_NONE);
+volatile sig_atomic_t shutdownRequested = 0;   // SIGTERM; acted on by the liveness thread
+const int DRAIN_HOLD_MS = 20;   // how long a draining server leaves a reader paused at a time
+
+void shutdownServer();
+
+// ---- Metrics ----
+
+// Counters are striped by thread across cache lines, so hot paths only do
+// an uncontended relaxed add; readers sum the stripes. Histograms use one
+// bucket per power of two. Nothing here takes a lock.
+const int METRIC_STRIPES = 16;
+
+struct alignas(64) MetricStripe {
+    atomic<uint64_t> value;
+};
+
+atomic<int> metricNextStripe(0);
+thread_local int metricStripe = metricNextStripe++ % METRIC_STRIPES;
+
+struct Counter {
+    MetricStripe stripes[METRIC_STRIPES];
+    
+    Counter() {
+        for (int i = 0; i < METRIC_STRIPES; i++) stripes[i].value.store(0);
+    }
+    
+    void add(uint64_t n = 1) {
+        stripes[metricStripe].value.fetch_add(n, memory_order_relaxed);
+    }
+    
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (int i = 0; i < METRIC_STRIPES; i++) total += stripes[i].value.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+struct Histogram {
+    static const int BUCKETS = 64;      // bucket b holds values below 2^b
+    atomic<uint64_t> buckets[BUCKETS];
+    atomic<uint64_t> count;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> maxValue;
+    
+    Histogram() : count(0), sum(0), maxValue(0) {
+        for (int i = 0; i < BUCKETS; i++) buckets[i].store(0);
+    }
+    
+    static int bucketOf(uint64_t v) {
+#ifdef __GNUC__
+        return v == 0 ? 0 : min(BUCKETS - 1, 64 - __builtin_clzll(v));
+#else
+        int b = 0;
+        while (v != 0 && b < BUCKETS - 1) { v >>= 1; b++; }
+        return b;
+#endif
+    }
+    
+    void record(uint64_t v) {
+        buckets[bucketOf(v)].fetch_add(1, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(v, memory_order_relaxed);
+        uint64_t seen = maxValue.load(memory_order_relaxed);
+        while (v > seen && !maxValue.compare_exchange_weak(seen, v, memory_order_relaxed)) {}
+    }
+    
+    // Upper bound of the bucket holding the p-th percentile
+    uint64_t percentile(double p) const {
+        uint64_t total = count.load(memory_order_relaxed);
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * total);
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += buckets[b].load(memory_order_relaxed);
+            if (seen > rank) return min(b == 0 ? 0 : (((uint64_t)1 << b) - 1), maxValue.load(memory_order_relaxed));
+        }
+        return maxValue.load(memory_order_relaxed);
+    }
+};
+
+struct ServerMetrics {
+    chrono::steady_clock::time_point started;
+    Counter accepts;
+    Counter authFailures;
+    Counter handshakeTimeouts;
+    Histogram authNs;
+    Counter routed[CAMPUS_COUNT][CAMPUS_COUNT];     // [from][to], 0 = unknown campus
+    Counter stored[CAMPUS_COUNT][CAMPUS_COUNT];
+    Counter failed[CAMPUS_COUNT][CAMPUS_COUNT];
+    Histogram routeNs;          // time to route one message
+    Histogram lockWaitNs;       // contended waits for an outbound queue lock
+    Counter bytesIn;
+    Counter bytesOut;
+    Counter ioSyscalls;         // socket, epoll, eventfd and io_uring calls serving campuses
+    Counter heartbeats;
+    Counter heartbeatBatches;
+    Histogram heartbeatGapMs;   // time between two heartbeats of one campus
+    Counter broadcasts;
+    Counter broadcastRecipients;
+    Histogram broadcastNs;
+    Counter publishes;
+    Counter publishRecipients;
+    Histogram publishNs;        // time to fan one publish out to its topic
+    Counter compressedFrames;   // compressed messages and publishes received
+    Counter compressedBytes;    // their payload bytes on the wire...
+    Counter originalBytes;      // ...and before compression
+    Counter inflatedFrames;     // decompressed for sessions without compression
+    Counter inflateFailures;
+    Histogram inflateNs;
+    Counter fileTransfers;      // offers handed to a receiver
+    Counter fileTransfersDone;
+    Counter fileChunks;
+    Counter fileBytes;
+    Counter historyRecords;     // messages written to the history and indexed
+    Counter historyDropped;     // not recorded: history thread too far behind
+    Histogram historySearchNs;
+    Counter sessionsResumed;
+    Counter resumeRefusals;     // unknown, expired or still-attached sessions
+    Counter resumeReplayed;     // frames re-sent to resumed sessions
+    Counter sessionsRestored;   // loaded from the shutdown snapshot
+    Counter peerForwarded;      // messages and publishes handed to other nodes
+    Counter peerReceived;       // ...and received from them
+    Counter peerLinkDrops;
+    Counter creditGrants;       // FRAME_CREDIT top-ups sent
+    Counter creditWaits;        // reads paused because a client sent past its window
+    Counter throttled;          // reads paused because a rate limit ran dry
+    Histogram throttleMs;       // how long each pause was set to last
+    Counter heapAllocations;    // on I/O threads, NU_COUNT_ALLOCATIONS builds only
+};
+
+ServerMetrics metrics;
+
+#ifdef NU_COUNT_ALLOCATIONS
+// Built with -DNU_COUNT_ALLOCATIONS, heap allocations made on the I/O and
+// routing threads are counted, so the benchmark can report allocations per
+// routed message. Logger, store and history threads are not counted.
+thread_local bool countAllocations = false;
+
+void* operator new(size_t size) {
+    if (countAllocations) metrics.heapAllocations.add();
+    void* pointer = malloc(size == 0 ? 1 : size);
+    if (pointer == NULL) throw bad_alloc();
+    return pointer;
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"   // malloc/free behind new/delete is the point
+#endif
+void operator delete(void* pointer) noexcept { free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { free(pointer); }
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+// Count the current thread's allocations (NU_COUNT_ALLOCATIONS builds)
+void countThreadAllocations() {
+#ifdef NU_COUNT_ALLOCATIONS
+    countAllocations = true;
+#endif
+}
+
+uint64_t metricClockNs() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Campus ID usable as a metrics index
+uint16_t metricCampus(uint16_t campusId) {
+    return campusId < CAMPUS_COUNT ? campusId : 0;
+}
+
+// ---- Buffer pools ----
+//
+// Frames, queue nodes, mailbox items and history entries on the routing
+// path come from slab pools instead of the heap. Each thread caches free
+// blocks per size class. A cache that grows to two batches hands one batch
+// to a shared depot, and an empty cache takes a batch back. Blocks built
+// by routers and released by writers therefore circulate without calling
+// the allocator once the pools are warm. Requests above the largest class
+// go to the heap. Pools keep their peak size; memory is not returned.
+const int POOL_CLASSES = 5;
+const size_t POOL_CLASS_SIZES[POOL_CLASSES] = {128, 512, 2048, 8192, 65536};
+const uint32_t POOL_HEAP = POOL_CLASSES;    // size class of blocks that bypass the pools
+const int POOL_BATCH = 32;                  // blocks moved to or from the depot at once
+
+// Header in front of every pooled block
+struct alignas(16) PoolBlock {
+    PoolBlock* next;            // free list link
+    PoolBlock* nextBatch;       // depot: the next batch
+    uint32_t sizeClass;
+    uint32_t batchSize;         // depot: blocks in this batch
+};
+
+// Plain data, so threads exiting during static teardown can still use it
+struct PoolDepot {
+    mutex lock;
+    PoolBlock* batches;
+};
+
+PoolDepot poolDepots[POOL_CLASSES];
+atomic<uint64_t> poolBlocksCreated(0);
+atomic<uint64_t> poolOversized(0);
+
+void givePoolBatch(uint32_t sizeClass, PoolBlock* batch, uint32_t size) {
+    PoolDepot& depot = poolDepots[sizeClass];
+    batch->batchSize = size;
+    lock_guard<mutex> lock(depot.lock);
+    batch->nextBatch = depot.batches;
+    depot.batches = batch;
+}
+
+PoolBlock* takePoolBatch(uint32_t sizeClass) {
+    PoolDepot& depot = poolDepots[sizeClass];
+    lock_guard<mutex> lock(depot.lock);
+    PoolBlock* batch = depot.batches;
+    if (batch != NULL) depot.batches = batch->nextBatch;
+    return batch;
+}
+
+thread_local bool poolCacheGone = false;
+
+// Free blocks of the current thread; handed to the depot when it exits
+struct PoolCache {
+    PoolBlock* free[POOL_CLASSES];
+    uint32_t count[POOL_CLASSES];
+    
+    PoolCache() {
+        for (int c = 0; c < POOL_CLASSES; c++) {
+            free[c] = NULL;
+            count[c] = 0;
+        }
+    }
+    
+    ~PoolCache() {
+        for (int c = 0; c < POOL_CLASSES; c++) {
+            if (free[c] != NULL) givePoolBatch(c, free[c], count[c]);
+        }
+        poolCacheGone = true;
+    }
+};
+
+thread_local PoolCache poolCache;
+
+void* poolAllocate(size_t bytes) {
+    uint32_t sizeClass = 0;
+    while (sizeClass < POOL_HEAP && POOL_CLASS_SIZES[sizeClass] < bytes) sizeClass++;
+    if (sizeClass == POOL_HEAP || poolCacheGone) {
+        if (sizeClass == POOL_HEAP) poolOversized++;
+        PoolBlock* block = static_cast<PoolBlock*>(::operator new(sizeof(PoolBlock) + bytes));
+        block->sizeClass = POOL_HEAP;
+        return block + 1;
+    }
+    
+    PoolCache& cache = poolCache;
+    if (cache.free[sizeClass] == NULL) {
+        PoolBlock* batch = takePoolBatch(sizeClass);
+        if (batch != NULL) {
+            cache.free[sizeClass] = batch;
+            cache.count[sizeClass] = batch->batchSize;
+        }
+    }
+    PoolBlock* block = cache.free[sizeClass];
+    if (block != NULL) {
+        cache.free[sizeClass] = block->next;
+        cache.count[sizeClass]--;
+    } else {
+        block = static_cast<PoolBlock*>(::operator new(sizeof(PoolBlock) + POOL_CLASS_SIZES[sizeClass]));
+        block->sizeClass = sizeClass;
+        poolBlocksCreated++;
+    }
+    return block + 1;
+}
+
+void poolRelease(void* pointer) {
+    if (pointer == NULL) return;
+    PoolBlock* block = static_cast<PoolBlock*>(pointer) - 1;
+    uint32_t sizeClass = block->sizeClass;
+    if (sizeClass == POOL_HEAP || poolCacheGone) {
+        ::operator delete(block);
+        return;
+    }
+    
+    PoolCache& cache = poolCache;
+    block->next = cache.free[sizeClass];
+    cache.free[sizeClass] = block;
+    if (++cache.count[sizeClass] < 2 * POOL_BATCH) return;
+    // Hand the most recently freed batch to the depot
+    PoolBlock* last = block;
+    for (int i = 1; i < POOL_BATCH; i++) last = last->next;
+    cache.free[sizeClass] = last->next;
+    last->next = NULL;
+    cache.count[sizeClass] -= POOL_BATCH;
+    givePoolBatch(sizeClass, block, POOL_BATCH);
+}
+
+// Allocator for containers on the routing path
+template <typename T>
+struct PoolAllocator {
+    typedef T value_type;
+    
+    PoolAllocator() {}
+    template <typename U> PoolAllocator(const PoolAllocator<U>&) {}
+    
+    T* allocate(size_t n) { return static_cast<T*>(poolAllocate(n * sizeof(T))); }
+    void deallocate(T* pointer, size_t) { poolRelease(pointer); }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+struct CreditAccount;
+void returnCredit(CreditAccount* account);
+
+// The bytes of one outbound frame, in a single pooled block with their
+// reference count
+class FrameBuffer {
+public:
+    size_t size() const { return length; }
+    const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+    const char& operator[](size_t i) const { return data()[i]; }
+    
+private:
+    friend class OutFrame;
+    atomic<uint32_t> refs;
+    uint32_t length;
+    atomic<CreditAccount*> credit;  // sender's flow-control account, see tagCredit
+};
+
+// Outbound frame; one buffer can sit on several queues at once. Handles
+// count references like shared_ptr, and the last one returns the buffer
+// to the pools.
+class OutFrame {
+public:
+    OutFrame() : buffer(NULL) {}
+    OutFrame(const OutFrame& other) : buffer(other.buffer) {
+        if (buffer != NULL) buffer->refs.fetch_add(1, memory_order_relaxed);
+    }
+    OutFrame(OutFrame&& other) : buffer(other.buffer) { other.buffer = NULL; }
+    ~OutFrame() { release(); }
+    
+    OutFrame& operator=(OutFrame other) {
+        swap(buffer, other.buffer);
+        return *this;
+    }
+    
+    // A new frame of length bytes; bytes is where to write them
+    static OutFrame allocate(size_t length, char*& bytes) {
+        FrameBuffer* buffer = new (poolAllocate(sizeof(FrameBuffer) + length)) FrameBuffer;
+        buffer->refs.store(1, memory_order_relaxed);
+        buffer->length = (uint32_t)length;
+        buffer->credit.store(NULL, memory_order_relaxed);
+        bytes = reinterpret_cast<char*>(buffer + 1);
+        return OutFrame(buffer);
+    }
+    
+    const FrameBuffer& operator*() const { return *buffer; }
+    const FrameBuffer* operator->() const { return buffer; }
+    explicit operator bool() const { return buffer != NULL; }
+    bool operator==(const OutFrame& other) const { return buffer == other.buffer; }
+    
+    // A frame routed under flow control carries its sender's credit until
+    // the first writer retires it, or until it is released unwritten
+    void setCredit(CreditAccount* account) const { buffer->credit.store(account, memory_order_relaxed); }
+    CreditAccount* takeCredit() const {
+        if (buffer->credit.load(memory_order_relaxed) == NULL) return NULL;
+        return buffer->credit.exchange(NULL, memory_order_acq_rel);
+    }
+    
+private:
+    explicit OutFrame(FrameBuffer* owned) : buffer(owned) {}
+    
+    void release() {
+        if (buffer != NULL && buffer->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            CreditAccount* account = buffer->credit.load(memory_order_relaxed);
+            if (account != NULL) returnCredit(account);
+            buffer->~FrameBuffer();
+            poolRelease(buffer);
+        }
+    }
+    
+    FrameBuffer* buffer;
+};
+
+typedef deque<OutFrame, PoolAllocator<OutFrame> > FrameQueue;
+
+enum EnqueueResult { ENQUEUED, QUEUE_REJECTED, QUEUE_DISCONNECTED, QUEUE_CLOSED, QUEUE_STORED, QUEUE_UNREADABLE,
+                     QUEUE_FORWARDED };     // handed to the owning node, which reports the outcome
+
+// Bounded per-connection queue of frames waiting to be written
+struct OutboundQueue {
+    mutex lock;
+    condition_variable ready;   // wakes the writer thread (thread-per-campus model)
+    FrameQueue frames;
+    // Frames and bytes in frames plus those still in a shard mailbox; read
+    // without the lock for admission checks and least-queued delivery
+    atomic<size_t> queuedCount;
+    atomic<size_t> queuedBytes;
+    size_t sentOffset;          // bytes of frames.front() already written
+    size_t sendingCount;        // front frames an io_uring send is writing
+    uint64_t dropped;
+    bool writeArmed;            // EPOLLOUT registered, or an io_uring send due (reactor models)
+    atomic<bool> closed;
+    // Session frames written but not yet acknowledged by the client
+    // (resumable sessions only); unacked.front() is frame unackedBase
+    FrameQueue unacked;
+    uint64_t unackedBase;
+    size_t unackedBytes;
+    // Credit of frames this queue refused; returned once it drains a frame
+    vector<CreditAccount*> parkedCredit;
+    
+    OutboundQueue() : queuedCount(0), queuedBytes(0), sentOffset(0), sendingCount(0), dropped(0), writeArmed(false),
+                      closed(false), unackedBase(0), unackedBytes(0) {}
+};
+
+struct IoWorker;
+struct CampusConnection;
+struct PeerNode;
+
+// A resumable session while it has no connection (see "Session
+// resumption"); while attached, its counters live on the connection
+struct SessionState {
+    string token;
+    string endpoint;
+    uint16_t campusId;
+    bool compression;
+    bool attached;              // a connection currently owns the session
+    int64_t detachedMs;         // monotonicMs() when it lost its connection
+    uint64_t received;          // session frames processed from the client
+    uint64_t sentBase;          // number of pending.front()
+    FrameQueue pending;         // unacknowledged frames, then never written ones
+    vector<pair<uint16_t, uint16_t> > topics;  // subscriptions to restore
+    weak_ptr<CampusConnection> owner;
+};
+
+// Credit a client gets back as the frames it sent leave the server: written
+// to a destination, stored, or dropped. Tagged frames hold a reference, so
+// the account outlives a connection whose frames are still queued.
+struct CreditAccount {
+    atomic<uint32_t> refs;          // the connection and each tagged frame
+    atomic<uint64_t> returned;      // admitted frames that have left
+    atomic<uint64_t> wakeAt;        // return count that makes a top-up due, 0 = none
+    weak_ptr<CampusConnection> conn;
+};
+
+void releaseCreditAccount(CreditAccount* account) {
+    if (account->refs.fetch_sub(1, memory_order_acq_rel) == 1) delete account;
+}
+
+// One authenticated campus connection, shared by its reader, its writer and
+// any router thread that is enqueueing frames for it
+struct CampusConnection : enable_shared_from_this<CampusConnection> {
+    SOCKET socket;
+    string campusName;
+    string endpoint;            // login name from the credentials file
+    uint16_t campusId;
+    RecvBuffer* buffer;
+    OutboundQueue outbound;
+    IoWorker* worker;           // owning shard (reactor models)
+    void* ioTag;                // epoll_event.data.ptr, or the io_uring connection state
+    bool authenticated;         // false while the login handshake is running
+    bool compression;           // negotiated at login: may be sent compressed frames
+    uint64_t acceptedNs;        // metricClockNs() at accept, for the auth latency
+    bool resumeOffered;         // client asked for a resumable session
+    bool resumed;               // this connection took over an existing session
+    shared_ptr<SessionState> session;
+    uint64_t received;          // session frames processed (reader only)
+    uint64_t receivedAcked;     // last count acknowledged to the client
+    PeerNode* peer;             // set on a link to another server node
+    uint64_t creditUsed;        // messages and publishes admitted (reader only)
+    atomic<uint64_t> creditGranted; // total the client may send, 0 = no credit (not asked for)
+    CreditAccount* credit;      // set while credit is in use
+    atomic<bool> creditDue;     // a top-up is due (thread-per-campus writer)
+    bool creditHeld;            // the frame being routed has credit no frame took yet (reader only)
+    int64_t throttledUntilMs;   // a rate limit paused reading until then, 0 = not
+    bool readPaused;            // EPOLLIN is off while throttled (owning shard only)
+    
+    CampusConnection() : socket(INVALID_SOCKET), campusId(0), buffer(NULL), worker(NULL), ioTag(NULL),
+                         authenticated(false), compression(false), acceptedNs(0), resumeOffered(false),
+                         resumed(false), received(0), receivedAcked(0), peer(NULL), creditUsed(0),
+                         creditGranted(0), credit(NULL), creditDue(false), creditHeld(false),
+                         throttledUntilMs(0), readPaused(false) {}
+    ~CampusConnection() {
+        delete buffer;
+        if (credit != NULL) releaseCreditAccount(credit);
+    }
+};
+
+// Minimal epoch-based RCU for the read-mostly routing table. Readers record
+// the epoch they entered in a per-thread slot; writers publish a new table,
+// bump the epoch and wait until no reader is still inside an older epoch
+// before freeing the table they replaced.
+const int RCU_MAX_READERS = 4096;
+
+struct RcuReaderSlot {
+    atomic<uint64_t> epoch;     // 0 while the thread is outside a read section
+    char padding[64 - sizeof(atomic<uint64_t>)];
+};
+
+RcuReaderSlot rcuSlots[RCU_MAX_READERS];
+atomic<uint64_t> rcuEpoch(1);
+atomic<int> rcuOverflowReaders(0);   // readers that found no free slot
+mutex rcuSlotMutex;
+int rcuFreeSlots[RCU_MAX_READERS];  // plain array: thread exits may outlive static teardown
+int rcuFreeCount = 0;
+int rcuSlotsUsed = 0;
+
+// Slot owned by the current thread, returned to the free list on exit
+struct RcuThreadSlot {
+    int index;
+    int depth;
+    
+    RcuThreadSlot() : index(-1), depth(0) {
+        lock_guard<mutex> lock(rcuSlotMutex);
+        if (rcuFreeCount > 0) {
+            index = rcuFreeSlots[--rcuFreeCount];
+        } else if (rcuSlotsUsed < RCU_MAX_READERS) {
+            index = rcuSlotsUsed++;
+        }
+    }
+    
+    ~RcuThreadSlot() {
+        if (index < 0) return;
+        lock_guard<mutex> lock(rcuSlotMutex);
+        rcuFreeSlots[rcuFreeCount++] = index;
+    }
+};
+
+thread_local RcuThreadSlot rcuThreadSlot;
+
+// Scope of an RCU read-side critical section (nestable)
+struct RcuReadGuard {
+    RcuReadGuard() {
+        if (rcuThreadSlot.depth++ > 0) return;
+        if (rcuThreadSlot.index >= 0) {
+            rcuSlots[rcuThreadSlot.index].epoch.store(rcuEpoch.load());
+        } else {
+            rcuOverflowReaders++;
+        }
+    }
+    
+    ~RcuReadGuard() {
+        if (--rcuThreadSlot.depth > 0) return;
+        if (rcuThreadSlot.index >= 0) {
+            rcuSlots[rcuThreadSlot.index].epoch.store(0);
+        } else {
+            rcuOverflowReaders--;
+        }
+    }
+};
+
+// Wait until every reader that could still see replaced data has left
+void rcuSynchronize() {
+    uint64_t target = ++rcuEpoch;
+    int used;
+    {
+        lock_guard<mutex> lock(rcuSlotMutex);
+        used = rcuSlotsUsed;
+    }
+    for (int i = 0; i < used; i++) {
+        uint64_t epoch;
+        while ((epoch = rcuSlots[i].epoch.load()) != 0 && epoch < target) {
+            this_thread::yield();
+        }
+    }
+    while (rcuOverflowReaders.load() != 0) this_thread::yield();
+}
+
+// ---- Timing wheel ----
+
+// Timer linked into one wheel slot; owned by whoever schedules it
+struct WheelTimer {
+    WheelTimer* prev;
+    WheelTimer* next;
+    uint64_t deadline;      // in ticks
+    bool scheduled;
+    void* owner;
+    
+    WheelTimer() : prev(this), next(this), deadline(0), scheduled(false), owner(NULL) {}
+};
+
+// Two-level hierarchical timing wheel. The inner level has one slot per tick,
+// the outer level one slot per inner revolution; timers beyond the outer
+// level wait in its furthest slot and are re-filed when it comes round.
+// Scheduling, cancelling and each tick are O(1) per timer. Not thread-safe.
+class TimerWheel {
+public:
+    static const int SLOT_BITS = 8;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t MASK = SLOTS - 1;
+    
+    TimerWheel() : current(0) {}
+    
+    uint64_t now() const { return current; }
+    
+    void schedule(WheelTimer* timer, uint64_t deadline) {
+        if (timer->scheduled) unlink(timer);
+        timer->deadline = deadline > current ? deadline : current + 1;
+        file(timer);
+    }
+    
+    void cancel(WheelTimer* timer) {
+        if (timer->scheduled) unlink(timer);
+    }
+    
+    // Advance one tick and move every timer that is now due into expired
+    void tick(vector<WheelTimer*>& expired) {
+        current++;
+        if ((current & MASK) == 0) {
+            // Start of an inner revolution: spread the matching outer slot
+            WheelTimer* head = &outer[(current >> SLOT_BITS) & MASK];
+            while (head->next != head) {
+                WheelTimer* timer = head->next;
+                unlink(timer);
+                file(timer);
+            }
+        }
+        WheelTimer* head = &inner[current & MASK];
+        while (head->next != head) {
+            WheelTimer* timer = head->next;
+            unlink(timer);
+            if (timer->deadline <= current) expired.push_back(timer);
+            else file(timer);
+        }
+    }
+    
+private:
+    void file(WheelTimer* timer) {
+        uint64_t deadline = timer->deadline;
+        WheelTimer* head;
+        if (deadline - current < SLOTS) {
+            head = &inner[deadline & MASK];
+        } else if ((deadline >> SLOT_BITS) - (current >> SLOT_BITS) < SLOTS) {
+            head = &outer[(deadline >> SLOT_BITS) & MASK];
+        } else {
+            head = &outer[((current >> SLOT_BITS) + MASK) & MASK];
+        }
+        timer->next = head;
+        timer->prev = head->prev;
+        head->prev->next = timer;
+        head->prev = timer;
+        timer->scheduled = true;
+    }
+    
+    void unlink(WheelTimer* timer) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = timer;
+        timer->scheduled = false;
+    }
+    
+    WheelTimer inner[SLOTS];
+    WheelTimer outer[SLOTS];
+    uint64_t current;
+};
+
+// Milliseconds on the monotonic clock; immune to wall-clock changes
+int64_t monotonicMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+enum Liveness { LIVENESS_OFFLINE, LIVENESS_ONLINE, LIVENESS_SUSPECT };
+
+// Per-campus state that outlives individual connections
+struct CampusState {
+    uint16_t campusId;
+    string campusName;
+    atomic<time_t> lastSeen;            // last login or heartbeat (wall clock, for display)
+    atomic<int64_t> lastHeartbeatMs;    // last login or heartbeat (monotonic)
+    atomic<int> liveness;
+    WheelTimer livenessTimer;           // guarded by livenessMutex
+    atomic<uint64_t> udpEndpoint;       // heartbeat source (address << 16 | port, network order), 0 = unknown
+    atomic<unsigned> nextSession;       // round-robin delivery cursor
+};
+
+// Liveness deadlines of all campuses, advanced by livenessLoop
+const int LIVENESS_TICK_MS = 100;
+TimerWheel livenessWheel;
+mutex livenessMutex;
+
+uint64_t heartbeatTicks(int intervals) {
+    return (uint64_t)intervals * serverConfig.heartbeatIntervalSec * 1000 / LIVENESS_TICK_MS;
+}
+
+// All logged-in sessions of one campus, oldest first
+typedef vector<shared_ptr<CampusConnection>> SessionList;
+
+// Immutable routing snapshot indexed by campus ID, replaced wholesale when a
+// session connects or disconnects
+struct RoutingTable {
+    vector<CampusState*> campuses;
+    vector<SessionList> sessions;   // empty = offline
+};
+
+atomic<RoutingTable*> routingTable(NULL);
+mutex routingWriteMutex;
+
+void initRoutingTable() {
+    RoutingTable* table = new RoutingTable;
+    table->campuses.resize(CAMPUS_COUNT, NULL);
+    table->sessions.resize(CAMPUS_COUNT);
+    for (uint16_t id = 1; id < CAMPUS_COUNT; id++) {
+        CampusState* state = new CampusState;
+        state->campusId = id;
+        state->campusName = campusNameOf(id);
+        state->lastSeen = 0;
+        state->lastHeartbeatMs = 0;
+        state->liveness = LIVENESS_OFFLINE;
+        state->livenessTimer.owner = state;
+        state->udpEndpoint = 0;
+        state->nextSession = 0;
+        table->campuses[id] = state;
+    }
+    routingTable.store(table);
+}
+
+// Current routing snapshot; only valid inside an RcuReadGuard
+RoutingTable* currentRoutes() {
+    return routingTable.load();
+}
+
+// Live sessions of a campus (empty if offline). Call inside an RcuReadGuard
+// and do not keep the reference past it.
+const SessionList& findSessions(uint16_t campusId) {
+    static const SessionList offline;
+    RoutingTable* table = currentRoutes();
+    return campusId < table->sessions.size() ? table->sessions[campusId] : offline;
+}
+
+size_t sessionCount(uint16_t campusId) {
+    RcuReadGuard guard;
+    return findSessions(campusId).size();
+}
+
+// Where single-session delivery starts: the next session in rotation, or
+// the one with the least queued data. Call inside an RcuReadGuard.
+size_t firstSession(uint16_t campusId, const SessionList& sessions) {
+    if (sessions.size() == 1) return 0;
+    if (serverConfig.delivery == DELIVER_LEAST_QUEUED) {
+        size_t best = 0;
+        for (size_t i = 1; i < sessions.size(); i++) {
+            if (sessions[i]->outbound.queuedBytes.load(memory_order_relaxed) <
+                sessions[best]->outbound.queuedBytes.load(memory_order_relaxed)) {
+                best = i;
+            }
+        }
+        return best;
+    }
+    return currentRoutes()->campuses[campusId]->nextSession.fetch_add(1, memory_order_relaxed) % sessions.size();
+}
+
+// The one session that gets frames meant for a single receiver, such as the
+// stored-message replay, or NULL if the campus is offline. With DELIVER_ALL
+// this is the oldest session. Call inside an RcuReadGuard.
+CampusConnection* pickSession(uint16_t campusId) {
+    const SessionList& sessions = findSessions(campusId);
+    if (sessions.empty()) return NULL;
+    if (serverConfig.delivery == DELIVER_ALL) return sessions[0].get();
+    return sessions[firstSession(campusId, sessions)].get();
+}
+
+// Publish a routing table with one campus's session list replaced and free
+// the old table once no reader can still see it. Called with
+// routingWriteMutex held; releases it before waiting.
+void replaceSessions(unique_lock<mutex>& lock, uint16_t campusId, const SessionList& sessions) {
+    RoutingTable* old = routingTable.load();
+    RoutingTable* updated = new RoutingTable(*old);
+    updated->sessions[campusId] = sessions;
+    routingTable.store(updated);
+    lock.unlock();
+    rcuSynchronize();
+    delete old;
+}
+
+// False if the campus already has --max-sessions sessions
+bool addSession(const shared_ptr<CampusConnection>& conn) {
+    unique_lock<mutex> lock(routingWriteMutex);
+    SessionList sessions = routingTable.load()->sessions[conn->campusId];
+    if (sessions.size() >= (size_t)serverConfig.maxSessions) return false;
+    sessions.push_back(conn);
+    replaceSessions(lock, conn->campusId, sessions);
+    return true;
+}
+
+// Sessions the campus has left, or -1 if conn was not one of them
+int removeSession(CampusConnection* conn) {
+    unique_lock<mutex> lock(routingWriteMutex);
+    SessionList sessions = routingTable.load()->sessions[conn->campusId];
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (sessions[i].get() == conn) {
+            sessions.erase(sessions.begin() + i);
+            int left = (int)sessions.size();
+            replaceSessions(lock, conn->campusId, sessions);
+            return left;
+        }
+    }
+    return -1;
+}
+
+// Add an authenticated connection to the campus's sessions and start
+// watching the campus's heartbeats; false if the session limit is reached
+bool publishConnection(const shared_ptr<CampusConnection>& conn) {
+    CampusState* state;
+    {
+        RcuReadGuard guard;
+        state = currentRoutes()->campuses[conn->campusId];
+    }
+    state->lastSeen.store(time(0));
+    state->lastHeartbeatMs.store(monotonicMs());
+    if (!addSession(conn)) return false;
+    
+    state->liveness.store(LIVENESS_ONLINE);
+    {
+        lock_guard<mutex> lock(livenessMutex);
+        if (!state->livenessTimer.scheduled) {
+            livenessWheel.schedule(&state->livenessTimer, livenessWheel.now() + heartbeatTicks(serverConfig.suspectAfter));
+        }
+    }
+    return true;
+}
+
+// Drop a session; the campus goes offline with its last one
+void unpublishConnection(CampusConnection* conn) {
+    if (removeSession(conn) == 0) {
+        RcuReadGuard guard;
+        currentRoutes()->campuses[conn->campusId]->liveness.store(LIVENESS_OFFLINE);
+    }
+}
+
+// ---- Department topics ----
+
+// One connection's interest in a (campus, department) topic. Inside the
+// index a wildcard field is 0, which is never a valid campus or department
+// of a topic ("all CS departments" is campus 0, department CS).
+struct Subscription {
+    shared_ptr<CampusConnection> conn;
+    uint16_t campusId;
+    uint16_t deptId;
+};
+
+const size_t TOPIC_SLOTS = CAMPUS_COUNT * DEPARTMENT_COUNT;
+
+size_t topicSlot(uint16_t campusId, uint16_t deptId) {
+    return (size_t)campusId * DEPARTMENT_COUNT + deptId;
+}
+
+// Map a wire topic (TOPIC_ANY wildcards) to index fields; false if invalid
+bool topicFields(uint16_t campus, uint16_t dept, uint16_t& campusId, uint16_t& deptId) {
+    campusId = campus == TOPIC_ANY ? 0 : campus;
+    deptId = dept == TOPIC_ANY ? 0 : dept;
+    return (campus == TOPIC_ANY || (campus > 0 && campus < CAMPUS_COUNT)) &&
+           (dept == TOPIC_ANY || (dept > 0 && dept < DEPARTMENT_COUNT));
+}
+
+bool topicFieldMatches(uint16_t subscribed, uint16_t published) {
+    return subscribed == 0 || published == 0 || subscribed == published;
+}
+
+// Immutable inverted index from topic to subscribers, replaced wholesale on
+// every change like the routing table. Wildcards are expanded when the index
+// is built, so a publish to any topic is a single lookup of a duplicate-free
+// recipient list.
+struct SubscriptionIndex {
+    vector<Subscription> subscriptions;
+    vector<vector<CampusConnection*>> recipients;   // by topicSlot
+};
+
+atomic<SubscriptionIndex*> subscriptionIndex(NULL);
+mutex subscriptionWriteMutex;
+
+SubscriptionIndex* buildSubscriptionIndex(const vector<Subscription>& subscriptions) {
+    SubscriptionIndex* index = new SubscriptionIndex;
+    index->subscriptions = subscriptions;
+    index->recipients.resize(TOPIC_SLOTS);
+    for (uint16_t campusId = 0; campusId < CAMPUS_COUNT; campusId++) {
+        for (uint16_t deptId = 0; deptId < DEPARTMENT_COUNT; deptId++) {
+            vector<CampusConnection*>& list = index->recipients[topicSlot(campusId, deptId)];
+            for (size_t i = 0; i < subscriptions.size(); i++) {
+                if (topicFieldMatches(subscriptions[i].campusId, campusId) &&
+                    topicFieldMatches(subscriptions[i].deptId, deptId)) {
+                    list.push_back(subscriptions[i].conn.get());
+                }
+            }
+            sort(list.begin(), list.end());
+            list.erase(unique(list.begin(), list.end()), list.end());
+        }
+    }
+    return index;
+}
+
+void initSubscriptions() {
+    subscriptionIndex.store(buildSubscriptionIndex(vector<Subscription>()));
+}
+
+// Subscriber list of a topic; only valid inside an RcuReadGuard
+const vector<CampusConnection*>& topicRecipients(uint16_t campusId, uint16_t deptId) {
+    return subscriptionIndex.load()->recipients[topicSlot(campusId, deptId)];
+}
+
+// Publish an edited subscription list and free the index it replaces.
+// Called with subscriptionWriteMutex held; releases it before waiting.
+void replaceSubscriptions(unique_lock<mutex>& lock, const vector<Subscription>& subscriptions) {
+    SubscriptionIndex* old = subscriptionIndex.load();
+    subscriptionIndex.store(buildSubscriptionIndex(subscriptions));
+    lock.unlock();
+    rcuSynchronize();
+    delete old;
+}
+
+// False if the connection already follows the topic
+bool addSubscription(const shared_ptr<CampusConnection>& conn, uint16_t campusId, uint16_t deptId) {
+    unique_lock<mutex> lock(subscriptionWriteMutex);
+    const vector<Subscription>& current = subscriptionIndex.load()->subscriptions;
+    for (size_t i = 0; i < current.size(); i++) {
+        if (current[i].conn == conn && current[i].campusId == campusId && current[i].deptId == deptId) return false;
+    }
+    vector<Subscription> updated = current;
+    Subscription subscription = {conn, campusId, deptId};
+    updated.push_back(subscription);
+    replaceSubscriptions(lock, updated);
+    return true;
+}
+
+// Drop one topic of a connection, or all of them when all is set; false if
+// there was nothing to drop
+bool removeSubscriptions(CampusConnection* conn, uint16_t campusId, uint16_t deptId, bool all) {
+    unique_lock<mutex> lock(subscriptionWriteMutex);
+    const vector<Subscription>& current = subscriptionIndex.load()->subscriptions;
+    vector<Subscription> updated;
+    updated.reserve(current.size());
+    for (size_t i = 0; i < current.size(); i++) {
+        if (current[i].conn.get() == conn &&
+            (all || (current[i].campusId == campusId && current[i].deptId == deptId))) continue;
+        updated.push_back(current[i]);
+    }
+    if (updated.size() == current.size()) return false;
+    replaceSubscriptions(lock, updated);
+    return true;
+}
+
+// Format a wall-clock time for display
+string formatTime(time_t when) {
+    char buf[80];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    return string(buf);
+}
+
+// Function to get current timestamp
+string getCurrentTime() {
+    return formatTime(time(0));
+}
+
+// ---- Asynchronous logging ----
+//
+// Logging threads copy each record into their own lock-free single-producer
+// ring; a background thread drains all rings, formats the batch with a
+// cached timestamp and writes it to the console and/or a rotating file.
+// A full ring drops records instead of blocking the caller.
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+const size_t LOG_TEXT_SIZE = 232;
+const size_t LOG_RING_SIZE = 256;     // records per thread, power of two
+
+struct LogRecord {
+    int64_t timeUs;
+    uint8_t level;
+    uint16_t length;
+    char text[LOG_TEXT_SIZE];
+};
+
+struct LogRing {
+    atomic<size_t> head;        // next record to consume (logger thread)
+    atomic<size_t> tail;        // next free record (owning thread)
+    atomic<bool> abandoned;     // owning thread has exited
+    LogRecord records[LOG_RING_SIZE];
+    
+    LogRing() : head(0), tail(0), abandoned(false) {}
+};
+
+struct LoggerConfig {
+    atomic<int> level;
+    bool console;
+    string filePath;
+    size_t maxFileBytes;
+    int keepFiles;
+};
+
+LoggerConfig loggerConfig = {{LOG_DEBUG}, true, "", 10 * 1024 * 1024, 5};
+
+mutex logRingsMutex;
+vector<LogRing*> logRings;
+atomic<uint64_t> logDropped(0);
+atomic<bool> loggerRunning(false);
+thread loggerThread;
+
+// Hands the calling thread's ring to the logger for cleanup when it exits
+struct LogRingOwner {
+    LogRing* ring;
+    LogRingOwner() : ring(NULL) {}
+    ~LogRingOwner() {
+        if (ring != NULL) ring->abandoned.store(true);
+    }
+};
+
+thread_local LogRingOwner logRingOwner;
+
+LogRing* threadLogRing() {
+    if (logRingOwner.ring == NULL) {
+        LogRing* ring = new LogRing;
+        lock_guard<mutex> lock(logRingsMutex);
+        logRings.push_back(ring);
+        logRingOwner.ring = ring;
+    }
+    return logRingOwner.ring;
+}
+
+// Hot path: copy one record into this thread's ring
+void writeLog(LogLevel level, const char* text, size_t length) {
+    LogRing* ring = threadLogRing();
+    size_t tail = ring->tail.load(memory_order_relaxed);
+    if (tail - ring->head.load(memory_order_acquire) >= LOG_RING_SIZE) {
+        logDropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    
+    LogRecord& record = ring->records[tail & (LOG_RING_SIZE - 1)];
+    record.timeUs = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    record.level = (uint8_t)level;
+    record.length = (uint16_t)min(length, LOG_TEXT_SIZE);
+    memcpy(record.text, text, record.length);
+    ring->tail.store(tail + 1, memory_order_release);
+}
+
+void writeLog(LogLevel level, const string& text) {
+    writeLog(level, text.data(), text.length());
+}
+
+// Build the message only when its level is enabled
+#define LOG(severity, message) \
+    do { \
+        if ((severity) >= loggerConfig.level.load(memory_order_relaxed)) writeLog((severity), (message)); \
+    } while (0)
+
+// Log output: console and an optional size-rotated file
+struct LogSink {
+    FILE* file;
+    size_t fileBytes;
+    
+    LogSink() : file(NULL), fileBytes(0) {}
+    
+    void open() {
+        if (loggerConfig.filePath.empty()) return;
+        file = fopen(loggerConfig.filePath.c_str(), "a");
+        if (file == NULL) {
+            cerr << "Cannot open log file " << loggerConfig.filePath << "\n";
+            return;
+        }
+        fseek(file, 0, SEEK_END);
+        fileBytes = ftell(file);
+    }
+    
+    // log -> log.1 -> ... -> log.N, dropping the oldest
+    void rotate() {
+        fclose(file);
+        const string& path = loggerConfig.filePath;
+        remove((path + "." + to_string(loggerConfig.keepFiles)).c_str());
+        for (int i = loggerConfig.keepFiles - 1; i >= 1; i--) {
+            rename((path + "." + to_string(i)).c_str(), (path + "." + to_string(i + 1)).c_str());
+        }
+        rename(path.c_str(), (path + ".1").c_str());
+        file = NULL;
+        fileBytes = 0;
+        open();
+    }
+    
+    void write(const string& batch) {
+        if (loggerConfig.console) {
+            fwrite(batch.data(), 1, batch.size(), stdout);
+            fflush(stdout);
+        }
+        if (file != NULL) {
+            fwrite(batch.data(), 1, batch.size(), file);
+            fflush(file);
+            fileBytes += batch.size();
+            if (fileBytes >= loggerConfig.maxFileBytes) rotate();
+        }
+    }
+};
+
+// Drain every ring into batch; frees rings whose threads have exited
+void collectLogRecords(vector<LogRecord>& batch) {
+    lock_guard<mutex> lock(logRingsMutex);
+    for (size_t i = 0; i < logRings.size();) {
+        LogRing* ring = logRings[i];
+        bool abandoned = ring->abandoned.load();
+        size_t head = ring->head.load(memory_order_relaxed);
+        size_t tail = ring->tail.load(memory_order_acquire);
+        for (; head != tail; head++) {
+            batch.push_back(ring->records[head & (LOG_RING_SIZE - 1)]);
+        }
+        ring->head.store(head, memory_order_release);
+        
+        if (abandoned) {
+            delete ring;
+            logRings[i] = logRings.back();
+            logRings.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+// Background thread: batch, order, format and write records
+void loggerLoop() {
+    static const char* const LEVEL_TAGS[] = {"", "", "WARN: ", "ERROR: "};
+    LogSink sink;
+    sink.open();
+    
+    vector<LogRecord> batch;
+    string out;
+    time_t cachedSecond = 0;
+    char cachedStamp[32] = {0};
+    
+    while (true) {
+        bool running = loggerRunning.load();
+        batch.clear();
+        collectLogRecords(batch);
+        
+        if (batch.empty()) {
+            if (!running) break;
+            this_thread::sleep_for(chrono::milliseconds(10));
+            continue;
+        }
+        
+        // Records from different threads interleave by time
+        stable_sort(batch.begin(), batch.end(), [](const LogRecord& a, const LogRecord& b) {
+            return a.timeUs < b.timeUs;
+        });
+        
+        out.clear();
+        for (size_t i = 0; i < batch.size(); i++) {
+            time_t second = (time_t)(batch[i].timeUs / 1000000);
+            if (second != cachedSecond) {
+                tm local;
+#ifdef _WIN32
+                localtime_s(&local, &second);
+#else
+                localtime_r(&second, &local);
+#endif
+                strftime(cachedStamp, sizeof(cachedStamp), "%Y-%m-%d %H:%M:%S", &local);
+                cachedSecond = second;
+            }
+            out += '[';
+            out += cachedStamp;
+            out += "] ";
+            out += LEVEL_TAGS[batch[i].level];
+            out.append(batch[i].text, batch[i].length);
+            out += '\n';
+        }
+        
+        uint64_t dropped = logDropped.exchange(0);
+        if (dropped > 0) {
+            out += "[" + string(cachedStamp) + "] WARN: " + to_string(dropped) + " log records dropped\n";
+        }
+        sink.write(out);
+    }
+    
+    if (sink.file != NULL) fclose(sink.file);
+}
+
+void startLogger() {
+    loggerRunning.store(true);
+    loggerThread = thread(loggerLoop);
+}
+
+// Flush everything logged so far and stop the background thread
+void stopLogger() {
+    if (!loggerRunning.exchange(false)) return;
+    loggerThread.join();
+}
+
+// Send a whole buffer, waiting for socket space if the socket is non-blocking
+bool sendAll(SOCKET socket, const char* data, size_t length) {
+    while (length > 0) {
+        int sent = send(socket, data, length, 0);
+        if (sent == SOCKET_ERROR) {
+#ifndef _WIN32
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pollfd pfd = {socket, POLLOUT, 0};
+                if (poll(&pfd, 1, serverConfig.sendTimeoutMs) > 0) continue;
+            }
+#endif
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Build an outbound frame (header followed by payload)
+OutFrame makeOutFrame(const FrameHeader& header, const char* payload) {
+    char* bytes;
+    OutFrame frame = OutFrame::allocate(FRAME_HEADER_SIZE + header.length, bytes);
+    encodeFrameHeader(bytes, header);
+    if (header.length > 0) memcpy(bytes + FRAME_HEADER_SIZE, payload, header.length);
+    return frame;
+}
+
+// Outbound copy of a whole encoded frame
+OutFrame copyOutFrame(const char* data, size_t length) {
+    char* bytes;
+    OutFrame frame = OutFrame::allocate(length, bytes);
+    memcpy(bytes, data, length);
+    return frame;
+}
+
+OutFrame makeTextFrame(uint8_t type, uint32_t seq, const string& text) {
+    FrameHeader header = {type, 0, (uint32_t)text.length(), seq, 0, 0, 0};
+    return makeOutFrame(header, text.data());
+}
+
+// Blocking send of a text frame, used before a connection has a writer
+bool sendTextFrame(SOCKET socket, uint8_t type, uint32_t seq, const string& text) {
+    OutFrame frame = makeTextFrame(type, seq, text);
+    return sendAll(socket, &(*frame)[0], frame->size());
+}
+
+// Login reply; its compression flag tells the client it may use
+// compression, and a resumable session adds its token
+OutFrame makeAuthReply(const CampusConnection* conn, uint32_t seq) {
+    uint8_t flags = conn->compression ? FRAME_FLAG_COMPRESSED : 0;
+    string text = conn->resumed ? "AUTH_RESUMED" : "AUTH_SUCCESS";
+    if (conn->session) {
+        flags |= FRAME_FLAG_RESUME;
+        text += ",Token:" + conn->session->token + ",Received:" + to_string(conn->received);
+    }
+    if (conn->creditGranted > 0) {
+        flags |= FRAME_FLAG_CREDIT;
+        text += ",Credit:" + to_string(conn->creditGranted.load());
+    }
+    FrameHeader header = {FRAME_AUTH_REPLY, flags, (uint32_t)text.size(), seq, 0, 0, 0};
+    return makeOutFrame(header, text.data());
+}
+
+OutFrame makeAckFrame(uint64_t received) {
+    char payload[8];
+    putU64(payload, received);
+    FrameHeader header = {FRAME_ACK, 0, sizeof(payload), 0, 0, 0, 0};
+    return makeOutFrame(header, payload);
+}
+
+// Plain copy of a compressed frame; empty if the payload is corrupt
+OutFrame inflateFrame(const FrameBuffer& frame) {
+    uint64_t inflateStart = metricClockNs();
+    const char* payload = frame.data() + FRAME_HEADER_SIZE;
+    size_t length = frame.size() - FRAME_HEADER_SIZE;
+    uint32_t original = compressedOriginalLength(payload, length);
+    char* bytes;
+    OutFrame plain = OutFrame::allocate(FRAME_HEADER_SIZE + original, bytes);
+    // Same header with the flags byte and length rewritten
+    memcpy(bytes, frame.data(), FRAME_HEADER_SIZE);
+    bytes[3] = (char)((uint8_t)frame[3] & ~FRAME_FLAG_COMPRESSED);
+    putU32(bytes + 4, original);
+    if (original == 0 || !lzDecompress(payload + COMPRESSED_PREFIX, length - COMPRESSED_PREFIX,
+                                       bytes + FRAME_HEADER_SIZE, original)) {
+        metrics.inflateFailures.add();
+        return OutFrame();
+    }
+    metrics.inflatedFrames.add();
+    metrics.inflateNs.record(metricClockNs() - inflateStart);
+    return plain;
+}
+
+// A frame on its way to one or more sessions. A compressed frame is queued
+// as received for sessions that negotiated compression; sessions without
+// it get a plain copy, decompressed once on first use.
+struct ForwardFrame {
+    OutFrame wire;
+    OutFrame plain;
+    bool inflateFailed;
+    
+    explicit ForwardFrame(const OutFrame& frame) : wire(frame), inflateFailed(false) {}
+    
+    // The frame to queue for conn; empty if it cannot be decompressed
+    OutFrame forSession(const CampusConnection* conn) {
+        if (conn->compression || !((uint8_t)(*wire)[3] & FRAME_FLAG_COMPRESSED)) return wire;
+        if (!plain && !inflateFailed) {
+            plain = inflateFrame(*wire);
+            inflateFailed = !plain;
+        }
+        return plain;
+    }
+};
+
+#ifdef __linux__
+// Change what a reactor connection waits for: readable unless its reading
+// is paused, writable if wantWrite (owning shard only)
+void updateInterest(CampusConnection* conn, bool wantWrite);
+#endif
+
+// Bulk file data, which other frames may overtake in an outbound queue
+bool isFileChunk(const FrameBuffer& frame) {
+    return (uint8_t)frame[2] == FRAME_FILE_CHUNK;
+}
+
+// Put a frame on a connection's queue under its lock. A reserved frame was
+// already counted in queuedCount/queuedBytes when it was posted to the
+// owning shard's mailbox, and gives the reservation back if it is refused.
+EnqueueResult queueFrame(CampusConnection* conn, const OutFrame& frame, bool reserved) {
+    OutboundQueue& q = conn->outbound;
+    size_t addCount = reserved ? 0 : 1;
+    size_t addBytes = reserved ? 0 : frame->size();
+    bool disconnect = false;
+    {
+        // Only a contended lock pays for the clock reads
+        unique_lock<mutex> lock(q.lock, try_to_lock);
+        if (!lock.owns_lock()) {
+            uint64_t waitStart = metricClockNs();
+            lock.lock();
+            metrics.lockWaitNs.record(metricClockNs() - waitStart);
+        }
+        
+        EnqueueResult refused = ENQUEUED;
+        if (q.closed) {
+            refused = QUEUE_CLOSED;
+        } else if (q.queuedCount + addCount > serverConfig.queueLimit ||
+                   q.queuedBytes + addBytes > serverConfig.queueByteLimit) {
+            if (serverConfig.overflowPolicy == OVERFLOW_REJECT) {
+                refused = QUEUE_REJECTED;
+            } else if (serverConfig.overflowPolicy == OVERFLOW_DISCONNECT) {
+                disconnect = true;
+            } else {
+                // Keep frames being written so the stream stays intact
+                size_t keep = max(q.sendingCount, (size_t)(q.sentOffset > 0 ? 1 : 0));
+                while (q.frames.size() > keep &&
+                       (q.queuedCount + addCount > serverConfig.queueLimit ||
+                        q.queuedBytes + addBytes > serverConfig.queueByteLimit)) {
+                    q.queuedCount--;
+                    q.queuedBytes -= q.frames[keep]->size();
+                    q.frames.erase(q.frames.begin() + keep);
+                    q.dropped++;
+                }
+            }
+        }
+        if (refused != ENQUEUED || disconnect) {
+            if (reserved) {
+                q.queuedCount--;
+                q.queuedBytes -= frame->size();
+            }
+            if (refused != ENQUEUED) return refused;
+        }
+        
+        if (disconnect) {
+            // Shut down under the lock so the socket cannot have been closed
+            // and reused; the reader then sees EOF and cleans up
+            shutdown(conn->socket, SHUT_RDWR);
+        } else {
+            // Other frames overtake queued file chunks, except the front
+            // one, which a writer may be in the middle of sending, and
+            // those an io_uring send has taken
+            size_t position = q.frames.size();
+            if (!isFileChunk(*frame)) {
+                size_t first = max((size_t)1, q.sendingCount);
+                while (position > first && isFileChunk(*q.frames[position - 1])) position--;
+            }
+            q.frames.insert(q.frames.begin() + position, frame);
+            q.queuedCount += addCount;
+            q.queuedBytes += addBytes;
+#ifdef __linux__
+            if (conn->worker != NULL) {
+                // Arm EPOLLOUT under the queue lock so it cannot race the
+                // writer disarming it or the connection closing
+                if (!q.writeArmed) {
+                    q.writeArmed = true;
+                    updateInterest(conn, true);
+                }
+                return ENQUEUED;
+            }
+#endif
+        }
+    }
+    
+    if (disconnect) return QUEUE_DISCONNECTED;
+    q.ready.notify_one();
+    return ENQUEUED;
+}
+
+#ifdef __linux__
+EnqueueResult postFrame(CampusConnection* conn, const OutFrame& frame);
+void drainMailbox(IoWorker* worker);
+extern thread_local IoWorker* currentWorker;
+#endif
+
+// Queue a frame for a connection's writer; never blocks on the network.
+// A connection owned by another reactor shard gets it through that shard's
+// mailbox, so routers never contend with the owner for the queue lock.
+EnqueueResult enqueueFrame(CampusConnection* conn, const OutFrame& frame) {
+#ifdef __linux__
+    if (conn->worker != NULL) {
+        if (conn->worker != currentWorker) return postFrame(conn, frame);
+        // Frames other threads already posted for this shard go first
+        drainMailbox(currentWorker);
+    }
+#endif
+    return queueFrame(conn, frame, false);
+}
+
+void retireStoredFrame(const OutFrame& frame);
+void settleStoreDelivery(const CampusConnection* conn, bool keptBySession);
+
+// Credit parked on a queue that refused frames goes back once it drains.
+// Call with the queue lock held.
+void returnParkedCredit(OutboundQueue& q) {
+    for (size_t i = 0; i < q.parkedCredit.size(); i++) returnCredit(q.parkedCredit[i]);
+    q.parkedCredit.clear();
+}
+
+// A frame was written in full, so its sender gets the credit back. Session
+// frames are kept until the client acknowledges them; past the queue byte
+// limit the oldest are let go, and only a client that already has them can
+// then resume. Call with the queue lock held.
+void retireFrame(CampusConnection* conn, const OutFrame& frame) {
+    CreditAccount* account = frame.takeCredit();
+    if (account != NULL) returnCredit(account);
+    if (!conn->outbound.parkedCredit.empty()) returnParkedCredit(conn->outbound);
+    retireStoredFrame(frame);
+    if (!conn->session || !isSessionFrame((uint8_t)(*frame)[2])) return;
+    OutboundQueue& q = conn->outbound;
+    q.unacked.push_back(frame);
+    q.unackedBytes += frame->size();
+    while (q.unackedBytes > serverConfig.queueByteLimit && q.unacked.size() > 1) {
+        q.unackedBytes -= q.unacked.front()->size();
+        q.unacked.pop_front();
+        q.unackedBase++;
+    }
+}
+
+void detachSession(CampusConnection* conn);
+
+// Stop accepting frames for a connection and discard what is queued; a
+// resumable session keeps them for the client's return, anything else
+// replayed from the store is replayed again
+void closeOutboundQueue(CampusConnection* conn) {
+    OutboundQueue& q = conn->outbound;
+    bool keptBySession;
+    {
+        lock_guard<mutex> lock(q.lock);
+        keptBySession = conn->session != NULL;
+        if (!q.closed && conn->session) detachSession(conn);
+        q.closed = true;
+        returnParkedCredit(q);
+        // Mailbox reservations are given back as their frames are drained
+        for (size_t i = 0; i < q.frames.size(); i++) {
+            q.queuedCount--;
+            q.queuedBytes -= q.frames[i]->size();
+        }
+        q.frames.clear();
+    }
+    q.ready.notify_all();
+    settleStoreDelivery(conn, keptBySession);
+}
+
+// ---- Store-and-forward queue for offline campuses ----
+//
+// Frames for a campus that is offline (or still has older stored frames
+// waiting) are appended to a per-destination log of memory-mapped segment
+// files. One store thread group-commits every dirty log per tick, confirms
+// stored frames to their senders once durable, replays committed frames
+// into the outbound queue of campuses that are back online and deletes
+// segments once everything in them has been delivered.
+//
+// Record layout inside a segment: u32 length, u32 FNV-1a checksum, frame.
+// A zero length marks the end of the records in a segment.
+
+const size_t STORE_RECORD_HEADER = 8;
+
+struct StoreConfig {
+    bool enabled;
+    string dir;
+    size_t segmentBytes;
+    size_t maxBytesPerCampus;
+    int commitIntervalMs;
+    int compactIntervalSec;
+};
+
+StoreConfig storeConfig = {
+#ifdef _WIN32
+    false,
+#else
+    true,
+#endif
+    "nu_store",
+    8 * 1024 * 1024,
+    1024ULL * 1024 * 1024,
+    2,
+    30
+};
+
+enum StoreResult { STORE_APPENDED, STORE_NOT_NEEDED, STORE_FAILED };
+
+#ifndef _WIN32
+struct StoreSegment {
+    uint64_t number;
+    int fd;
+    char* map;
+    size_t size;
+    bool synced;                // file size made durable
+};
+
+// Sender waiting for confirmation that its frame is on disk
+struct StoreNotice {
+    shared_ptr<CampusConnection> sender;
+    uint32_t seq;
+};
+
+// Replayed frame queued for a session but not yet written to it
+struct StoreDelivery {
+    OutFrame frame;
+    size_t offset;                      // its record inside segments.front()
+    const CampusConnection* target;
+};
+
+struct CampusStore {
+    mutex lock;
+    mutex commitLock;               // one commit or compaction at a time (store thread, shutdown)
+    uint16_t campusId;
+    string dir;
+    deque<StoreSegment> segments;   // oldest first; back() is appended to
+    size_t readOffset;              // replay cursor inside segments.front()
+    size_t writeOffset;             // append position inside segments.back()
+    uint64_t committedSegment;      // durable prefix ends at this segment...
+    size_t committedOffset;         // ...and offset
+    size_t syncedOffset;            // start of the unsynced range of back()
+    vector<StoreSegment> rolled;    // sealed segments not yet synced
+    atomic<uint64_t> backlog;       // records not yet delivered
+    size_t storedBytes;
+    bool dirty;
+    bool cursorDirty;
+    int cursorFd;
+    vector<StoreNotice> notices;
+    deque<StoreDelivery> inFlight;  // replayed, not yet written; oldest first
+    atomic<size_t> inFlightCount;
+};
+
+vector<CampusStore*> campusStores;     // indexed by campus ID
+mutex storeWakeMutex;
+condition_variable storeWake;
+atomic<bool> storeWakePending(false);
+
+uint32_t storeChecksum(const char* data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+string segmentPath(const CampusStore* store, uint64_t number) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.seg", (unsigned long long)number);
+    return store->dir + "/" + name;
+}
+
+bool mapSegment(StoreSegment& segment, const string& path, size_t size, bool create) {
+    segment.fd = open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (segment.fd < 0) return false;
+    if (create && ftruncate(segment.fd, size) != 0) {
+        close(segment.fd);
+        return false;
+    }
+    segment.size = size;
+    segment.synced = !create;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+    if (map == MAP_FAILED) {
+        close(segment.fd);
+        return false;
+    }
+    segment.map = (char*)map;
+    return true;
+}
+
+void unmapSegment(StoreSegment& segment) {
+    munmap(segment.map, segment.size);
+    close(segment.fd);
+}
+
+// Length of the valid record at offset, or 0 at the end of the segment
+size_t storeRecordAt(const StoreSegment& segment, size_t offset) {
+    if (offset + STORE_RECORD_HEADER > segment.size) return 0;
+    uint32_t length = getU32(segment.map + offset);
+    if (length == 0 || offset + STORE_RECORD_HEADER + length > segment.size) return 0;
+    if (getU32(segment.map + offset + 4) != storeChecksum(segment.map + offset + STORE_RECORD_HEADER, length)) {
+        return 0;
+    }
+    return length;
+}
+
+// Persist the delivery cursor (first undelivered segment and offset)
+void writeStoreCursor(int cursorFd, uint64_t segment, size_t offset) {
+    char cursor[16];
+    putU32(cursor, (uint32_t)(segment >> 32));
+    putU32(cursor + 4, (uint32_t)segment);
+    putU32(cursor + 8, 0);
+    putU32(cursor + 12, (uint32_t)offset);
+    if (pwrite(cursorFd, cursor, sizeof(cursor), 0) == (ssize_t)sizeof(cursor)) {
+        fdatasync(cursorFd);
+    }
+}
+
+bool addStoreSegment(CampusStore* store, uint64_t number, size_t size) {
+    StoreSegment segment;
+    segment.number = number;
+    if (!mapSegment(segment, segmentPath(store, number), size, true)) {
+        LOG(LOG_ERROR, "Cannot create store segment in " + store->dir);
+        return false;
+    }
+    store->segments.push_back(segment);
+    store->storedBytes += size;
+    store->writeOffset = 0;
+    store->syncedOffset = 0;
+    return true;
+}
+
+// Open (or create) the log of one destination and recover its state
+CampusStore* openCampusStore(uint16_t campusId) {
+    CampusStore* store = new CampusStore;
+    store->campusId = campusId;
+    store->dir = storeConfig.dir + "/" + campusNameOf(campusId);
+    store->readOffset = store->writeOffset = store->committedOffset = store->syncedOffset = 0;
+    store->committedSegment = 0;
+    store->backlog = 0;
+    store->storedBytes = 0;
+    store->dirty = store->cursorDirty = false;
+    store->inFlightCount = 0;
+    mkdir(store->dir.c_str(), 0755);
+    
+    store->cursorFd = open((store->dir + "/cursor").c_str(), O_RDWR | O_CREAT, 0644);
+    if (store->cursorFd < 0) {
+        delete store;
+        return NULL;
+    }
+    char cursor[16];
+    uint64_t cursorSegment = 0;
+    size_t cursorOffset = 0;
+    if (pread(store->cursorFd, cursor, sizeof(cursor), 0) == (ssize_t)sizeof(cursor)) {
+        cursorSegment = ((uint64_t)getU32(cursor) << 32) | getU32(cursor + 4);
+        cursorOffset = getU32(cursor + 12);
+    }
+    
+    // Existing segments, oldest first; anything before the cursor is delivered
+    vector<uint64_t> numbers;
+    DIR* dir = opendir(store->dir.c_str());
+    if (dir != NULL) {
+        dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            string name = entry->d_name;
+            if (name.size() == 24 && name.compare(20, 4, ".seg") == 0) {
+                numbers.push_back(strtoull(name.c_str(), NULL, 10));
+            }
+        }
+        closedir(dir);
+    }
+    sort(numbers.begin(), numbers.end());
+    
+    for (size_t i = 0; i < numbers.size(); i++) {
+        string path = segmentPath(store, numbers[i]);
+        if (numbers[i] < cursorSegment) {
+            unlink(path.c_str());
+            continue;
+        }
+        struct stat info;
+        StoreSegment segment;
+        segment.number = numbers[i];
+        if (stat(path.c_str(), &info) != 0 || info.st_size < (off_t)STORE_RECORD_HEADER ||
+            !mapSegment(segment, path, info.st_size, false)) {
+            LOG(LOG_WARN, "Skipping unreadable store segment " + path);
+            continue;
+        }
+        store->segments.push_back(segment);
+        store->storedBytes += segment.size;
+    }
+    
+    if (store->segments.empty()) {
+        if (!addStoreSegment(store, cursorSegment, storeConfig.segmentBytes)) {
+            delete store;
+            return NULL;
+        }
+        store->segments.back().synced = false;
+    } else {
+        if (store->segments.front().number == cursorSegment) store->readOffset = cursorOffset;
+        
+        // Count undelivered records; a torn tail ends the last segment
+        for (size_t i = 0; i < store->segments.size(); i++) {
+            size_t offset = (i == 0) ? store->readOffset : 0;
+            size_t length;
+            while ((length = storeRecordAt(store->segments[i], offset)) > 0) {
+                offset += STORE_RECORD_HEADER + length;
+                store->backlog++;
+            }
+            if (i + 1 == store->segments.size()) store->writeOffset = offset;
+        }
+        store->syncedOffset = store->writeOffset;
+    }
+    store->committedSegment = store->segments.back().number;
+    store->committedOffset = store->writeOffset;
+    
+    if (store->backlog > 0) {
+        LOG(LOG_INFO, "Recovered " + to_string(store->backlog.load()) + " stored messages for " +
+                      campusNameOf(campusId));
+    }
+    return store;
+}
+
+// Append a frame to a campus's log. With onlyIfBacklogged the frame is
+// stored only when older frames are still waiting, which keeps delivery
+// in order while a reconnected campus drains its backlog.
+StoreResult storeFrame(uint16_t campusId, const FrameHeader& header, const char* payload,
+                       const shared_ptr<CampusConnection>& sender, bool onlyIfBacklogged) {
+    if (!storeConfig.enabled || campusId == 0 || campusId >= campusStores.size() ||
+        campusStores[campusId] == NULL) {
+        return onlyIfBacklogged ? STORE_NOT_NEEDED : STORE_FAILED;
+    }
+    CampusStore* store = campusStores[campusId];
+    if (onlyIfBacklogged && store->backlog.load() == 0) return STORE_NOT_NEEDED;
+    
+    size_t frameSize = FRAME_HEADER_SIZE + header.length;
+    size_t recordSize = STORE_RECORD_HEADER + frameSize;
+    bool wake;
+    {
+        lock_guard<mutex> lock(store->lock);
+        if (onlyIfBacklogged && store->backlog.load() == 0) return STORE_NOT_NEEDED;
+        
+        if (store->writeOffset + recordSize > store->segments.back().size) {
+            if (store->storedBytes + max(recordSize, storeConfig.segmentBytes) > storeConfig.maxBytesPerCampus) {
+                return STORE_FAILED;
+            }
+            // Seal the current segment; the store thread syncs it
+            store->rolled.push_back(store->segments.back());
+            if (!addStoreSegment(store, store->segments.back().number + 1,
+                                 max(recordSize, storeConfig.segmentBytes))) {
+                store->rolled.pop_back();
+                return STORE_FAILED;
+            }
+        }
+        
+        char* record = store->segments.back().map + store->writeOffset;
+        encodeFrameHeader(record + STORE_RECORD_HEADER, header);
+        if (header.length > 0) memcpy(record + STORE_RECORD_HEADER + FRAME_HEADER_SIZE, payload, header.length);
+        putU32(record + 4, storeChecksum(record + STORE_RECORD_HEADER, frameSize));
+        putU32(record, (uint32_t)frameSize);
+        store->writeOffset += recordSize;
+        store->backlog++;
+        
+        if (sender) {
+            StoreNotice notice = {sender, header.seq};
+            store->notices.push_back(notice);
+        }
+        wake = !store->dirty;
+        store->dirty = true;
+    }
+    if (wake && !storeWakePending.exchange(true)) storeWake.notify_one();
+    return STORE_APPENDED;
+}
+
+// Make everything appended so far durable, then confirm it to the senders
+void commitCampusStore(CampusStore* store) {
+    static const size_t PAGE = sysconf(_SC_PAGESIZE);
+    vector<StoreSegment> rolled;
+    vector<StoreNotice> notices;
+    StoreSegment active;
+    size_t syncFrom, syncTo;
+    bool writeCursor;
+    uint64_t cursorSegment;
+    size_t cursorOffset;
+    // A commit still syncing on another thread finishes first, so one that
+    // finds nothing dirty really has nothing left to make durable
+    lock_guard<mutex> commit(store->commitLock);
+    {
+        lock_guard<mutex> lock(store->lock);
+        if (!store->dirty && !store->cursorDirty) return;
+        rolled.swap(store->rolled);
+        notices.swap(store->notices);
+        active = store->segments.back();
+        store->segments.back().synced = true;
+        syncFrom = store->syncedOffset & ~(PAGE - 1);
+        syncTo = store->writeOffset;
+        store->syncedOffset = syncTo;
+        writeCursor = store->cursorDirty;
+        // Frames replayed but not yet written are replayed again after a crash
+        cursorSegment = store->segments.front().number;
+        cursorOffset = store->inFlight.empty() ? store->readOffset : store->inFlight.front().offset;
+        store->dirty = store->cursorDirty = false;
+    }
+    if (writeCursor) writeStoreCursor(store->cursorFd, cursorSegment, cursorOffset);
+    
+    // One sync per touched segment covers every frame of this tick
+    for (size_t i = 0; i < rolled.size(); i++) {
+        msync(rolled[i].map, rolled[i].size, MS_SYNC);
+        if (!rolled[i].synced) fdatasync(rolled[i].fd);
+    }
+    if (syncTo > syncFrom) msync(active.map + syncFrom, syncTo - syncFrom, MS_SYNC);
+    if (!active.synced) fdatasync(active.fd);
+    
+    {
+        lock_guard<mutex> lock(store->lock);
+        // The durable prefix only grows
+        if (active.number > store->committedSegment ||
+            (active.number == store->committedSegment && syncTo > store->committedOffset)) {
+            store->committedSegment = active.number;
+            store->committedOffset = syncTo;
+        }
+    }
+    
+    if (notices.empty()) return;
+    bool online;
+    {
+        RcuReadGuard guard;
+        online = !findSessions(store->campusId).empty();
+    }
+    string text = string("Campus ") + campusNameOf(store->campusId) +
+                  (online ? " is catching up on stored messages, message stored for delivery"
+                          : " is offline, message stored for delivery");
+    for (size_t i = 0; i < notices.size(); i++) {
+        enqueueFrame(notices[i].sender.get(), makeTextFrame(FRAME_QUEUED, notices[i].seq, text));
+    }
+}
+
+// Retire the oldest segment once everything in it has been delivered
+void dropFrontSegment(CampusStore* store) {
+    StoreSegment segment = store->segments.front();
+    store->segments.pop_front();
+    store->storedBytes -= segment.size;
+    store->readOffset = 0;
+    store->cursorDirty = true;
+    unmapSegment(segment);
+    unlink(segmentPath(store, segment.number).c_str());
+}
+
+// Replay committed frames to a campus that is back online. The persisted
+// cursor only passes a frame once its writer has retired it; frames still
+// queued stay with one session so they can be replayed in order if it is
+// lost.
+void deliverCampusStore(CampusStore* store) {
+    if (store->backlog.load() == 0) return;
+    
+    RcuReadGuard guard;
+    CampusConnection* target = pickSession(store->campusId);
+    if (target == NULL) return;
+    
+    // Take a batch under the store lock; the writers retire frames with
+    // their queue lock held, so the queue is never locked inside this one
+    const OutboundQueue& q = target->outbound;
+    size_t queuedCount = q.queuedCount, queuedBytes = q.queuedBytes;
+    if (q.closed || queuedCount >= serverConfig.queueLimit / 2 ||
+        queuedBytes >= serverConfig.queueByteLimit / 2) {
+        return;
+    }
+    size_t roomFrames = serverConfig.queueLimit / 2 - queuedCount;
+    size_t roomBytes = serverConfig.queueByteLimit / 2 - queuedBytes;
+    vector<StoreDelivery> batch;
+    {
+        lock_guard<mutex> lock(store->lock);
+        if (!store->inFlight.empty() && store->inFlight.back().target != target) return;
+        size_t batchBytes = 0;
+        while (store->backlog > 0 && batch.size() < roomFrames && batchBytes < roomBytes) {
+            StoreSegment& front = store->segments.front();
+            if (front.number > store->committedSegment ||
+                (front.number == store->committedSegment && store->readOffset >= store->committedOffset)) {
+                break;  // not durable yet
+            }
+            size_t length = storeRecordAt(front, store->readOffset);
+            if (length == 0) {
+                if (store->segments.size() == 1 || !store->inFlight.empty()) break;
+                dropFrontSegment(store);
+                continue;
+            }
+            
+            const char* frame = front.map + store->readOffset + STORE_RECORD_HEADER;
+            ForwardFrame stored(copyOutFrame(frame, length));
+            OutFrame out = stored.forSession(target);
+            if (!out) {
+                LOG(LOG_WARN, string("Dropped a stored message for ") + campusNameOf(store->campusId) +
+                              ": compressed payload is corrupt");
+            } else {
+                StoreDelivery delivery = {out, store->readOffset, target};
+                store->inFlight.push_back(delivery);
+                batch.push_back(delivery);
+                batchBytes += out->size();
+            }
+            store->readOffset += STORE_RECORD_HEADER + length;
+            store->backlog--;
+            store->cursorDirty = true;
+        }
+        store->inFlightCount = store->inFlight.size();
+    }
+    
+    size_t delivered = 0;
+    while (delivered < batch.size() && enqueueFrame(target, batch[delivered].frame) == ENQUEUED) delivered++;
+    if (delivered < batch.size()) {
+        // The queue refused the rest; wind the replay cursor back to them
+        lock_guard<mutex> lock(store->lock);
+        for (size_t i = 0; i < store->inFlight.size(); i++) {
+            if (!(store->inFlight[i].frame == batch[delivered].frame)) continue;
+            store->readOffset = store->inFlight[i].offset;
+            store->backlog += store->inFlight.size() - i;
+            store->inFlight.erase(store->inFlight.begin() + i, store->inFlight.end());
+            break;
+        }
+        store->inFlightCount = store->inFlight.size();
+    }
+    
+    if (delivered > 0) {
+        LOG(LOG_INFO, "Delivered " + to_string(delivered) + " stored messages to " +
+                      campusNameOf(store->campusId));
+    }
+}
+
+// A frame was written in full; if it was replayed from a store the
+// persisted cursor may move past it. Frames ahead of it in the in-flight
+// list were dropped by the overflow policy. Called with the writer's
+// queue lock held.
+void retireStoredFrame(const OutFrame& frame) {
+    if ((uint8_t)(*frame)[2] != FRAME_MESSAGE || campusStores.empty()) return;
+    uint16_t campusId = getU16(frame->data() + 14);
+    if (campusId == 0 || campusId >= campusStores.size() || campusStores[campusId] == NULL) return;
+    CampusStore* store = campusStores[campusId];
+    if (store->inFlightCount.load() == 0) return;
+    
+    lock_guard<mutex> lock(store->lock);
+    for (size_t i = 0; i < store->inFlight.size(); i++) {
+        if (!(store->inFlight[i].frame == frame)) continue;
+        store->inFlight.erase(store->inFlight.begin(), store->inFlight.begin() + i + 1);
+        store->inFlightCount = store->inFlight.size();
+        store->cursorDirty = true;
+        return;
+    }
+}
+
+void kickStoreWorker();
+
+// A connection's queue was closed. A resumable session took its replayed
+// frames along; otherwise they are replayed again from the first unsent one.
+void settleStoreDelivery(const CampusConnection* conn, bool keptBySession) {
+    bool replay = false;
+    for (size_t id = 1; id < campusStores.size(); id++) {
+        CampusStore* store = campusStores[id];
+        if (store == NULL || store->inFlightCount.load() == 0) continue;
+        
+        lock_guard<mutex> lock(store->lock);
+        if (store->inFlight.empty() || store->inFlight.front().target != conn) continue;
+        if (!keptBySession) {
+            store->readOffset = store->inFlight.front().offset;
+            store->backlog += store->inFlight.size();
+            replay = true;
+        }
+        store->inFlight.clear();
+        store->inFlightCount = 0;
+        store->cursorDirty = true;
+    }
+    if (replay) kickStoreWorker();
+}
+
+// Compaction: once a log is fully delivered, drop its segments and start
+// a fresh one so disk usage returns to a single empty segment
+void compactCampusStore(CampusStore* store) {
+    lock_guard<mutex> commit(store->commitLock);
+    lock_guard<mutex> lock(store->lock);
+    if (store->backlog > 0 || !store->inFlight.empty() || store->dirty || !store->rolled.empty() ||
+        store->writeOffset == 0) {
+        return;
+    }
+    
+    uint64_t next = store->segments.back().number + 1;
+    while (!store->segments.empty()) dropFrontSegment(store);
+    if (addStoreSegment(store, next, storeConfig.segmentBytes)) {
+        store->committedSegment = next;
+        store->committedOffset = 0;
+        writeStoreCursor(store->cursorFd, next, 0);
+        store->cursorDirty = false;
+        store->dirty = true;    // new segment's size must be synced
+    }
+}
+
+// Store thread: group commit, replay and compaction
+void storeWorker() {
+    chrono::steady_clock::time_point nextCompaction = chrono::steady_clock::now();
+    while (true) {
+        {
+            unique_lock<mutex> lock(storeWakeMutex);
+            storeWake.wait_for(lock, chrono::milliseconds(storeConfig.commitIntervalMs * 50),
+                               [] { return storeWakePending.load(); });
+        }
+        // Let a burst of appends accumulate into one commit
+        this_thread::sleep_for(chrono::milliseconds(storeConfig.commitIntervalMs));
+        storeWakePending.store(false);
+        
+        bool compact = chrono::steady_clock::now() >= nextCompaction;
+        if (compact) nextCompaction += chrono::seconds(storeConfig.compactIntervalSec);
+        
+        for (size_t id = 1; id < campusStores.size(); id++) {
+            CampusStore* store = campusStores[id];
+            if (store == NULL) continue;
+            commitCampusStore(store);
+            deliverCampusStore(store);
+            if (compact) compactCampusStore(store);
+        }
+    }
+}
+
+// Wake the store thread, e.g. when a campus with stored frames logs in
+void kickStoreWorker() {
+    if (storeConfig.enabled && !storeWakePending.exchange(true)) storeWake.notify_one();
+}
+
+uint64_t storedBacklog(uint16_t campusId) {
+    if (campusId >= campusStores.size() || campusStores[campusId] == NULL) return 0;
+    return campusStores[campusId]->backlog.load();
+}
+
+bool startStore() {
+    mkdir(storeConfig.dir.c_str(), 0755);
+    campusStores.assign(CAMPUS_COUNT, NULL);
+    for (uint16_t id = 1; id < CAMPUS_COUNT; id++) {
+        campusStores[id] = openCampusStore(id);
+        if (campusStores[id] == NULL) {
+            LOG(LOG_ERROR, "Cannot open message store in " + storeConfig.dir);
+            return false;
+        }
+    }
+    thread(storeWorker).detach();
+    LOG(LOG_INFO, "Message store ready in " + storeConfig.dir);
+    return true;
+}
+
+// Commit whatever the last tick has not synced yet (called on shutdown);
+// waits for a commit the store thread has in progress
+void stopStore() {
+    for (size_t id = 1; id < campusStores.size(); id++) {
+        if (campusStores[id] != NULL) commitCampusStore(campusStores[id]);
+    }
+}
+#else
+StoreResult storeFrame(uint16_t, const FrameHeader&, const char*, const shared_ptr<CampusConnection>&,
+                       bool onlyIfBacklogged) {
+    return onlyIfBacklogged ? STORE_NOT_NEEDED : STORE_FAILED;
+}
+void kickStoreWorker() {}
+void retireStoredFrame(const OutFrame&) {}
+void settleStoreDelivery(const CampusConnection*, bool) {}
+uint64_t storedBacklog(uint16_t) { return 0; }
+bool startStore() { return false; }
+void stopStore() {}
+#endif
+
+// ---- Message history ----
+//
+// Every routed message and publish is kept in an append-only history the
+// admin can search. The routing path only pushes a reference to the frame
+// it already built onto a lock-free list; the history thread picks the
+// list up on its own schedule, appends the frames to segment files and
+// indexes them in memory, so routing never waits on disk or the index.
+//
+// The index is columnar (one array per field, the row number is the
+// message number) with an inverted index from terms to the sorted rows
+// that contain them: "from:Lahore", "to:Karachi", "dept:CS" and every
+// lower-cased word of the text. Rows are in time order, so a time range is
+// a binary search on the time column.
+//
+// Record layout inside a segment: u32 frame length, u64 time in ms, frame.
+// Segments are read back at startup to rebuild the index.
+
+const size_t HISTORY_RECORD_HEADER = 12;
+const size_t HISTORY_MIN_WORD = 2;
+const size_t HISTORY_MAX_WORD = 32;
+const size_t HISTORY_PREVIEW = 160;     // text shown per search result
+
+struct HistoryConfig {
+    bool enabled;
+    string dir;
+    size_t segmentBytes;
+    size_t maxPending;          // frames waiting for the history thread
+    int intervalMs;             // how often the history thread picks them up
+};
+
+HistoryConfig historyConfig = {
+#ifdef _WIN32
+    false,
+#else
+    true,
+#endif
+    "nu_history",
+    64 * 1024 * 1024,
+    100000,
+    5
+};
+
+#ifndef _WIN32
+// Frame handed from a router to the history thread
+struct HistoryEntry {
+    HistoryEntry* next;
+    OutFrame frame;
+    int64_t timeMs;
+    
+    static void* operator new(size_t size) { return poolAllocate(size); }
+    static void operator delete(void* pointer) { poolRelease(pointer); }
+};
+
+struct HistorySegment {
+    uint64_t number;
+    int fd;
+    size_t size;
+};
+
+struct HistoryIndex {
+    mutex lock;                 // history thread appends, admin queries read
+    vector<int64_t> times;      // non-decreasing
+    vector<uint16_t> from;
+    vector<uint16_t> to;
+    vector<uint16_t> dept;
+    vector<uint32_t> segment;   // position in segments
+    vector<uint32_t> offset;    // record offset inside that segment
+    vector<HistorySegment> segments;
+    unordered_map<string, vector<uint32_t>> postings;
+};
+
+HistoryIndex historyIndex;
+atomic<HistoryEntry*> historyInbox(NULL);
+atomic<size_t> historyPending(0);
+mutex historyWriteMutex;        // one writer: the history thread or shutdown
+int64_t historyLastTimeMs = 0;
+
+int64_t wallClockMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Called by routers once a frame was accepted for delivery or storage.
+// Reuses the frame the router built when there is one.
+void recordHistory(const FrameHeader& header, const char* payload, const OutFrame& built) {
+    if (!historyConfig.enabled) return;
+    if (historyPending.fetch_add(1, memory_order_relaxed) >= historyConfig.maxPending) {
+        historyPending.fetch_sub(1, memory_order_relaxed);
+        metrics.historyDropped.add();
+        return;
+    }
+    HistoryEntry* entry = new HistoryEntry;
+    entry->frame = built ? built : makeOutFrame(header, payload);
+    entry->timeMs = wallClockMs();
+    entry->next = historyInbox.load(memory_order_relaxed);
+    while (!historyInbox.compare_exchange_weak(entry->next, entry, memory_order_release, memory_order_relaxed)) {}
+}
+
+string historySegmentPath(uint64_t number) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.hist", (unsigned long long)number);
+    return historyConfig.dir + "/" + name;
+}
+
+void addHistoryTerm(const string& term, uint32_t row) {
+    vector<uint32_t>& rows = historyIndex.postings[term];
+    if (rows.empty() || rows.back() != row) rows.push_back(row);
+}
+
+// Split text into lower-cased words; bytes above 0x7F count as letters so
+// non-Latin words are indexed too
+void forEachHistoryWord(const char* text, size_t length, vector<string>& words) {
+    string word;
+    for (size_t i = 0; i <= length; i++) {
+        unsigned char c = i < length ? (unsigned char)text[i] : ' ';
+        if (isalnum(c) || c >= 0x80) {
+            word += (char)tolower(c);
+            continue;
+        }
+        if (word.size() >= HISTORY_MIN_WORD && word.size() <= HISTORY_MAX_WORD) words.push_back(word);
+        word.clear();
+    }
+}
+
+// Text of a stored frame, decompressed if needed; false if corrupt
+bool historyText(const char* frame, vector<char>& scratch, const char*& text, size_t& length) {
+    length = getU32(frame + 4);
+    text = frame + FRAME_HEADER_SIZE;
+    if (!((uint8_t)frame[3] & FRAME_FLAG_COMPRESSED)) return true;
+    if (!decompressPayload(text, length, scratch)) return false;
+    text = scratch.empty() ? "" : &scratch[0];
+    length = scratch.size();
+    return true;
+}
+
+// Add one record to the columns and postings. Call with the index lock held.
+void indexHistoryRecord(uint32_t segment, uint32_t offset, int64_t timeMs, const char* frame,
+                        vector<char>& scratch, vector<string>& words) {
+    HistoryIndex& index = historyIndex;
+    uint32_t row = (uint32_t)index.times.size();
+    uint16_t from = getU16(frame + 12), to = getU16(frame + 14), dept = getU16(frame + 16);
+    index.times.push_back(timeMs);
+    index.from.push_back(from);
+    index.to.push_back(to);
+    index.dept.push_back(dept);
+    index.segment.push_back(segment);
+    index.offset.push_back(offset);
+    
+    addHistoryTerm(string("from:") + campusNameOf(from), row);
+    addHistoryTerm(string("to:") + (to == TOPIC_ANY ? "*" : campusNameOf(to)), row);
+    if (dept != 0) addHistoryTerm(string("dept:") + (dept == TOPIC_ANY ? "*" : departmentNameOf(dept)), row);
+    
+    const char* text;
+    size_t length;
+    words.clear();
+    if (historyText(frame, scratch, text, length)) forEachHistoryWord(text, length, words);
+    for (size_t i = 0; i < words.size(); i++) addHistoryTerm(words[i], row);
+    metrics.historyRecords.add();
+}
+
+bool openHistorySegment(uint64_t number) {
+    string path = historySegmentPath(number);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        LOG(LOG_ERROR, "Cannot create history segment " + path);
+        return false;
+    }
+    HistorySegment segment = {number, fd, 0};
+    lock_guard<mutex> lock(historyIndex.lock);
+    historyIndex.segments.push_back(segment);
+    return true;
+}
+
+// Write a batch of records to the current segment and index them
+bool flushHistoryBatch(const vector<char>& batch, const vector<size_t>& starts) {
+    if (starts.empty()) return true;
+    HistorySegment& current = historyIndex.segments.back();
+    size_t written = 0;
+    while (written < batch.size()) {
+        ssize_t n = write(current.fd, &batch[written], batch.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    if (written < batch.size()) {
+        // Cut the partial record off so the segment stays readable
+        if (ftruncate(current.fd, current.size) != 0) {}
+        LOG(LOG_ERROR, "History write failed in " + historySegmentPath(current.number));
+        metrics.historyDropped.add(starts.size());
+        return false;
+    }
+    
+    static vector<char> scratch;
+    static vector<string> words;
+    lock_guard<mutex> lock(historyIndex.lock);
+    uint32_t segment = (uint32_t)historyIndex.segments.size() - 1;
+    for (size_t i = 0; i < starts.size(); i++) {
+        const char* record = &batch[starts[i]];
+        indexHistoryRecord(segment, (uint32_t)(current.size + starts[i]), (int64_t)getU64(record + 4),
+                           record + HISTORY_RECORD_HEADER, scratch, words);
+    }
+    current.size += batch.size();
+    return true;
+}
+
+// Append entries (oldest first), rolling to a new segment when one is full.
+// Call with historyWriteMutex held.
+void appendHistory(const vector<HistoryEntry*>& entries) {
+    static vector<char> batch;
+    static vector<size_t> starts;
+    batch.clear();
+    starts.clear();
+    for (size_t i = 0; i < entries.size(); i++) {
+        const FrameBuffer& frame = *entries[i]->frame;
+        size_t recordSize = HISTORY_RECORD_HEADER + frame.size();
+        size_t used = historyIndex.segments.back().size + batch.size();
+        if (used > 0 && used + recordSize > historyConfig.segmentBytes) {
+            flushHistoryBatch(batch, starts);
+            batch.clear();
+            starts.clear();
+            if (!openHistorySegment(historyIndex.segments.back().number + 1)) return;
+        }
+        // Times are kept non-decreasing so ranges can be binary searched
+        historyLastTimeMs = max(historyLastTimeMs, entries[i]->timeMs);
+        char header[HISTORY_RECORD_HEADER];
+        putU32(header, (uint32_t)frame.size());
+        putU64(header + 4, (uint64_t)historyLastTimeMs);
+        starts.push_back(batch.size());
+        batch.insert(batch.end(), header, header + HISTORY_RECORD_HEADER);
+        batch.insert(batch.end(), frame.data(), frame.data() + frame.size());
+    }
+    flushHistoryBatch(batch, starts);
+}
+
+// Take everything routers have recorded so far and persist it
+void drainHistoryInbox() {
+    static vector<HistoryEntry*> entries;
+    HistoryEntry* head = historyInbox.exchange(NULL, memory_order_acquire);
+    if (head == NULL) return;
+    entries.clear();
+    for (; head != NULL; head = head->next) entries.push_back(head);
+    reverse(entries.begin(), entries.end());    // the list is newest first
+    historyPending.fetch_sub(entries.size(), memory_order_relaxed);
+    
+    appendHistory(entries);
+    for (size_t i = 0; i < entries.size(); i++) delete entries[i];
+}
+
+// History thread. It polls instead of being woken so that recording a
+// message never costs the router a system call.
+void historyWorker() {
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(historyConfig.intervalMs));
+        lock_guard<mutex> lock(historyWriteMutex);
+        drainHistoryInbox();
+    }
+}
+
+// Re-index one segment; a torn record at the end is cut off
+bool loadHistorySegment(uint64_t number) {
+    string path = historySegmentPath(number);
+    int fd = open(path.c_str(), O_RDWR | O_APPEND);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    vector<char> data(info.st_size);
+    size_t got = 0;
+    while (got < data.size()) {
+        ssize_t n = pread(fd, &data[got], data.size() - got, got);
+        if (n <= 0) break;
+        got += n;
+    }
+    
+    vector<char> scratch;
+    vector<string> words;
+    lock_guard<mutex> lock(historyIndex.lock);
+    uint32_t segment = (uint32_t)historyIndex.segments.size();
+    size_t offset = 0;
+    while (offset + HISTORY_RECORD_HEADER + FRAME_HEADER_SIZE <= got) {
+        const char* record = &data[offset];
+        size_t frameSize = getU32(record);
+        if (frameSize < FRAME_HEADER_SIZE || frameSize > got - offset - HISTORY_RECORD_HEADER ||
+            (uint8_t)record[HISTORY_RECORD_HEADER] != FRAME_MAGIC ||
+            getU32(record + HISTORY_RECORD_HEADER + 4) != frameSize - FRAME_HEADER_SIZE) break;
+        int64_t timeMs = max(historyLastTimeMs, (int64_t)getU64(record + 4));
+        historyLastTimeMs = timeMs;
+        indexHistoryRecord(segment, (uint32_t)offset, timeMs, record + HISTORY_RECORD_HEADER, scratch, words);
+        offset += HISTORY_RECORD_HEADER + frameSize;
+    }
+    if (offset < (size_t)info.st_size) {
+        LOG(LOG_WARN, "Truncating damaged history segment " + path + " at " + to_string(offset));
+        if (ftruncate(fd, offset) != 0) {}
+    }
+    HistorySegment loaded = {number, fd, offset};
+    historyIndex.segments.push_back(loaded);
+    return true;
+}
+
+bool startHistory() {
+    mkdir(historyConfig.dir.c_str(), 0755);
+    vector<uint64_t> numbers;
+    DIR* dir = opendir(historyConfig.dir.c_str());
+    if (dir == NULL) {
+        LOG(LOG_ERROR, "Cannot open message history in " + historyConfig.dir);
+        return false;
+    }
+    dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        string name = entry->d_name;
+        if (name.size() == 25 && name.compare(20, 5, ".hist") == 0) {
+            numbers.push_back(strtoull(name.c_str(), NULL, 10));
+        }
+    }
+    closedir(dir);
+    sort(numbers.begin(), numbers.end());
+    
+    uint64_t loadStart = metricClockNs();
+    for (size_t i = 0; i < numbers.size(); i++) {
+        if (!loadHistorySegment(numbers[i])) {
+            LOG(LOG_WARN, "Skipping unreadable history segment " + historySegmentPath(numbers[i]));
+        }
+    }
+    if (historyIndex.segments.empty() && !openHistorySegment(numbers.empty() ? 0 : numbers.back() + 1)) return false;
+    
+    thread(historyWorker).detach();
+    LOG(LOG_INFO, "Message history ready in " + historyConfig.dir + ": " + to_string(historyIndex.times.size()) +
+                  " messages indexed in " + to_string((metricClockNs() - loadStart) / 1000000) + " ms");
+    return true;
+}
+
+// Persist what is still waiting (called on shutdown)
+void stopHistory() {
+    if (!historyConfig.enabled) return;
+    lock_guard<mutex> lock(historyWriteMutex);
+    drainHistoryInbox();
+}
+
+struct HistoryQuery {
+    vector<string> terms;       // every term must match
+    int64_t sinceMs;
+    int64_t untilMs;            // exclusive
+    size_t limit;
+};
+
+// "7d", "12h", "30m", "45s" ago, or a local "YYYY-MM-DD[THH:MM[:SS]]"
+bool parseHistoryTime(const string& text, int64_t& timeMs) {
+    char unit = 0;
+    long long amount = 0;
+    int used = 0;
+    if (sscanf(text.c_str(), "%lld%c%n", &amount, &unit, &used) == 2 && used == (int)text.size()) {
+        int64_t scale = unit == 'd' ? 86400000 : unit == 'h' ? 3600000 : unit == 'm' ? 60000 : unit == 's' ? 1000 : 0;
+        if (scale == 0 || amount < 0) return false;
+        timeMs = wallClockMs() - amount * scale;
+        return true;
+    }
+    struct tm when;
+    memset(&when, 0, sizeof(when));
+    int fields = sscanf(text.c_str(), "%d-%d-%dT%d:%d:%d", &when.tm_year, &when.tm_mon, &when.tm_mday,
+                        &when.tm_hour, &when.tm_min, &when.tm_sec);
+    if (fields < 3 || fields == 4) return false;
+    when.tm_year -= 1900;
+    when.tm_mon -= 1;
+    when.tm_isdst = -1;
+    time_t seconds = mktime(&when);
+    if (seconds == (time_t)-1) return false;
+    timeMs = (int64_t)seconds * 1000;
+    return true;
+}
+
+// Parse "[from=CAMPUS] [to=CAMPUS|*] [dept=DEPT|*] [since=T] [until=T] [limit=N] [words...]"
+bool parseHistoryQuery(const string& args, HistoryQuery& query, string& error) {
+    query.terms.clear();
+    query.sinceMs = INT64_MIN;
+    query.untilMs = INT64_MAX;
+    query.limit = 20;
+    
+    istringstream in(args);
+    string token;
+    while (in >> token) {
+        size_t eq = token.find('=');
+        string key = eq == string::npos ? "" : token.substr(0, eq);
+        string value = eq == string::npos ? token : token.substr(eq + 1);
+        if (key == "from" || key == "to") {
+            if (campusIdOf(value) == 0 && !(key == "to" && value == "*")) {
+                error = "Unknown campus: " + value;
+                return false;
+            }
+            query.terms.push_back(key + ":" + value);
+        } else if (key == "dept") {
+            if (departmentIdOf(value) == 0 && value != "*") {
+                error = "Unknown department: " + value;
+                return false;
+            }
+            query.terms.push_back("dept:" + value);
+        } else if (key == "since" || key == "until") {
+            if (!parseHistoryTime(value, key == "since" ? query.sinceMs : query.untilMs)) {
+                error = "Bad time: " + value + " (use 7d, 12h, 30m, 45s or YYYY-MM-DD[THH:MM])";
+                return false;
+            }
+        } else if (key == "limit") {
+            query.limit = max(1, atoi(value.c_str()));
+        } else if (key.empty()) {
+            vector<string> words;
+            forEachHistoryWord(value.data(), value.size(), words);
+            query.terms.insert(query.terms.end(), words.begin(), words.end());
+        } else {
+            error = "Unknown search field: " + key;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Rows matching the query, newest first, up to the limit; returns the
+// total number of matches. Call with the index lock held.
+size_t runHistoryQuery(const HistoryQuery& query, vector<uint32_t>& rows) {
+    const HistoryIndex& index = historyIndex;
+    uint32_t lo = lower_bound(index.times.begin(), index.times.end(), query.sinceMs) - index.times.begin();
+    uint32_t hi = lower_bound(index.times.begin(), index.times.end(), query.untilMs) - index.times.begin();
+    if (lo >= hi) return 0;
+    
+    vector<const vector<uint32_t>*> lists;
+    for (size_t i = 0; i < query.terms.size(); i++) {
+        unordered_map<string, vector<uint32_t>>::const_iterator found = index.postings.find(query.terms[i]);
+        if (found == index.postings.end()) return 0;
+        lists.push_back(&found->second);
+    }
+    if (lists.empty()) {
+        for (uint32_t row = hi; row > lo && rows.size() < query.limit; row--) rows.push_back(row - 1);
+        return hi - lo;
+    }
+    
+    // Walk the shortest list and probe the others
+    sort(lists.begin(), lists.end(),
+         [](const vector<uint32_t>* a, const vector<uint32_t>* b) { return a->size() < b->size(); });
+    const vector<uint32_t>& driver = *lists[0];
+    size_t matches = 0;
+    size_t end = lower_bound(driver.begin(), driver.end(), hi) - driver.begin();
+    for (size_t i = end; i > 0 && driver[i - 1] >= lo; i--) {
+        uint32_t row = driver[i - 1];
+        bool all = true;
+        for (size_t l = 1; l < lists.size() && all; l++) {
+            all = binary_search(lists[l]->begin(), lists[l]->end(), row);
+        }
+        if (!all) continue;
+        if (rows.size() < query.limit) rows.push_back(row);
+        matches++;
+    }
+    return matches;
+}
+
+// One result line, read back from its segment. Call with the index lock held.
+string describeHistoryRow(uint32_t row) {
+    const HistoryIndex& index = historyIndex;
+    const HistorySegment& segment = index.segments[index.segment[row]];
+    char header[HISTORY_RECORD_HEADER];
+    string line = formatTime((time_t)(index.times[row] / 1000)) + "  ";
+    if (pread(segment.fd, header, sizeof(header), index.offset[row]) != (ssize_t)sizeof(header)) {
+        return line + "(unreadable)";
+    }
+    vector<char> frame(getU32(header));
+    if (pread(segment.fd, &frame[0], frame.size(), index.offset[row] + HISTORY_RECORD_HEADER) != (ssize_t)frame.size()) {
+        return line + "(unreadable)";
+    }
+    
+    uint8_t type = (uint8_t)frame[2];
+    line += string(campusNameOf(index.from[row])) +
+            (type == FRAME_PUBLISH ? " => " + topicName(index.to[row], index.dept[row])
+                                   : string(" -> ") + campusNameOf(index.to[row]) +
+                                     (index.dept[row] != 0 ? string("/") + departmentNameOf(index.dept[row]) : ""));
+    vector<char> scratch;
+    const char* text;
+    size_t length;
+    if (!historyText(&frame[0], scratch, text, length)) return line + ": (corrupt compressed message)";
+    string preview(text, min(length, HISTORY_PREVIEW));
+    replace(preview.begin(), preview.end(), '\n', ' ');
+    return line + ": " + preview + (length > HISTORY_PREVIEW ? "..." : "");
+}
+
+// Admin "search" (and "history", which is a search without filters)
+void searchHistory(const string& args) {
+    if (!historyConfig.enabled) {
+        cout << "Message history is disabled\n";
+        return;
+    }
+    HistoryQuery query;
+    string error;
+    if (!parseHistoryQuery(args, query, error)) {
+        cout << error << "\n";
+        return;
+    }
+    
+    lock_guard<mutex> lock(historyIndex.lock);
+    uint64_t searchStart = metricClockNs();
+    vector<uint32_t> rows;
+    size_t matches = runHistoryQuery(query, rows);
+    uint64_t elapsed = metricClockNs() - searchStart;
+    metrics.historySearchNs.record(elapsed);
+    
+    for (size_t i = rows.size(); i > 0; i--) cout << describeHistoryRow(rows[i - 1]) << "\n";
+    char summary[128];
+    snprintf(summary, sizeof(summary), "%zu of %zu matching messages (of %zu), searched in %.3f ms\n",
+             rows.size(), matches, historyIndex.times.size(), elapsed / 1000000.0);
+    cout << summary;
+}
+
+size_t historyTermCount() {
+    lock_guard<mutex> lock(historyIndex.lock);
+    return historyIndex.postings.size();
+}
+#else
+void recordHistory(const FrameHeader&, const char*, const OutFrame&) {}
+bool startHistory() { return false; }
+void stopHistory() {}
+void searchHistory(const string&) { cout << "Message history is disabled\n"; }
+size_t historyTermCount() { return 0; }
+#endif
+
+// ---- Credential registry ----
+
+// Logins are checked against an external file of endpoints, each mapped to
+// the campus it logs in as and a salted PBKDF2-HMAC-SHA256 password hash:
+//
+//   # endpoint   campus   hash
+//   Lahore       Lahore   pbkdf2-sha256$2000$<salt hex>$<hash hex>
+//
+// The file is parsed into a hash map published like the routing table, so
+// a reload swaps it in without touching sessions that are already logged in.
+
+struct Sha256 {
+    uint32_t state[8];
+    uint8_t block[64];
+    uint64_t length;    // bytes hashed so far
+    size_t used;        // bytes waiting in block
+    
+    Sha256() : length(0), used(0) {
+        static const uint32_t INIT[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(state, INIT, sizeof(state));
+    }
+    
+    void update(const void* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        length += size;
+        while (size > 0) {
+            size_t chunk = min(size, sizeof(block) - used);
+            memcpy(block + used, bytes, chunk);
+            used += chunk;
+            bytes += chunk;
+            size -= chunk;
+            if (used == sizeof(block)) {
+                compress();
+                used = 0;
+            }
+        }
+    }
+    
+    void finish(uint8_t digest[32]) {
+        uint64_t bits = length * 8;
+        uint8_t padding[72] = {0x80};
+        size_t padLength = (used < 56 ? 56 : 120) - used;
+        for (int i = 0; i < 8; i++) padding[padLength + i] = (uint8_t)(bits >> (56 - 8 * i));
+        update(padding, padLength + 8);
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = (uint8_t)(state[i] >> 24);
+            digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+            digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+            digest[4 * i + 3] = (uint8_t)state[i];
+        }
+    }
+    
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+    
+    void compress() {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+                   ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+};
+
+// PBKDF2-HMAC-SHA256 with a single 32-byte output block. The padded key
+// is hashed once up front, so every iteration costs two compressions.
+void pbkdf2Sha256(const string& password, const string& salt, int iterations, uint8_t out[32]) {
+    uint8_t key[64] = {0};
+    if (password.size() > sizeof(key)) {
+        Sha256 keyHash;
+        keyHash.update(password.data(), password.size());
+        keyHash.finish(key);
+    } else {
+        memcpy(key, password.data(), password.size());
+    }
+    uint8_t innerPad[64], outerPad[64];
+    for (int i = 0; i < 64; i++) {
+        innerPad[i] = key[i] ^ 0x36;
+        outerPad[i] = key[i] ^ 0x5c;
+    }
+    Sha256 inner, outer;
+    inner.update(innerPad, sizeof(innerPad));
+    outer.update(outerPad, sizeof(outerPad));
+    
+    // U1 = HMAC(password, salt || INT(1)), Un = HMAC(password, Un-1)
+    static const uint8_t BLOCK_INDEX[4] = {0, 0, 0, 1};
+    uint8_t u[32], innerDigest[32];
+    Sha256 h = inner;
+    h.update(salt.data(), salt.size());
+    h.update(BLOCK_INDEX, sizeof(BLOCK_INDEX));
+    for (int round = 0; round < iterations; round++) {
+        if (round > 0) {
+            h = inner;
+            h.update(u, sizeof(u));
+        }
+        h.finish(innerDigest);
+        Sha256 o = outer;
+        o.update(innerDigest, sizeof(innerDigest));
+        o.finish(u);
+        if (round == 0) memcpy(out, u, sizeof(u));
+        else for (int i = 0; i < 32; i++) out[i] ^= u[i];
+    }
+}
+
+// Compare without an early exit, so the time taken does not reveal how
+// many leading bytes matched
+bool constantTimeEqual(const uint8_t* a, const uint8_t* b, size_t size) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < size; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+string toHex(const uint8_t* data, size_t size) {
+    static const char DIGITS[] = "0123456789abcdef";
+    string hex;
+    for (size_t i = 0; i < size; i++) {
+        hex += DIGITS[data[i] >> 4];
+        hex += DIGITS[data[i] & 15];
+    }
+    return hex;
+}
+
+int hexDigitValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool fromHex(const string& hex, string& bytes) {
+    if (hex.size() % 2 != 0) return false;
+    bytes.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int high = hexDigitValue(hex[i]), low = hexDigitValue(hex[i + 1]);
+        if (high < 0 || low < 0) return false;
+        bytes += (char)(high * 16 + low);
+    }
+    return true;
+}
+
+const char* const HASH_SCHEME = "pbkdf2-sha256";
+const int DEFAULT_HASH_ITERATIONS = 2000;
+const int MAX_HASH_ITERATIONS = 1000000;
+const size_t SALT_BYTES = 16;
+
+struct Credential {
+    uint16_t campusId;      // campus the endpoint logs in as
+    int iterations;
+    string salt;
+    uint8_t hash[32];
+};
+
+// pbkdf2-sha256$ITERATIONS$SALT$HASH (salt and hash in hex)
+bool parseCredentialHash(const string& text, Credential& credential) {
+    size_t first = text.find('$');
+    size_t second = first == string::npos ? string::npos : text.find('$', first + 1);
+    size_t third = second == string::npos ? string::npos : text.find('$', second + 1);
+    if (third == string::npos || text.compare(0, first, HASH_SCHEME) != 0) return false;
+    
+    credential.iterations = atoi(text.c_str() + first + 1);
+    string hash;
+    if (credential.iterations < 1 || credential.iterations > MAX_HASH_ITERATIONS ||
+        !fromHex(text.substr(second + 1, third - second - 1), credential.salt) ||
+        !fromHex(text.substr(third + 1), hash) || hash.size() != sizeof(credential.hash)) {
+        return false;
+    }
+    memcpy(credential.hash, hash.data(), sizeof(credential.hash));
+    return true;
+}
+
+string makeCredentialHash(const string& password, int iterations) {
+    random_device random;
+    uint8_t salt[SALT_BYTES];
+    for (size_t i = 0; i < SALT_BYTES; i++) salt[i] = (uint8_t)random();
+    uint8_t hash[32];
+    pbkdf2Sha256(password, string((const char*)salt, SALT_BYTES), iterations, hash);
+    return string(HASH_SCHEME) + "$" + to_string(iterations) + "$" + toHex(salt, SALT_BYTES) + "$" +
+           toHex(hash, sizeof(hash));
+}
+
+struct CredentialConfig {
+    string path;
+    int hashIterations;     // for --hash-password
+};
+
+CredentialConfig credentialConfig = {"credentials.conf", DEFAULT_HASH_ITERATIONS};
+
+struct CredentialRegistry {
+    unordered_map<string, Credential> endpoints;   // by login name
+};
+
+atomic<CredentialRegistry*> credentialRegistry(NULL);
+mutex credentialWriteMutex;     // serializes reloads
+volatile sig_atomic_t credentialReloadRequested = 0;
+
+// Parse the credentials file; NULL (with the reason in error) if any line
+// is malformed, so a bad edit never half-replaces the registry
+CredentialRegistry* loadCredentials(const string& path, string& error) {
+    ifstream file(path.c_str());
+    if (!file) {
+        error = "cannot open " + path;
+        return NULL;
+    }
+    CredentialRegistry* registry = new CredentialRegistry();
+    string line;
+    for (int lineNumber = 1; getline(file, line); lineNumber++) {
+        size_t comment = line.find('#');
+        if (comment != string::npos) line.erase(comment);
+        istringstream fields(line);
+        string endpoint, campus, hash, extra;
+        if (!(fields >> endpoint)) continue;
+        
+        Credential credential;
+        const char* problem = NULL;
+        if (!(fields >> campus >> hash) || (fields >> extra)) problem = "expected: endpoint campus hash";
+        else if ((credential.campusId = campusIdOf(campus)) == 0) problem = "unknown campus";
+        else if (!parseCredentialHash(hash, credential)) problem = "malformed hash";
+        else if (!registry->endpoints.insert(make_pair(endpoint, credential)).second) problem = "duplicate endpoint";
+        if (problem != NULL) {
+            error = path + ":" + to_string(lineNumber) + ": " + problem;
+            delete registry;
+            return NULL;
+        }
+    }
+    return registry;
+}
+
+void dropRevokedSessions();
+
+// Swap in a freshly loaded registry. On error the current one stays.
+// Connections already logged in are untouched, but an endpoint that was
+// removed or moved to another campus fails its next login and cannot
+// resume a session: detached ones are dropped here, and resumeSession()
+// refuses the rest.
+bool reloadCredentials() {
+    lock_guard<mutex> lock(credentialWriteMutex);
+    string error;
+    CredentialRegistry* registry = loadCredentials(credentialConfig.path, error);
+    if (registry == NULL) {
+        LOG(LOG_ERROR, "Credentials not loaded: " + error);
+        return false;
+    }
+    CredentialRegistry* old = credentialRegistry.exchange(registry);
+    rcuSynchronize();
+    delete old;
+    LOG(LOG_INFO, "Loaded " + to_string(registry->endpoints.size()) + " endpoints from " + credentialConfig.path);
+    dropRevokedSessions();
+    return true;
+}
+
+#ifndef _WIN32
+void requestCredentialReload(int) {
+    credentialReloadRequested = 1;
+}
+#endif
+
+// Check an endpoint's password; campusId is set on success. The entry is
+// copied out so the slow key derivation runs outside the read section.
+// Unknown endpoints are hashed against a dummy entry so they take as long
+// as a wrong password.
+bool verifyCredentials(const string& endpoint, const string& password, uint16_t& campusId) {
+    Credential credential;
+    bool known;
+    {
+        RcuReadGuard guard;
+        const unordered_map<string, Credential>& endpoints = credentialRegistry.load()->endpoints;
+        unordered_map<string, Credential>::const_iterator it = endpoints.find(endpoint);
+        known = it != endpoints.end();
+        if (known) credential = it->second;
+    }
+    if (!known) {
+        credential.campusId = 0;
+        credential.iterations = DEFAULT_HASH_ITERATIONS;
+        credential.salt.assign(SALT_BYTES, '\0');
+        memset(credential.hash, 0, sizeof(credential.hash));
+    }
+    uint8_t hash[32];
+    pbkdf2Sha256(password, credential.salt, credential.iterations, hash);
+    bool match = constantTimeEqual(hash, credential.hash, sizeof(hash));
+    if (!known || !match) return false;
+    campusId = credential.campusId;
+    return true;
+}
+
+// Whether endpoint is still in the registry as a login of campusId
+bool endpointMapsTo(const string& endpoint, uint16_t campusId) {
+    RcuReadGuard guard;
+    const unordered_map<string, Credential>& endpoints = credentialRegistry.load()->endpoints;
+    unordered_map<string, Credential>::const_iterator it = endpoints.find(endpoint);
+    return it != endpoints.end() && it->second.campusId == campusId;
+}
+
+enum AuthStatus { AUTH_INCOMPLETE, AUTH_ACCEPTED, AUTH_REJECTED, AUTH_RESUME_FAILED, AUTH_RESUME_BUSY, AUTH_CHECKING };
+
+const size_t MAX_AUTH_FRAME = 1024;
+
+// ---- Session resumption ----
+//
+// A client that logs in with FRAME_FLAG_RESUME gets a session token. Both
+// sides count the session frames they process and acknowledge them with
+// FRAME_ACK after each batch they read; the server keeps written frames
+// until they are acknowledged. When the link drops, the session outlives
+// its connection for --resume-grace seconds with its unacknowledged and
+// unsent frames and its topics. A client that comes back with the token
+// skips the password check, learns how many of its own frames the server
+// processed, and gets only the frames it had not received yet.
+
+unordered_map<string, shared_ptr<SessionState> > sessionsByToken;
+mutex sessionsMutex;
+
+string newSessionToken() {
+    static mutex randomMutex;
+    static random_device random;
+    uint8_t bytes[16];
+    lock_guard<mutex> lock(randomMutex);
+    for (size_t i = 0; i < sizeof(bytes); i += 4) {
+        uint32_t value = random();
+        memcpy(bytes + i, &value, 4);
+    }
+    return toHex(bytes, sizeof(bytes));
+}
+
+// Register a new session for a connection that logged in with a password
+void openSession(CampusConnection* conn) {
+    shared_ptr<SessionState> state = make_shared<SessionState>();
+    state->endpoint = conn->endpoint;
+    state->campusId = conn->campusId;
+    state->compression = conn->compression;
+    state->attached = true;
+    state->detachedMs = 0;
+    state->received = 0;
+    state->sentBase = 0;
+    state->owner = conn->shared_from_this();
+    lock_guard<mutex> lock(sessionsMutex);
+    do {
+        state->token = newSessionToken();
+    } while (sessionsByToken.count(state->token) != 0);
+    sessionsByToken[state->token] = state;
+    conn->session = state;
+}
+
+// Take a session over for a new connection. What the client has not
+// received is queued ahead of anything routed to the new connection, and
+// its topics are followed again.
+AuthStatus resumeSession(CampusConnection* conn, const string& token, uint64_t clientReceived) {
+    shared_ptr<SessionState> state;
+    {
+        lock_guard<mutex> lock(sessionsMutex);
+        unordered_map<string, shared_ptr<SessionState> >::iterator it = sessionsByToken.find(token);
+        if (it == sessionsByToken.end()) return AUTH_RESUME_FAILED;
+        state = it->second;
+        // The token stands in for the password only while the endpoint
+        // would still be let in with one (also for snapshot sessions)
+        if (!endpointMapsTo(state->endpoint, state->campusId)) {
+            sessionsByToken.erase(it);
+            return AUTH_RESUME_FAILED;
+        }
+        if (state->attached) {
+            // The old connection is probably dead but not noticed yet; the
+            // socket is only closed after the session is detached
+            shared_ptr<CampusConnection> old = state->owner.lock();
+            if (old) shutdown(old->socket, SHUT_RDWR);
+            return AUTH_RESUME_BUSY;
+        }
+        if (clientReceived < state->sentBase || clientReceived - state->sentBase > state->pending.size()) {
+            sessionsByToken.erase(it);
+            return AUTH_RESUME_FAILED;
+        }
+        state->attached = true;
+        state->owner = conn->shared_from_this();
+    }
+    
+    conn->session = state;
+    conn->resumed = true;
+    conn->endpoint = state->endpoint;
+    conn->campusId = state->campusId;
+    conn->compression = state->compression;
+    conn->received = conn->receivedAcked = state->received;
+    
+    OutboundQueue& q = conn->outbound;
+    size_t replayed = 0;
+    {
+        lock_guard<mutex> lock(q.lock);
+        q.unackedBase = clientReceived;
+        for (size_t i = clientReceived - state->sentBase; i < state->pending.size(); i++, replayed++) {
+            q.frames.push_back(state->pending[i]);
+            q.queuedCount++;
+            q.queuedBytes += state->pending[i]->size();
+        }
+        state->pending.clear();
+    }
+    for (size_t i = 0; i < state->topics.size(); i++) {
+        addSubscription(conn->shared_from_this(), state->topics[i].first, state->topics[i].second);
+    }
+    metrics.sessionsResumed.add();
+    metrics.resumeReplayed.add(replayed);
+    LOG(LOG_DEBUG, "Resumed session of " + state->endpoint + ", replaying " + to_string(replayed) + " frames");
+    return AUTH_ACCEPTED;
+}
+
+// Keep what a closing connection's client may not have received, so the
+// session can be resumed. Call with the connection's queue lock held.
+void detachSession(CampusConnection* conn) {
+    OutboundQueue& q = conn->outbound;
+    SessionState* state = conn->session.get();
+    state->sentBase = q.unackedBase;
+    state->pending.swap(q.unacked);
+    for (size_t i = 0; i < q.frames.size(); i++) {
+        if (isSessionFrame((uint8_t)(*q.frames[i])[2])) state->pending.push_back(q.frames[i]);
+    }
+    q.unacked.clear();
+    q.unackedBytes = 0;
+    
+    state->topics.clear();
+    {
+        RcuReadGuard guard;
+        const vector<Subscription>& subscriptions = subscriptionIndex.load()->subscriptions;
+        for (size_t i = 0; i < subscriptions.size(); i++) {
+            if (subscriptions[i].conn.get() != conn) continue;
+            state->topics.push_back(make_pair(subscriptions[i].campusId, subscriptions[i].deptId));
+        }
+    }
+    
+    lock_guard<mutex> lock(sessionsMutex);
+    state->received = conn->received;
+    state->attached = false;
+    state->detachedMs = monotonicMs();
+}
+
+// The client has processed every session frame before number received
+void acknowledgeFrames(CampusConnection* conn, uint64_t received) {
+    OutboundQueue& q = conn->outbound;
+    lock_guard<mutex> lock(q.lock);
+    while (q.unackedBase < received && !q.unacked.empty()) {
+        q.unackedBytes -= q.unacked.front()->size();
+        q.unacked.pop_front();
+        q.unackedBase++;
+    }
+}
+
+// Forget sessions whose client has not come back in time
+void expireSessions(int64_t nowMs) {
+    int64_t graceMs = (int64_t)serverConfig.resumeGraceSec * 1000;
+    lock_guard<mutex> lock(sessionsMutex);
+    unordered_map<string, shared_ptr<SessionState> >::iterator it = sessionsByToken.begin();
+    while (it != sessionsByToken.end()) {
+        if (!it->second->attached && nowMs - it->second->detachedMs > graceMs) {
+            it = sessionsByToken.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Forget detached sessions whose endpoint a credentials reload removed or
+// moved to another campus
+void dropRevokedSessions() {
+    size_t dropped = 0;
+    {
+        lock_guard<mutex> lock(sessionsMutex);
+        unordered_map<string, shared_ptr<SessionState> >::iterator it = sessionsByToken.begin();
+        while (it != sessionsByToken.end()) {
+            if (!it->second->attached && !endpointMapsTo(it->second->endpoint, it->second->campusId)) {
+                it = sessionsByToken.erase(it);
+                dropped++;
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (dropped > 0) LOG(LOG_INFO, "Dropped " + to_string(dropped) + " detached sessions of revoked endpoints");
+}
+
+size_t detachedSessionCount() {
+    lock_guard<mutex> lock(sessionsMutex);
+    size_t count = 0;
+    for (unordered_map<string, shared_ptr<SessionState> >::iterator it = sessionsByToken.begin();
+         it != sessionsByToken.end(); ++it) {
+        if (!it->second->attached) count++;
+    }
+    return count;
+}
+
+// ---- Federation ----
+//
+// Several server nodes can share the campuses. Each node owns some of them
+// (--own) and keeps one persistent link to every other node (--peer). A
+// link is an ordinary connection that logged in with FRAME_FLAG_PEER and
+// carries the traffic of all campuses between the two nodes. The routing
+// table lists it as the last session of every campus its node owns, so
+// routing and store-and-forward work on it unchanged; while it is down,
+// messages for those campuses are stored here and drained to it later.
+//
+// The campus-to-node map is replicated. Every node sends its map when a
+// link comes up. An entry with a later epoch wins: the epoch is the
+// claiming node's start time, and ties go to the greater node name.
+// Changed entries are passed on to the other links. Frames that arrive
+// over a link are only delivered locally, never forwarded again. A
+// forwarded message carries an ID chosen by this node as its seq; the
+// owning node's reply is matched back to the sender, so clients see the
+// same outcomes as on a single node.
+
+struct PeerNode {
+    string name;
+    string host;
+    int port;
+    shared_ptr<CampusConnection> link;  // NULL while down; under federationMutex
+};
+
+struct FederationConfig {
+    string nodeName;
+    string secret;                      // shared by all nodes, checked on peer login
+    vector<PeerNode*> peers;
+    vector<uint16_t> owned;             // campuses this node claims
+};
+
+FederationConfig federation = {"Islamabad", "", vector<PeerNode*>(), vector<uint16_t>()};
+
+// One entry of the replicated map; an empty node means unclaimed, and an
+// unclaimed campus is served wherever it logs in
+struct CampusOwner {
+    string node;
+    uint64_t epoch;
+};
+
+mutex federationMutex;
+CampusOwner campusOwners[CAMPUS_COUNT];
+
+// A forwarded message or publish whose outcome other nodes will report,
+// keyed by the ID sent as its seq
+struct RemoteReply {
+    weak_ptr<CampusConnection> sender;
+    uint32_t seq;                       // the sender's own seq
+    bool wantAck;                       // the sender asked for DELIVERED
+    bool publish;
+    string topic;
+    uint64_t recipients;                // publishes: subscribers reached so far
+    vector<const CampusConnection*> waiting;    // links that still owe an answer
+};
+
+mutex remoteRepliesMutex;
+unordered_map<uint32_t, RemoteReply> remoteReplies;
+atomic<uint32_t> nextRemoteId(1);
+
+bool federated() {
+    return !federation.peers.empty();
+}
+
+PeerNode* findPeer(const string& name) {
+    for (size_t i = 0; i < federation.peers.size(); i++) {
+        if (federation.peers[i]->name == name) return federation.peers[i];
+    }
+    return NULL;
+}
+
+bool claimIsNewer(const CampusOwner& claim, const CampusOwner& current) {
+    return claim.epoch > current.epoch || (claim.epoch == current.epoch && claim.node > current.node);
+}
+
+// True if another node owns the campus; its name goes to owner
+bool servedElsewhere(uint16_t campusId, string& owner) {
+    lock_guard<mutex> lock(federationMutex);
+    owner = campusId < CAMPUS_COUNT ? campusOwners[campusId].node : "";
+    return !owner.empty() && owner != federation.nodeName;
+}
+
+// Map entries of the given campuses. Call with federationMutex held.
+OutFrame makePeerMapFrame(const vector<uint16_t>& campuses) {
+    string payload;
+    for (size_t i = 0; i < campuses.size(); i++) {
+        const CampusOwner& owner = campusOwners[campuses[i]];
+        if (owner.node.empty()) continue;
+        char entry[11];
+        putU16(entry, campuses[i]);
+        putU64(entry + 2, owner.epoch);
+        entry[10] = (char)owner.node.size();
+        payload.append(entry, sizeof(entry));
+        payload += owner.node;
+    }
+    FrameHeader header = {FRAME_PEER_MAP, 0, (uint32_t)payload.size(), 0, 0, 0, 0};
+    return makeOutFrame(header, payload.data());
+}
+
+// Route every campus owned by another node to that node's link while the
+// link is up, and to local sessions only otherwise
+void refreshPeerRoutes() {
+    vector<shared_ptr<CampusConnection> > links(CAMPUS_COUNT);
+    {
+        lock_guard<mutex> lock(federationMutex);
+        for (uint16_t id = 1; id < CAMPUS_COUNT; id++) {
+            PeerNode* node = findPeer(campusOwners[id].node);
+            if (node != NULL) links[id] = node->link;
+        }
+    }
+    
+    unique_lock<mutex> lock(routingWriteMutex);
+    RoutingTable* old = routingTable.load();
+    RoutingTable* updated = new RoutingTable(*old);
+    bool changed = false;
+    for (uint16_t id = 1; id < CAMPUS_COUNT; id++) {
+        SessionList sessions;
+        for (size_t i = 0; i < old->sessions[id].size(); i++) {
+            if (!old->sessions[id][i]->peer) sessions.push_back(old->sessions[id][i]);
+        }
+        if (links[id]) sessions.push_back(links[id]);
+        if (sessions != old->sessions[id]) {
+            updated->sessions[id] = sessions;
+            changed = true;
+        }
+    }
+    if (!changed) {
+        delete updated;
+        return;
+    }
+    routingTable.store(updated);
+    lock.unlock();
+    rcuSynchronize();
+    delete old;
+    // Messages stored while a link was down can go out now
+    kickStoreWorker();
+}
+
+// Apply map entries received over a link and pass the changed ones on.
+// Local sessions of a campus that now belongs to another node are closed;
+// their clients log in there instead.
+void mergeCampusMap(CampusConnection* link, const FrameView& frame) {
+    vector<uint16_t> changed;
+    vector<string> logLines;
+    vector<shared_ptr<CampusConnection> > others;
+    OutFrame update;
+    {
+        lock_guard<mutex> lock(federationMutex);
+        const char* entry = frame.payload;
+        size_t left = frame.header.length;
+        while (left >= 11 && left >= 11 + (size_t)(uint8_t)entry[10]) {
+            uint16_t id = getU16(entry);
+            size_t nameLength = (uint8_t)entry[10];
+            CampusOwner claim = {string(entry + 11, nameLength), getU64(entry + 2)};
+            entry += 11 + nameLength;
+            left -= 11 + nameLength;
+            if (id == 0 || id >= CAMPUS_COUNT || claim.node.empty() || !claimIsNewer(claim, campusOwners[id])) continue;
+            if (campusOwners[id].node == federation.nodeName) {
+                logLines.push_back(string("Campus ") + campusNameOf(id) + " moved to node " + claim.node +
+                                   ", closing its sessions here");
+            } else {
+                logLines.push_back(string("Campus ") + campusNameOf(id) + " is served by node " + claim.node);
+            }
+            campusOwners[id] = claim;
+            changed.push_back(id);
+        }
+        if (changed.empty()) return;
+        update = makePeerMapFrame(changed);
+        for (size_t i = 0; i < federation.peers.size(); i++) {
+            const shared_ptr<CampusConnection>& other = federation.peers[i]->link;
+            if (other && other.get() != link) others.push_back(other);
+        }
+    }
+    for (size_t i = 0; i < logLines.size(); i++) LOG(LOG_INFO, logLines[i]);
+    for (size_t i = 0; i < others.size(); i++) enqueueFrame(others[i].get(), update);
+    refreshPeerRoutes();
+    
+    RcuReadGuard guard;
+    for (size_t i = 0; i < changed.size(); i++) {
+        const SessionList& sessions = findSessions(changed[i]);
+        for (size_t s = 0; s < sessions.size(); s++) {
+            if (!sessions[s]->peer) shutdown(sessions[s]->socket, SHUT_RDWR);
+        }
+    }
+}
+
+// Register an outcome that links will report; returns the ID to send as seq
+uint32_t expectRemoteReply(const RemoteReply& reply) {
+    lock_guard<mutex> lock(remoteRepliesMutex);
+    uint32_t id;
+    do {
+        id = nextRemoteId++;
+    } while (id == 0 || remoteReplies.count(id) != 0);
+    remoteReplies[id] = reply;
+    return id;
+}
+
+// A link answered for reply id, or can no longer. A message's outcome goes
+// straight to its sender; a publish is answered once every link has, with
+// the subscribers of all nodes counted.
+void settleRemoteReply(uint32_t id, const CampusConnection* link, uint8_t type, const string& text) {
+    RemoteReply reply;
+    {
+        lock_guard<mutex> lock(remoteRepliesMutex);
+        unordered_map<uint32_t, RemoteReply>::iterator it = remoteReplies.find(id);
+        if (it == remoteReplies.end()) return;
+        vector<const CampusConnection*>& waiting = it->second.waiting;
+        vector<const CampusConnection*>::iterator position = find(waiting.begin(), waiting.end(), link);
+        if (position == waiting.end()) return;
+        waiting.erase(position);
+        if (it->second.publish) {
+            if (type == FRAME_DELIVERED) it->second.recipients += strtoull(text.c_str(), NULL, 10);
+            if (!waiting.empty()) return;
+        }
+        reply = it->second;
+        remoteReplies.erase(it);
+    }
+    
+    shared_ptr<CampusConnection> sender = reply.sender.lock();
+    if (!sender) return;
+    if (reply.publish) {
+        if (reply.recipients == 0) {
+            enqueueFrame(sender.get(), makeTextFrame(FRAME_ERROR, reply.seq, "No subscribers for " + reply.topic));
+        } else if (reply.wantAck) {
+            enqueueFrame(sender.get(), makeTextFrame(FRAME_DELIVERED, reply.seq, to_string(reply.recipients)));
+        }
+    } else if (type != FRAME_DELIVERED || reply.wantAck) {
+        enqueueFrame(sender.get(), makeTextFrame(type, reply.seq, text));
+    }
+}
+
+// Settle what a closed link still owed: a publish counts no subscribers
+// there, a message is reported as unconfirmed
+void failRemoteReplies(const CampusConnection* link) {
+    vector<uint32_t> ids;
+    {
+        lock_guard<mutex> lock(remoteRepliesMutex);
+        for (unordered_map<uint32_t, RemoteReply>::iterator it = remoteReplies.begin(); it != remoteReplies.end(); ++it) {
+            const vector<const CampusConnection*>& waiting = it->second.waiting;
+            if (find(waiting.begin(), waiting.end(), link) != waiting.end()) ids.push_back(it->first);
+        }
+    }
+    for (size_t i = 0; i < ids.size(); i++) {
+        settleRemoteReply(ids[i], link, FRAME_ERROR,
+                          "Link to node " + link->peer->name + " lost before delivery was confirmed");
+    }
+}
+
+// Hand a message for a campus of another node to that node's link.
+// QUEUE_FORWARDED means the owning node will report the outcome.
+EnqueueResult forwardToNode(CampusConnection* link, CampusConnection* sender, const FrameHeader& forward,
+                            const char* payload, bool wantAck) {
+    RemoteReply reply = {sender->shared_from_this(), forward.seq, wantAck, false, "", 0,
+                         vector<const CampusConnection*>(1, link)};
+    FrameHeader header = forward;
+    header.seq = expectRemoteReply(reply);
+    header.flags |= FRAME_FLAG_ACK;
+    EnqueueResult result = enqueueFrame(link, makeOutFrame(header, payload));
+    if (result != ENQUEUED) {
+        lock_guard<mutex> lock(remoteRepliesMutex);
+        remoteReplies.erase(header.seq);
+        return result;
+    }
+    metrics.peerForwarded.add();
+    return QUEUE_FORWARDED;
+}
+
+// Offer a publish to every other node whose link is up. True if their
+// answers are awaited; settleRemoteReply then sends the final reply.
+bool forwardPublish(CampusConnection* sender, const FrameHeader& forward, const char* payload, bool wantAck,
+                    uint64_t localRecipients) {
+    vector<shared_ptr<CampusConnection> > links;
+    {
+        lock_guard<mutex> lock(federationMutex);
+        for (size_t i = 0; i < federation.peers.size(); i++) {
+            if (federation.peers[i]->link) links.push_back(federation.peers[i]->link);
+        }
+    }
+    if (links.empty()) return false;
+    
+    RemoteReply reply = {sender->shared_from_this(), forward.seq, wantAck, true, topicName(forward.to, forward.dept),
+                         localRecipients, vector<const CampusConnection*>()};
+    for (size_t i = 0; i < links.size(); i++) reply.waiting.push_back(links[i].get());
+    FrameHeader header = forward;
+    header.seq = expectRemoteReply(reply);
+    header.flags |= FRAME_FLAG_ACK;
+    OutFrame out = makeOutFrame(header, payload);
+    for (size_t i = 0; i < links.size(); i++) {
+        if (enqueueFrame(links[i].get(), out) == ENQUEUED) {
+            metrics.peerForwarded.add();
+        } else {
+            settleRemoteReply(header.seq, links[i].get(), FRAME_ERROR, "");
+        }
+    }
+    return true;
+}
+
+// Check a peer node's login: a configured node name and the cluster secret
+bool checkPeerLogin(CampusConnection* conn, const string& authMsg) {
+    size_t secretPos = authMsg.find(",Secret:");
+    if (federation.secret.empty() || authMsg.find("Node:") != 0 || secretPos == string::npos) return false;
+    PeerNode* node = findPeer(authMsg.substr(5, secretPos - 5));
+    string secret = authMsg.substr(secretPos + 8);
+    if (node == NULL || secret.size() != federation.secret.size() ||
+        !constantTimeEqual((const uint8_t*)secret.data(), (const uint8_t*)federation.secret.data(), secret.size())) {
+        return false;
+    }
+    conn->peer = node;
+    conn->endpoint = "node " + node->name;
+    conn->compression = true;   // frames are passed on as they came
+    return true;
+}
+
+// A link to a peer node is up, whichever side opened it. A newer link
+// replaces an older one; the other node gets our whole map.
+void admitPeer(CampusConnection* conn) {
+    PeerNode* node = conn->peer;
+    conn->campusName = "node " + node->name;
+    conn->authenticated = true;
+    shared_ptr<CampusConnection> old;
+    OutFrame announce;
+    {
+        lock_guard<mutex> lock(federationMutex);
+        old = node->link;
+        node->link = conn->shared_from_this();
+        vector<uint16_t> all;
+        for (uint16_t id = 1; id < CAMPUS_COUNT; id++) all.push_back(id);
+        announce = makePeerMapFrame(all);
+    }
+    if (old) {
+        // Shut down under the queue lock so the socket cannot have been closed and reused
+        lock_guard<mutex> lock(old->outbound.lock);
+        if (!old->outbound.closed) shutdown(old->socket, SHUT_RDWR);
+    }
+    enqueueFrame(conn, announce);
+    LOG(LOG_INFO, "Peer link to node " + node->name + " is up");
+    refreshPeerRoutes();
+}
+
+// A link closed; messages for its node's campuses are stored until it is back
+void detachPeerLink(CampusConnection* conn) {
+    bool current;
+    {
+        lock_guard<mutex> lock(federationMutex);
+        current = conn->peer->link.get() == conn;
+        if (current) conn->peer->link.reset();
+    }
+    if (current) {
+        metrics.peerLinkDrops.add();
+        LOG(LOG_WARN, "Peer link to node " + conn->peer->name + " is down");
+        refreshPeerRoutes();
+    }
+    failRemoteReplies(conn);
+}
+
+size_t peerLinksUp() {
+    lock_guard<mutex> lock(federationMutex);
+    size_t up = 0;
+    for (size_t i = 0; i < federation.peers.size(); i++) {
+        if (federation.peers[i]->link) up++;
+    }
+    return up;
+}
+
+// Admin view of the nodes and the campus-to-node map
+void printFederation() {
+    if (!federated()) {
+        cout << "\nFederation is off (no --peer nodes)\n";
+        return;
+    }
+    lock_guard<mutex> lock(federationMutex);
+    cout << "\n=== Federation ===\n"
+         << "Node: " << federation.nodeName << " (this node)\n";
+    for (size_t i = 0; i < federation.peers.size(); i++) {
+        const PeerNode* node = federation.peers[i];
+        cout << "Node: " << node->name << " at " << node->host << ":" << node->port << " | Link: ";
+        if (node->link) {
+            cout << "up | Queue: " << node->link->outbound.queuedCount.load() << " frames, "
+                 << node->link->outbound.queuedBytes.load() << " bytes\n";
+        } else {
+            cout << "down\n";
+        }
+    }
+    cout << "Campus map:\n";
+    for (uint16_t id = 1; id < CAMPUS_COUNT; id++) {
+        const string& owner = campusOwners[id].node;
+        cout << "  " << campusNameOf(id) << " -> " << (owner.empty() ? "(unclaimed, served where it logs in)" : owner) << "\n";
+    }
+}
+
+void openCreditAccount(CampusConnection* conn);
+
+// Check the login frame at the head of the buffer without blocking. On
+// AUTH_ACCEPTED the connection's endpoint, campusId and compression are
+// set (and its session, when it resumes one); seq is the frame's sequence
+// number for the reply. Given password, an endpoint login is not hashed
+// here: it comes back as AUTH_CHECKING with the password to verify.
+AuthStatus checkAuthFrame(CampusConnection* conn, uint32_t& seq, string* password = NULL) {
+    FrameView frame;
+    RecvBuffer& buffer = *conn->buffer;
+    FrameStatus status = buffer.nextFrame(frame);
+    if (status == FRAME_INCOMPLETE) return buffer.size() > MAX_AUTH_FRAME ? AUTH_REJECTED : AUTH_INCOMPLETE;
+    if (status == FRAME_INVALID || frame.header.type != FRAME_AUTH) return AUTH_REJECTED;
+    seq = frame.header.seq;
+    conn->compression = serverConfig.compression && (frame.header.flags & FRAME_FLAG_COMPRESSED);
+    conn->creditGranted = (frame.header.flags & FRAME_FLAG_CREDIT) ? serverConfig.creditWindow : 0;
+    if (conn->creditGranted > 0) openCreditAccount(conn);
+    
+    string authMsg(frame.payload, frame.header.length);
+    if (shutdownPhase.load() != SHUTDOWN_NONE) {
+        // A resuming client tries again, and finds the restarted server
+        return (frame.header.flags & FRAME_FLAG_RESUME) && authMsg.find("Resume:") == 0 ? AUTH_RESUME_BUSY
+                                                                                        : AUTH_REJECTED;
+    }
+    if (frame.header.flags & FRAME_FLAG_PEER) return checkPeerLogin(conn, authMsg) ? AUTH_ACCEPTED : AUTH_REJECTED;
+    if (frame.header.flags & FRAME_FLAG_RESUME) {
+        conn->resumeOffered = serverConfig.resumeGraceSec > 0;
+        if (authMsg.find("Resume:") == 0) {
+            size_t countPos = authMsg.find(",Received:");
+            if (!conn->resumeOffered || countPos == string::npos) return AUTH_RESUME_FAILED;
+            return resumeSession(conn, authMsg.substr(7, countPos - 7), strtoull(authMsg.c_str() + countPos + 10, NULL, 10));
+        }
+    }
+    size_t campusPos = authMsg.find("Campus:");
+    size_t passPos = authMsg.find(",Pass:");
+    
+    if (campusPos == string::npos || passPos == string::npos) return AUTH_REJECTED;
+    
+    conn->endpoint = authMsg.substr(campusPos + 7, passPos - campusPos - 7);
+    if (password != NULL) {
+        *password = authMsg.substr(passPos + 6);
+        return AUTH_CHECKING;
+    }
+    return verifyCredentials(conn->endpoint, authMsg.substr(passPos + 6), conn->campusId) ? AUTH_ACCEPTED : AUTH_REJECTED;
+}
+
+// Make a connection whose credentials were accepted a session of its
+// campus; the error reply text if it cannot be admitted
+const char* admitCampus(CampusConnection* conn) {
+    if (conn->peer) {
+        admitPeer(conn);
+        return NULL;
+    }
+    conn->campusName = campusNameOf(conn->campusId);
+    string owner;
+    if (servedElsewhere(conn->campusId, owner)) {
+        LOG(LOG_WARN, "Refused login for " + conn->campusName + ": served by node " + owner);
+        return "AUTH_FAILED: campus is served by another node";
+    }
+    if (conn->resumeOffered && !conn->session) openSession(conn);
+    if (!publishConnection(conn->shared_from_this())) {
+        LOG(LOG_WARN, "Refused login for " + conn->campusName + ": session limit reached");
+        return "AUTH_FAILED: too many sessions";
+    }
+    conn->authenticated = true;
+    metrics.authNs.record(metricClockNs() - conn->acceptedNs);
+    if (conn->resumed) {
+        LOG(LOG_INFO, "Campus " + conn->campusName + " resumed its session (endpoint " + conn->endpoint + ")");
+    } else if (conn->endpoint == conn->campusName) {
+        LOG(LOG_INFO, "Campus " + conn->campusName + " connected successfully");
+    } else {
+        LOG(LOG_INFO, "Campus " + conn->campusName + " connected successfully (endpoint " + conn->endpoint + ")");
+    }
+    return NULL;
+}
+
+// Reply text for a refused login
+const char* loginRefusal(AuthStatus status) {
+    return status == AUTH_RESUME_FAILED ? "RESUME_FAILED" : status == AUTH_RESUME_BUSY ? "RESUME_BUSY" : "AUTH_FAILED";
+}
+
+void loginFailed(AuthStatus status) {
+    if (status == AUTH_RESUME_FAILED || status == AUTH_RESUME_BUSY) {
+        metrics.resumeRefusals.add();
+        LOG(LOG_DEBUG, string("Session resume refused: ") + loginRefusal(status));
+        return;
+    }
+    metrics.authFailures.add();
+    LOG(LOG_WARN, "Authentication failed for a client");
+}
+
+// Blocking login for the thread-per-campus model. A silent client only
+// holds up its own thread, and only until the auth timeout.
+bool authenticateCampus(CampusConnection* conn) {
+    RecvBuffer& buffer = *conn->buffer;
+#ifdef _WIN32
+    DWORD timeout = serverConfig.authTimeoutSec * 1000, noTimeout = 0;
+#else
+    timeval timeout = {serverConfig.authTimeoutSec, 0}, noTimeout = {0, 0};
+#endif
+    setsockopt(conn->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    
+    uint32_t seq = 0;
+    AuthStatus status;
+    while ((status = checkAuthFrame(conn, seq)) == AUTH_INCOMPLETE) {
+        char* space = buffer.writePtr();
+        int bytesReceived = recv(conn->socket, space, buffer.writeSpace(), 0);
+        if (bytesReceived <= 0) {
+#ifdef _WIN32
+            if (WSAGetLastError() == WSAETIMEDOUT) metrics.handshakeTimeouts.add();
+#else
+            if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) metrics.handshakeTimeouts.add();
+#endif
+            status = AUTH_REJECTED;
+            break;
+        }
+        buffer.commit(bytesReceived);
+        metrics.bytesIn.add(bytesReceived);
+    }
+    
+    const char* refusal = status == AUTH_ACCEPTED ? admitCampus(conn) : loginRefusal(status);
+    if (refusal != NULL) {
+        loginFailed(status);
+        closeOutboundQueue(conn);   // hands a resumed session back
+        sendTextFrame(conn->socket, FRAME_AUTH_REPLY, seq, refusal);
+        return false;
+    }
+    // Nothing is written to the socket until the writer starts, so the
+    // reply goes out ahead of frames already routed to the new session
+    setsockopt(conn->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&noTimeout, sizeof(noTimeout));
+    OutFrame reply = makeAuthReply(conn, seq);
+    sendAll(conn->socket, &(*reply)[0], reply->size());
+    kickStoreWorker();
+    return true;
+}
+
+// Queue a frame for one session in the form that session can read
+EnqueueResult forwardTo(CampusConnection* conn, ForwardFrame& frame) {
+    OutFrame out = frame.forSession(conn);
+    return out ? enqueueFrame(conn, out) : QUEUE_UNREADABLE;
+}
+
+void tagCredit(CampusConnection* sender, const OutFrame& frame);
+void parkCredit(uint16_t campusId, const OutFrame& frame);
+
+// Queue a frame for a campus under the delivery policy: on every session,
+// or on one of them, trying the others in turn if that one refuses it.
+// Call inside an RcuReadGuard.
+EnqueueResult deliverToCampus(uint16_t campusId, ForwardFrame& frame) {
+    const SessionList& sessions = findSessions(campusId);
+    EnqueueResult result = QUEUE_CLOSED;
+    if (serverConfig.delivery == DELIVER_ALL) {
+        bool queued = false;
+        for (size_t i = 0; i < sessions.size(); i++) {
+            EnqueueResult attempt = forwardTo(sessions[i].get(), frame);
+            if (attempt == ENQUEUED) queued = true;
+            else if (attempt != QUEUE_CLOSED) result = attempt;
+        }
+        return queued ? ENQUEUED : result;
+    }
+    
+    size_t start = sessions.empty() ? 0 : firstSession(campusId, sessions);
+    for (size_t n = 0; n < sessions.size(); n++) {
+        EnqueueResult attempt = forwardTo(sessions[(start + n) % sessions.size()].get(), frame);
+        if (attempt == ENQUEUED) return ENQUEUED;
+        if (attempt != QUEUE_CLOSED) result = attempt;
+    }
+    return result;
+}
+
+// Reply to the sender of a message or publish. Another node's link is
+// answered only when it asked (see FRAME_FLAG_PEER).
+void replyToSender(CampusConnection* sender, const FrameView& frame, uint8_t type, const string& text) {
+    if (sender->peer && !(frame.header.flags & FRAME_FLAG_ACK)) return;
+    enqueueFrame(sender, makeTextFrame(type, frame.header.seq, text));
+}
+
+// Route one message frame to its target campus. The frame is forwarded
+// unchanged except that the source is stamped with the sender's campus ID
+// (a frame from another node keeps its own); a compressed payload stays
+// compressed unless a recipient cannot read it. Routing only enqueues; the
+// destination's writer does the network I/O.
+void routeMessage(CampusConnection* sender, const FrameView& frame) {
+    uint64_t routeStart = metricClockNs();
+    const string campusName = sender->peer ? campusNameOf(frame.header.from) : sender->campusName;
+    const string targetName = campusNameOf(frame.header.to);
+    if (frame.header.flags & FRAME_FLAG_COMPRESSED) {
+        LOG(LOG_DEBUG, "Message from " + campusName + ": (" + to_string(frame.header.length) + " bytes compressed)");
+    } else {
+        LOG(LOG_DEBUG, "Message from " + campusName + ": " + string(frame.payload, frame.header.length));
+    }
+    
+    FrameHeader forward = frame.header;
+    if (!sender->peer) forward.from = sender->campusId;
+    forward.flags &= ~FRAME_FLAG_ACK;
+    bool wantAck = (frame.header.flags & FRAME_FLAG_ACK) != 0;
+    bool quiet = sender->peer && !wantAck;
+    
+    EnqueueResult result = QUEUE_CLOSED;
+    OutFrame built;     // handed on to the history when delivery built one
+    {
+        RcuReadGuard guard;
+        const SessionList& sessions = findSessions(frame.header.to);
+        if (!sessions.empty()) {
+            // Stay behind any stored frames the campus is still draining;
+            // like an offline campus, the sender is told once it is durable
+            if (storeFrame(forward.to, forward, frame.payload,
+                           quiet ? shared_ptr<CampusConnection>() : sender->shared_from_this(), true) == STORE_APPENDED) {
+                result = QUEUE_STORED;
+            } else if (sessions.back()->peer) {
+                // Owned by another node; a frame from a link never goes back out on one
+                if (!sender->peer) result = forwardToNode(sessions.back().get(), sender, forward, frame.payload, wantAck);
+            } else {
+                ForwardFrame out(makeOutFrame(forward, frame.payload));
+                tagCredit(sender, out.wire);
+                result = deliverToCampus(forward.to, out);
+                if (result == QUEUE_REJECTED) parkCredit(forward.to, out.wire);
+                built = out.wire;
+            }
+        } else if (storeFrame(forward.to, forward, frame.payload,
+                              quiet ? shared_ptr<CampusConnection>() : sender->shared_from_this(), false) == STORE_APPENDED) {
+            // The sender is told once the frame is durable
+            result = QUEUE_STORED;
+        }
+    }
+    
+    uint16_t from = metricCampus(forward.from);
+    uint16_t to = metricCampus(frame.header.to);
+    if (result == QUEUE_STORED) {
+        metrics.stored[from][to].add();
+    } else if (result == ENQUEUED) {
+        metrics.routed[from][to].add();
+    } else if (result != QUEUE_FORWARDED) {
+        metrics.failed[from][to].add();
+    }
+    if (result == QUEUE_STORED || result == ENQUEUED) recordHistory(forward, frame.payload, built);
+    
+    if (result == QUEUE_FORWARDED) {
+        LOG(LOG_DEBUG, "Forwarded message from " + campusName + " to " + targetName + " to its node");
+    } else if (result == QUEUE_STORED) {
+        LOG(LOG_DEBUG, "Stored message from " + campusName + " for " + targetName);
+    } else if (result == ENQUEUED) {
+        if (wantAck) replyToSender(sender, frame, FRAME_DELIVERED, targetName);
+        LOG(LOG_DEBUG, "Routed message from " + campusName + " to " + targetName);
+    } else if (result == QUEUE_REJECTED) {
+        replyToSender(sender, frame, FRAME_ERROR, "Campus " + targetName + " queue is full");
+        LOG(LOG_DEBUG, "Failed to route: " + targetName + " queue is full");
+    } else if (result == QUEUE_DISCONNECTED) {
+        replyToSender(sender, frame, FRAME_ERROR, "Campus " + targetName + " was disconnected (too slow)");
+        LOG(LOG_WARN, "Disconnected " + targetName + ": outbound queue overflow");
+    } else if (result == QUEUE_UNREADABLE) {
+        replyToSender(sender, frame, FRAME_ERROR, "Message could not be decompressed for " + targetName);
+        LOG(LOG_WARN, "Failed to route: corrupt compressed message from " + campusName);
+    } else {
+        replyToSender(sender, frame, FRAME_ERROR, "Campus " + targetName + " is not online");
+        LOG(LOG_DEBUG, "Failed to route: " + targetName + " is offline");
+    }
+    metrics.routeNs.record(metricClockNs() - routeStart);
+}
+
+// Subscribe or unsubscribe the connection to the frame's topic
+void changeSubscription(CampusConnection* conn, const FrameView& frame) {
+    uint16_t campusId, deptId;
+    bool subscribe = frame.header.type == FRAME_SUBSCRIBE;
+    if (!topicFields(frame.header.to, frame.header.dept, campusId, deptId)) {
+        enqueueFrame(conn, makeTextFrame(FRAME_ERROR, frame.header.seq, "Unknown topic"));
+        return;
+    }
+    
+    string topic = topicName(frame.header.to, frame.header.dept);
+    if (subscribe) {
+        if (addSubscription(conn->shared_from_this(), campusId, deptId)) {
+            LOG(LOG_DEBUG, conn->campusName + " subscribed to " + topic);
+        }
+    } else if (!removeSubscriptions(conn, campusId, deptId, false)) {
+        enqueueFrame(conn, makeTextFrame(FRAME_ERROR, frame.header.seq, "Not subscribed to " + topic));
+        return;
+    }
+    
+    if (frame.header.flags & FRAME_FLAG_ACK) {
+        enqueueFrame(conn, makeTextFrame(FRAME_DELIVERED, frame.header.seq, topic));
+    }
+}
+
+// Deliver a publish to every connection subscribed to a matching topic,
+// except the publisher. All recipients share one encoded frame. A publish
+// from a local client is also offered to the other nodes, and the sender
+// gets one reply counting the subscribers on all of them.
+void publishMessage(CampusConnection* sender, const FrameView& frame) {
+    uint64_t publishStart = metricClockNs();
+    uint16_t campusId, deptId;
+    if (!topicFields(frame.header.to, frame.header.dept, campusId, deptId)) {
+        replyToSender(sender, frame, FRAME_ERROR, "Unknown topic");
+        return;
+    }
+    
+    FrameHeader forward = frame.header;
+    if (!sender->peer) forward.from = sender->campusId;
+    forward.flags &= ~FRAME_FLAG_ACK;
+    
+    uint64_t recipients = 0;
+    OutFrame built;
+    {
+        RcuReadGuard guard;
+        const vector<CampusConnection*>& targets = topicRecipients(campusId, deptId);
+        if (!targets.empty()) {
+            ForwardFrame shared(makeOutFrame(forward, frame.payload));
+            tagCredit(sender, shared.wire);
+            for (size_t i = 0; i < targets.size(); i++) {
+                if (targets[i] != sender && forwardTo(targets[i], shared) == ENQUEUED) recipients++;
+            }
+            built = shared.wire;
+        }
+    }
+    if (recipients > 0) recordHistory(forward, frame.payload, built);
+    
+    string topic = topicName(frame.header.to, frame.header.dept);
+    metrics.publishes.add();
+    metrics.publishRecipients.add(recipients);
+    metrics.publishNs.record(metricClockNs() - publishStart);
+    LOG(LOG_DEBUG, "Published " + topic + " from " + sender->campusName + " to " +
+                   to_string(recipients) + " subscribers");
+    
+    bool wantAck = (frame.header.flags & FRAME_FLAG_ACK) != 0;
+    if (!sender->peer && forwardPublish(sender, forward, frame.payload, wantAck, recipients)) return;
+    if (recipients == 0) {
+        replyToSender(sender, frame, FRAME_ERROR, "No subscribers for " + topic);
+    } else if (wantAck) {
+        replyToSender(sender, frame, FRAME_DELIVERED, to_string(recipients));
+    }
+}
+
+// ---- Flow control ----
+//
+// Two mechanisms keep one campus from flooding the routers. Credit: a
+// client that asks for it at login may send --credit-window messages and
+// publishes that have not yet left the server. A routed frame carries its
+// sender's credit until a destination writer has written it (or it is
+// dropped); a frame a full queue refused gives it back only once that
+// queue drains, so a congested destination slows its senders. The window
+// is topped up with FRAME_CREDIT once half of it has come back, and a
+// client that sends past it is paused like one over a rate limit.
+// Rate limits: token buckets per campus (shared by all its sessions) and
+// per campus and department refill at --rate-limit / --dept-rate-limit
+// messages per second. A frame that finds a bucket empty stays in the
+// receive buffer and the connection stops reading until the bucket has
+// refilled: the backlog waits in the sender's socket and, with credit, in
+// the sender itself, never in server memory. Peer links are not limited;
+// the node a message entered at has done that.
+
+struct RateLimit {
+    double perSecond;   // 0 = unlimited, -1 = not set (use the default)
+    double burst;       // bucket size; 0 = one second's worth
+};
+
+struct TokenBucket {
+    mutex lock;
+    double perSecond;
+    double burst;
+    double tokens;
+    int64_t refilledUs;
+};
+
+// From the command line; slot 0 holds the default for the others
+RateLimit campusRates[CAMPUS_COUNT] = {{0, 0}, {-1, 0}, {-1, 0}, {-1, 0}, {-1, 0}, {-1, 0}};
+RateLimit departmentRates[DEPARTMENT_COUNT] = {{0, 0}, {-1, 0}, {-1, 0}, {-1, 0}, {-1, 0}};
+
+TokenBucket campusBuckets[CAMPUS_COUNT];
+TokenBucket departmentBuckets[CAMPUS_COUNT][DEPARTMENT_COUNT];   // [sender][department]
+
+int64_t monotonicUs() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void initBucket(TokenBucket& bucket, const RateLimit& limit, int64_t nowUs) {
+    bucket.perSecond = limit.perSecond;
+    bucket.burst = limit.burst > 0 ? limit.burst : max(1.0, limit.perSecond);
+    bucket.tokens = bucket.burst;
+    bucket.refilledUs = nowUs;
+}
+
+// Resolve the configured limits into full buckets (called once at startup)
+void initRateLimits() {
+    int64_t nowUs = monotonicUs();
+    for (uint16_t c = 0; c < CAMPUS_COUNT; c++) {
+        initBucket(campusBuckets[c], campusRates[c].perSecond < 0 ? campusRates[0] : campusRates[c], nowUs);
+        for (uint16_t d = 0; d < DEPARTMENT_COUNT; d++) {
+            initBucket(departmentBuckets[c][d],
+                       departmentRates[d].perSecond < 0 ? departmentRates[0] : departmentRates[d], nowUs);
+        }
+    }
+}
+
+bool rateLimited() {
+    for (uint16_t c = 0; c < CAMPUS_COUNT; c++) {
+        if (campusBuckets[c].perSecond > 0) return true;
+        for (uint16_t d = 0; d < DEPARTMENT_COUNT; d++) {
+            if (departmentBuckets[c][d].perSecond > 0) return true;
+        }
+    }
+    return false;
+}
+
+// Add the tokens earned since the last refill; returns the milliseconds
+// until the bucket holds a whole token (0 = it does)
+int64_t refillBucket(TokenBucket& bucket, int64_t nowUs) {
+    if (bucket.perSecond <= 0) return 0;
+    bucket.tokens = min(bucket.burst, bucket.tokens + (nowUs - bucket.refilledUs) * bucket.perSecond / 1e6);
+    bucket.refilledUs = nowUs;
+    if (bucket.tokens >= 1) return 0;
+    return (int64_t)((1 - bucket.tokens) * 1000 / bucket.perSecond) + 1;
+}
+
+// Take one token from both of the sender's buckets, or none if either is
+// empty; returns 0, or how many milliseconds to wait before trying again
+int64_t takeRateToken(uint16_t campusId, uint16_t deptId) {
+    TokenBucket& campus = campusBuckets[campusId < CAMPUS_COUNT ? campusId : 0];
+    TokenBucket& department = departmentBuckets[campusId < CAMPUS_COUNT ? campusId : 0]
+                                               [deptId < DEPARTMENT_COUNT ? deptId : 0];
+    // Limits are fixed after startup, so unlimited senders never lock
+    if (campus.perSecond <= 0 && department.perSecond <= 0) return 0;
+    
+    lock_guard<mutex> campusLock(campus.lock);
+    lock_guard<mutex> departmentLock(department.lock);
+    int64_t nowUs = monotonicUs();
+    int64_t waitMs = max(refillBucket(campus, nowUs), refillBucket(department, nowUs));
+    if (waitMs > 0) return waitMs;
+    if (campus.perSecond > 0) campus.tokens -= 1;
+    if (department.perSecond > 0) department.tokens -= 1;
+    return 0;
+}
+
+string describeRate(const RateLimit& limit) {
+    if (limit.perSecond <= 0) return "unlimited";
+    char text[64];
+    snprintf(text, sizeof(text), "%g/s burst %g", limit.perSecond,
+             limit.burst > 0 ? limit.burst : max(1.0, limit.perSecond));
+    return text;
+}
+
+// The configured limits, defaults first, for the stats output
+string describeRateLimits() {
+    string text = "campus " + describeRate(campusRates[0]);
+    for (uint16_t c = 1; c < CAMPUS_COUNT; c++) {
+        if (campusRates[c].perSecond >= 0) text += string(", ") + CAMPUS_NAMES[c] + " " + describeRate(campusRates[c]);
+    }
+    text += "; department " + describeRate(departmentRates[0]);
+    for (uint16_t d = 1; d < DEPARTMENT_COUNT; d++) {
+        if (departmentRates[d].perSecond >= 0) {
+            text += string(", ") + DEPARTMENT_NAMES[d] + " " + describeRate(departmentRates[d]);
+        }
+    }
+    return text;
+}
+
+// "[NAME=]RATE[/BURST]" from --rate-limit / --dept-rate-limit
+bool parseRateLimit(const string& spec, const char* const names[], uint16_t count, RateLimit* limits) {
+    size_t equals = spec.find('=');
+    uint16_t id = 0;
+    if (equals != string::npos) {
+        string name = spec.substr(0, equals);
+        id = lookupId(names, count, name.data(), name.size());
+        if (id == 0) return false;
+    }
+    string value = spec.substr(equals == string::npos ? 0 : equals + 1);
+    char* end;
+    double rate = strtod(value.c_str(), &end);
+    double burst = 0;
+    if (*end == '/') burst = strtod(end + 1, &end);
+    if (end == value.c_str() || *end != '\0' || rate < 0 || burst < 0) return false;
+    limits[id].perSecond = rate;
+    limits[id].burst = burst;
+    return true;
+}
+
+OutFrame makeCreditFrame(uint64_t granted) {
+    char payload[8];
+    putU64(payload, granted);
+    FrameHeader header = {FRAME_CREDIT, 0, sizeof(payload), 0, 0, 0, 0};
+    return makeOutFrame(header, payload);
+}
+
+// How often a reader paused on an exhausted window looks again
+const int CREDIT_RECHECK_MS = 5;
+
+void openCreditAccount(CampusConnection* conn) {
+    if (conn->credit != NULL) return;
+    CreditAccount* account = new CreditAccount;
+    account->refs = 1;
+    account->returned = 0;
+    account->wakeAt = 0;
+    account->conn = conn->shared_from_this();
+    conn->credit = account;
+}
+
+// The frame being routed takes over the credit its sender's reader holds
+void tagCredit(CampusConnection* sender, const OutFrame& frame) {
+    if (!sender->creditHeld) return;
+    sender->creditHeld = false;
+    sender->credit->refs.fetch_add(1, memory_order_relaxed);
+    frame.setCredit(sender->credit);
+}
+
+// Hold a refused frame's credit on the queue of the session it was meant
+// for until that queue drains
+void parkCredit(uint16_t campusId, const OutFrame& frame) {
+    CreditAccount* account = frame.takeCredit();
+    if (account == NULL) return;
+    CampusConnection* target = pickSession(campusId);
+    if (target != NULL) {
+        OutboundQueue& q = target->outbound;
+        lock_guard<mutex> lock(q.lock);
+        if (!q.closed) {
+            q.parkedCredit.push_back(account);
+            return;
+        }
+    }
+    returnCredit(account);
+}
+
+#ifdef __linux__
+void postCreditCheck(const shared_ptr<CampusConnection>& conn);
+#endif
+
+// A top-up is due: wake the connection's owner to send it. Credit comes
+// back wherever frames are retired or released, possibly under another
+// queue's lock, so this only posts.
+void wakeForCredit(CreditAccount* account) {
+    shared_ptr<CampusConnection> conn = account->conn.lock();
+    if (!conn) return;
+#ifdef __linux__
+    if (conn->worker != NULL) {
+        postCreditCheck(conn);
+        return;
+    }
+#endif
+    conn->creditDue = true;
+    conn->outbound.ready.notify_all();
+}
+
+void creditReturned(CreditAccount* account) {
+    uint64_t returned = account->returned.fetch_add(1) + 1;
+    uint64_t due = account->wakeAt.load();
+    if (due != 0 && returned >= due && account->wakeAt.compare_exchange_strong(due, 0)) wakeForCredit(account);
+}
+
+// A tagged frame was written or released: give back its credit and its
+// reference to the account
+void returnCredit(CreditAccount* account) {
+    creditReturned(account);
+    releaseCreditAccount(account);
+}
+
+// Credit a frame was admitted with but no routed frame took over (stored,
+// forwarded to a node or refused) is back at once
+void settleCredit(CampusConnection* conn) {
+    if (!conn->creditHeld) return;
+    conn->creditHeld = false;
+    creditReturned(conn->credit);
+}
+
+// Grant more once half the window has come back; until then the return
+// that makes it due wakes the owner (reader, writer thread or shard)
+void topUpCredit(CampusConnection* conn) {
+    CreditAccount* account = conn->credit;
+    if (account == NULL) return;
+    uint64_t half = serverConfig.creditWindow / 2;
+    while (true) {
+        uint64_t granted = conn->creditGranted.load();
+        if (granted == 0) return;
+        account->wakeAt.store(max(granted - half, (uint64_t)1));
+        uint64_t returned = account->returned.load();
+        if (returned + half < granted) return;
+        uint64_t topped = returned + serverConfig.creditWindow;
+        if (topped <= granted) return;
+        if (!conn->creditGranted.compare_exchange_strong(granted, topped)) continue;
+        // Not enqueueFrame: a shard calls this while draining its mailbox
+        queueFrame(conn, makeCreditFrame(topped), false);
+        metrics.creditGrants.add();
+    }
+}
+
+// ---- File transfers ----
+//
+// A transfer is a conversation between one sending session and the one
+// receiving session its offer was handed to. The server only remembers
+// that pair; chunks are relayed like any other frame, straight from the
+// receive buffer into one shared outbound buffer, and the receiver's
+// accept/ack frames pace the sender.
+
+struct FileRoute {
+    weak_ptr<CampusConnection> sender;
+    weak_ptr<CampusConnection> receiver;
+    const CampusConnection* senderConn;     // identity checks without locking the weak_ptrs
+    const CampusConnection* receiverConn;
+};
+
+mutex fileRoutesMutex;
+unordered_map<uint64_t, FileRoute> fileRoutes;     // by fileRouteKey()
+
+// Transfer IDs are chosen by the sender, so they are unique per campus
+uint64_t fileRouteKey(uint16_t senderCampus, uint32_t transferId) {
+    return ((uint64_t)senderCampus << 32) | transferId;
+}
+
+OutFrame makeFileCancel(uint32_t transferId, uint16_t from, uint16_t to, const string& reason) {
+    FrameHeader header = {FRAME_FILE_CANCEL, 0, (uint32_t)reason.size(), transferId, from, to, 0};
+    return makeOutFrame(header, reason.data());
+}
+
+// Start a transfer: hand the offer to one session of the target campus
+void offerFile(CampusConnection* sender, const FrameView& frame) {
+    uint16_t to = frame.header.to;
+    string refusal;
+    if (to == 0 || to >= CAMPUS_COUNT || to == sender->campusId) {
+        refusal = "Invalid target campus";
+    } else if (frame.header.length <= 8) {
+        refusal = "Malformed file offer";
+    }
+    
+    FrameHeader forward = frame.header;
+    forward.from = sender->campusId;
+    forward.flags = 0;
+    uint64_t key = fileRouteKey(sender->campusId, frame.header.seq);
+    if (refusal.empty()) {
+        RcuReadGuard guard;
+        CampusConnection* receiver = pickSession(to);
+        if (receiver == NULL) {
+            refusal = string("Campus ") + campusNameOf(to) + " is not online";
+        } else if (receiver->peer) {
+            refusal = string("Campus ") + campusNameOf(to) + " is served by another node; files cannot cross nodes";
+        } else {
+            {
+                lock_guard<mutex> lock(fileRoutesMutex);
+                FileRoute route = {sender->shared_from_this(), receiver->shared_from_this(), sender, receiver};
+                if (!fileRoutes.insert(make_pair(key, route)).second) refusal = "Transfer ID already in use";
+            }
+            if (refusal.empty() && enqueueFrame(receiver, makeOutFrame(forward, frame.payload)) != ENQUEUED) {
+                lock_guard<mutex> lock(fileRoutesMutex);
+                fileRoutes.erase(key);
+                refusal = string("Campus ") + campusNameOf(to) + " cannot take the transfer";
+            }
+        }
+    }
+    
+    if (!refusal.empty()) {
+        enqueueFrame(sender, makeFileCancel(frame.header.seq, to, sender->campusId, refusal));
+        return;
+    }
+    metrics.fileTransfers.add();
+    LOG(LOG_INFO, "File transfer " + to_string(frame.header.seq) + " from " + sender->campusName + " to " +
+                  campusNameOf(to) + ": " + string(frame.payload + 8, frame.header.length - 8) + ", " +
+                  to_string(getU64(frame.payload)) + " bytes");
+}
+
+// Pass a frame of a running transfer to the other side: chunks and cancels
+// from the sender, accept / ack / done / cancel from the receiver
+void relayFileFrame(CampusConnection* conn, const FrameView& frame) {
+    uint8_t type = frame.header.type;
+    bool finished = type == FRAME_FILE_DONE || type == FRAME_FILE_CANCEL;
+    uint64_t key = 0;
+    bool fromSender = false;
+    shared_ptr<CampusConnection> peer;
+    {
+        lock_guard<mutex> lock(fileRoutesMutex);
+        unordered_map<uint64_t, FileRoute>::iterator it = fileRoutes.end();
+        if (type == FRAME_FILE_CHUNK || type == FRAME_FILE_CANCEL) {
+            it = fileRoutes.find(fileRouteKey(conn->campusId, frame.header.seq));
+            if (it != fileRoutes.end() && it->second.senderConn != conn) it = fileRoutes.end();
+        }
+        fromSender = it != fileRoutes.end();
+        if (!fromSender && type != FRAME_FILE_CHUNK) {
+            // The receiver names the sending campus in `to`
+            it = fileRoutes.find(fileRouteKey(frame.header.to, frame.header.seq));
+            if (it != fileRoutes.end() && it->second.receiverConn != conn) it = fileRoutes.end();
+        }
+        if (it != fileRoutes.end()) {
+            key = it->first;
+            peer = (fromSender ? it->second.receiver : it->second.sender).lock();
+            if (finished || !peer) fileRoutes.erase(it);
+        }
+    }
+    
+    if (!peer) {
+        // Unknown or broken transfer: tell whoever is still talking about it
+        if (frame.header.type != FRAME_FILE_CANCEL) {
+            enqueueFrame(conn, makeFileCancel(frame.header.seq, frame.header.to, conn->campusId, "Unknown transfer"));
+        }
+        return;
+    }
+    
+    FrameHeader forward = frame.header;
+    forward.from = conn->campusId;
+    forward.to = peer->campusId;
+    forward.flags = 0;
+    if (enqueueFrame(peer.get(), makeOutFrame(forward, frame.payload)) != ENQUEUED) {
+        // Nothing was lost that a resume cannot fetch again
+        {
+            lock_guard<mutex> lock(fileRoutesMutex);
+            fileRoutes.erase(key);
+        }
+        enqueueFrame(conn, makeFileCancel(frame.header.seq, peer->campusId, conn->campusId,
+                                          "Campus " + peer->campusName + " is not keeping up"));
+        enqueueFrame(peer.get(), makeFileCancel(frame.header.seq, conn->campusId, peer->campusId,
+                                                "Transfer interrupted"));
+        return;
+    }
+    
+    if (frame.header.type == FRAME_FILE_CHUNK) {
+        metrics.fileChunks.add();
+        metrics.fileBytes.add(frame.header.length > 8 ? frame.header.length - 8 : 0);
+    } else if (frame.header.type == FRAME_FILE_DONE) {
+        metrics.fileTransfersDone.add();
+        LOG(LOG_INFO, "File transfer " + to_string(frame.header.seq) + " to " + conn->campusName + " completed");
+    }
+}
+
+// Abort every transfer a closing session takes part in
+void cancelFileTransfers(CampusConnection* conn) {
+    vector<pair<shared_ptr<CampusConnection>, uint32_t> > peers;
+    {
+        lock_guard<mutex> lock(fileRoutesMutex);
+        unordered_map<uint64_t, FileRoute>::iterator it = fileRoutes.begin();
+        while (it != fileRoutes.end()) {
+            bool sender = it->second.senderConn == conn;
+            if (!sender && it->second.receiverConn != conn) {
+                ++it;
+                continue;
+            }
+            shared_ptr<CampusConnection> peer = (sender ? it->second.receiver : it->second.sender).lock();
+            if (peer) peers.push_back(make_pair(peer, (uint32_t)it->first));
+            it = fileRoutes.erase(it);
+        }
+    }
+    for (size_t i = 0; i < peers.size(); i++) {
+        enqueueFrame(peers[i].first.get(), makeFileCancel(peers[i].second, conn->campusId, peers[i].first->campusId,
+                                                          "Campus " + conn->campusName + " disconnected"));
+    }
+}
+
+// A frame from another node's link: traffic for local campuses, outcomes
+// of frames this node forwarded, or map updates
+void handlePeerFrame(CampusConnection* link, const FrameView& frame) {
+    uint8_t type = frame.header.type;
+    if (type == FRAME_MESSAGE) {
+        metrics.peerReceived.add();
+        routeMessage(link, frame);
+    } else if (type == FRAME_PUBLISH) {
+        metrics.peerReceived.add();
+        publishMessage(link, frame);
+    } else if (type == FRAME_DELIVERED || type == FRAME_QUEUED || type == FRAME_ERROR) {
+        settleRemoteReply(frame.header.seq, link, type, string(frame.payload, frame.header.length));
+    } else if (type == FRAME_PEER_MAP) {
+        mergeCampusMap(link, frame);
+    }
+}
+
+// Parse and dispatch every complete frame in the buffer; false means the
+// stream is corrupt and the connection must be dropped. A frame over a rate
+// limit or past the credit window stops the loop and sets throttledUntilMs;
+// the caller must not read the socket again before then. While the server
+// drains, every message and publish is held that way: the client sends it
+// again after resuming.
+bool processFrames(CampusConnection* conn) {
+    FrameView frame;
+    FrameStatus status;
+    conn->throttledUntilMs = 0;
+    while ((status = conn->buffer->nextFrame(frame)) == FRAME_READY) {
+        if (usesCredit(frame.header.type) && !conn->peer) {
+            bool draining = shutdownPhase.load() != SHUTDOWN_NONE;
+            uint64_t granted = conn->creditGranted.load();
+            bool overCredit = granted > 0 && conn->creditUsed >= granted;
+            int64_t waitMs = draining     ? DRAIN_HOLD_MS
+                             : overCredit ? CREDIT_RECHECK_MS
+                                          : takeRateToken(conn->campusId, frame.header.dept);
+            if (waitMs > 0) {
+                conn->buffer->unread(frame);
+                conn->throttledUntilMs = monotonicMs() + waitMs;
+                if (overCredit && !draining) {
+                    metrics.creditWaits.add();
+                } else if (!draining) {
+                    metrics.throttled.add();
+                    metrics.throttleMs.record(waitMs);
+                }
+                break;
+            }
+            conn->creditUsed++;
+            conn->creditHeld = conn->credit != NULL;
+        }
+        if (isSessionFrame(frame.header.type)) conn->received++;
+        if (frame.header.flags & FRAME_FLAG_COMPRESSED) {
+            // Only the length prefix is read; the payload is forwarded as is
+            uint32_t original = compressedOriginalLength(frame.payload, frame.header.length);
+            if (original == 0) {
+                enqueueFrame(conn, makeTextFrame(FRAME_ERROR, frame.header.seq, "Malformed compressed payload"));
+                settleCredit(conn);
+                continue;
+            }
+            metrics.compressedFrames.add();
+            metrics.compressedBytes.add(frame.header.length);
+            metrics.originalBytes.add(original);
+        }
+        if (conn->peer) {
+            handlePeerFrame(conn, frame);
+        } else if (frame.header.type == FRAME_MESSAGE) {
+            routeMessage(conn, frame);
+        } else if (frame.header.type == FRAME_PUBLISH) {
+            publishMessage(conn, frame);
+        } else if (frame.header.type == FRAME_SUBSCRIBE || frame.header.type == FRAME_UNSUBSCRIBE) {
+            changeSubscription(conn, frame);
+        } else if (frame.header.type == FRAME_FILE_OFFER) {
+            offerFile(conn, frame);
+        } else if (frame.header.type >= FRAME_FILE_ACCEPT && frame.header.type <= FRAME_FILE_CANCEL) {
+            relayFileFrame(conn, frame);
+        } else if (frame.header.type == FRAME_ACK && frame.header.length >= 8) {
+            acknowledgeFrames(conn, getU64(frame.payload));
+        }
+        settleCredit(conn);
+    }
+    if (status == FRAME_INVALID) {
+        LOG(LOG_WARN, "Invalid frame from " + conn->campusName + ", dropping connection");
+        return false;
+    }
+    // One acknowledgement per batch read from the socket
+    if (conn->session && conn->received != conn->receivedAcked) {
+        conn->receivedAcked = conn->received;
+        enqueueFrame(conn, makeAckFrame(conn->received));
+    }
+    topUpCredit(conn);
+    return true;
+}
+
+// Mark a campus offline (or a peer link down) and release its socket
+void closeCampusConnection(CampusConnection* conn) {
+    closeOutboundQueue(conn);
+    if (conn->peer) {
+        detachPeerLink(conn);
+    } else {
+        LOG(LOG_INFO, "Campus " + conn->campusName + " disconnected");
+        unpublishConnection(conn);
+    }
+    removeSubscriptions(conn, 0, 0, true);
+    cancelFileTransfers(conn);
+    closesocket(conn->socket);
+}
+
+// Writer thread for the thread-per-campus model: drains the outbound queue
+void campusWriter(shared_ptr<CampusConnection> conn) {
+    countThreadAllocations();
+    OutboundQueue& q = conn->outbound;
+    while (true) {
+        if (conn->creditDue.exchange(false)) topUpCredit(conn.get());
+        OutFrame frame;
+        {
+            unique_lock<mutex> lock(q.lock);
+            while (!q.closed && q.frames.empty() && !conn->creditDue) {
+                if (conn->credit == NULL) {
+                    q.ready.wait(lock);
+                } else {
+                    // Returned credit notifies without the lock; look again now and then
+                    q.ready.wait_for(lock, chrono::milliseconds(CREDIT_RECHECK_MS * 20));
+                }
+            }
+            if (q.closed) return;
+            if (q.frames.empty()) continue;
+            frame = q.frames.front();
+        }
+        
+        bool ok = sendAll(conn->socket, &(*frame)[0], frame->size());
+        metrics.ioSyscalls.add();
+        if (ok) metrics.bytesOut.add(frame->size());
+        
+        {
+            lock_guard<mutex> lock(q.lock);
+            // The queue may have been cleared by close while we were sending;
+            // a frame that failed stays for a resumed session
+            if (ok && !q.frames.empty() && q.frames.front() == frame) {
+                q.frames.pop_front();
+                q.queuedCount--;
+                q.queuedBytes -= frame->size();
+                retireFrame(conn.get(), frame);
+            }
+        }
+        if (!ok) {
+            // Let the reader notice and clean up
+            shutdown(conn->socket, SHUT_RDWR);
+            return;
+        }
+    }
+}
+
+// Serve a logged-in connection on this thread until it closes, with its
+// own writer thread: thread-per-campus connections and the peer links this
+// node opens
+void serveConnection(shared_ptr<CampusConnection> conn) {
+    thread writer(campusWriter, conn);
+    countThreadAllocations();
+    
+    // Frames pipelined behind the auth frame are already buffered
+    RecvBuffer& buffer = *conn->buffer;
+    while (processFrames(conn.get())) {
+        if (conn->throttledUntilMs > 0) {
+            // Over a rate limit: leave the socket unread until tokens are back.
+            // A reader held by a draining server leaves once it is closing.
+            if (shutdownPhase.load() == SHUTDOWN_CLOSING) break;
+            this_thread::sleep_for(chrono::milliseconds(conn->throttledUntilMs - monotonicMs()));
+            continue;
+        }
+        char* space = buffer.writePtr();
+        int bytesReceived = recv(conn->socket, space, buffer.writeSpace(), 0);
+        metrics.ioSyscalls.add();
+        
+        if (bytesReceived <= 0) break;
+        buffer.commit(bytesReceived);
+        metrics.bytesIn.add(bytesReceived);
+    }
+    
+    // Cleanup: unblock and stop the writer before the socket is closed
+    shutdown(conn->socket, SHUT_RDWR);
+    closeOutboundQueue(conn.get());
+    writer.join();
+    closeCampusConnection(conn.get());
+}
+
+// Handle individual campus client, from login to disconnect
+void handleCampusClient(shared_ptr<CampusConnection> conn) {
+    if (!authenticateCampus(conn.get())) {
+        closesocket(conn->socket);
+        return;
+    }
+    serveConnection(conn);
+}
+
+// Open the link to a peer node and log in to it as this node
+shared_ptr<CampusConnection> dialPeer(PeerNode* node) {
+    SOCKET peerSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (peerSocket == INVALID_SOCKET) return shared_ptr<CampusConnection>();
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(node->port);
+    if (inet_pton(AF_INET, node->host.c_str(), &addr.sin_addr) != 1 ||
+        connect(peerSocket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        closesocket(peerSocket);
+        return shared_ptr<CampusConnection>();
+    }
+    
+    shared_ptr<CampusConnection> conn = make_shared<CampusConnection>();
+    conn->socket = peerSocket;
+    conn->buffer = new RecvBuffer;
+    conn->peer = node;
+    conn->endpoint = "node " + node->name;
+    conn->compression = true;
+#ifdef _WIN32
+    DWORD timeout = serverConfig.authTimeoutSec * 1000, noTimeout = 0;
+#else
+    timeval timeout = {serverConfig.authTimeoutSec, 0}, noTimeout = {0, 0};
+#endif
+    setsockopt(peerSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    
+    string hello = "Node:" + federation.nodeName + ",Secret:" + federation.secret;
+    FrameHeader header = {FRAME_AUTH, FRAME_FLAG_PEER, (uint32_t)hello.size(), 0, 0, 0, 0};
+    OutFrame auth = makeOutFrame(header, hello.data());
+    FrameView reply;
+    FrameStatus status = FRAME_INCOMPLETE;
+    if (sendAll(peerSocket, &(*auth)[0], auth->size())) {
+        while ((status = conn->buffer->nextFrame(reply)) == FRAME_INCOMPLETE) {
+            int bytesReceived = recv(peerSocket, conn->buffer->writePtr(), conn->buffer->writeSpace(), 0);
+            if (bytesReceived <= 0) break;
+            conn->buffer->commit(bytesReceived);
+        }
+    }
+    string answer = status == FRAME_READY ? string(reply.payload, reply.header.length) : "";
+    if (status != FRAME_READY || reply.header.type != FRAME_AUTH_REPLY || answer.find("AUTH_SUCCESS") != 0) {
+        if (!answer.empty()) LOG(LOG_WARN, "Node " + node->name + " refused the peer link: " + answer);
+        closesocket(peerSocket);
+        return shared_ptr<CampusConnection>();
+    }
+    setsockopt(peerSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&noTimeout, sizeof(noTimeout));
+    admitPeer(conn.get());
+    return conn;
+}
+
+// Keep the link to a peer whose name sorts after ours open, reopening it
+// with backoff whenever it drops; the other node waits for us to dial
+void peerDialer(PeerNode* node) {
+    int delayMs = 500;
+    bool reported = false;
+    while (true) {
+        shared_ptr<CampusConnection> conn = dialPeer(node);
+        if (conn) {
+            delayMs = 500;
+            reported = false;
+            serveConnection(conn);
+        } else if (!reported) {
+            LOG(LOG_WARN, "Cannot reach node " + node->name + " at " + node->host + ":" + to_string(node->port) +
+                          ", retrying");
+            reported = true;
+        }
+        if (shutdownPhase.load() != SHUTDOWN_NONE) return;
+        this_thread::sleep_for(chrono::milliseconds(delayMs));
+        delayMs = min(delayMs * 2, 10000);
+    }
+}
+
+// Claim this node's campuses and start dialing peers
+void startFederation() {
+    if (!federated()) return;
+    string owned;
+    {
+        lock_guard<mutex> lock(federationMutex);
+        uint64_t epoch = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        for (size_t i = 0; i < federation.owned.size(); i++) {
+            CampusOwner claim = {federation.nodeName, epoch};
+            campusOwners[federation.owned[i]] = claim;
+            owned += string(owned.empty() ? "" : ", ") + campusNameOf(federation.owned[i]);
+        }
+    }
+    for (size_t i = 0; i < federation.peers.size(); i++) {
+        if (federation.nodeName < federation.peers[i]->name) thread(peerDialer, federation.peers[i]).detach();
+    }
+    LOG(LOG_INFO, "Node " + federation.nodeName + " serves " + (owned.empty() ? string("no campuses") : owned) +
+                  " with " + to_string(federation.peers.size()) + " peer nodes");
+}
+
+#ifdef __linux__
+struct AuthCheck;
+
+// What a mailbox item asks of the shard that owns its connection
+enum MailboxKind {
+    MAIL_FRAME,             // queue the frame on the connection
+    MAIL_CREDIT,            // top up the connection's credit
+    MAIL_LOGIN              // an auth worker has checked the connection's password
+};
+
+// Work posted to a connection owned by another shard
+struct MailboxItem {
+    atomic<MailboxItem*> next;
+    MailboxKind kind;
+    shared_ptr<CampusConnection> conn;
+    OutFrame frame;             // MAIL_FRAME
+    AuthCheck* check;           // MAIL_LOGIN
+    
+    static void* operator new(size_t size) { return poolAllocate(size); }
+    static void operator delete(void* pointer) { poolRelease(pointer); }
+};
+
+// Lock-free multi-producer, single-consumer queue of posted frames
+// (Vyukov's intrusive MPSC queue). Any thread may push; only the owning
+// shard pops.
+class Mailbox {
+public:
+    Mailbox() : head(&stub), tail(&stub) { stub.next.store(NULL); }
+    
+    void push(MailboxItem* item) {
+        item->next.store(NULL, memory_order_relaxed);
+        MailboxItem* previous = head.exchange(item, memory_order_acq_rel);
+        previous->next.store(item, memory_order_release);
+    }
+    
+    // Oldest item, or NULL if empty. An item whose push is still half done
+    // is not visible yet; its producer wakes the shard again afterwards.
+    MailboxItem* pop() {
+        MailboxItem* first = tail;
+        MailboxItem* next = first->next.load(memory_order_acquire);
+        if (first == &stub) {
+            if (next == NULL) return NULL;
+            tail = next;
+            first = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next != NULL) {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(memory_order_acquire)) return NULL;
+        // first is the last item: put the stub behind it so it can be taken
+        push(&stub);
+        next = first->next.load(memory_order_acquire);
+        if (next == NULL) return NULL;
+        tail = next;
+        return first;
+    }
+    
+private:
+    atomic<MailboxItem*> head;
+    MailboxItem* tail;
+    MailboxItem stub;
+};
+
+// A connection that has not logged in yet, and when it must have
+struct PendingLogin {
+    int64_t deadlineMs;
+    weak_ptr<CampusConnection> conn;
+};
+
+struct UringRing;
+struct UringConnection;
+
+// One reactor shard: an event loop with its own SO_REUSEPORT listener. It
+// accepts, authenticates and serves its connections, and other threads
+// reach them only through its mailbox.
+struct IoWorker {
+    int epollFd;                    // -1 on an io_uring shard
+    int wakeFd;                     // eventfd signalled when the mailbox gets work
+    SOCKET listenSocket;
+    Mailbox mailbox;
+    atomic<bool> wakePending;
+    deque<PendingLogin> logins;     // in deadline order (the timeout is fixed)
+    multimap<int64_t, weak_ptr<CampusConnection> > throttled;  // paused readers by resume time
+    vector<MailboxItem*> checkedLogins;     // verdicts to act on outside a nested drain
+    UringRing* ring;                // io_uring shard only
+    vector<UringConnection*> flushes;   // connections with a send or a release due (io_uring)
+    uint64_t wakeValue;             // where the io_uring shard reads its eventfd
+    thread loopThread;
+    
+    IoWorker() : epollFd(-1), wakeFd(-1), listenSocket(INVALID_SOCKET), wakePending(false), ring(NULL), wakeValue(0) {}
+};
+
+vector<IoWorker*> ioWorkers;
+thread_local IoWorker* currentWorker = NULL;
+
+// epoll tags of a shard's own descriptors; connections use their handle
+char listenTag, wakeTag;
+
+#ifdef NU_IO_URING
+void updateUringInterest(CampusConnection* conn, bool wantWrite);
+void closeUringConnection(CampusConnection* conn);
+#endif
+
+void updateInterest(CampusConnection* conn, bool wantWrite) {
+#ifdef NU_IO_URING
+    if (conn->worker->ring != NULL) {
+        updateUringInterest(conn, wantWrite);
+        return;
+    }
+#endif
+    epoll_event ev;
+    ev.events = (conn->readPaused ? 0u : (uint32_t)(EPOLLIN | EPOLLRDHUP)) | (wantWrite ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = conn->ioTag;
+    epoll_ctl(conn->worker->epollFd, EPOLL_CTL_MOD, conn->socket, &ev);
+    metrics.ioSyscalls.add();
+}
+
+void postMailboxItem(IoWorker* worker, MailboxItem* item) {
+    worker->mailbox.push(item);
+    // One wakeup per batch: the shard clears the flag before it drains
+    if (!worker->wakePending.exchange(true)) {
+        uint64_t one = 1;
+        metrics.ioSyscalls.add();
+        if (write(worker->wakeFd, &one, sizeof(one)) < 0) {
+            LOG(LOG_WARN, "Failed to wake I/O shard");
+        }
+    }
+}
+
+// Hand a frame to the shard that owns conn. Room is reserved up front, so
+// a full queue is still reported to the caller under --overflow=reject.
+EnqueueResult postFrame(CampusConnection* conn, const OutFrame& frame) {
+    OutboundQueue& q = conn->outbound;
+    if (q.closed) return QUEUE_CLOSED;
+    
+    size_t count = q.queuedCount.fetch_add(1) + 1;
+    size_t bytes = q.queuedBytes.fetch_add(frame->size()) + frame->size();
+    if (serverConfig.overflowPolicy == OVERFLOW_REJECT &&
+        (count > serverConfig.queueLimit || bytes > serverConfig.queueByteLimit)) {
+        q.queuedCount--;
+        q.queuedBytes -= frame->size();
+        return QUEUE_REJECTED;
+    }
+    
+    MailboxItem* item = new MailboxItem;
+    item->kind = MAIL_FRAME;
+    item->conn = conn->shared_from_this();
+    item->frame = frame;
+    postMailboxItem(conn->worker, item);
+    return ENQUEUED;
+}
+
+// Ask conn's shard to top up its credit
+void postCreditCheck(const shared_ptr<CampusConnection>& conn) {
+    MailboxItem* item = new MailboxItem;
+    item->kind = MAIL_CREDIT;
+    item->conn = conn;
+    postMailboxItem(conn->worker, item);
+}
+
+// Move posted frames onto their connections' queues (owning shard only).
+// Login verdicts are only collected: a drain nested in routing must not
+// admit a campus, so the event loop acts on them via finishCheckedLogins().
+void drainMailbox(IoWorker* worker) {
+    while (MailboxItem* item = worker->mailbox.pop()) {
+        if (item->kind == MAIL_FRAME) {
+            queueFrame(item->conn.get(), item->frame, true);
+        } else if (item->kind == MAIL_CREDIT) {
+            topUpCredit(item->conn.get());
+        } else {
+            worker->checkedLogins.push_back(item);
+            continue;
+        }
+        delete item;
+    }
+}
+
+// Retire the frames a write of sent bytes completed, and advance into the
+// one it ended in. Call with the queue lock held.
+void retireSent(CampusConnection* conn, size_t sent) {
+    OutboundQueue& q = conn->outbound;
+    size_t remaining = sent;
+    while (remaining > 0 && !q.frames.empty()) {
+        size_t left = q.frames.front()->size() - q.sentOffset;
+        if (remaining < left) {
+            q.sentOffset += remaining;
+            break;
+        }
+        remaining -= left;
+        q.queuedCount--;
+        q.queuedBytes -= q.frames.front()->size();
+        retireFrame(conn, q.frames.front());
+        q.frames.pop_front();
+        q.sentOffset = 0;
+    }
+}
+
+// Write queued frames with non-blocking gathered sends until the queue is
+// empty or the socket is full; false means the connection is broken
+bool drainOutbound(CampusConnection* conn) {
+    const int MAX_IOV = 64;
+    OutboundQueue& q = conn->outbound;
+    lock_guard<mutex> lock(q.lock);
+    
+    while (!q.frames.empty()) {
+        iovec iov[MAX_IOV];
+        int count = 0;
+        for (size_t i = 0; i < q.frames.size() && count < MAX_IOV; i++, count++) {
+            const FrameBuffer& frame = *q.frames[i];
+            size_t offset = (i == 0) ? q.sentOffset : 0;
+            iov[count].iov_base = (void*)(&frame[0] + offset);
+            iov[count].iov_len = frame.size() - offset;
+        }
+        
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(conn->socket, &msg, MSG_NOSIGNAL);
+        metrics.ioSyscalls.add();
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        metrics.bytesOut.add(sent);
+        retireSent(conn, sent);
+    }
+    
+    if (q.writeArmed) {
+        q.writeArmed = false;
+        updateInterest(conn, false);
+    }
+    return true;
+}
+
+// Accept everything pending on the shard's listener; each new connection
+// starts in the login handshake
+void acceptConnections(IoWorker* worker) {
+    while (true) {
+        SOCKET clientSocket = accept4(worker->listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        metrics.ioSyscalls.add();
+        if (clientSocket == INVALID_SOCKET) {
+            if (errno == EINTR) continue;
+            return;     // EAGAIN, or out of descriptors until one is closed
+        }
+        if (shutdownPhase.load() != SHUTDOWN_NONE) {
+            closesocket(clientSocket);
+            continue;
+        }
+        metrics.accepts.add();
+        
+        shared_ptr<CampusConnection> conn = make_shared<CampusConnection>();
+        conn->socket = clientSocket;
+        conn->buffer = new RecvBuffer;
+        conn->worker = worker;
+        conn->acceptedNs = metricClockNs();
+        shared_ptr<CampusConnection>* handle = new shared_ptr<CampusConnection>(conn);
+        conn->ioTag = handle;
+        
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = handle;
+        if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, clientSocket, &ev) < 0) {
+            closesocket(clientSocket);
+            delete handle;
+            continue;
+        }
+        PendingLogin login = {monotonicMs() + serverConfig.authTimeoutSec * 1000, conn};
+        worker->logins.push_back(login);
+    }
+}
+
+void queueLoginReply(CampusConnection* conn, const OutFrame& reply) {
+    OutboundQueue& q = conn->outbound;
+    lock_guard<mutex> lock(q.lock);
+    q.frames.push_front(reply);
+    q.queuedCount++;
+    q.queuedBytes += reply->size();
+    if (!q.writeArmed) {
+        q.writeArmed = true;
+        updateInterest(conn, true);
+    }
+}
+
+// ---- Password checks ----
+//
+// PBKDF2 is slow on purpose, a few milliseconds per login, and a shard
+// that hashed inline would stall every connection it serves for each one.
+// The shard hands the password to the auth workers and stops reading the
+// connection; the verdict comes back through the shard's mailbox and the
+// handshake goes on from there. A connection that times out or hangs up
+// meanwhile is closed as usual and its verdict ignored. The thread-per-
+// campus model hashes on the connection's own thread.
+
+// A password waiting for, or checked by, an auth worker
+struct AuthCheck {
+    weak_ptr<CampusConnection> conn;
+    string endpoint;
+    string password;
+    uint32_t seq;               // of the auth frame, for the reply
+    bool accepted;
+    uint16_t campusId;          // set when accepted
+};
+
+mutex authQueueMutex;
+condition_variable authQueueReady;
+deque<AuthCheck*> authQueue;
+
+// Auth worker: hash queued passwords and post each verdict to the shard
+// that owns the connection
+void authWorker() {
+    while (true) {
+        AuthCheck* check;
+        {
+            unique_lock<mutex> lock(authQueueMutex);
+            authQueueReady.wait(lock, [] { return !authQueue.empty(); });
+            check = authQueue.front();
+            authQueue.pop_front();
+        }
+        // Logins that timed out in the queue are not worth hashing
+        if (!check->conn.expired()) {
+            check->accepted = verifyCredentials(check->endpoint, check->password, check->campusId);
+        }
+        shared_ptr<CampusConnection> conn = check->conn.lock();
+        if (!conn) {
+            delete check;   // dropped before the check finished
+            continue;
+        }
+        MailboxItem* item = new MailboxItem;
+        item->kind = MAIL_LOGIN;
+        item->conn = conn;
+        item->check = check;
+        postMailboxItem(conn->worker, item);
+    }
+}
+
+void startAuthWorkers() {
+    for (int i = 0; i < serverConfig.authThreads; i++) thread(authWorker).detach();
+}
+
+void setReadPaused(CampusConnection* conn, bool paused);
+
+// Queue conn's password for an auth worker and leave the rest of what it
+// sent unread until the verdict is back
+void checkPassword(CampusConnection* conn, uint32_t seq, const string& password) {
+    setReadPaused(conn, true);
+    AuthCheck* check = new AuthCheck;
+    check->conn = conn->shared_from_this();
+    check->endpoint = conn->endpoint;
+    check->password = password;
+    check->seq = seq;
+    check->accepted = false;
+    check->campusId = 0;
+    {
+        lock_guard<mutex> lock(authQueueMutex);
+        authQueue.push_back(check);
+    }
+    authQueueReady.notify_one();
+}
+
+bool finishLogin(CampusConnection* conn, uint32_t seq, AuthStatus status);
+
+// Advance the login handshake after new bytes arrived; false means the
+// connection must be dropped
+bool continueLogin(CampusConnection* conn) {
+    // A password check is out; later bytes wait for its verdict
+    if (conn->readPaused) return true;
+    uint32_t seq = 0;
+    string password;
+    AuthStatus status = checkAuthFrame(conn, seq, &password);
+    if (status == AUTH_INCOMPLETE) return true;
+    if (status == AUTH_CHECKING) {
+        checkPassword(conn, seq, password);
+        return true;
+    }
+    return finishLogin(conn, seq, status);
+}
+
+// Admit or refuse a login whose credentials have been checked
+bool finishLogin(CampusConnection* conn, uint32_t seq, AuthStatus status) {
+    const char* refusal = status == AUTH_ACCEPTED ? admitCampus(conn) : loginRefusal(status);
+    if (refusal != NULL) {
+        // Best effort: a client that does not read its reply just gets closed
+        loginFailed(status);
+        closeOutboundQueue(conn);   // hands a resumed session back
+        OutFrame reply = makeTextFrame(FRAME_AUTH_REPLY, seq, refusal);
+        send(conn->socket, &(*reply)[0], reply->size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        metrics.ioSyscalls.add();
+        return false;
+    }
+    
+    // Other threads only reach this connection through the mailbox, which
+    // is drained after this returns, so only frames replayed into a resumed
+    // session can be queued already; the reply goes ahead of them
+    queueLoginReply(conn, makeAuthReply(conn, seq));
+    kickStoreWorker();
+    // Route anything the client pipelined behind its auth frame
+    return processFrames(conn);
+}
+
+// Close a connection that has not logged in; it was never published
+void dropLogin(CampusConnection* conn) {
+    conn->outbound.closed = true;   // a password check still out finds it gone
+#ifdef NU_IO_URING
+    if (conn->worker->ring != NULL) {
+        closeUringConnection(conn);
+        return;
+    }
+#endif
+    closesocket(conn->socket);
+    delete static_cast<shared_ptr<CampusConnection>*>(conn->ioTag);
+}
+
+// Close a shard's connection, logged in or not, and release its handle
+void dropConnection(CampusConnection* conn) {
+    if (!conn->authenticated) {
+        dropLogin(conn);
+        return;
+    }
+#ifdef NU_IO_URING
+    if (conn->worker->ring != NULL) {
+        closeUringConnection(conn);
+        return;
+    }
+#endif
+    shared_ptr<CampusConnection>* handle = static_cast<shared_ptr<CampusConnection>*>(conn->ioTag);
+    // close() also removes the socket from the epoll set
+    closeCampusConnection(conn);
+    delete handle;
+}
+
+// Stop or restart reading a throttled connection, keeping EPOLLOUT as is
+void setReadPaused(CampusConnection* conn, bool paused) {
+    OutboundQueue& q = conn->outbound;
+    lock_guard<mutex> lock(q.lock);
+    conn->readPaused = paused;
+    updateInterest(conn, q.writeArmed);
+}
+
+// processFrames() hit a rate limit: leave the socket unread until then
+void pauseReading(IoWorker* worker, CampusConnection* conn) {
+    if (conn->readPaused) return;   // already waiting for a wakeup
+    setReadPaused(conn, true);
+    worker->throttled.insert(make_pair(conn->throttledUntilMs, weak_ptr<CampusConnection>(conn->shared_from_this())));
+}
+
+// Resume connections whose pause is over: route what they had buffered and
+// read again unless they are still over the limit. Returns the epoll_wait
+// timeout until the next pause ends (-1 = none).
+int resumeThrottled(IoWorker* worker) {
+    int64_t now = monotonicMs();
+    while (!worker->throttled.empty()) {
+        multimap<int64_t, weak_ptr<CampusConnection> >::iterator first = worker->throttled.begin();
+        if (first->first > now) return (int)(first->first - now);
+        shared_ptr<CampusConnection> conn = first->second.lock();
+        worker->throttled.erase(first);
+        if (!conn || conn->outbound.closed) continue;
+        
+        // Readers held by a draining server are closed with the rest
+        if (shutdownPhase.load() == SHUTDOWN_CLOSING || !processFrames(conn.get())) {
+            dropConnection(conn.get());
+        } else if (conn->throttledUntilMs > 0) {
+            worker->throttled.insert(make_pair(conn->throttledUntilMs, weak_ptr<CampusConnection>(conn)));
+        } else {
+            setReadPaused(conn.get(), false);
+        }
+    }
+    return -1;
+}
+
+// Drop connections that did not log in before their deadline; returns the
+// epoll_wait timeout until the next deadline (-1 = none)
+int expireLogins(IoWorker* worker) {
+    int64_t now = monotonicMs();
+    while (!worker->logins.empty()) {
+        PendingLogin& front = worker->logins.front();
+        shared_ptr<CampusConnection> conn = front.conn.lock();
+        if (conn && !conn->authenticated) {
+            if (front.deadlineMs > now) return (int)(front.deadlineMs - now);
+            metrics.handshakeTimeouts.add();
+            loginFailed(AUTH_INCOMPLETE);
+            dropLogin(conn.get());
+        }
+        worker->logins.pop_front();
+    }
+    return -1;
+}
+
+// Act on the password checks the mailbox brought back
+void finishCheckedLogins(IoWorker* worker) {
+    for (size_t i = 0; i < worker->checkedLogins.size(); i++) {
+        MailboxItem* item = worker->checkedLogins[i];
+        CampusConnection* conn = item->conn.get();
+        AuthCheck* check = item->check;
+        if (!conn->outbound.closed) {
+            if (check->accepted) conn->campusId = check->campusId;
+            setReadPaused(conn, false);
+            bool alive = finishLogin(conn, check->seq, check->accepted ? AUTH_ACCEPTED : AUTH_REJECTED);
+            if (!alive) {
+                dropConnection(conn);
+            } else if (conn->throttledUntilMs > 0) {
+                pauseReading(worker, conn);
+            }
+        }
+        delete check;
+        delete item;
+    }
+    worker->checkedLogins.clear();
+}
+
+// Event loop: accept and authenticate new connections, read ready campus
+// sockets, route what they sent and flush their outbound queues
+void ioWorkerLoop(IoWorker* worker) {
+    const int MAX_EVENTS = 256;
+    epoll_event events[MAX_EVENTS];
+    currentWorker = worker;
+    countThreadAllocations();
+    
+    while (true) {
+        int loginWait = expireLogins(worker);
+        int throttleWait = resumeThrottled(worker);
+        int timeout = loginWait < 0 ? throttleWait : throttleWait < 0 ? loginWait : min(loginWait, throttleWait);
+        int ready = epoll_wait(worker->epollFd, events, MAX_EVENTS, timeout);
+        metrics.ioSyscalls.add();
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            LOG(LOG_ERROR, "epoll_wait failed, I/O worker stopping");
+            return;
+        }
+        
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == &listenTag) {
+                acceptConnections(worker);
+                continue;
+            }
+            if (events[i].data.ptr == &wakeTag) {
+                uint64_t wakeups;
+                metrics.ioSyscalls.add();
+                if (read(worker->wakeFd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+                    LOG(LOG_WARN, "Failed to read I/O shard wakeup");
+                }
+                worker->wakePending.store(false);
+                drainMailbox(worker);
+                continue;
+            }
+            
+            shared_ptr<CampusConnection>* handle = static_cast<shared_ptr<CampusConnection>*>(events[i].data.ptr);
+            CampusConnection* conn = handle->get();
+            bool alive = true;
+            
+            if (events[i].events & EPOLLOUT) {
+                alive = drainOutbound(conn);
+            }
+            
+            if (alive && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                RecvBuffer& buffer = *conn->buffer;
+                char* space = buffer.writePtr();
+                int bytesReceived = recv(conn->socket, space, buffer.writeSpace(), 0);
+                metrics.ioSyscalls.add();
+                
+                if (bytesReceived > 0) {
+                    buffer.commit(bytesReceived);
+                    metrics.bytesIn.add(bytesReceived);
+                    alive = conn->authenticated ? processFrames(conn) : continueLogin(conn);
+                    if (alive && conn->throttledUntilMs > 0) pauseReading(worker, conn);
+                } else if (bytesReceived == 0 ||
+                           (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    alive = false;
+                }
+            }
+            
+            if (!alive) dropConnection(conn);
+        }
+        // Only once the batch is done: a refused login frees its handle,
+        // which later events of the batch may still point at
+        finishCheckedLogins(worker);
+    }
+}
+
+#ifdef NU_IO_URING
+// ---- io_uring engine ----
+//
+// --io=uring runs the same shards as the epoll reactor, driven by an
+// io_uring per shard instead of readiness events. Each connection keeps one
+// multishot receive armed for its whole life; the kernel fills buffers from
+// a ring the shard registered up front, and the shard copies them into the
+// connection's RecvBuffer and hands them straight back. Writes are gathered
+// sends of the queued frames, one in flight per connection. Accepts are
+// multishot as well and the mailbox eventfd is read through the ring.
+// Everything a pass of the loop prepared is submitted by the same
+// io_uring_enter that waits for the next completions, so a busy shard makes
+// one system call per pass where epoll needs a recv, a sendmsg and two
+// epoll_ctl calls per connection.
+
+const unsigned URING_ENTRIES = 1024;        // submission queue slots per shard
+const unsigned URING_BUFFERS = 256;         // receive buffers per shard, a power of two
+const size_t URING_BUFFER_SIZE = 8192;
+const int URING_MAX_IOV = 64;               // frames gathered into one send
+
+// user_data of the shard's own requests
+const uint64_t URING_ACCEPT = 1;
+const uint64_t URING_WAKE = 2;
+const uint64_t URING_IGNORE = 3;            // cancellations
+// A connection's requests carry its state pointer, with the kind in the low bits
+const uint64_t URING_RECV = 0;
+const uint64_t URING_SEND = 1;
+const uint64_t URING_KIND_MASK = 7;
+
+// A ring mapped into this process, with one group (0) of provided buffers
+struct UringRing {
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;       // slots filled; published to *sqTail on entering
+    io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+    void* ringMap;
+    size_t ringMapSize;
+    void* cqMap;                // ringMap itself with IORING_FEAT_SINGLE_MMAP
+    size_t cqMapSize;
+    size_t sqeMapSize;
+    io_uring_buf_ring* bufferRing;
+    char* buffers;
+    unsigned bufferCount;
+    size_t bufferSize;
+    uint16_t bufferTail;
+    
+    UringRing() : fd(-1), sqHead(NULL), sqTail(NULL), sqMask(0), sqEntries(0), sqLocalTail(0), sqes(NULL),
+                  cqHead(NULL), cqTail(NULL), cqMask(0), cqes(NULL), ringMap(NULL), ringMapSize(0), cqMap(NULL),
+                  cqMapSize(0), sqeMapSize(0), bufferRing(NULL), buffers(NULL), bufferCount(0), bufferSize(0),
+                  bufferTail(0) {}
+};
+
+void uringClose(UringRing& ring) {
+    if (ring.sqes != NULL) munmap(ring.sqes, ring.sqeMapSize);
+    if (ring.cqMap != NULL && ring.cqMap != ring.ringMap) munmap(ring.cqMap, ring.cqMapSize);
+    if (ring.ringMap != NULL) munmap(ring.ringMap, ring.ringMapSize);
+    if (ring.fd >= 0) close(ring.fd);
+    // The kernel lets go of the buffers with the ring
+    if (ring.bufferRing != NULL) munmap(ring.bufferRing, ring.bufferCount * sizeof(io_uring_buf));
+    if (ring.buffers != NULL) munmap(ring.buffers, ring.bufferCount * ring.bufferSize);
+    ring = UringRing();
+}
+
+void* mapRing(int fd, size_t size, off_t offset) {
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+// Create a ring and map its queues; false if the kernel refuses or cannot
+// bound a wait (IORING_FEAT_EXT_ARG, Linux 5.11)
+bool uringOpen(UringRing& ring, unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+#ifdef IORING_SETUP_COOP_TASKRUN
+    // Completions are only collected when the shard enters the kernel anyway
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+#endif
+    ring.fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd < 0 && errno == EINVAL && params.flags != 0) {
+        memset(&params, 0, sizeof(params));
+        ring.fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring.fd < 0) return false;
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        uringClose(ring);
+        return false;
+    }
+    
+    ring.ringMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) ring.ringMapSize = ring.cqMapSize = max(ring.ringMapSize, ring.cqMapSize);
+    ring.ringMap = mapRing(ring.fd, ring.ringMapSize, IORING_OFF_SQ_RING);
+    ring.cqMap = single ? ring.ringMap : mapRing(ring.fd, ring.cqMapSize, IORING_OFF_CQ_RING);
+    ring.sqeMapSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring.sqes = static_cast<io_uring_sqe*>(mapRing(ring.fd, ring.sqeMapSize, IORING_OFF_SQES));
+    if (ring.ringMap == NULL || ring.cqMap == NULL || ring.sqes == NULL) {
+        uringClose(ring);
+        return false;
+    }
+    
+    char* sq = static_cast<char*>(ring.ringMap);
+    ring.sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring.sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring.sqEntries = params.sq_entries;
+    ring.sqLocalTail = *ring.sqTail;
+    // Slots are filled in order, so the index array is fixed
+    unsigned* slots = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < ring.sqEntries; i++) slots[i] = i;
+    char* cq = static_cast<char*>(ring.cqMap);
+    ring.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring.cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Hand a receive buffer back to the kernel
+void uringRecycleBuffer(UringRing& ring, uint16_t id) {
+    // Indexed by hand: in C++ the header's flexible bufs[] array starts one
+    // entry late. Only addr, len and bid are written, as the first entry's
+    // last field is the ring tail.
+    io_uring_buf& entry = reinterpret_cast<io_uring_buf*>(ring.bufferRing)[ring.bufferTail & (ring.bufferCount - 1)];
+    entry.addr = (uint64_t)(uintptr_t)(ring.buffers + id * ring.bufferSize);
+    entry.len = (uint32_t)ring.bufferSize;
+    entry.bid = id;
+    __atomic_store_n(&ring.bufferRing->tail, ++ring.bufferTail, __ATOMIC_RELEASE);
+}
+
+// Register count buffers of size bytes as buffer group 0 (Linux 5.19)
+bool uringAddBuffers(UringRing& ring, unsigned count, size_t size) {
+    void* entries = mmap(NULL, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* data = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.bufferRing = entries == MAP_FAILED ? NULL : static_cast<io_uring_buf_ring*>(entries);
+    ring.buffers = data == MAP_FAILED ? NULL : static_cast<char*>(data);
+    ring.bufferCount = count;
+    ring.bufferSize = size;
+    if (ring.bufferRing == NULL || ring.buffers == NULL) return false;
+    
+    io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t)(uintptr_t)ring.bufferRing;
+    registration.ring_entries = count;
+    registration.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) return false;
+    for (unsigned i = 0; i < count; i++) uringRecycleBuffer(ring, (uint16_t)i);
+    return true;
+}
+
+// Submit the filled slots and wait for waitFor completions, at most
+// timeoutMs (-1 = no limit); false on errors other than a timeout
+bool uringEnter(UringRing& ring, unsigned waitFor, int timeoutMs) {
+    __atomic_store_n(ring.sqTail, ring.sqLocalTail, __ATOMIC_RELEASE);
+    unsigned submit = ring.sqLocalTail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+    if (submit == 0 && waitFor == 0) return true;
+    
+    io_uring_getevents_arg wait;
+    __kernel_timespec limit;
+    memset(&wait, 0, sizeof(wait));
+    if (timeoutMs >= 0) {
+        limit.tv_sec = timeoutMs / 1000;
+        limit.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+        wait.ts = (uint64_t)(uintptr_t)&limit;
+    }
+    unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    metrics.ioSyscalls.add();
+    long result = syscall(__NR_io_uring_enter, ring.fd, submit, waitFor, flags,
+                          waitFor > 0 ? &wait : NULL, waitFor > 0 ? sizeof(wait) : 0);
+    return result >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY;
+}
+
+// Next submission slot, cleared; a full queue is submitted first
+io_uring_sqe* uringSqe(UringRing& ring, uint8_t opcode, int fd, uint64_t userData) {
+    while (ring.sqLocalTail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) >= ring.sqEntries) {
+        if (!uringEnter(ring, 0, -1)) this_thread::yield();
+    }
+    io_uring_sqe* sqe = &ring.sqes[ring.sqLocalTail++ & ring.sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = userData;
+    return sqe;
+}
+
+// Oldest unread completion, or NULL; uringSeen() releases its slot
+io_uring_cqe* uringPeek(UringRing& ring) {
+    unsigned head = *ring.cqHead;
+    if (head == __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring.cqes[head & ring.cqMask];
+}
+
+void uringSeen(UringRing& ring) {
+    __atomic_store_n(ring.cqHead, *ring.cqHead + 1, __ATOMIC_RELEASE);
+}
+
+// A receive that takes buffers from group 0 until it is cancelled or fails
+void prepareMultishotRecv(io_uring_sqe* sqe) {
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+}
+
+// Whether this kernel runs what the engine needs: bounded waits, provided
+// buffer rings and multishot receive (Linux 6.0), and io_uring is allowed
+bool uringSupported() {
+    UringRing ring;
+    int pair[2] = {-1, -1};
+    bool ok = uringOpen(ring, 8) && uringAddBuffers(ring, 8, 64) && socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0;
+    if (ok) {
+        prepareMultishotRecv(uringSqe(ring, IORING_OP_RECV, pair[0], URING_RECV));
+        ok = write(pair[1], "x", 1) == 1 && uringEnter(ring, 1, 1000);
+        io_uring_cqe* cqe = ok ? uringPeek(ring) : NULL;
+        ok = cqe != NULL && cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) && (cqe->flags & IORING_CQE_F_BUFFER);
+    }
+    if (pair[0] >= 0) close(pair[0]);
+    if (pair[1] >= 0) close(pair[1]);
+    uringClose(ring);
+    return ok;
+}
+
+// A connection on an io_uring shard. The state outlives the socket until
+// the kernel has completed every request that points at it.
+struct UringConnection {
+    shared_ptr<CampusConnection> conn;
+    int pending;                // requests in flight, plus one while on the flush list
+    bool receiving;             // the multishot receive is armed
+    bool sending;
+    bool flushQueued;
+    bool closing;
+    msghdr message;
+    iovec iov[URING_MAX_IOV];
+    OutFrame frames[URING_MAX_IOV];     // what the send in flight points into
+    
+    UringConnection() : pending(0), receiving(false), sending(false), flushQueued(false), closing(false) {}
+};
+
+uint64_t uringTag(UringConnection* uc, uint64_t kind) {
+    return (uint64_t)(uintptr_t)uc | kind;
+}
+
+void armUringRecv(IoWorker* worker, UringConnection* uc) {
+    prepareMultishotRecv(uringSqe(*worker->ring, IORING_OP_RECV, uc->conn->socket, uringTag(uc, URING_RECV)));
+    uc->receiving = true;
+    uc->pending++;
+}
+
+// Have the next flush pass look at the connection
+void queueUringFlush(IoWorker* worker, UringConnection* uc) {
+    if (uc->flushQueued) return;
+    uc->flushQueued = true;
+    uc->pending++;
+    worker->flushes.push_back(uc);
+}
+
+// Free the state of a closed connection once nothing refers to it
+void finishUringConnection(UringConnection* uc) {
+    if (!uc->closing || uc->pending > 0) return;
+    uc->conn->ioTag = NULL;
+    delete uc;
+}
+
+// The io_uring side of updateInterest(): a send is started by the next
+// flush pass, and a paused reader has its receive cancelled. Bytes the
+// receive delivers before the cancel lands stay in the buffer.
+void updateUringInterest(CampusConnection* conn, bool wantWrite) {
+    UringConnection* uc = static_cast<UringConnection*>(conn->ioTag);
+    if (uc == NULL || uc->closing) return;
+    if (wantWrite && !uc->sending) queueUringFlush(conn->worker, uc);
+    if (conn->readPaused && uc->receiving) {
+        io_uring_sqe* sqe = uringSqe(*conn->worker->ring, IORING_OP_ASYNC_CANCEL, -1, URING_IGNORE);
+        sqe->addr = uringTag(uc, URING_RECV);
+    } else if (!conn->readPaused && !uc->receiving) {
+        armUringRecv(conn->worker, uc);
+    }
+}
+
+// Shut the socket down, which ends the requests in flight, and close it.
+// The state goes once they have completed.
+void closeUringConnection(CampusConnection* conn) {
+    UringConnection* uc = static_cast<UringConnection*>(conn->ioTag);
+    if (uc->closing) return;
+    uc->closing = true;
+    shutdown(conn->socket, SHUT_RDWR);
+    if (conn->authenticated) {
+        closeCampusConnection(conn);
+    } else {
+        closesocket(conn->socket);
+    }
+    // Nothing may be in flight (a paused reader); the flush pass checks
+    queueUringFlush(conn->worker, uc);
+}
+
+// Gather the front of the outbound queue into one send
+void submitUringSend(IoWorker* worker, UringConnection* uc) {
+    CampusConnection* conn = uc->conn.get();
+    OutboundQueue& q = conn->outbound;
+    int count = 0;
+    {
+        lock_guard<mutex> lock(q.lock);
+        for (size_t i = 0; i < q.frames.size() && count < URING_MAX_IOV; i++, count++) {
+            const FrameBuffer& frame = *q.frames[i];
+            size_t offset = (i == 0) ? q.sentOffset : 0;
+            uc->iov[count].iov_base = (void*)(&frame[0] + offset);
+            uc->iov[count].iov_len = frame.size() - offset;
+            uc->frames[count] = q.frames[i];
+        }
+        // queueFrame() leaves these in place until the send completes
+        q.sendingCount = count;
+        if (count == 0) q.writeArmed = false;
+    }
+    if (count == 0) return;
+    
+    memset(&uc->message, 0, sizeof(uc->message));
+    uc->message.msg_iov = uc->iov;
+    uc->message.msg_iovlen = count;
+    io_uring_sqe* sqe = uringSqe(*worker->ring, IORING_OP_SENDMSG, conn->socket, uringTag(uc, URING_SEND));
+    sqe->addr = (uint64_t)(uintptr_t)&uc->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    uc->sending = true;
+    uc->pending++;
+}
+
+// A send finished: retire what it wrote and send the rest
+void completeUringSend(IoWorker* worker, UringConnection* uc, int result) {
+    CampusConnection* conn = uc->conn.get();
+    OutboundQueue& q = conn->outbound;
+    uc->sending = false;
+    uc->pending--;
+    bool more;
+    {
+        lock_guard<mutex> lock(q.lock);
+        q.sendingCount = 0;
+        // A closed queue was emptied (or handed to its session) meanwhile
+        if (result > 0 && !q.closed) retireSent(conn, result);
+        more = result >= 0 && !q.closed && !q.frames.empty();
+        if (!more) q.writeArmed = false;
+    }
+    if (result > 0) metrics.bytesOut.add(result);
+    for (int i = 0; i < URING_MAX_IOV && uc->frames[i]; i++) uc->frames[i] = OutFrame();
+    
+    if (result < 0) {
+        closeUringConnection(conn);
+    } else if (more && !uc->closing) {
+        submitUringSend(worker, uc);
+    }
+}
+
+// Data (or the end) from a connection's multishot receive
+void completeUringRecv(IoWorker* worker, UringConnection* uc, int result, uint32_t flags) {
+    CampusConnection* conn = uc->conn.get();
+    if (!(flags & IORING_CQE_F_MORE)) {
+        uc->receiving = false;
+        uc->pending--;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        if (result > 0 && !uc->closing) {
+            RecvBuffer& buffer = *conn->buffer;
+            memcpy(buffer.writePtr(result), worker->ring->buffers + id * URING_BUFFER_SIZE, result);
+            buffer.commit(result);
+            metrics.bytesIn.add(result);
+        }
+        uringRecycleBuffer(*worker->ring, id);
+    }
+    if (uc->closing) return;
+    
+    if (result > 0) {
+        // A paused reader's bytes wait for resumeThrottled()
+        if (conn->readPaused) return;
+        bool alive = conn->authenticated ? processFrames(conn) : continueLogin(conn);
+        if (!alive) {
+            dropConnection(conn);
+            return;
+        }
+        if (conn->throttledUntilMs > 0) pauseReading(worker, conn);
+    } else if (result != -ENOBUFS && result != -ECANCELED) {
+        // End of stream or a socket error
+        dropConnection(conn);
+        return;
+    }
+    // The kernel ends a multishot receive when buffers run out or on cancel
+    if (!uc->receiving && !conn->readPaused) armUringRecv(worker, uc);
+}
+
+void armUringAccept(IoWorker* worker) {
+    io_uring_sqe* sqe = uringSqe(*worker->ring, IORING_OP_ACCEPT, worker->listenSocket, URING_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void armUringWake(IoWorker* worker) {
+    io_uring_sqe* sqe = uringSqe(*worker->ring, IORING_OP_READ, worker->wakeFd, URING_WAKE);
+    sqe->addr = (uint64_t)(uintptr_t)&worker->wakeValue;
+    sqe->len = sizeof(worker->wakeValue);
+}
+
+// A new connection starts in the login handshake, like acceptConnections()
+void adoptUringConnection(IoWorker* worker, SOCKET clientSocket) {
+    if (shutdownPhase.load() != SHUTDOWN_NONE) {
+        closesocket(clientSocket);
+        return;
+    }
+    metrics.accepts.add();
+    shared_ptr<CampusConnection> conn = make_shared<CampusConnection>();
+    conn->socket = clientSocket;
+    conn->buffer = new RecvBuffer;
+    conn->worker = worker;
+    conn->acceptedNs = metricClockNs();
+    UringConnection* uc = new UringConnection;
+    uc->conn = conn;
+    conn->ioTag = uc;
+    armUringRecv(worker, uc);
+    PendingLogin login = {monotonicMs() + serverConfig.authTimeoutSec * 1000, conn};
+    worker->logins.push_back(login);
+}
+
+// Start the sends this pass queued frames for, and free closed connections
+// the kernel is done with
+void flushUring(IoWorker* worker) {
+    for (size_t i = 0; i < worker->flushes.size(); i++) {
+        UringConnection* uc = worker->flushes[i];
+        uc->flushQueued = false;
+        uc->pending--;
+        if (!uc->closing && !uc->sending) submitUringSend(worker, uc);
+        finishUringConnection(uc);
+    }
+    worker->flushes.clear();
+}
+
+// Event loop of an io_uring shard; the counterpart of ioWorkerLoop()
+void uringWorkerLoop(IoWorker* worker) {
+    UringRing& ring = *worker->ring;
+    currentWorker = worker;
+    countThreadAllocations();
+    armUringAccept(worker);
+    armUringWake(worker);
+    
+    while (true) {
+        int loginWait = expireLogins(worker);
+        int throttleWait = resumeThrottled(worker);
+        int timeout = loginWait < 0 ? throttleWait : throttleWait < 0 ? loginWait : min(loginWait, throttleWait);
+        flushUring(worker);
+        if (!uringEnter(ring, 1, timeout)) {
+            LOG(LOG_ERROR, "io_uring_enter failed, I/O worker stopping");
+            return;
+        }
+        
+        io_uring_cqe* cqe;
+        while ((cqe = uringPeek(ring)) != NULL) {
+            uint64_t tag = cqe->user_data;
+            int result = cqe->res;
+            uint32_t flags = cqe->flags;
+            uringSeen(ring);
+            
+            if (tag == URING_ACCEPT) {
+                if (result >= 0) adoptUringConnection(worker, result);
+                if (!(flags & IORING_CQE_F_MORE)) armUringAccept(worker);
+            } else if (tag == URING_WAKE) {
+                worker->wakePending.store(false);
+                drainMailbox(worker);
+                finishCheckedLogins(worker);
+                armUringWake(worker);
+            } else if (tag != URING_IGNORE) {
+                UringConnection* uc = reinterpret_cast<UringConnection*>((uintptr_t)(tag & ~URING_KIND_MASK));
+                if ((tag & URING_KIND_MASK) == URING_SEND) {
+                    completeUringSend(worker, uc, result);
+                } else {
+                    completeUringRecv(worker, uc, result, flags);
+                }
+                finishUringConnection(uc);
+            }
+        }
+    }
+}
+#endif
+#endif
+
+// Listening TCP socket on the server port. With reusePort several sockets can
+// bind the port and the kernel spreads new connections across them.
+SOCKET openListener(bool reusePort) {
+    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket == INVALID_SOCKET) {
+        LOG(LOG_ERROR, "Failed to create TCP socket");
+        return INVALID_SOCKET;
+    }
+    
+    // Allow port reuse
+    int opt = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reusePort && setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, (char*)&opt, sizeof(opt)) < 0) {
+        closesocket(serverSocket);
+        return INVALID_SOCKET;
+    }
+#endif
+    
+    sockaddr_in serverAddr;
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(serverConfig.tcpPort);
+    
+    if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+        LOG(LOG_ERROR, "TCP Bind failed");
+        closesocket(serverSocket);
+        return INVALID_SOCKET;
+    }
+    
+    if (listen(serverSocket, serverConfig.listenBacklog) == SOCKET_ERROR) {
+        LOG(LOG_ERROR, "TCP Listen failed");
+        closesocket(serverSocket);
+        return INVALID_SOCKET;
+    }
+    return serverSocket;
+}
+
+#ifdef __linux__
+// Start the reactor shards, each with its own SO_REUSEPORT listener. If the
+// kernel lacks SO_REUSEPORT, the shards share one listener and the kernel
+// wakes one of them per connection (EPOLLEXCLUSIVE).
+bool startReactor() {
+    SOCKET sharedListener = INVALID_SOCKET;
+    for (int i = 0; i < serverConfig.ioThreads; i++) {
+        IoWorker* worker = new IoWorker;
+        worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker->wakePending = false;
+        worker->listenSocket = sharedListener != INVALID_SOCKET ? sharedListener : openListener(true);
+        if (worker->listenSocket == INVALID_SOCKET && i == 0) {
+            worker->listenSocket = sharedListener = openListener(false);
+        }
+        if (worker->epollFd < 0 || worker->wakeFd < 0 || worker->listenSocket == INVALID_SOCKET) {
+            LOG(LOG_ERROR, "Failed to set up I/O shard " + to_string(i));
+            return false;
+        }
+        int flags = fcntl(worker->listenSocket, F_GETFL, 0);
+        fcntl(worker->listenSocket, F_SETFL, flags | O_NONBLOCK);
+        
+        epoll_event ev;
+        ev.events = EPOLLIN | (sharedListener != INVALID_SOCKET ? (uint32_t)EPOLLEXCLUSIVE : 0u);
+        ev.data.ptr = &listenTag;
+        epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->listenSocket, &ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wakeTag;
+        epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &ev);
+        ioWorkers.push_back(worker);
+    }
+    for (size_t i = 0; i < ioWorkers.size(); i++) {
+        ioWorkers[i]->loopThread = thread(ioWorkerLoop, ioWorkers[i]);
+        ioWorkers[i]->loopThread.detach();
+    }
+    LOG(LOG_INFO, "TCP Server listening on port " + to_string(serverConfig.tcpPort) + " with " +
+                  to_string(serverConfig.ioThreads) + (sharedListener == INVALID_SOCKET ?
+                  " SO_REUSEPORT shards" : " shards on a shared listener"));
+    return true;
+}
+#endif
+
+#ifdef NU_IO_URING
+// Close what a failed startUring() opened, so epoll can take the port
+void discardUringShards() {
+    SOCKET closed = INVALID_SOCKET;
+    for (size_t i = 0; i < ioWorkers.size(); i++) {
+        IoWorker* worker = ioWorkers[i];
+        if (worker->listenSocket != INVALID_SOCKET && worker->listenSocket != closed) {
+            closed = worker->listenSocket;
+            closesocket(worker->listenSocket);
+        }
+        if (worker->wakeFd >= 0) close(worker->wakeFd);
+        uringClose(*worker->ring);
+        delete worker->ring;
+        delete worker;
+    }
+    ioWorkers.clear();
+}
+
+// Start the shards on io_uring, laid out like startReactor(); false if the
+// kernel lacks what the engine needs, and the caller falls back to epoll
+bool startUring() {
+    if (!uringSupported()) {
+        LOG(LOG_WARN, "io_uring is not available here (needs Linux 6.0 and io_uring enabled)");
+        return false;
+    }
+    SOCKET sharedListener = INVALID_SOCKET;
+    for (int i = 0; i < serverConfig.ioThreads; i++) {
+        IoWorker* worker = new IoWorker;
+        worker->ring = new UringRing;
+        ioWorkers.push_back(worker);
+        // Blocking descriptors: the ring waits on them, nothing else reads them
+        worker->wakeFd = eventfd(0, EFD_CLOEXEC);
+        worker->listenSocket = sharedListener != INVALID_SOCKET ? sharedListener : openListener(true);
+        if (worker->listenSocket == INVALID_SOCKET && i == 0) {
+            worker->listenSocket = sharedListener = openListener(false);
+        }
+        if (worker->wakeFd < 0 || worker->listenSocket == INVALID_SOCKET || !uringOpen(*worker->ring, URING_ENTRIES) ||
+            !uringAddBuffers(*worker->ring, URING_BUFFERS, URING_BUFFER_SIZE)) {
+            LOG(LOG_ERROR, "Failed to set up io_uring shard " + to_string(i));
+            discardUringShards();
+            return false;
+        }
+    }
+    for (size_t i = 0; i < ioWorkers.size(); i++) {
+        ioWorkers[i]->loopThread = thread(uringWorkerLoop, ioWorkers[i]);
+        ioWorkers[i]->loopThread.detach();
+    }
+    LOG(LOG_INFO, "TCP Server listening on port " + to_string(serverConfig.tcpPort) + " with " +
+                  to_string(serverConfig.ioThreads) + (sharedListener == INVALID_SOCKET ?
+                  " io_uring shards" : " io_uring shards on a shared listener"));
+    return true;
+}
+#endif
+
+// TCP Server for handling campus connections. The reactor shards accept on
+// their own; otherwise this thread accepts and each connection's thread
+// does its own login.
+void tcpServer() {
+#ifdef NU_IO_URING
+    if (serverConfig.ioModel == IO_URING_REACTOR) {
+        if (startUring()) {
+            startAuthWorkers();
+            return;
+        }
+        LOG(LOG_WARN, "Falling back to epoll I/O");
+        serverConfig.ioModel = IO_EPOLL_REACTOR;
+    }
+#endif
+#ifdef __linux__
+    if (serverConfig.ioModel == IO_EPOLL_REACTOR) {
+        if (startReactor()) {
+            startAuthWorkers();
+            return;
+        }
+        LOG(LOG_WARN, "Falling back to thread-per-campus I/O");
+        serverConfig.ioModel = IO_THREAD_PER_CAMPUS;
+    }
+#endif
+    
+    SOCKET serverSocket = openListener(false);
+    if (serverSocket == INVALID_SOCKET) return;
+    LOG(LOG_INFO, "TCP Server listening on port " + to_string(serverConfig.tcpPort));
+    
+    while (true) {
+        sockaddr_in clientAddr;
+        socklen_t clientLen = sizeof(clientAddr);
+        SOCKET clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientLen);
+        
+        if (clientSocket == INVALID_SOCKET) continue;
+        if (shutdownPhase.load() != SHUTDOWN_NONE) {
+            closesocket(clientSocket);
+            continue;
+        }
+        metrics.accepts.add();
+        
+        shared_ptr<CampusConnection> conn = make_shared<CampusConnection>();
+        conn->socket = clientSocket;
+        conn->buffer = new RecvBuffer;
+        conn->acceptedNs = metricClockNs();
+        thread(handleCampusClient, conn).detach();
+    }
+    
+    closesocket(serverSocket);
+}
+
+// ---- Liveness tracking ----
+
+// A campus's deadline came up. Heartbeats only bump lastHeartbeatMs, so
+// the deadline is re-derived here: not yet missed means reschedule, a few
+// missed means suspect, too many means the connection is dropped.
+void checkLiveness(CampusState* state, int64_t nowMs) {
+    int64_t intervalMs = (int64_t)serverConfig.heartbeatIntervalSec * 1000;
+    int64_t silentMs = nowMs - state->lastHeartbeatMs.load();
+    int64_t suspectMs = serverConfig.suspectAfter * intervalMs;
+    int64_t offlineMs = serverConfig.offlineAfter * intervalMs;
+    
+    RcuReadGuard guard;
+    const SessionList& sessions = findSessions(state->campusId);
+    if (sessions.empty()) {
+        state->liveness.store(LIVENESS_OFFLINE);
+        return;
+    }
+    
+    if (silentMs >= offlineMs) {
+        LOG(LOG_WARN, "Campus " + state->campusName + " missed " + to_string(silentMs / intervalMs) +
+            " heartbeats, disconnecting");
+        state->liveness.store(LIVENESS_OFFLINE);
+        // Each session's own read path sees the shutdown and cleans up;
+        // a link to another node is not this campus's to close
+        for (size_t i = 0; i < sessions.size(); i++) {
+            if (!sessions[i]->peer) shutdown(sessions[i]->socket, SHUT_RDWR);
+        }
+        return;
+    }
+    
+    int64_t nextCheckMs;
+    if (silentMs >= suspectMs) {
+        int expected = LIVENESS_ONLINE;
+        if (state->liveness.compare_exchange_strong(expected, LIVENESS_SUSPECT)) {
+            LOG(LOG_WARN, "Campus " + state->campusName + " is suspect: no heartbeat for " +
+                to_string(silentMs / 1000) + "s");
+        }
+        nextCheckMs = offlineMs - silentMs;
+    } else {
+        nextCheckMs = suspectMs - silentMs;
+    }
+    uint64_t ticks = (uint64_t)(nextCheckMs + LIVENESS_TICK_MS - 1) / LIVENESS_TICK_MS;
+    livenessWheel.schedule(&state->livenessTimer, livenessWheel.now() + ticks);
+}
+
+// Ticks the liveness wheel on the monotonic clock
+void livenessLoop() {
+    vector<WheelTimer*> expired;
+    chrono::steady_clock::time_point nextTick = chrono::steady_clock::now() + chrono::milliseconds(LIVENESS_TICK_MS);
+    while (true) {
+        this_thread::sleep_until(nextTick);
+        
+        lock_guard<mutex> lock(livenessMutex);
+        // Catch up on ticks lost to a late wakeup
+        while (chrono::steady_clock::now() >= nextTick) {
+            livenessWheel.tick(expired);
+            nextTick += chrono::milliseconds(LIVENESS_TICK_MS);
+        }
+        int64_t nowMs = monotonicMs();
+        for (size_t i = 0; i < expired.size(); i++) {
+            checkLiveness((CampusState*)expired[i]->owner, nowMs);
+        }
+        expired.clear();
+        expireSessions(nowMs);
+        
+        // SIGHUP only sets a flag; the reload itself is done here
+        if (credentialReloadRequested) {
+            credentialReloadRequested = 0;
+            reloadCredentials();
+        }
+        // SIGTERM likewise; the shutdown ends the process from its own thread
+        if (shutdownRequested) {
+            shutdownRequested = 0;
+            thread(shutdownServer).detach();
+        }
+    }
+}
+
+// Heartbeat datagrams are drained in batches of up to HEARTBEAT_BATCH
+const int HEARTBEAT_BATCH = 64;
+const int HEARTBEAT_MAX_BYTES = 256;
+
+struct HeartbeatBatch {
+    char data[HEARTBEAT_BATCH][HEARTBEAT_MAX_BYTES];
+    int lengths[HEARTBEAT_BATCH];
+    sockaddr_in senders[HEARTBEAT_BATCH];
+    int count;
+};
+
+// Apply a whole batch of heartbeats in one pass: one clock read, one RCU
+// read section and one log line, however many datagrams arrived
+void applyHeartbeats(const HeartbeatBatch& batch) {
+    static const char PREFIX[] = "HEARTBEAT|";
+    const size_t PREFIX_LENGTH = sizeof(PREFIX) - 1;
+    time_t wallNow = time(0);
+    int64_t nowMs = monotonicMs();
+    int accepted = 0;
+    
+    RcuReadGuard guard;
+    RoutingTable* table = currentRoutes();
+    for (int i = 0; i < batch.count; i++) {
+        // Expected format: "HEARTBEAT|CampusName"
+        const char* text = batch.data[i];
+        size_t length = batch.lengths[i];
+        if (length <= PREFIX_LENGTH || memcmp(text, PREFIX, PREFIX_LENGTH) != 0) continue;
+        
+        uint16_t campusId = lookupId(CAMPUS_NAMES, CAMPUS_COUNT, text + PREFIX_LENGTH, length - PREFIX_LENGTH);
+        CampusState* state = campusId != 0 ? table->campuses[campusId] : NULL;
+        if (state == NULL || state->lastSeen.load() == 0) continue;
+        
+        state->lastSeen.store(wallNow);
+        int64_t previousMs = state->lastHeartbeatMs.exchange(nowMs);
+        if (previousMs != 0 && nowMs >= previousMs) metrics.heartbeatGapMs.record(nowMs - previousMs);
+        // Broadcasts go back to wherever the heartbeats come from
+        state->udpEndpoint.store(((uint64_t)batch.senders[i].sin_addr.s_addr << 16) | batch.senders[i].sin_port);
+        int expected = LIVENESS_SUSPECT;
+        if (state->liveness.compare_exchange_strong(expected, LIVENESS_ONLINE)) {
+            LOG(LOG_INFO, "Campus " + state->campusName + " is alive again");
+        }
+        accepted++;
+    }
+    metrics.heartbeats.add(accepted);
+    metrics.heartbeatBatches.add();
+    if (accepted == 1 && batch.count == 1) {
+        LOG(LOG_DEBUG, "Heartbeat received from " + string(batch.data[0] + PREFIX_LENGTH, batch.lengths[0] - PREFIX_LENGTH));
+    } else if (batch.count > 0) {
+        LOG(LOG_DEBUG, "Heartbeats received: " + to_string(accepted) + " of " + to_string(batch.count) + " datagrams");
+    }
+}
+
+// Block for at least one heartbeat datagram and take whatever else is
+// already queued; errors give an empty batch
+void receiveHeartbeats(SOCKET udpSocket, HeartbeatBatch& batch) {
+#ifdef __linux__
+    mmsghdr messages[HEARTBEAT_BATCH];
+    iovec buffers[HEARTBEAT_BATCH];
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < HEARTBEAT_BATCH; i++) {
+        buffers[i].iov_base = batch.data[i];
+        buffers[i].iov_len = HEARTBEAT_MAX_BYTES;
+        messages[i].msg_hdr.msg_iov = &buffers[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &batch.senders[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(batch.senders[i]);
+    }
+    
+    int received = recvmmsg(udpSocket, messages, HEARTBEAT_BATCH, MSG_WAITFORONE, NULL);
+    metrics.ioSyscalls.add();
+    batch.count = received > 0 ? received : 0;
+    for (int i = 0; i < batch.count; i++) batch.lengths[i] = (int)messages[i].msg_len;
+#else
+    socklen_t senderLength = sizeof(batch.senders[0]);
+    int bytesReceived = recvfrom(udpSocket, batch.data[0], HEARTBEAT_MAX_BYTES, 0,
+                                 (sockaddr*)&batch.senders[0], &senderLength);
+    metrics.ioSyscalls.add();
+    batch.count = bytesReceived > 0 ? 1 : 0;
+    batch.lengths[0] = bytesReceived;
+#endif
+}
+
+#ifdef NU_IO_URING
+// Heartbeats through io_uring: one multishot recvmsg stays armed and puts
+// each datagram, behind its sender's address, in a provided buffer
+const unsigned HEARTBEAT_RING_BUFFERS = 256;
+const size_t HEARTBEAT_RING_BUFFER_SIZE = 512;
 
-// Connected clients structure
-struct CampusClient {
-    SOCKET socket;
-    string campusName;
-    string lastSeen;
-    bool isOnline;
+struct HeartbeatRing {
+    UringRing ring;
+    msghdr layout;              // room the kernel leaves for the address
+    bool armed;
 };
 
-map<string, CampusClient> connectedClients;
-mutex clientsMutex;
-mutex coutMutex;
-
-// Function to get current timestamp
-string getCurrentTime() {
-    time_t now = time(0);
-    char buf[80];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    return string(buf);
+bool openHeartbeatRing(HeartbeatRing& heartbeats) {
+    memset(&heartbeats.layout, 0, sizeof(heartbeats.layout));
+    heartbeats.layout.msg_namelen = sizeof(sockaddr_in);
+    heartbeats.armed = false;
+    if (uringSupported() && uringOpen(heartbeats.ring, 64) &&
+        uringAddBuffers(heartbeats.ring, HEARTBEAT_RING_BUFFERS, HEARTBEAT_RING_BUFFER_SIZE)) {
+        return true;
+    }
+    uringClose(heartbeats.ring);
+    return false;
 }
 
-// Thread-safe console output
-void safeLog(const string& message) {
-    lock_guard<mutex> lock(coutMutex);
-    cout << "[" << getCurrentTime() << "] " << message << endl;
+// receiveHeartbeats() through the ring: one io_uring_enter per batch; false
+// if the ring failed
+bool receiveHeartbeatsUring(HeartbeatRing& heartbeats, SOCKET udpSocket, HeartbeatBatch& batch) {
+    UringRing& ring = heartbeats.ring;
+    batch.count = 0;
+    if (!heartbeats.armed) {
+        io_uring_sqe* sqe = uringSqe(ring, IORING_OP_RECVMSG, udpSocket, 0);
+        sqe->addr = (uint64_t)(uintptr_t)&heartbeats.layout;
+        sqe->len = 1;
+        prepareMultishotRecv(sqe);
+        heartbeats.armed = true;
+    }
+    if (!uringEnter(ring, 1, -1)) return false;
+    
+    io_uring_cqe* cqe;
+    while (batch.count < HEARTBEAT_BATCH && (cqe = uringPeek(ring)) != NULL) {
+        int result = cqe->res;
+        uint32_t flags = cqe->flags;
+        uringSeen(ring);
+        if (!(flags & IORING_CQE_F_MORE)) heartbeats.armed = false;
+        if (!(flags & IORING_CQE_F_BUFFER)) continue;
+        
+        // Buffer layout: io_uring_recvmsg_out, the address, then the datagram
+        uint16_t id = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        const char* data = ring.buffers + id * ring.bufferSize;
+        const io_uring_recvmsg_out* out = reinterpret_cast<const io_uring_recvmsg_out*>(data);
+        size_t payload = sizeof(io_uring_recvmsg_out) + heartbeats.layout.msg_namelen;
+        if (result >= (int)payload && out->namelen >= sizeof(sockaddr_in)) {
+            size_t length = min((size_t)out->payloadlen, min((size_t)HEARTBEAT_MAX_BYTES, (size_t)result - payload));
+            memcpy(&batch.senders[batch.count], data + sizeof(io_uring_recvmsg_out), sizeof(sockaddr_in));
+            memcpy(batch.data[batch.count], data + payload, length);
+            batch.lengths[batch.count++] = (int)length;
+        }
+        uringRecycleBuffer(ring, id);
+    }
+    return true;
 }
+#endif
 
-// Parse message format: FROM|TO|DEPT|MESSAGE
-struct Message {
-    string from;
-    string to;
-    string dept;
-    string content;
-};
-
-Message parseMessage(const string& msg) {
-    Message m;
-    stringstream ss(msg);
-    getline(ss, m.from, '|');
-    getline(ss, m.to, '|');
-    getline(ss, m.dept, '|');
-    getline(ss, m.content);
-    return m;
-}
+// Heartbeat socket; also the source of UDP broadcasts
+SOCKET udpServerSocket = INVALID_SOCKET;
 
-// Handle authentication
-bool authenticateCampus(SOCKET clientSocket, string& campusName) {
-    char buffer[1024] = {0};
-    int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
+// UDP Server for heartbeat monitoring; with useUring the datagrams come in
+// through io_uring when the kernel allows
+void udpServer(bool useUring) {
+    SOCKET udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udpSocket == INVALID_SOCKET) {
+        LOG(LOG_ERROR, "Failed to create UDP socket");
+        return;
+    }
     
-    if (bytesReceived <= 0) return false;
+    sockaddr_in serverAddr;
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(serverConfig.udpPort);
     
-    string authMsg(buffer);
-    size_t campusPos = authMsg.find("Campus:");
-    size_t passPos = authMsg.find(",Pass:");
+    if (bind(udpSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+        LOG(LOG_ERROR, "UDP Bind failed");
+        closesocket(udpSocket);
+        return;
+    }
     
-    if (campusPos == string::npos || passPos == string::npos) return false;
+    LOG(LOG_INFO, "UDP Server listening on port " + to_string(serverConfig.udpPort));
+    udpServerSocket = udpSocket;
     
-    campusName = authMsg.substr(campusPos + 7, passPos - campusPos - 7);
-    string password = authMsg.substr(passPos + 6);
+    HeartbeatBatch* batch = new HeartbeatBatch;
+#ifdef NU_IO_URING
+    HeartbeatRing* heartbeats = useUring ? new HeartbeatRing : NULL;
+    if (heartbeats != NULL && openHeartbeatRing(*heartbeats)) {
+        LOG(LOG_INFO, "UDP heartbeats read through io_uring");
+        while (receiveHeartbeatsUring(*heartbeats, udpSocket, *batch)) applyHeartbeats(*batch);
+        LOG(LOG_WARN, "io_uring heartbeat ring failed, using recvmmsg");
+        uringClose(heartbeats->ring);
+    }
+    delete heartbeats;
+#endif
+    while (true) {
+        receiveHeartbeats(udpSocket, *batch);
+        applyHeartbeats(*batch);
+    }
     
-    // Validate credentials
-    if (campusCredentials.find(campusName) != campusCredentials.end() &&
-        campusCredentials[campusName] == password) {
-        
-        string response = "AUTH_SUCCESS";
-        send(clientSocket, response.c_str(), response.length(), 0);
-        return true;
+    delete batch;
+    closesocket(udpSocket);
+}
+
+// ---- Broadcast engine ----
+
+// UDP: one datagram per campus to its heartbeat endpoint, in sendmmsg
+// batches. Multicast: one datagram to a group the clients join. TCP: one
+// shared frame queued on every campus connection (reliable, in order).
+enum BroadcastMode { BROADCAST_UDP, BROADCAST_MULTICAST, BROADCAST_TCP };
+
+struct BroadcastConfig {
+    BroadcastMode mode;
+    string groupIp;
+    int groupPort;
+    string multicastInterface;  // local address to send multicast from, empty = default route
+    int multicastTtl;
+};
+
+BroadcastConfig broadcastConfig = {BROADCAST_UDP, "239.255.78.1", 8082, "", 1};
+
+const char* broadcastModeName(BroadcastMode mode) {
+    switch (mode) {
+        case BROADCAST_MULTICAST: return "multicast";
+        case BROADCAST_TCP: return "tcp";
+        default: return "udp";
     }
+}
+
+// Send text to every online campus with a known heartbeat endpoint;
+// returns the number of campuses reached
+int broadcastUdp(const string& text) {
+    if (udpServerSocket == INVALID_SOCKET) return 0;
     
-    string response = "AUTH_FAILED";
-    send(clientSocket, response.c_str(), response.length(), 0);
-    return false;
+    vector<sockaddr_in> targets;
+    {
+        RcuReadGuard guard;
+        RoutingTable* table = currentRoutes();
+        for (size_t id = 1; id < table->sessions.size(); id++) {
+            uint64_t endpoint = table->campuses[id]->udpEndpoint.load();
+            if (table->sessions[id].empty() || endpoint == 0) continue;
+            sockaddr_in target;
+            memset(&target, 0, sizeof(target));
+            target.sin_family = AF_INET;
+            target.sin_addr.s_addr = (uint32_t)(endpoint >> 16);
+            target.sin_port = (uint16_t)endpoint;
+            targets.push_back(target);
+        }
+    }
+    
+#ifdef __linux__
+    vector<mmsghdr> messages(targets.size());
+    iovec payload = {(void*)text.data(), text.size()};
+    for (size_t i = 0; i < targets.size(); i++) {
+        memset(&messages[i], 0, sizeof(messages[i]));
+        messages[i].msg_hdr.msg_iov = &payload;
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &targets[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(targets[i]);
+    }
+    size_t sent = 0;
+    while (sent < targets.size()) {
+        int result = sendmmsg(udpServerSocket, &messages[sent], targets.size() - sent, 0);
+        if (result <= 0) break;
+        sent += result;
+    }
+    return (int)sent;
+#else
+    int sent = 0;
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (sendto(udpServerSocket, text.c_str(), text.length(), 0,
+                   (sockaddr*)&targets[i], sizeof(targets[i])) != SOCKET_ERROR) sent++;
+    }
+    return sent;
+#endif
 }
 
-// Handle individual campus client
-void handleCampusClient(SOCKET clientSocket, string campusName) {
-    safeLog("Campus " + campusName + " connected successfully");
+// One datagram to the multicast group; the socket is set up on first use
+int broadcastMulticast(const string& text) {
+    static SOCKET groupSocket = INVALID_SOCKET;
+    if (groupSocket == INVALID_SOCKET) {
+        groupSocket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (groupSocket == INVALID_SOCKET) return 0;
+        unsigned char ttl = (unsigned char)broadcastConfig.multicastTtl;
+        setsockopt(groupSocket, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+        if (!broadcastConfig.multicastInterface.empty()) {
+            in_addr local;
+            inet_pton(AF_INET, broadcastConfig.multicastInterface.c_str(), &local);
+            setsockopt(groupSocket, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&local, sizeof(local));
+        }
+    }
     
-    char buffer[4096];
-    while (true) {
-        memset(buffer, 0, sizeof(buffer));
-        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        
-        if (bytesReceived <= 0) {
-            safeLog("Campus " + campusName + " disconnected");
-            break;
+    sockaddr_in group;
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(broadcastConfig.groupPort);
+    inet_pton(AF_INET, broadcastConfig.groupIp.c_str(), &group.sin_addr);
+    return sendto(groupSocket, text.c_str(), text.length(), 0, (sockaddr*)&group, sizeof(group)) == SOCKET_ERROR ? 0 : 1;
+}
+
+// Queue one shared FRAME_BROADCAST buffer on every campus session
+int broadcastReliable(const string& text) {
+    OutFrame frame = makeTextFrame(FRAME_BROADCAST, 0, text);
+    int queued = 0;
+    RcuReadGuard guard;
+    RoutingTable* table = currentRoutes();
+    for (size_t id = 1; id < table->sessions.size(); id++) {
+        for (size_t i = 0; i < table->sessions[id].size(); i++) {
+            if (table->sessions[id][i]->peer) continue;     // other nodes broadcast for themselves
+            if (enqueueFrame(table->sessions[id][i].get(), frame) == ENQUEUED) queued++;
         }
-        
-        string receivedMsg(buffer, bytesReceived);
-        safeLog("Message from " + campusName + ": " + receivedMsg);
-        
-        // Parse and route message
-        Message msg = parseMessage(receivedMsg);
-        
-        {
-            lock_guard<mutex> lock(clientsMutex);
-            auto it = connectedClients.find(msg.to);
-            
-            if (it != connectedClients.end() && it->second.isOnline) {
-                string forwardMsg = msg.from + "|" + msg.dept + "|" + msg.content;
-                send(it->second.socket, forwardMsg.c_str(), forwardMsg.length(), 0);
-                safeLog("Routed message from " + msg.from + " to " + msg.to);
-            } else {
-                string errorMsg = "ERROR|Campus " + msg.to + " is not online";
-                send(clientSocket, errorMsg.c_str(), errorMsg.length(), 0);
-                safeLog("Failed to route: " + msg.to + " is offline");
+    }
+    return queued;
+}
+
+void broadcastMessage(const string& message, BroadcastMode mode) {
+    uint64_t broadcastStart = metricClockNs();
+    int reached;
+    if (mode == BROADCAST_TCP) {
+        reached = broadcastReliable(message);
+    } else if (mode == BROADCAST_MULTICAST) {
+        reached = broadcastMulticast("BROADCAST|" + message);
+    } else {
+        reached = broadcastUdp("BROADCAST|" + message);
+    }
+    metrics.broadcastNs.record(metricClockNs() - broadcastStart);
+    metrics.broadcasts.add();
+    metrics.broadcastRecipients.add(reached);
+    LOG(LOG_INFO, string("Broadcast sent (") + broadcastModeName(mode) + ", " +
+        (mode == BROADCAST_MULTICAST ? (reached ? "sent to group" : "send failed") : to_string(reached) + " campuses") +
+        "): " + message);
+}
+
+// ---- Graceful shutdown and warm restart ----
+//
+// `quit` and SIGTERM drain the server instead of exiting on the spot. New
+// connections are closed as they are accepted and logins are refused.
+// Messages and publishes from campuses are left unread, as if rate limited,
+// so their clients send them again after resuming. Outbound queues are
+// flushed until they are empty or --drain-timeout runs out; then every
+// connection is shut down and its reader closes it, which detaches its
+// session. The detached sessions are written to a binary snapshot and the
+// store and history are flushed before the process exits.
+//
+// At startup the snapshot is loaded and deleted. A client that comes back
+// with its token resumes as if the server had never gone: no password
+// check, its topics are restored and it gets only the frames it had not
+// received. The resume grace period does not run while the server is down.
+//
+// Snapshot layout: "NUSNAP01", u32 session count, then for each session
+// u16 token length, token, u16 endpoint length, endpoint, u16 campus, u8
+// compression, u64 ms since it was detached, u64 received, u64 sentBase,
+// u32 topic count, topics (u16 campus, u16 dept), u32 frame count, frames
+// (u32 length, frame); last a u32 FNV-1a checksum of all that.
+
+const char SNAPSHOT_MAGIC[] = "NUSNAP01";
+const size_t SNAPSHOT_MAGIC_SIZE = 8;
+const int SHUTDOWN_CLOSE_MS = 2000;     // how long closing connections may take
+
+struct RestartConfig {
+    bool snapshot;              // save sessions on shutdown and load them at start
+    string snapshotPath;
+    int drainTimeoutSec;        // how long shutdown waits for outbound queues to empty
+};
+
+RestartConfig restartConfig = {
+#ifdef _WIN32
+    false,
+#else
+    true,
+#endif
+    "nu_state.snap",
+    5
+};
+
+// Every open campus connection and peer link
+void openConnections(vector<shared_ptr<CampusConnection> >& conns) {
+    {
+        RcuReadGuard guard;
+        RoutingTable* table = currentRoutes();
+        for (size_t id = 1; id < table->sessions.size(); id++) {
+            conns.insert(conns.end(), table->sessions[id].begin(), table->sessions[id].end());
+        }
+    }
+    {
+        lock_guard<mutex> lock(federationMutex);
+        for (size_t i = 0; i < federation.peers.size(); i++) {
+            if (federation.peers[i]->link) conns.push_back(federation.peers[i]->link);
+        }
+    }
+    // A peer link is listed under every campus its node owns
+    sort(conns.begin(), conns.end());
+    conns.erase(unique(conns.begin(), conns.end()), conns.end());
+}
+
+// Wait until the writers have flushed every outbound queue or the deadline
+// passes; returns the frames still queued
+size_t drainOutboundQueues(int64_t deadlineMs) {
+    while (true) {
+        vector<shared_ptr<CampusConnection> > conns;
+        openConnections(conns);
+        size_t queued = 0;
+        for (size_t i = 0; i < conns.size(); i++) queued += conns[i]->outbound.queuedCount.load();
+        if (queued == 0 || monotonicMs() >= deadlineMs) return queued;
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
+
+// Shut every connection down and wait for the readers to close them;
+// returns the connections still open at the deadline
+size_t closeConnections(int64_t deadlineMs) {
+    vector<shared_ptr<CampusConnection> > conns;
+    openConnections(conns);
+    for (size_t i = 0; i < conns.size(); i++) {
+        // Under the lock, so the socket cannot have been closed and reused
+        OutboundQueue& q = conns[i]->outbound;
+        lock_guard<mutex> lock(q.lock);
+        if (!q.closed) shutdown(conns[i]->socket, SHUT_RDWR);
+    }
+    while (!conns.empty() && monotonicMs() < deadlineMs) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        conns.clear();
+        openConnections(conns);
+    }
+    return conns.size();
+}
+
+#ifndef _WIN32
+void appendSnapshotString(string& data, const string& text) {
+    char length[2];
+    putU16(length, (uint16_t)text.size());
+    data.append(length, sizeof(length));
+    data += text;
+}
+
+// Save the detached sessions; the file is replaced atomically
+bool writeSnapshot() {
+    string data(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    data.append(4, '\0');       // session count, filled in below
+    uint32_t saved = 0;
+    size_t frames = 0;
+    int64_t nowMs = monotonicMs();
+    {
+        lock_guard<mutex> lock(sessionsMutex);
+        for (unordered_map<string, shared_ptr<SessionState> >::iterator it = sessionsByToken.begin();
+             it != sessionsByToken.end(); ++it) {
+            const SessionState& state = *it->second;
+            // Attached only if its connection did not close in time
+            if (state.attached || state.endpoint.size() > 0xFFFF) continue;
+            appendSnapshotString(data, state.token);
+            appendSnapshotString(data, state.endpoint);
+            char fields[35];
+            putU16(fields, state.campusId);
+            fields[2] = state.compression ? 1 : 0;
+            putU64(fields + 3, (uint64_t)(nowMs - state.detachedMs));
+            putU64(fields + 11, state.received);
+            putU64(fields + 19, state.sentBase);
+            putU32(fields + 27, (uint32_t)state.topics.size());
+            data.append(fields, 31);
+            for (size_t i = 0; i < state.topics.size(); i++) {
+                putU16(fields, state.topics[i].first);
+                putU16(fields + 2, state.topics[i].second);
+                data.append(fields, 4);
+            }
+            putU32(fields, (uint32_t)state.pending.size());
+            data.append(fields, 4);
+            for (size_t i = 0; i < state.pending.size(); i++) {
+                const FrameBuffer& frame = *state.pending[i];
+                putU32(fields, (uint32_t)frame.size());
+                data.append(fields, 4);
+                data.append(&frame[0], frame.size());
             }
+            saved++;
+            frames += state.pending.size();
         }
     }
+    putU32(&data[SNAPSHOT_MAGIC_SIZE], saved);
+    char checksum[4];
+    putU32(checksum, storeChecksum(data.data(), data.size()));
+    data.append(checksum, sizeof(checksum));
     
-    // Cleanup
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        connectedClients[campusName].isOnline = false;
+    const string& path = restartConfig.snapshotPath;
+    string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t written = 0;
+    while (fd >= 0 && written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    bool ok = fd >= 0 && written == data.size() && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        LOG(LOG_ERROR, "Cannot write the session snapshot " + path);
+        return false;
     }
-    closesocket(clientSocket);
+    LOG(LOG_INFO, "Saved " + to_string(saved) + " sessions with " + to_string(frames) + " frames to " + path);
+    return true;
 }
 
-// TCP Server for handling campus connections
-void tcpServer() {
-    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == INVALID_SOCKET) {
-        safeLog("Failed to create TCP socket");
-        return;
+// Bounds-checked cursor over a loaded snapshot
+struct SnapshotReader {
+    const char* next;
+    const char* end;
+    
+    const char* take(size_t size) {
+        if ((size_t)(end - next) < size) return NULL;
+        const char* at = next;
+        next += size;
+        return at;
     }
     
-    // Allow port reuse
-    int opt = 1;
-    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+    bool takeString(string& text) {
+        const char* length = take(2);
+        const char* bytes = length ? take(getU16(length)) : NULL;
+        if (bytes == NULL) return false;
+        text.assign(bytes, getU16(length));
+        return true;
+    }
+};
+
+// One saved session, detached as it was, or NULL if the record is damaged
+shared_ptr<SessionState> readSnapshotSession(SnapshotReader& in, int64_t nowMs) {
+    shared_ptr<SessionState> state = make_shared<SessionState>();
+    const char* fields;
+    if (!in.takeString(state->token) || !in.takeString(state->endpoint) || (fields = in.take(31)) == NULL) {
+        return shared_ptr<SessionState>();
+    }
+    state->campusId = getU16(fields);
+    state->compression = fields[2] != 0 && serverConfig.compression;
+    state->attached = false;
+    state->detachedMs = nowMs - (int64_t)min(getU64(fields + 3), (uint64_t)INT64_MAX / 2);
+    state->received = getU64(fields + 11);
+    state->sentBase = getU64(fields + 19);
+    if (state->token.empty() || state->campusId == 0 || state->campusId >= CAMPUS_COUNT) {
+        return shared_ptr<SessionState>();
+    }
     
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(TCP_PORT);
+    for (uint32_t i = 0, topics = getU32(fields + 27); i < topics; i++) {
+        const char* topic = in.take(4);
+        if (topic == NULL) return shared_ptr<SessionState>();
+        state->topics.push_back(make_pair(getU16(topic), getU16(topic + 2)));
+    }
+    const char* count = in.take(4);
+    if (count == NULL) return shared_ptr<SessionState>();
+    for (uint32_t i = 0, frames = getU32(count); i < frames; i++) {
+        const char* length = in.take(4);
+        const char* frame = length ? in.take(getU32(length)) : NULL;
+        if (frame == NULL || getU32(length) < FRAME_HEADER_SIZE || (uint8_t)frame[0] != FRAME_MAGIC ||
+            getU32(frame + 4) != getU32(length) - FRAME_HEADER_SIZE) {
+            return shared_ptr<SessionState>();
+        }
+        state->pending.push_back(copyOutFrame(frame, getU32(length)));
+    }
+    return state;
+}
+
+// Restore the sessions the last shutdown saved. The file is used once: a
+// later crash must not bring the same frames back.
+void loadSnapshot() {
+    const string& path = restartConfig.snapshotPath;
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0) return;
+    uint64_t loadStart = metricClockNs();
+    vector<char> data(fstat(fd, &info) == 0 ? info.st_size : 0);
+    size_t got = 0;
+    while (got < data.size()) {
+        ssize_t n = pread(fd, &data[got], data.size() - got, got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    unlink(path.c_str());
     
-    if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-        safeLog("TCP Bind failed");
-        closesocket(serverSocket);
+    if (got != data.size() || got < SNAPSHOT_MAGIC_SIZE + 8 || memcmp(&data[0], SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0 ||
+        storeChecksum(&data[0], got - 4) != getU32(&data[got - 4])) {
+        LOG(LOG_WARN, "Ignoring damaged session snapshot " + path);
         return;
     }
-    
-    if (listen(serverSocket, 10) == SOCKET_ERROR) {
-        safeLog("TCP Listen failed");
-        closesocket(serverSocket);
+    if (serverConfig.resumeGraceSec == 0) {
+        LOG(LOG_INFO, "Session resumption is off, ignoring the snapshot " + path);
         return;
     }
     
-    safeLog("TCP Server listening on port " + to_string(TCP_PORT));
+    SnapshotReader in = {&data[SNAPSHOT_MAGIC_SIZE + 4], &data[got - 4]};
+    uint32_t count = getU32(&data[SNAPSHOT_MAGIC_SIZE]);
+    int64_t nowMs = monotonicMs();
+    vector<shared_ptr<SessionState> > restored;
+    for (uint32_t i = 0; i < count; i++) {
+        shared_ptr<SessionState> state = readSnapshotSession(in, nowMs);
+        if (!state) {
+            LOG(LOG_WARN, "Ignoring damaged session snapshot " + path);
+            return;
+        }
+        restored.push_back(state);
+    }
     
-    while (true) {
-        sockaddr_in clientAddr;
-        socklen_t clientLen = sizeof(clientAddr);
-        SOCKET clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientLen);
-        
-        if (clientSocket == INVALID_SOCKET) continue;
-        
-        // Authenticate client
-        string campusName;
-        if (authenticateCampus(clientSocket, campusName)) {
-            {
-                lock_guard<mutex> lock(clientsMutex);
-                connectedClients[campusName] = {clientSocket, campusName, getCurrentTime(), true};
-            }
-            
-            // Handle client in new thread
-            thread(handleCampusClient, clientSocket, campusName).detach();
-        } else {
-            safeLog("Authentication failed for a client");
-            closesocket(clientSocket);
+    size_t frames = 0;
+    {
+        lock_guard<mutex> lock(sessionsMutex);
+        for (size_t i = 0; i < restored.size(); i++) {
+            sessionsByToken[restored[i]->token] = restored[i];
+            frames += restored[i]->pending.size();
         }
     }
+    metrics.sessionsRestored.add(restored.size());
+    LOG(LOG_INFO, "Restored " + to_string(restored.size()) + " sessions with " + to_string(frames) + " frames from " +
+                  path + " in " + to_string((metricClockNs() - loadStart) / 1000) + " us");
+}
+#else
+bool writeSnapshot() { return false; }
+void loadSnapshot() {}
+#endif
+
+#ifndef _WIN32
+void requestShutdown(int) {
+    shutdownRequested = 1;
+}
+#endif
+
+// Drain, close, save the sessions and exit. Runs once; a second `quit` or
+// SIGTERM while it works is ignored.
+void shutdownServer() {
+    int running = SHUTDOWN_NONE;
+    if (!shutdownPhase.compare_exchange_strong(running, SHUTDOWN_DRAINING)) return;
+    int64_t start = monotonicMs();
+    LOG(LOG_INFO, "Shutting down server: draining connections for up to " + to_string(restartConfig.drainTimeoutSec) +
+                  "s");
+    size_t queued = drainOutboundQueues(start + (int64_t)restartConfig.drainTimeoutSec * 1000);
+    if (queued > 0) LOG(LOG_WARN, to_string(queued) + " frames were still queued at the drain timeout");
     
-    closesocket(serverSocket);
+    shutdownPhase.store(SHUTDOWN_CLOSING);
+    size_t stillOpen = closeConnections(monotonicMs() + SHUTDOWN_CLOSE_MS);
+    if (stillOpen > 0) LOG(LOG_WARN, to_string(stillOpen) + " connections did not close in time");
+    if (restartConfig.snapshot) writeSnapshot();
+    stopStore();
+    stopHistory();
+    LOG(LOG_INFO, "Server stopped in " + to_string(monotonicMs() - start) + " ms");
+    stopLogger();
+    cout.flush();
+    // Detached workers are still running; static destructors must not race them
+    _exit(0);
 }
 
-// UDP Server for heartbeat monitoring
-void udpServer() {
-    SOCKET udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udpSocket == INVALID_SOCKET) {
-        safeLog("Failed to create UDP socket");
-        return;
+// ---- Metrics reporting ----
+
+void appendMetric(string& out, const string& name, const string& labels, uint64_t value) {
+    out += name;
+    if (!labels.empty()) out += "{" + labels + "}";
+    out += " " + to_string(value) + "\n";
+}
+
+void appendHistogram(string& out, const string& name, const Histogram& h) {
+    uint64_t cumulative = 0;
+    int top = Histogram::BUCKETS - 1;
+    while (top > 0 && h.buckets[top].load(memory_order_relaxed) == 0) top--;
+    for (int b = 0; b <= top; b++) {
+        cumulative += h.buckets[b].load(memory_order_relaxed);
+        uint64_t bound = b == 0 ? 0 : (((uint64_t)1 << b) - 1);
+        appendMetric(out, name + "_bucket", "le=\"" + to_string(bound) + "\"", cumulative);
+    }
+    appendMetric(out, name + "_bucket", "le=\"+Inf\"", h.count.load(memory_order_relaxed));
+    appendMetric(out, name + "_sum", "", h.sum.load(memory_order_relaxed));
+    appendMetric(out, name + "_count", "", h.count.load(memory_order_relaxed));
+}
+
+const char* ioModelName(IoModel model) {
+    switch (model) {
+        case IO_EPOLL_REACTOR: return "epoll";
+        case IO_URING_REACTOR: return "uring";
+        default: return "threads";
     }
+}
+
+// All metrics in the Prometheus text exposition format
+string formatMetrics() {
+    string out;
+    out.reserve(16 * 1024);
+    uint64_t uptime = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - metrics.started).count();
+    appendMetric(out, "nu_uptime_seconds", "", uptime);
+    appendMetric(out, "nu_accepts_total", "", metrics.accepts.value());
+    appendMetric(out, "nu_auth_failures_total", "", metrics.authFailures.value());
+    appendMetric(out, "nu_handshake_timeouts_total", "", metrics.handshakeTimeouts.value());
+    appendHistogram(out, "nu_auth_ns", metrics.authNs);
     
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(UDP_PORT);
+    const char* names[] = {"routed", "stored", "failed"};
+    Counter (*tables[])[CAMPUS_COUNT] = {metrics.routed, metrics.stored, metrics.failed};
+    for (int t = 0; t < 3; t++) {
+        for (uint16_t from = 0; from < CAMPUS_COUNT; from++) {
+            for (uint16_t to = 0; to < CAMPUS_COUNT; to++) {
+                uint64_t value = tables[t][from][to].value();
+                if (value == 0) continue;
+                appendMetric(out, string("nu_messages_") + names[t] + "_total",
+                             string("from=\"") + campusNameOf(from) + "\",to=\"" + campusNameOf(to) + "\"", value);
+            }
+        }
+    }
+    appendHistogram(out, "nu_route_ns", metrics.routeNs);
+    appendHistogram(out, "nu_queue_lock_wait_ns", metrics.lockWaitNs);
+    appendMetric(out, "nu_bytes_in_total", "", metrics.bytesIn.value());
+    appendMetric(out, "nu_bytes_out_total", "", metrics.bytesOut.value());
+    appendMetric(out, "nu_io_model", string("model=\"") + ioModelName(serverConfig.ioModel) + "\"", 1);
+    appendMetric(out, "nu_io_syscalls_total", "", metrics.ioSyscalls.value());
+    appendMetric(out, "nu_heartbeats_total", "", metrics.heartbeats.value());
+    appendMetric(out, "nu_heartbeat_batches_total", "", metrics.heartbeatBatches.value());
+    appendHistogram(out, "nu_heartbeat_gap_ms", metrics.heartbeatGapMs);
+    appendMetric(out, "nu_broadcasts_total", "", metrics.broadcasts.value());
+    appendMetric(out, "nu_broadcast_recipients_total", "", metrics.broadcastRecipients.value());
+    appendHistogram(out, "nu_broadcast_ns", metrics.broadcastNs);
+    appendMetric(out, "nu_publishes_total", "", metrics.publishes.value());
+    appendMetric(out, "nu_publish_recipients_total", "", metrics.publishRecipients.value());
+    appendHistogram(out, "nu_publish_ns", metrics.publishNs);
+    appendMetric(out, "nu_compressed_frames_total", "", metrics.compressedFrames.value());
+    appendMetric(out, "nu_compressed_bytes_total", "", metrics.compressedBytes.value());
+    appendMetric(out, "nu_compressed_original_bytes_total", "", metrics.originalBytes.value());
+    appendMetric(out, "nu_inflated_frames_total", "", metrics.inflatedFrames.value());
+    appendMetric(out, "nu_inflate_failures_total", "", metrics.inflateFailures.value());
+    appendHistogram(out, "nu_inflate_ns", metrics.inflateNs);
+    appendMetric(out, "nu_file_transfers_total", "", metrics.fileTransfers.value());
+    appendMetric(out, "nu_file_transfers_completed_total", "", metrics.fileTransfersDone.value());
+    appendMetric(out, "nu_file_chunks_total", "", metrics.fileChunks.value());
+    appendMetric(out, "nu_file_bytes_total", "", metrics.fileBytes.value());
+    appendMetric(out, "nu_sessions_resumed_total", "", metrics.sessionsResumed.value());
+    appendMetric(out, "nu_resume_refusals_total", "", metrics.resumeRefusals.value());
+    appendMetric(out, "nu_resume_replayed_frames_total", "", metrics.resumeReplayed.value());
+    appendMetric(out, "nu_sessions_restored_total", "", metrics.sessionsRestored.value());
+    appendMetric(out, "nu_peer_forwarded_total", "", metrics.peerForwarded.value());
+    appendMetric(out, "nu_peer_received_total", "", metrics.peerReceived.value());
+    appendMetric(out, "nu_peer_link_drops_total", "", metrics.peerLinkDrops.value());
+    appendMetric(out, "nu_peer_links_up", "", peerLinksUp());
+    appendMetric(out, "nu_credit_grants_total", "", metrics.creditGrants.value());
+    appendMetric(out, "nu_credit_waits_total", "", metrics.creditWaits.value());
+    appendMetric(out, "nu_throttled_total", "", metrics.throttled.value());
+    appendHistogram(out, "nu_throttle_ms", metrics.throttleMs);
+    appendMetric(out, "nu_pool_blocks", "", poolBlocksCreated.load(memory_order_relaxed));
+    appendMetric(out, "nu_pool_oversized_total", "", poolOversized.load(memory_order_relaxed));
+#ifdef NU_COUNT_ALLOCATIONS
+    appendMetric(out, "nu_heap_allocations_total", "", metrics.heapAllocations.value());
+#endif
+    appendMetric(out, "nu_history_records_total", "", metrics.historyRecords.value());
+    appendMetric(out, "nu_history_dropped_total", "", metrics.historyDropped.value());
+    appendHistogram(out, "nu_history_search_ns", metrics.historySearchNs);
     
-    if (bind(udpSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-        safeLog("UDP Bind failed");
-        closesocket(udpSocket);
-        return;
+    uint64_t online = 0, sessions = 0;
+    {
+        RcuReadGuard guard;
+        RoutingTable* table = currentRoutes();
+        for (size_t id = 1; id < table->sessions.size(); id++) {
+            // Peer links are listed last
+            size_t local = table->sessions[id].size();
+            while (local > 0 && table->sessions[id][local - 1]->peer) local--;
+            if (local > 0) online++;
+            sessions += local;
+        }
     }
+    appendMetric(out, "nu_campuses_online", "", online);
+    appendMetric(out, "nu_sessions", "", sessions);
+    return out;
+}
+
+string describeHistogram(const Histogram& h, double scale, const char* unit) {
+    char text[160];
+    uint64_t count = h.count.load(memory_order_relaxed);
+    snprintf(text, sizeof(text), "n=%llu p50<=%.1f%s p99<=%.1f%s max=%.1f%s", (unsigned long long)count,
+             h.percentile(50) / scale, unit, h.percentile(99) / scale, unit,
+             h.maxValue.load(memory_order_relaxed) / scale, unit);
+    return text;
+}
+
+// Human-readable summary for the admin console
+void printStats() {
+    double uptime = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - metrics.started).count() / 1000.0;
+    if (uptime <= 0) uptime = 1;
+    uint64_t accepts = metrics.accepts.value();
     
-    safeLog("UDP Server listening on port " + to_string(UDP_PORT));
+    cout << "\n=== Server Statistics ===\n"
+         << "Uptime:        " << (uint64_t)uptime << "s\n"
+         << "Accepts:       " << accepts << " (" << accepts / uptime << "/s), "
+         << metrics.authFailures.value() << " auth failures (" << metrics.handshakeTimeouts.value() << " timed out)\n"
+         << "Auth time:     " << describeHistogram(metrics.authNs, 1000.0, "us") << "\n"
+         << "Bytes in/out:  " << metrics.bytesIn.value() << " / " << metrics.bytesOut.value() << "\n"
+         << "I/O:           " << ioModelName(serverConfig.ioModel) << ", " << metrics.ioSyscalls.value()
+         << " system calls\n"
+         << "Route time:    " << describeHistogram(metrics.routeNs, 1000.0, "us") << "\n"
+         << "Lock waits:    " << describeHistogram(metrics.lockWaitNs, 1000.0, "us") << "\n"
+         << "Heartbeats:    " << metrics.heartbeats.value() << " in " << metrics.heartbeatBatches.value() << " batches, gap "
+         << describeHistogram(metrics.heartbeatGapMs, 1000.0, "s") << "\n"
+         << "Broadcasts:    " << metrics.broadcasts.value() << " to " << metrics.broadcastRecipients.value()
+         << " recipients, " << describeHistogram(metrics.broadcastNs, 1000.0, "us") << "\n"
+         << "Publishes:     " << metrics.publishes.value() << " to " << metrics.publishRecipients.value()
+         << " subscribers, " << describeHistogram(metrics.publishNs, 1000.0, "us") << "\n";
     
-    char buffer[1024];
-    while (true) {
-        sockaddr_in clientAddr;
-        socklen_t clientLen = sizeof(clientAddr);
-        
-        int bytesReceived = recvfrom(udpSocket, buffer, sizeof(buffer), 0,
-                                     (sockaddr*)&clientAddr, &clientLen);
-        
-        if (bytesReceived > 0) {
-            buffer[bytesReceived] = '\0';
-            string heartbeat(buffer);
-            
-            // Expected format: "HEARTBEAT|CampusName"
-            if (heartbeat.find("HEARTBEAT|") == 0) {
-                string campusName = heartbeat.substr(10);
-                
-                lock_guard<mutex> lock(clientsMutex);
-                if (connectedClients.find(campusName) != connectedClients.end()) {
-                    connectedClients[campusName].lastSeen = getCurrentTime();
-                    safeLog("Heartbeat received from " + campusName);
-                }
-            }
+    uint64_t compressedBytes = metrics.compressedBytes.value();
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.2f", compressedBytes ? (double)metrics.originalBytes.value() / compressedBytes : 0.0);
+    cout << "Compression:   " << metrics.compressedFrames.value() << " frames, " << metrics.originalBytes.value()
+         << " -> " << compressedBytes << " bytes (ratio " << ratio << ")\n"
+         << "Decompressed:  " << metrics.inflatedFrames.value() << " frames for older clients ("
+         << metrics.inflateFailures.value() << " corrupt), " << describeHistogram(metrics.inflateNs, 1000.0, "us") << "\n"
+         << "File transfers: " << metrics.fileTransfers.value() << " started, " << metrics.fileTransfersDone.value()
+         << " completed, " << metrics.fileChunks.value() << " chunks, " << metrics.fileBytes.value() << " bytes\n"
+         << "Resumptions:   " << metrics.sessionsResumed.value() << " sessions resumed, "
+         << metrics.resumeReplayed.value() << " frames replayed, " << metrics.resumeRefusals.value()
+         << " refused, " << detachedSessionCount() << " waiting for their client, "
+         << metrics.sessionsRestored.value() << " restored at startup\n"
+         << "History:       " << metrics.historyRecords.value() << " messages indexed, " << historyTermCount()
+         << " terms, " << metrics.historyDropped.value() << " dropped, search "
+         << describeHistogram(metrics.historySearchNs, 1000.0, "us") << "\n"
+         << "Flow control:  credit window "
+         << (serverConfig.creditWindow > 0 ? to_string(serverConfig.creditWindow) : string("off")) << ", "
+         << metrics.creditGrants.value() << " grants, " << metrics.creditWaits.value() << " credit waits, "
+         << metrics.throttled.value() << " rate-limit pauses, "
+         << describeHistogram(metrics.throttleMs, 1.0, "ms") << "\n";
+    if (rateLimited()) cout << "Rate limits:   " << describeRateLimits() << "\n";
+    cout << "Buffer pools:  " << poolBlocksCreated.load(memory_order_relaxed) << " blocks, "
+         << poolOversized.load(memory_order_relaxed) << " oversized frames from the heap"
+#ifdef NU_COUNT_ALLOCATIONS
+         << ", " << metrics.heapAllocations.value() << " heap allocations on I/O threads"
+#endif
+         << "\n";
+    if (federated()) {
+        cout << "Federation:    node " << federation.nodeName << ", " << peerLinksUp() << "/" << federation.peers.size()
+             << " peer links up, " << metrics.peerForwarded.value() << " frames forwarded, "
+             << metrics.peerReceived.value() << " received, " << metrics.peerLinkDrops.value() << " link drops\n";
+    }
+    
+    cout << "Messages (routed / stored / failed):\n";
+    for (uint16_t from = 0; from < CAMPUS_COUNT; from++) {
+        for (uint16_t to = 0; to < CAMPUS_COUNT; to++) {
+            uint64_t routed = metrics.routed[from][to].value();
+            uint64_t stored = metrics.stored[from][to].value();
+            uint64_t failed = metrics.failed[from][to].value();
+            if (routed + stored + failed == 0) continue;
+            cout << "  " << campusNameOf(from) << " -> " << campusNameOf(to) << ": "
+                 << routed << " / " << stored << " / " << failed << "\n";
         }
     }
+}
+
+// Local scrape endpoint: answers any HTTP request with formatMetrics()
+void metricsServer() {
+    SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket == INVALID_SOCKET) return;
     
-    closesocket(udpSocket);
+    int reuse = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(serverConfig.metricsPort);
+    if (bind(listenSocket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listenSocket, 16) == SOCKET_ERROR) {
+        LOG(LOG_WARN, "Metrics endpoint unavailable on port " + to_string(serverConfig.metricsPort));
+        closesocket(listenSocket);
+        return;
+    }
+    LOG(LOG_INFO, "Metrics at http://127.0.0.1:" + to_string(serverConfig.metricsPort) + "/metrics");
+    
+    char request[1024];
+    while (true) {
+        SOCKET client = accept(listenSocket, NULL, NULL);
+        if (client == INVALID_SOCKET) continue;
+        recv(client, request, sizeof(request), 0);
+        string body = formatMetrics();
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                          to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        sendAll(client, response.data(), response.size());
+        closesocket(client);
+    }
 }
 
 // Admin console for monitoring and broadcasting
 void adminConsole() {
-    safeLog("Admin Console started. Type 'help' for commands.");
+    LOG(LOG_INFO, "Admin Console started. Type 'help' for commands.");
     
     string command;
     while (true) {
@@ -274,55 +6854,361 @@ void adminConsole() {
         if (command == "help") {
             cout << "Commands:\n"
                  << "  status  - Show all connected campuses\n"
+                 << "  stats   - Show traffic, latency and heartbeat statistics\n"
+                 << "  topics  - Show department topic subscriptions\n"
+                 << "  reload  - Reload the credentials file (also on SIGHUP)\n"
+                 << "  nodes   - Show the server nodes and which campuses each serves\n"
+                 << "  history [N] - Show the last N routed messages (default 20)\n"
+                 << "  search [from=CAMPUS] [to=CAMPUS] [dept=DEPT] [since=T] [until=T] [limit=N] [words]\n"
+                 << "          - Search the message history; T is 7d, 12h, 30m or YYYY-MM-DD[THH:MM]\n"
                  << "  broadcast <message> - Broadcast message to all campuses\n"
-                 << "  quit - Exit server\n";
+                 << "  broadcast-tcp <message> - Broadcast over the TCP connections (reliable)\n"
+                 << "  quit - Drain the connections, save the sessions and exit (also on SIGTERM)\n";
         }
         else if (command == "status") {
-            lock_guard<mutex> lock(clientsMutex);
+            RcuReadGuard guard;
+            RoutingTable* table = currentRoutes();
             cout << "\n=== Connected Campuses ===\n";
-            for (const auto& pair : connectedClients) {
-                cout << "Campus: " << pair.first
-                     << " | Status: " << (pair.second.isOnline ? "Online" : "Offline")
-                     << " | Last Seen: " << pair.second.lastSeen << "\n";
+            for (size_t id = 1; id < table->campuses.size(); id++) {
+                CampusState* state = table->campuses[id];
+                string owner;
+                if (servedElsewhere((uint16_t)id, owner)) {
+                    cout << "Campus: " << state->campusName << " | Served by node " << owner
+                         << (table->sessions[id].empty() ? " (link down)" : "");
+                    uint64_t stored = storedBacklog((uint16_t)id);
+                    if (stored > 0) cout << " | Stored: " << stored;
+                    cout << "\n";
+                    continue;
+                }
+                time_t lastSeen = state->lastSeen.load();
+                if (lastSeen == 0) continue;
+                
+                const SessionList& sessions = table->sessions[id];
+                const char* status = sessions.empty() ? "Offline" :
+                                     state->liveness.load() == LIVENESS_SUSPECT ? "Suspect" : "Online";
+                cout << "Campus: " << state->campusName
+                     << " | Status: " << status
+                     << " | Last Seen: " << formatTime(lastSeen);
+                if (!sessions.empty()) {
+                    cout << " (" << (monotonicMs() - state->lastHeartbeatMs.load()) / 1000 << "s ago)"
+                         << " | Sessions: " << sessions.size();
+                }
+                uint64_t stored = storedBacklog((uint16_t)id);
+                if (stored > 0) cout << " | Stored: " << stored;
+                cout << "\n";
+                for (size_t i = 0; i < sessions.size(); i++) {
+                    OutboundQueue& q = sessions[i]->outbound;
+                    lock_guard<mutex> queueLock(q.lock);
+                    cout << "  Session " << (i + 1) << " | Endpoint: " << sessions[i]->endpoint << " | Queue: " << q.frames.size() << " frames, "
+                         << q.queuedBytes << " bytes, " << q.dropped << " dropped\n";
+                }
             }
         }
+        else if (command == "stats") {
+            printStats();
+        }
+        else if (command == "topics") {
+            RcuReadGuard guard;
+            const vector<Subscription>& subscriptions = subscriptionIndex.load()->subscriptions;
+            cout << "\n=== Topic Subscriptions ===\n";
+            for (size_t i = 0; i < subscriptions.size(); i++) {
+                const Subscription& sub = subscriptions[i];
+                cout << sub.conn->campusName << " -> "
+                     << topicName(sub.campusId == 0 ? TOPIC_ANY : sub.campusId, sub.deptId == 0 ? TOPIC_ANY : sub.deptId) << "\n";
+            }
+            if (subscriptions.empty()) cout << "(none)\n";
+        }
+        else if (command == "reload") {
+            reloadCredentials();
+        }
+        else if (command == "nodes") {
+            printFederation();
+        }
+        else if (command == "history" || command.find("history ") == 0) {
+            string count = command.size() > 8 ? command.substr(8) : "";
+            searchHistory(count.empty() ? "" : "limit=" + count);
+        }
+        else if (command == "search" || command.find("search ") == 0) {
+            searchHistory(command.size() > 7 ? command.substr(7) : "");
+        }
         else if (command.find("broadcast ") == 0) {
-            string message = command.substr(10);
-            
-            // Create UDP socket for broadcasting
-            SOCKET udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
-            
-            lock_guard<mutex> lock(clientsMutex);
-            for (const auto& pair : connectedClients) {
-                if (pair.second.isOnline) {
-                    sockaddr_in campusAddr;
-                    campusAddr.sin_family = AF_INET;
-                    campusAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-                    campusAddr.sin_port = htons(UDP_PORT + 1); // Client UDP port
-                    
-                    string broadcastMsg = "BROADCAST|" + message;
-                    sendto(udpSocket, broadcastMsg.c_str(), broadcastMsg.length(), 0,
-                           (sockaddr*)&campusAddr, sizeof(campusAddr));
+            broadcastMessage(command.substr(10), broadcastConfig.mode);
+        }
+        else if (command.find("broadcast-tcp ") == 0) {
+            broadcastMessage(command.substr(14), BROADCAST_TCP);
+        }
+        else if (command == "quit") {
+            shutdownServer();
+        }
+    }
+}
+
+// Set by --hash-password: print the hash instead of starting the server
+string hashPassword;
+
+// Parse command-line options
+//   --io=threads|epoll|uring  connection handling model
+//   --io-threads=N       number of reactor shards, each with its own listener
+//   --auth-threads=N     threads that check login passwords for the shards
+//   --auth-timeout=SEC   time a new connection has to log in
+//   --backlog=N          TCP listen backlog
+//   --heartbeat-interval=SEC  expected campus heartbeat interval
+//   --suspect-after=N    missed heartbeats before a campus is suspect
+//   --offline-after=N    missed heartbeats before it is disconnected
+//   --queue-limit=N      max frames queued for one campus
+//   --queue-bytes=N      max bytes queued for one campus
+//   --overflow=drop-oldest|reject|disconnect
+//                        what to do when a campus queue is full
+//   --credit-window=N    messages a client may have in flight (0 = off)
+//   --rate-limit=[CAMPUS=]RATE[/BURST]
+//                        messages per second from a campus (repeatable;
+//                        without CAMPUS it applies to every campus)
+//   --dept-rate-limit=[DEPT=]RATE[/BURST]
+//                        messages per second from a campus to one department
+//   --broadcast=udp|multicast|tcp  how the broadcast command delivers
+//   --broadcast-group=IP:PORT      multicast group for --broadcast=multicast
+//   --multicast-if=IP    local interface address for multicast
+//   --multicast-ttl=N    multicast hop limit
+//   --log-level=debug|info|warn|error
+//   --production         no per-message logs (same as --log-level=info)
+//   --log-file=PATH      also write logs to PATH, rotated by size
+//   --log-max-bytes=N    rotate the log file after N bytes
+//   --quiet              do not log to the console
+//   --store-dir=PATH     where messages for offline campuses are kept
+//   --store-segment-bytes=N  size of one store segment file
+//   --no-store           reply with an error instead of storing
+//   --history-dir=PATH   where routed messages are kept for history/search
+//   --history-segment-bytes=N  size at which a history segment is closed
+//   --no-history         do not record routed messages
+//   --metrics-port=N     local plain-text metrics endpoint (0 = off)
+//   --delivery=all|round-robin|least-queued
+//                        which sessions of a campus get its messages
+//   --max-sessions=N     concurrent logins allowed per campus
+//   --credentials=PATH   endpoint credentials file
+//   --hash-password=SECRET  print a credentials-file hash and exit
+//   --hash-iterations=N  PBKDF2 iterations for --hash-password
+//   --no-compression     refuse compression when clients ask for it
+//   --resume-grace=SEC   how long a dropped session can be resumed (0 = never)
+//   --drain-timeout=SEC  how long shutdown waits for outbound queues to empty
+//   --snapshot=PATH      where shutdown saves the sessions for the next start
+//   --no-snapshot        neither save nor load the session snapshot
+//   --port=N             TCP port for campuses and peer nodes; heartbeats on N+1
+//   --node=NAME          this server's name among federated nodes
+//   --peer=NAME@IP:PORT  another server node (repeat for each one)
+//   --own=C1,C2          campuses this node serves when federated
+//   --cluster-secret=S   shared secret the nodes log in to each other with
+bool parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        
+        if (arg == "--io=threads") {
+            serverConfig.ioModel = IO_THREAD_PER_CAMPUS;
+        } else if (arg == "--io=epoll") {
+#ifdef __linux__
+            serverConfig.ioModel = IO_EPOLL_REACTOR;
+#else
+            cout << "epoll is only available on Linux, using threads\n";
+#endif
+        } else if (arg == "--io=uring") {
+#if defined(NU_IO_URING)
+            serverConfig.ioModel = IO_URING_REACTOR;
+#elif defined(__linux__)
+            cout << "io_uring needs Linux 6.0 kernel headers to build, using epoll\n";
+            serverConfig.ioModel = IO_EPOLL_REACTOR;
+#else
+            cout << "io_uring is only available on Linux, using threads\n";
+#endif
+        } else if (arg.find("--io-threads=") == 0) {
+            serverConfig.ioThreads = atoi(arg.c_str() + 13);
+            if (serverConfig.ioThreads < 1) serverConfig.ioThreads = 1;
+        } else if (arg.find("--auth-threads=") == 0) {
+            serverConfig.authThreads = max(1, atoi(arg.c_str() + 15));
+        } else if (arg.find("--auth-timeout=") == 0) {
+            serverConfig.authTimeoutSec = max(1, atoi(arg.c_str() + 15));
+        } else if (arg.find("--backlog=") == 0) {
+            serverConfig.listenBacklog = atoi(arg.c_str() + 10);
+        } else if (arg.find("--metrics-port=") == 0) {
+            serverConfig.metricsPort = atoi(arg.c_str() + 15);
+        } else if (arg == "--delivery=all") {
+            serverConfig.delivery = DELIVER_ALL;
+        } else if (arg == "--delivery=round-robin") {
+            serverConfig.delivery = DELIVER_ROUND_ROBIN;
+        } else if (arg == "--delivery=least-queued") {
+            serverConfig.delivery = DELIVER_LEAST_QUEUED;
+        } else if (arg.find("--max-sessions=") == 0) {
+            serverConfig.maxSessions = max(1, atoi(arg.c_str() + 15));
+        } else if (arg.find("--credentials=") == 0) {
+            credentialConfig.path = arg.substr(14);
+        } else if (arg.find("--hash-iterations=") == 0) {
+            credentialConfig.hashIterations = max(1, min(MAX_HASH_ITERATIONS, atoi(arg.c_str() + 18)));
+        } else if (arg == "--no-compression") {
+            serverConfig.compression = false;
+        } else if (arg.find("--resume-grace=") == 0) {
+            serverConfig.resumeGraceSec = max(0, atoi(arg.c_str() + 15));
+        } else if (arg.find("--drain-timeout=") == 0) {
+            restartConfig.drainTimeoutSec = max(0, atoi(arg.c_str() + 16));
+        } else if (arg.find("--snapshot=") == 0) {
+            restartConfig.snapshotPath = arg.substr(11);
+        } else if (arg == "--no-snapshot") {
+            restartConfig.snapshot = false;
+        } else if (arg.find("--port=") == 0) {
+            serverConfig.tcpPort = atoi(arg.c_str() + 7);
+            serverConfig.udpPort = serverConfig.tcpPort + 1;
+        } else if (arg.find("--node=") == 0) {
+            federation.nodeName = arg.substr(7);
+        } else if (arg.find("--peer=") == 0) {
+            string spec = arg.substr(7);
+            size_t at = spec.find('@'), colon = spec.rfind(':');
+            if (at == string::npos || at == 0 || colon == string::npos || colon < at) {
+                cout << "Bad --peer (expected NAME@IP:PORT): " << spec << "\n";
+                return false;
+            }
+            PeerNode* node = new PeerNode;
+            node->name = spec.substr(0, at);
+            node->host = spec.substr(at + 1, colon - at - 1);
+            node->port = atoi(spec.c_str() + colon + 1);
+            federation.peers.push_back(node);
+        } else if (arg.find("--own=") == 0) {
+            stringstream names(arg.substr(6));
+            string name;
+            while (getline(names, name, ',')) {
+                uint16_t id = campusIdOf(name);
+                if (id == 0) {
+                    cout << "Unknown campus in --own: " << name << "\n";
+                    return false;
                 }
+                federation.owned.push_back(id);
             }
-            
-            closesocket(udpSocket);
-            safeLog("Broadcast sent: " + message);
+        } else if (arg.find("--cluster-secret=") == 0) {
+            federation.secret = arg.substr(17);
+        } else if (arg.find("--hash-password=") == 0) {
+            hashPassword = arg.substr(16);
+        } else if (arg.find("--heartbeat-interval=") == 0) {
+            serverConfig.heartbeatIntervalSec = max(1, atoi(arg.c_str() + 21));
+        } else if (arg.find("--suspect-after=") == 0) {
+            serverConfig.suspectAfter = max(1, atoi(arg.c_str() + 16));
+        } else if (arg.find("--offline-after=") == 0) {
+            serverConfig.offlineAfter = max(1, atoi(arg.c_str() + 16));
+        } else if (arg.find("--queue-limit=") == 0) {
+            serverConfig.queueLimit = max(1, atoi(arg.c_str() + 14));
+        } else if (arg.find("--queue-bytes=") == 0) {
+            serverConfig.queueByteLimit = strtoull(arg.c_str() + 14, NULL, 10);
+        } else if (arg.find("--credit-window=") == 0) {
+            serverConfig.creditWindow = strtoull(arg.c_str() + 16, NULL, 10);
+        } else if (arg.find("--rate-limit=") == 0) {
+            if (!parseRateLimit(arg.substr(13), CAMPUS_NAMES, CAMPUS_COUNT, campusRates)) {
+                cout << "Bad --rate-limit (expected [CAMPUS=]RATE[/BURST]): " << arg.substr(13) << "\n";
+                return false;
+            }
+        } else if (arg.find("--dept-rate-limit=") == 0) {
+            if (!parseRateLimit(arg.substr(18), DEPARTMENT_NAMES, DEPARTMENT_COUNT, departmentRates)) {
+                cout << "Bad --dept-rate-limit (expected [DEPT=]RATE[/BURST]): " << arg.substr(18) << "\n";
+                return false;
+            }
+        } else if (arg == "--broadcast=udp") {
+            broadcastConfig.mode = BROADCAST_UDP;
+        } else if (arg == "--broadcast=multicast") {
+            broadcastConfig.mode = BROADCAST_MULTICAST;
+        } else if (arg == "--broadcast=tcp") {
+            broadcastConfig.mode = BROADCAST_TCP;
+        } else if (arg.find("--broadcast-group=") == 0) {
+            string group = arg.substr(18);
+            size_t colon = group.find(':');
+            broadcastConfig.groupIp = group.substr(0, colon);
+            if (colon != string::npos) broadcastConfig.groupPort = atoi(group.c_str() + colon + 1);
+        } else if (arg.find("--multicast-if=") == 0) {
+            broadcastConfig.multicastInterface = arg.substr(15);
+        } else if (arg.find("--multicast-ttl=") == 0) {
+            broadcastConfig.multicastTtl = max(0, min(255, atoi(arg.c_str() + 16)));
+        } else if (arg == "--overflow=drop-oldest") {
+            serverConfig.overflowPolicy = OVERFLOW_DROP_OLDEST;
+        } else if (arg == "--overflow=reject") {
+            serverConfig.overflowPolicy = OVERFLOW_REJECT;
+        } else if (arg == "--overflow=disconnect") {
+            serverConfig.overflowPolicy = OVERFLOW_DISCONNECT;
+        } else if (arg == "--log-level=debug") {
+            loggerConfig.level = LOG_DEBUG;
+        } else if (arg == "--log-level=info" || arg == "--production") {
+            loggerConfig.level = LOG_INFO;
+        } else if (arg == "--log-level=warn") {
+            loggerConfig.level = LOG_WARN;
+        } else if (arg == "--log-level=error") {
+            loggerConfig.level = LOG_ERROR;
+        } else if (arg.find("--log-file=") == 0) {
+            loggerConfig.filePath = arg.substr(11);
+        } else if (arg.find("--log-max-bytes=") == 0) {
+            loggerConfig.maxFileBytes = strtoull(arg.c_str() + 16, NULL, 10);
+        } else if (arg == "--quiet") {
+            loggerConfig.console = false;
+        } else if (arg.find("--store-dir=") == 0) {
+            storeConfig.dir = arg.substr(12);
+        } else if (arg.find("--store-segment-bytes=") == 0) {
+            storeConfig.segmentBytes = max(4096ULL, strtoull(arg.c_str() + 22, NULL, 10));
+        } else if (arg == "--no-store") {
+            storeConfig.enabled = false;
+        } else if (arg.find("--history-dir=") == 0) {
+            historyConfig.dir = arg.substr(14);
+        } else if (arg.find("--history-segment-bytes=") == 0) {
+            historyConfig.segmentBytes = max(4096ULL, min(1ULL << 30, strtoull(arg.c_str() + 24, NULL, 10)));
+        } else if (arg == "--no-history") {
+            historyConfig.enabled = false;
+        } else {
+            cout << "Unknown option: " << arg << "\n"
+                 << "Usage: server [--io=threads|epoll|uring] [--io-threads=N] [--auth-threads=N]\n"
+                 << "              [--backlog=N] [--auth-timeout=SEC]\n"
+                 << "              [--heartbeat-interval=SEC] [--suspect-after=N] [--offline-after=N]\n"
+                 << "              [--metrics-port=N] [--delivery=all|round-robin|least-queued]\n"
+                 << "              [--max-sessions=N] [--credentials=PATH]\n"
+                 << "              [--hash-password=SECRET] [--hash-iterations=N] [--no-compression]\n"
+                 << "              [--resume-grace=SEC] [--drain-timeout=SEC] [--snapshot=PATH] [--no-snapshot]\n"
+                 << "              [--port=N]\n"
+                 << "              [--node=NAME] [--peer=NAME@IP:PORT]... [--own=C1,C2] [--cluster-secret=S]\n"
+                 << "              [--queue-limit=N] [--queue-bytes=N] [--credit-window=N]\n"
+                 << "              [--rate-limit=[CAMPUS=]RATE[/BURST]]... [--dept-rate-limit=[DEPT=]RATE[/BURST]]...\n"
+                 << "              [--overflow=drop-oldest|reject|disconnect]\n"
+                 << "              [--broadcast=udp|multicast|tcp] [--broadcast-group=IP:PORT]\n"
+                 << "              [--multicast-if=IP] [--multicast-ttl=N]\n"
+                 << "              [--log-level=debug|info|warn|error] [--production]\n"
+                 << "              [--log-file=PATH] [--log-max-bytes=N] [--quiet]\n"
+                 << "              [--store-dir=PATH] [--store-segment-bytes=N] [--no-store]\n"
+                 << "              [--history-dir=PATH] [--history-segment-bytes=N] [--no-history]\n";
+            return false;
         }
-        else if (command == "quit") {
-            safeLog("Shutting down server...");
-            exit(0);
+    }
+    if (serverConfig.offlineAfter <= serverConfig.suspectAfter) {
+        serverConfig.offlineAfter = serverConfig.suspectAfter + 1;
+    }
+    if (federated() && federation.secret.empty()) {
+        cout << "--peer needs --cluster-secret\n";
+        return false;
+    }
+    for (size_t i = 0; i < federation.peers.size(); i++) {
+        if (federation.peers[i]->name == federation.nodeName) {
+            cout << "--peer names this node (" << federation.nodeName << "); set --node\n";
+            return false;
         }
     }
+    return true;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (!parseArguments(argc, argv)) return 1;
+    if (!hashPassword.empty()) {
+        cout << makeCredentialHash(hashPassword, credentialConfig.hashIterations) << endl;
+        return 0;
+    }
+    
 #ifdef _WIN32
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
         cout << "WSAStartup failed" << endl;
         return 1;
     }
+#else
+    // A campus dropping mid-send must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, requestCredentialReload);
+    signal(SIGTERM, requestShutdown);
 #endif
     
     cout << "======================================\n";
@@ -330,9 +7216,34 @@ int main() {
     cout << "  Central Server (Islamabad Campus)\n";
     cout << "======================================\n\n";
     
+    startLogger();
+    if (!reloadCredentials()) {
+        stopLogger();
+        return 1;
+    }
+    initRoutingTable();
+    initSubscriptions();
+    initRateLimits();
+    metrics.started = chrono::steady_clock::now();
+    // Before the listeners open, so returning clients find their sessions
+    if (restartConfig.snapshot) loadSnapshot();
+    if (storeConfig.enabled && !startStore()) {
+        LOG(LOG_WARN, "Store-and-forward disabled");
+        storeConfig.enabled = false;
+    }
+    if (historyConfig.enabled && !startHistory()) {
+        LOG(LOG_WARN, "Message history disabled");
+        historyConfig.enabled = false;
+    }
+    
+    // Claims go in before the first login is admitted
+    startFederation();
+    
     // Start TCP and UDP servers in separate threads
     thread tcpThread(tcpServer);
-    thread udpThread(udpServer);
+    thread udpThread(udpServer, serverConfig.ioModel == IO_URING_REACTOR);
+    thread(livenessLoop).detach();
+    if (serverConfig.metricsPort > 0) thread(metricsServer).detach();
     
     // Run admin console in main thread
     adminConsole();